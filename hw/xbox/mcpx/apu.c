@@ -30,6 +30,7 @@
 #include "sysemu/runstate.h"
 #include "audio/audio.h"
 #include "qemu/fifo8.h"
+#include "qemu/bitmap.h"
 #include "ui/xemu-settings.h"
 
 #include "dsp/dsp.h"
@@ -41,6 +42,7 @@
 #include "apu_debug.h"
 #include "adpcm.h"
 #include "svf.h"
+#include "vp_kernels.h"
 #include "fpconv.h"
 
 #define GET_MASK(v, mask) (((v) & (mask)) >> ctz32(mask))
@@ -77,13 +79,99 @@ typedef struct MCPXAPUVPSSLData {
     int ssl_seg;
 } MCPXAPUVPSSLData;
 
+/*
+ * Snapshot of a voice's NV_PAVS block, taken once the VP owns the voice for
+ * the frame. The VP reads and updates fields in the snapshot and only the
+ * fields it changed are merged back into guest memory afterwards, so guest
+ * writes to other fields in the meantime are kept.
+ */
+typedef struct MCPXAPUVoiceCache {
+    uint16_t voice;
+    hwaddr addr;
+    uint32_t regs[NV_PAVS_SIZE / 4];
+    uint32_t dirty[NV_PAVS_SIZE / 4];
+} MCPXAPUVoiceCache;
+
 typedef struct MCPXAPUVoiceFilter {
     uint16_t voice;
+    MCPXAPUVoiceCache *cache;
     float resample_buf[NUM_SAMPLES_PER_FRAME * 2];
     SRC_STATE *resampler;
+    unsigned int resampler_channels;
     sv_filter svf[2];
+
+    /*
+     * Input of the linear and Hermite resamplers: the last frames still
+     * needed by the interpolation window, followed by a newly fetched frame
+     * of the voice. resample_pos is relative to the first of them.
+     */
+    float resample_in[VP_RESAMPLE_TAPS - 1 + NUM_SAMPLES_PER_FRAME][2];
+    int resample_in_len;
+    double resample_pos;
+    int resampler_mode;
+
+    /* Time spent resampling, excluding fetching the voice's samples */
+    int64_t fetch_ns;
+    int64_t resample_ns[AUDIO_RESAMPLER__COUNT];
+    uint64_t resample_samples[AUDIO_RESAMPLER__COUNT];
 } MCPXAPUVoiceFilter;
 
+#define MCPX_ADPCM_CACHE_SET_BITS 8
+#define MCPX_ADPCM_CACHE_SETS (1 << MCPX_ADPCM_CACHE_SET_BITS)
+#define MCPX_ADPCM_CACHE_WAYS 4
+
+/* A decoded ADPCM block of a buffer voice, keyed by its guest address */
+typedef struct MCPXAPUADPCMBlock {
+    hwaddr addr;
+    uint16_t block_size;
+    uint8_t channels;
+    bool valid;
+    int16_t samples[65*2];
+} MCPXAPUADPCMBlock;
+
+typedef struct MCPXAPUADPCMCacheSet {
+    QemuSpin lock;
+    unsigned int next_victim;
+    MCPXAPUADPCMBlock blocks[MCPX_ADPCM_CACHE_WAYS];
+} MCPXAPUADPCMCacheSet;
+
+#define MCPX_VP_MAX_WORKERS 3
+
+/*
+ * The voice list is cut into this many contiguous slices, which the APU thread
+ * and the workers claim until none are left
+ */
+#define MCPX_VP_NUM_SLICES 8
+
+/* Below this many voices in a frame the APU thread processes them alone */
+#define MCPX_VP_MIN_PARALLEL_VOICES 16
+
+typedef struct MCPXAPUVPMix {
+    float mixbins[NUM_MIXBINS][NUM_SAMPLES_PER_FRAME];
+    float sample_buf[NUM_SAMPLES_PER_FRAME][2];
+} MCPXAPUVPMix;
+
+/*
+ * What a voice contributes to the frame. Voices are processed in any order and
+ * on any thread, then the APU thread mixes these in voice list order, so the
+ * MIXBINs are bit-identical to processing the list on a single thread.
+ */
+typedef struct MCPXAPUVPVoiceOut {
+    bool mixed;
+    unsigned int channels;
+    int bin[8];
+    float gain[8];
+    bool monitor;
+    float monitor_gain;
+    float samples[NUM_SAMPLES_PER_FRAME][2];
+    float channel_samples[2][NUM_SAMPLES_PER_FRAME];
+} MCPXAPUVPVoiceOut;
+
+typedef struct MCPXAPUVPWorker {
+    struct MCPXAPUState *d;
+    QemuThread thread;
+} MCPXAPUVPWorker;
+
 typedef struct MCPXAPUState {
     PCIDevice dev;
     bool exiting;
@@ -114,9 +202,51 @@ typedef struct MCPXAPUState {
         uint8_t hrtf_headroom;
         uint8_t hrtf_submix[4];
         uint8_t submix_headroom[NUM_MIXBINS];
-        float sample_buf[NUM_SAMPLES_PER_FRAME][2];
         uint64_t voice_locked[4];
         QemuSpin voice_spinlocks[MCPX_HW_MAX_VOICES];
+
+        /* Voices to process this frame, in voice list order */
+        uint16_t voices[MCPX_HW_MAX_VOICES];
+        bool deferred[MCPX_HW_MAX_VOICES];
+        MCPXAPUVPVoiceOut out[MCPX_HW_MAX_VOICES];
+        unsigned int num_voices;
+        unsigned int next_slice;
+        MCPXAPUVPMix mix;
+
+        MCPXAPUVPWorker workers[MCPX_VP_MAX_WORKERS];
+        unsigned int num_workers;
+        QemuMutex worker_lock;
+        QemuCond work_cond;
+        QemuCond done_cond;
+        bool workers_exiting;
+        unsigned int frame;
+        unsigned int num_workers_done;
+
+        /*
+         * Looping sounds and voices sharing a buffer decode the same blocks
+         * over and over. Entries are dropped when the guest writes to them,
+         * as seen through DIRTY_MEMORY_MCPX at the start of each frame.
+         */
+        MCPXAPUADPCMCacheSet adpcm_cache[MCPX_ADPCM_CACHE_SETS];
+
+        /*
+         * Number of valid cached blocks on each guest page, and a bitmap of
+         * the pages with any, so only those pages have their dirty state
+         * checked and cleared
+         */
+        QemuSpin adpcm_pages_lock;
+        unsigned long adpcm_num_pages;
+        uint16_t *adpcm_page_refs;
+        unsigned long *adpcm_pages;
+        unsigned long *adpcm_dirty_pages;
+        unsigned int adpcm_blocks_cached;
+        unsigned int adpcm_blocks_decoded;
+
+        int resampler_mode;
+
+        /* Resamplers are only timed while the debug view asks for it */
+        bool profile_resamplers;
+        bool profiling;
     } vp;
 
     /* Global Processor */
@@ -155,7 +285,6 @@ static uint64_t g_dbg_muted_voices[4];
 static const int16_t ep_silence[256][2] = { 0 };
 
 static float clampf(float v, float min, float max);
-static float attenuate(uint16_t vol);
 
 static void mcpx_debug_begin_frame(void);
 static void mcpx_debug_end_frame(void);
@@ -164,10 +293,14 @@ static uint32_t voice_get_mask(MCPXAPUState *d, uint16_t voice_handle,
                                hwaddr offset, uint32_t mask);
 static void voice_set_mask(MCPXAPUState *d, uint16_t voice_handle,
                            hwaddr offset, uint32_t mask, uint32_t val);
+static void voice_cache_load(MCPXAPUState *d, MCPXAPUVoiceCache *c,
+                             uint16_t v);
+static void voice_cache_store(MCPXAPUState *d, MCPXAPUVoiceCache *c);
 static uint64_t mcpx_apu_read(void *opaque, hwaddr addr, unsigned int size);
 static void mcpx_apu_write(void *opaque, hwaddr addr, uint64_t val,
                            unsigned int size);
 static void voice_off(MCPXAPUState *d, uint16_t v);
+static void voice_cache_off(MCPXAPUState *d, MCPXAPUVoiceCache *c);
 static void voice_lock(MCPXAPUState *d, uint16_t v, bool lock);
 static bool is_voice_locked(MCPXAPUState *d, uint16_t v);
 static void fe_method(MCPXAPUState *d, uint32_t method, uint32_t argument);
@@ -197,7 +330,7 @@ static void gp_write(void *opaque, hwaddr addr, uint64_t val,
 static uint64_t ep_read(void *opaque, hwaddr addr, unsigned int size);
 static void ep_write(void *opaque, hwaddr addr, uint64_t val,
                      unsigned int size);
-static float voice_step_envelope(MCPXAPUState *d, uint16_t v,
+static float voice_step_envelope(MCPXAPUState *d, MCPXAPUVoiceCache *c,
                                  uint32_t reg_0, uint32_t reg_a,
                                  uint32_t rr_reg, uint32_t rr_mask,
                                  uint32_t lvl_reg, uint32_t lvl_mask,
@@ -206,15 +339,42 @@ static hwaddr get_data_ptr(hwaddr sge_base, unsigned int max_sge,
                            uint32_t addr);
 static void set_notify_status(MCPXAPUState *d, uint32_t v, int notifier,
                               int status);
+static void voice_fetch_samples(MCPXAPUState *d, MCPXAPUVoiceFilter *filter,
+                                float samples[][2]);
 static long voice_resample_callback(void *cb_data, float **data);
-static int voice_resample(MCPXAPUState *d, uint16_t v, float samples[][2],
-                          int requested_num, float rate);
+static int voice_resample_sinc(MCPXAPUVoiceFilter *filter, float samples[][2],
+                               int requested_num, float rate,
+                               unsigned int channels);
+static int voice_resample_interpolate(MCPXAPUState *d,
+                                      MCPXAPUVoiceFilter *filter,
+                                      float samples[][2], int requested_num,
+                                      float rate, unsigned int channels);
+static void voice_reset_resampler(MCPXAPUVoiceFilter *filter);
+static int voice_resample(MCPXAPUState *d, MCPXAPUVoiceCache *c,
+                          float samples[][2], int requested_num, float rate);
 static void voice_reset_filters(MCPXAPUState *d, uint16_t v);
-static void voice_process(MCPXAPUState *d,
-                          float mixbins[NUM_MIXBINS][NUM_SAMPLES_PER_FRAME],
-                          uint16_t v);
-static int voice_get_samples(MCPXAPUState *d, uint32_t v, float samples[][2],
-                             int num_samples_requested);
+static void voice_process(MCPXAPUState *d, MCPXAPUVPVoiceOut *out,
+                          MCPXAPUVoiceCache *c);
+static int voice_get_samples(MCPXAPUState *d, MCPXAPUVoiceCache *c,
+                             float samples[][2], int num_samples_requested);
+static void adpcm_cache_init(MCPXAPUState *d);
+static void adpcm_cache_flush(MCPXAPUState *d);
+static void adpcm_cache_invalidate_dirty(MCPXAPUState *d);
+static bool adpcm_cache_lookup(MCPXAPUState *d, hwaddr addr,
+                               size_t block_size, unsigned int channels,
+                               int16_t *samples);
+static void adpcm_cache_insert(MCPXAPUState *d, hwaddr addr,
+                               size_t block_size, unsigned int channels,
+                               const int16_t *samples);
+static void voice_decode_adpcm_block(MCPXAPUState *d, uint32_t linear_addr,
+                                     size_t block_size, unsigned int channels,
+                                     int16_t *samples);
+static void vp_process_slices(MCPXAPUState *d);
+static void *vp_worker_thread(void *arg);
+static void vp_workers_init(MCPXAPUState *d);
+static void vp_workers_finalize(MCPXAPUState *d);
+static MCPXAPUVPMix *vp_mix_voices(MCPXAPUState *d);
+static void vp_collect_resampler_stats(MCPXAPUState *d);
 static void se_frame(MCPXAPUState *d);
 static void update_irq(MCPXAPUState *d);
 static void sleep_ns(int64_t ns);
@@ -258,6 +418,25 @@ void mcpx_apu_debug_set_ep_realtime_enabled(bool run)
     g_state->ep.realtime = run;
 }
 
+void mcpx_apu_set_resampler(int mode)
+{
+    assert(mode >= 0 && mode < AUDIO_RESAMPLER__COUNT);
+    xemu_settings_set_enum(XEMU_SETTINGS_AUDIO_RESAMPLER, mode);
+
+    /* Each voice switches over and restarts its resampler on its next frame */
+    qatomic_set(&g_state->vp.resampler_mode, mode);
+}
+
+int mcpx_apu_get_resampler(void)
+{
+    return qatomic_read(&g_state->vp.resampler_mode);
+}
+
+void mcpx_apu_debug_set_resampler_profiling(bool enable)
+{
+    qatomic_set(&g_state->vp.profile_resamplers, enable);
+}
+
 int mcpx_apu_debug_get_monitor(void)
 {
     return g_state->mon;
@@ -307,12 +486,6 @@ static float clampf(float v, float min, float max)
     }
 }
 
-static float attenuate(uint16_t vol)
-{
-    vol &= 0xFFF;
-    return (vol == 0xFFF) ? 0.0 : powf(10.0f, vol/(64.0 * -20.0f));
-}
-
 static uint32_t voice_get_mask(MCPXAPUState *d, uint16_t voice_handle,
                                hwaddr offset, uint32_t mask)
 {
@@ -331,6 +504,74 @@ static void voice_set_mask(MCPXAPUState *d, uint16_t voice_handle,
                 v | ((val << ctz32(mask)) & mask));
 }
 
+static bool voice_cache_in_ram(MCPXAPUState *d, MCPXAPUVoiceCache *c)
+{
+    return c->addr + NV_PAVS_SIZE <= memory_region_size(d->ram);
+}
+
+static void voice_cache_load(MCPXAPUState *d, MCPXAPUVoiceCache *c,
+                             uint16_t v)
+{
+    c->voice = v;
+    c->addr = d->regs[NV_PAPU_VPVADDR] + v * NV_PAVS_SIZE;
+    memset(c->dirty, 0, sizeof(c->dirty));
+
+    if (voice_cache_in_ram(d, c)) {
+        for (int i = 0; i < ARRAY_SIZE(c->regs); i++) {
+            c->regs[i] = ldl_le_p(&d->ram_ptr[c->addr + i * 4]);
+        }
+    } else {
+        for (int i = 0; i < ARRAY_SIZE(c->regs); i++) {
+            c->regs[i] = ldl_le_phys(&address_space_memory, c->addr + i * 4);
+        }
+    }
+}
+
+static void voice_cache_store(MCPXAPUState *d, MCPXAPUVoiceCache *c)
+{
+    bool in_ram = voice_cache_in_ram(d, c);
+    bool written = false;
+
+    for (int i = 0; i < ARRAY_SIZE(c->regs); i++) {
+        uint32_t mask = c->dirty[i];
+        if (!mask) {
+            continue;
+        }
+        hwaddr addr = c->addr + i * 4;
+        if (in_ram) {
+            uint32_t v = ldl_le_p(&d->ram_ptr[addr]) & ~mask;
+            stl_le_p(&d->ram_ptr[addr], v | (c->regs[i] & mask));
+            written = true;
+        } else {
+            uint32_t v = ldl_le_phys(&address_space_memory, addr) & ~mask;
+            stl_le_phys(&address_space_memory, addr, v | (c->regs[i] & mask));
+        }
+        c->dirty[i] = 0;
+    }
+
+    if (written) {
+        memory_region_set_dirty(d->ram, c->addr, NV_PAVS_SIZE);
+    }
+}
+
+static inline uint32_t voice_cache_get(MCPXAPUVoiceCache *c, hwaddr offset,
+                                       uint32_t mask)
+{
+    return (c->regs[offset / 4] & mask) >> ctz32(mask);
+}
+
+static inline void voice_cache_set(MCPXAPUVoiceCache *c, hwaddr offset,
+                                   uint32_t mask, uint32_t val)
+{
+    uint32_t *reg = &c->regs[offset / 4];
+    uint32_t v = (*reg & ~mask) | ((val << ctz32(mask)) & mask);
+
+    if (v != *reg) {
+        c->dirty[offset / 4] |= mask;
+        *reg = v;
+    }
+}
+
 static void update_irq(MCPXAPUState *d)
 {
     if (d->regs[NV_PAPU_FECTL] & NV_PAPU_FECTL_FEMETHMODE_TRAPPED) {
@@ -414,13 +655,8 @@ static const MemoryRegionOps mcpx_apu_mmio_ops = {
     .write = mcpx_apu_write,
 };
 
-static void voice_off(MCPXAPUState *d, uint16_t v)
+static void voice_off_notify(MCPXAPUState *d, uint16_t v, bool stream)
 {
-    voice_set_mask(d, v, NV_PAVS_VOICE_PAR_STATE,
-                   NV_PAVS_VOICE_PAR_STATE_ACTIVE_VOICE, 0);
-
-    bool stream = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_FMT,
-                                 NV_PAVS_VOICE_CFG_FMT_DATA_TYPE);
     int notifier = MCPX_HW_NOTIFIER_SSLA_DONE;
     if (stream) {
         assert(v < MCPX_HW_MAX_VOICES);
@@ -430,6 +666,23 @@ static void voice_off(MCPXAPUState *d, uint16_t v)
     set_notify_status(d, v, notifier, NV1BA0_NOTIFICATION_STATUS_DONE_SUCCESS);
 }
 
+static void voice_off(MCPXAPUState *d, uint16_t v)
+{
+    voice_set_mask(d, v, NV_PAVS_VOICE_PAR_STATE,
+                   NV_PAVS_VOICE_PAR_STATE_ACTIVE_VOICE, 0);
+    voice_off_notify(d, v, voice_get_mask(d, v, NV_PAVS_VOICE_CFG_FMT,
+                                          NV_PAVS_VOICE_CFG_FMT_DATA_TYPE));
+}
+
+static void voice_cache_off(MCPXAPUState *d, MCPXAPUVoiceCache *c)
+{
+    voice_cache_set(c, NV_PAVS_VOICE_PAR_STATE,
+                    NV_PAVS_VOICE_PAR_STATE_ACTIVE_VOICE, 0);
+    voice_off_notify(d, c->voice,
+                     voice_cache_get(c, NV_PAVS_VOICE_CFG_FMT,
+                                     NV_PAVS_VOICE_CFG_FMT_DATA_TYPE));
+}
+
 static void voice_lock(MCPXAPUState *d, uint16_t v, bool lock)
 {
     assert(v < MCPX_HW_MAX_VOICES);
@@ -1305,37 +1558,38 @@ static hwaddr get_data_ptr(hwaddr sge_base, unsigned int max_sge, uint32_t addr)
     return prd_address + addr % TARGET_PAGE_SIZE;
 }
 
-static float voice_step_envelope(MCPXAPUState *d, uint16_t v, uint32_t reg_0,
-                           uint32_t reg_a, uint32_t rr_reg, uint32_t rr_mask,
-                           uint32_t lvl_reg, uint32_t lvl_mask,
-                           uint32_t count_mask, uint32_t cur_mask)
+static float voice_step_envelope(MCPXAPUState *d, MCPXAPUVoiceCache *c,
+                                 uint32_t reg_0, uint32_t reg_a,
+                                 uint32_t rr_reg, uint32_t rr_mask,
+                                 uint32_t lvl_reg, uint32_t lvl_mask,
+                                 uint32_t count_mask, uint32_t cur_mask)
 {
-    uint8_t cur = voice_get_mask(d, v, NV_PAVS_VOICE_PAR_STATE, cur_mask);
+    uint8_t cur = voice_cache_get(c, NV_PAVS_VOICE_PAR_STATE, cur_mask);
     switch (cur) {
     case NV_PAVS_VOICE_PAR_STATE_EFCUR_OFF:
-        voice_set_mask(d, v, NV_PAVS_VOICE_CUR_ECNT, count_mask, 0);
-        voice_set_mask(d, v, lvl_reg, lvl_mask, 0xFF);
+        voice_cache_set(c, NV_PAVS_VOICE_CUR_ECNT, count_mask, 0);
+        voice_cache_set(c, lvl_reg, lvl_mask, 0xFF);
         return 1.0f;
     case NV_PAVS_VOICE_PAR_STATE_EFCUR_DELAY: {
         uint16_t count =
-            voice_get_mask(d, v, NV_PAVS_VOICE_CUR_ECNT, count_mask);
-        voice_set_mask(d, v, lvl_reg, lvl_mask, 0x00); // FIXME: Confirm this?
+            voice_cache_get(c, NV_PAVS_VOICE_CUR_ECNT, count_mask);
+        voice_cache_set(c, lvl_reg, lvl_mask, 0x00); // FIXME: Confirm this?
 
         if (count == 0) {
             cur++;
-            voice_set_mask(d, v, NV_PAVS_VOICE_PAR_STATE, cur_mask, cur);
+            voice_cache_set(c, NV_PAVS_VOICE_PAR_STATE, cur_mask, cur);
             count = 0;
         } else {
             count--;
         }
-        voice_set_mask(d, v, NV_PAVS_VOICE_CUR_ECNT, count_mask, count);
+        voice_cache_set(c, NV_PAVS_VOICE_CUR_ECNT, count_mask, count);
         return 0.0f;
     }
     case NV_PAVS_VOICE_PAR_STATE_EFCUR_ATTACK: {
         uint16_t count =
-            voice_get_mask(d, v, NV_PAVS_VOICE_CUR_ECNT, count_mask);
+            voice_cache_get(c, NV_PAVS_VOICE_CUR_ECNT, count_mask);
         uint16_t attack_rate =
-            voice_get_mask(d, v, reg_0, NV_PAVS_VOICE_CFG_ENV0_EA_ATTACKRATE);
+            voice_cache_get(c, reg_0, NV_PAVS_VOICE_CFG_ENV0_EA_ATTACKRATE);
 
         float value;
         if (attack_rate == 0) {
@@ -1351,45 +1605,45 @@ static float voice_step_envelope(MCPXAPUState *d, uint16_t v, uint32_t reg_0,
                 value = 255.0f;
             }
         }
-        voice_set_mask(d, v, lvl_reg, lvl_mask, value);
+        voice_cache_set(c, lvl_reg, lvl_mask, value);
         // FIXME: Comparison could also be the other way around?! Test please.
         if (count == (attack_rate * 16)) {
             cur++;
-            voice_set_mask(d, v, NV_PAVS_VOICE_PAR_STATE, cur_mask, cur);
+            voice_cache_set(c, NV_PAVS_VOICE_PAR_STATE, cur_mask, cur);
             uint16_t hold_time =
-                voice_get_mask(d, v, reg_a, NV_PAVS_VOICE_CFG_ENVA_EA_HOLDTIME);
+                voice_cache_get(c, reg_a, NV_PAVS_VOICE_CFG_ENVA_EA_HOLDTIME);
             count = hold_time * 16; // FIXME: Skip next phase if count is 0?
                                     // [other instances too]
         } else {
             count++;
         }
-        voice_set_mask(d, v, NV_PAVS_VOICE_CUR_ECNT, count_mask, count);
+        voice_cache_set(c, NV_PAVS_VOICE_CUR_ECNT, count_mask, count);
         return value / 255.0f;
     }
     case NV_PAVS_VOICE_PAR_STATE_EFCUR_HOLD: {
         uint16_t count =
-            voice_get_mask(d, v, NV_PAVS_VOICE_CUR_ECNT, count_mask);
-        voice_set_mask(d, v, lvl_reg, lvl_mask, 0xFF);
+            voice_cache_get(c, NV_PAVS_VOICE_CUR_ECNT, count_mask);
+        voice_cache_set(c, lvl_reg, lvl_mask, 0xFF);
 
         if (count == 0) {
             cur++;
-            voice_set_mask(d, v, NV_PAVS_VOICE_PAR_STATE, cur_mask, cur);
-            uint16_t decay_rate = voice_get_mask(
-                d, v, reg_a, NV_PAVS_VOICE_CFG_ENVA_EA_DECAYRATE);
+            voice_cache_set(c, NV_PAVS_VOICE_PAR_STATE, cur_mask, cur);
+            uint16_t decay_rate = voice_cache_get(
+                c, reg_a, NV_PAVS_VOICE_CFG_ENVA_EA_DECAYRATE);
             count = decay_rate * 16;
         } else {
             count--;
         }
-        voice_set_mask(d, v, NV_PAVS_VOICE_CUR_ECNT, count_mask, count);
+        voice_cache_set(c, NV_PAVS_VOICE_CUR_ECNT, count_mask, count);
         return 1.0f;
     }
     case NV_PAVS_VOICE_PAR_STATE_EFCUR_DECAY: {
         uint16_t count =
-            voice_get_mask(d, v, NV_PAVS_VOICE_CUR_ECNT, count_mask);
+            voice_cache_get(c, NV_PAVS_VOICE_CUR_ECNT, count_mask);
         uint16_t decay_rate =
-            voice_get_mask(d, v, reg_a, NV_PAVS_VOICE_CFG_ENVA_EA_DECAYRATE);
+            voice_cache_get(c, reg_a, NV_PAVS_VOICE_CFG_ENVA_EA_DECAYRATE);
         uint8_t sustain_level =
-            voice_get_mask(d, v, reg_a, NV_PAVS_VOICE_CFG_ENVA_EA_SUSTAINLEVEL);
+            voice_cache_get(c, reg_a, NV_PAVS_VOICE_CFG_ENVA_EA_SUSTAINLEVEL);
 
         // FIXME: Decay should return a value no less than sustain
         float value;
@@ -1404,27 +1658,27 @@ static float voice_step_envelope(MCPXAPUState *d, uint16_t v, uint32_t reg_0,
         if (value <= (sustain_level + 0.2f) || (value > 255.0f)) {
             // FIXME: Should we still update lvl?
             cur++;
-            voice_set_mask(d, v, NV_PAVS_VOICE_PAR_STATE, cur_mask, cur);
+            voice_cache_set(c, NV_PAVS_VOICE_PAR_STATE, cur_mask, cur);
         } else {
             count--;
-            voice_set_mask(d, v, NV_PAVS_VOICE_CUR_ECNT, count_mask, count);
-            voice_set_mask(d, v, lvl_reg, lvl_mask, value);
+            voice_cache_set(c, NV_PAVS_VOICE_CUR_ECNT, count_mask, count);
+            voice_cache_set(c, lvl_reg, lvl_mask, value);
         }
         return value / 255.0f;
     }
     case NV_PAVS_VOICE_PAR_STATE_EFCUR_SUSTAIN: {
         uint8_t sustain_level =
-            voice_get_mask(d, v, reg_a, NV_PAVS_VOICE_CFG_ENVA_EA_SUSTAINLEVEL);
-        voice_set_mask(
-            d, v, NV_PAVS_VOICE_CUR_ECNT, count_mask,
+            voice_cache_get(c, reg_a, NV_PAVS_VOICE_CFG_ENVA_EA_SUSTAINLEVEL);
+        voice_cache_set(
+            c, NV_PAVS_VOICE_CUR_ECNT, count_mask,
             0x00); // FIXME: is this only set to 0 once or forced to zero?
-        voice_set_mask(d, v, lvl_reg, lvl_mask, sustain_level);
+        voice_cache_set(c, lvl_reg, lvl_mask, sustain_level);
         return sustain_level / 255.0f;
     }
     case NV_PAVS_VOICE_PAR_STATE_EFCUR_RELEASE: {
         uint16_t count =
-            voice_get_mask(d, v, NV_PAVS_VOICE_CUR_ECNT, count_mask);
-        uint16_t release_rate = voice_get_mask(d, v, rr_reg, rr_mask);
+            voice_cache_get(c, NV_PAVS_VOICE_CUR_ECNT, count_mask);
+        uint16_t release_rate = voice_cache_get(c, rr_reg, rr_mask);
 
         if (release_rate == 0) {
             count = 0;
@@ -1432,7 +1686,7 @@ static float voice_step_envelope(MCPXAPUState *d, uint16_t v, uint32_t reg_0,
 
         float value = 0;
         if (count == 0) {
-            voice_set_mask(d, v, NV_PAVS_VOICE_PAR_STATE, cur_mask, ++cur);
+            voice_cache_set(c, NV_PAVS_VOICE_PAR_STATE, cur_mask, ++cur);
         } else {
             // FIXME: Appears to be an exponential but unsure about actual
             // curve; performing standard decay of current level to T60 over the
@@ -1443,17 +1697,17 @@ static float voice_step_envelope(MCPXAPUState *d, uint16_t v, uint32_t reg_0,
             // permit simpler attenuation more efficiently and update level on
             // each round.
             float pos = clampf(1 - count / (release_rate * 16.0), 0, 1);
-            uint8_t lvl = voice_get_mask(d, v, lvl_reg, lvl_mask);
+            uint8_t lvl = voice_cache_get(c, lvl_reg, lvl_mask);
             value = powf(M_E, -6.91*pos)*lvl;
             count--; // FIXME: Should release count ascend or descend?
-            voice_set_mask(d, v, NV_PAVS_VOICE_CUR_ECNT, count_mask, count);
+            voice_cache_set(c, NV_PAVS_VOICE_CUR_ECNT, count_mask, count);
         }
 
         return value / 255.0f;
     }
     case NV_PAVS_VOICE_PAR_STATE_EFCUR_FORCE_RELEASE:
         if (count_mask == NV_PAVS_VOICE_CUR_ECNT_EACOUNT) {
-            voice_off(d, v);
+            voice_cache_off(d, c);
         }
         return 0.0f;
     default:
@@ -1484,23 +1738,22 @@ static void set_notify_status(MCPXAPUState *d, uint32_t v, int notifier,
     d->set_irq = true;
 }
 
-static long voice_resample_callback(void *cb_data, float **data)
+/* Fetches a frame of the voice, padded with silence if it runs out */
+static void voice_fetch_samples(MCPXAPUState *d, MCPXAPUVoiceFilter *filter,
+                                float samples[][2])
 {
-    MCPXAPUVoiceFilter *filter = cb_data;
-    uint16_t v = filter->voice;
-    assert(v < MCPX_HW_MAX_VOICES);
-    MCPXAPUState *d = container_of(filter, MCPXAPUState, vp.filters[v]);
+    MCPXAPUVoiceCache *c = filter->cache;
+    int64_t start = d->vp.profiling ? get_clock() : 0;
 
     int sample_count = 0;
     while (sample_count < NUM_SAMPLES_PER_FRAME) {
-        int active = voice_get_mask(d, v, NV_PAVS_VOICE_PAR_STATE,
-                                    NV_PAVS_VOICE_PAR_STATE_ACTIVE_VOICE);
+        int active = voice_cache_get(c, NV_PAVS_VOICE_PAR_STATE,
+                                     NV_PAVS_VOICE_PAR_STATE_ACTIVE_VOICE);
         if (!active) {
             break;
         }
-        int count = voice_get_samples(
-            d, v, (float(*)[2]) & filter->resample_buf[2 * sample_count],
-            NUM_SAMPLES_PER_FRAME - sample_count);
+        int count = voice_get_samples(d, c, &samples[sample_count],
+                                      NUM_SAMPLES_PER_FRAME - sample_count);
         if (count < 0) {
             break;
         }
@@ -1508,24 +1761,47 @@ static long voice_resample_callback(void *cb_data, float **data)
     }
 
     if (sample_count < NUM_SAMPLES_PER_FRAME) {
-        /* Starvation causes SRC hang on repeated calls. Provide silence. */
-        memset(&filter->resample_buf[2*sample_count], 0,
-            2*(NUM_SAMPLES_PER_FRAME-sample_count)*sizeof(float));
-        sample_count = NUM_SAMPLES_PER_FRAME;
+        memset(&samples[sample_count], 0,
+               (NUM_SAMPLES_PER_FRAME - sample_count) * sizeof(samples[0]));
     }
 
-    *data = filter->resample_buf;
-    return sample_count;
+    if (d->vp.profiling) {
+        filter->fetch_ns += get_clock() - start;
+    }
 }
 
-static int voice_resample(MCPXAPUState *d, uint16_t v, float samples[][2],
-                          int requested_num, float rate)
+static long voice_resample_callback(void *cb_data, float **data)
 {
+    MCPXAPUVoiceFilter *filter = cb_data;
+    uint16_t v = filter->voice;
     assert(v < MCPX_HW_MAX_VOICES);
-    MCPXAPUVoiceFilter *filter = &d->vp.filters[v];
+    MCPXAPUState *d = container_of(filter, MCPXAPUState, vp.filters[v]);
+
+    /* Starvation causes SRC hang on repeated calls, so always provide a full
+     * frame, padded with silence. */
+    float (*frames)[2] = (float(*)[2])filter->resample_buf;
+    voice_fetch_samples(d, filter, frames);
+
+    if (filter->resampler_channels == 1) {
+        for (int i = 0; i < NUM_SAMPLES_PER_FRAME; i++) {
+            filter->resample_buf[i] = frames[i][0];
+        }
+    }
+
+    *data = filter->resample_buf;
+    return NUM_SAMPLES_PER_FRAME;
+}
+
+static int voice_resample_sinc(MCPXAPUVoiceFilter *filter, float samples[][2],
+                               int requested_num, float rate,
+                               unsigned int channels)
+{
+    if (filter->resampler && filter->resampler_channels != channels) {
+        src_delete(filter->resampler);
+        filter->resampler = NULL;
+    }
 
     if (filter->resampler == NULL) {
-        filter->voice = v;
         int err;
 
         /* Note: Using a sinc based resampler for quality. Unsure about
@@ -1533,17 +1809,122 @@ static int voice_resample(MCPXAPUState *d, uint16_t v, float samples[][2],
          * which case using this resampler is overkill, but quality is good
          * so use it for now.
          */
-        // FIXME: Don't do 2ch resampling if this is a mono voice
         filter->resampler = src_callback_new(&voice_resample_callback,
-                                           SRC_SINC_FASTEST, 2, &err, filter);
+                                             SRC_SINC_FASTEST, channels, &err,
+                                             filter);
         if (filter->resampler == NULL) {
             fprintf(stderr, "src error: %s\n", src_strerror(err));
             assert(0);
         }
+        filter->resampler_channels = channels;
     }
 
     int count = src_callback_read(filter->resampler, rate, requested_num,
                                   (float *)samples);
+
+    if (channels == 1 && count > 0) {
+        /* Expand in place, from the back so nothing is overwritten early */
+        float *mono = (float *)samples;
+        for (int i = count - 1; i >= 0; i--) {
+            samples[i][1] = samples[i][0] = mono[i];
+        }
+    }
+
+    return count;
+}
+
+static int voice_resample_interpolate(MCPXAPUState *d,
+                                      MCPXAPUVoiceFilter *filter,
+                                      float samples[][2], int requested_num,
+                                      float rate, unsigned int channels)
+{
+    /* rate is the ratio of output to input samples, as SRC takes it */
+    double step = 1.0 / rate;
+    int count = 0;
+
+    while (count < requested_num) {
+        int k = (int)filter->resample_pos;
+        if (k + VP_RESAMPLE_TAPS > filter->resample_in_len) {
+            /* Drop the frames the window has moved past, then append the
+             * next frame of the voice. High pitches may need several. */
+            int drop = MIN(k, filter->resample_in_len);
+            filter->resample_in_len -= drop;
+            filter->resample_pos -= drop;
+            memmove(filter->resample_in, filter->resample_in[drop],
+                    filter->resample_in_len * sizeof(filter->resample_in[0]));
+            assert(filter->resample_in_len + NUM_SAMPLES_PER_FRAME <=
+                   ARRAY_SIZE(filter->resample_in));
+            voice_fetch_samples(d, filter,
+                                &filter->resample_in[filter->resample_in_len]);
+            filter->resample_in_len += NUM_SAMPLES_PER_FRAME;
+            continue;
+        }
+
+        if (filter->resampler_mode == AUDIO_RESAMPLER_LINEAR) {
+            count += vp_resample_linear(
+                filter->resample_in, filter->resample_in_len,
+                &filter->resample_pos, step, &samples[count],
+                requested_num - count, channels);
+        } else {
+            count += vp_resample_hermite(
+                filter->resample_in, filter->resample_in_len,
+                &filter->resample_pos, step, &samples[count],
+                requested_num - count, channels);
+        }
+    }
+
+    return count;
+}
+
+static void voice_reset_resampler(MCPXAPUVoiceFilter *filter)
+{
+    /* Start on a silent history frame, so the first output is the first
+     * sample of the voice */
+    memset(filter->resample_in[0], 0, sizeof(filter->resample_in[0]));
+    filter->resample_in_len = 1;
+    filter->resample_pos = 0;
+    if (filter->resampler) {
+        src_reset(filter->resampler);
+    }
+}
+
+static int voice_resample(MCPXAPUState *d, MCPXAPUVoiceCache *c,
+                          float samples[][2], int requested_num, float rate)
+{
+    uint16_t v = c->voice;
+    assert(v < MCPX_HW_MAX_VOICES);
+    MCPXAPUVoiceFilter *filter = &d->vp.filters[v];
+    bool stereo = voice_cache_get(c, NV_PAVS_VOICE_CFG_FMT,
+                                  NV_PAVS_VOICE_CFG_FMT_STEREO);
+    unsigned int channels = stereo ? 2 : 1;
+    int mode = qatomic_read(&d->vp.resampler_mode);
+
+    filter->voice = v;
+    filter->cache = c;
+    if (mode != filter->resampler_mode) {
+        filter->resampler_mode = mode;
+        voice_reset_resampler(filter);
+    }
+
+    int64_t start = d->vp.profiling ? get_clock() : 0;
+    filter->fetch_ns = 0;
+
+    int count;
+    if (mode == AUDIO_RESAMPLER_SINC) {
+        count = voice_resample_sinc(filter, samples, requested_num, rate,
+                                    channels);
+    } else {
+        count = voice_resample_interpolate(d, filter, samples, requested_num,
+                                           rate, channels);
+    }
+
+    if (d->vp.profiling) {
+        filter->resample_ns[mode] += get_clock() - start - filter->fetch_ns;
+        if (count > 0) {
+            filter->resample_samples[mode] += count;
+        }
+    }
+
     if (count == -1) {
         DPRINTF("resample error\n");
     }
@@ -1561,21 +1942,20 @@ static void voice_reset_filters(MCPXAPUState *d, uint16_t v)
 {
     assert(v < MCPX_HW_MAX_VOICES);
     memset(&d->vp.filters[v].svf, 0, sizeof(d->vp.filters[v].svf));
-    if (d->vp.filters[v].resampler) {
-        src_reset(d->vp.filters[v].resampler);
-    }
+    voice_reset_resampler(&d->vp.filters[v]);
 }
 
-static void voice_process(MCPXAPUState *d,
-                          float mixbins[NUM_MIXBINS][NUM_SAMPLES_PER_FRAME],
-                          uint16_t v)
+static void voice_process(MCPXAPUState *d, MCPXAPUVPVoiceOut *out,
+                          MCPXAPUVoiceCache *c)
 {
+    uint16_t v = c->voice;
     assert(v < MCPX_HW_MAX_VOICES);
-    bool stereo = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_FMT,
-                                 NV_PAVS_VOICE_CFG_FMT_STEREO);
+    out->mixed = false;
+    bool stereo = voice_cache_get(c, NV_PAVS_VOICE_CFG_FMT,
+                                  NV_PAVS_VOICE_CFG_FMT_STEREO);
     unsigned int channels = stereo ? 2 : 1;
-    bool paused = voice_get_mask(d, v, NV_PAVS_VOICE_PAR_STATE,
-                                 NV_PAVS_VOICE_PAR_STATE_PAUSED);
+    bool paused = voice_cache_get(c, NV_PAVS_VOICE_PAR_STATE,
+                                  NV_PAVS_VOICE_PAR_STATE_PAUSED);
 
     struct McpxApuDebugVoice *dbg = &g_dbg.vp.v[v];
     dbg->active = true;
@@ -1587,21 +1967,21 @@ static void voice_process(MCPXAPUState *d,
     }
 
     float ef_value = voice_step_envelope(
-        d, v, NV_PAVS_VOICE_CFG_ENV1, NV_PAVS_VOICE_CFG_ENVF,
+        d, c, NV_PAVS_VOICE_CFG_ENV1, NV_PAVS_VOICE_CFG_ENVF,
         NV_PAVS_VOICE_CFG_MISC, NV_PAVS_VOICE_CFG_MISC_EF_RELEASERATE,
         NV_PAVS_VOICE_PAR_NEXT, NV_PAVS_VOICE_PAR_NEXT_EFLVL,
         NV_PAVS_VOICE_CUR_ECNT_EFCOUNT, NV_PAVS_VOICE_PAR_STATE_EFCUR);
     assert(ef_value >= 0.0f);
     assert(ef_value <= 1.0f);
-    int16_t p = voice_get_mask(d, v, NV_PAVS_VOICE_TAR_PITCH_LINK,
-                               NV_PAVS_VOICE_TAR_PITCH_LINK_PITCH);
-    int8_t ps = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_ENV0,
-                               NV_PAVS_VOICE_CFG_ENV0_EF_PITCHSCALE);
+    int16_t p = voice_cache_get(c, NV_PAVS_VOICE_TAR_PITCH_LINK,
+                                NV_PAVS_VOICE_TAR_PITCH_LINK_PITCH);
+    int8_t ps = voice_cache_get(c, NV_PAVS_VOICE_CFG_ENV0,
+                                NV_PAVS_VOICE_CFG_ENV0_EF_PITCHSCALE);
     float rate = 1.0 / powf(2.0f, (p + ps * 32 * ef_value) / 4096.0f);
     dbg->rate = rate;
 
     float ea_value = voice_step_envelope(
-        d, v, NV_PAVS_VOICE_CFG_ENV0, NV_PAVS_VOICE_CFG_ENVA,
+        d, c, NV_PAVS_VOICE_CFG_ENV0, NV_PAVS_VOICE_CFG_ENVA,
         NV_PAVS_VOICE_TAR_LFO_ENV, NV_PAVS_VOICE_TAR_LFO_ENV_EA_RELEASERATE,
         NV_PAVS_VOICE_PAR_OFFSET, NV_PAVS_VOICE_PAR_OFFSET_EALVL,
         NV_PAVS_VOICE_CUR_ECNT_EACOUNT, NV_PAVS_VOICE_PAR_STATE_EACUR);
@@ -1610,12 +1990,12 @@ static void voice_process(MCPXAPUState *d,
 
     float samples[NUM_SAMPLES_PER_FRAME][2] = { 0 };
     for (int sample_count = 0; sample_count < NUM_SAMPLES_PER_FRAME;) {
-        int active = voice_get_mask(d, v, NV_PAVS_VOICE_PAR_STATE,
-                                    NV_PAVS_VOICE_PAR_STATE_ACTIVE_VOICE);
+        int active = voice_cache_get(c, NV_PAVS_VOICE_PAR_STATE,
+                                     NV_PAVS_VOICE_PAR_STATE_ACTIVE_VOICE);
         if (!active) {
             return;
         }
-        int count = voice_resample(d, v, &samples[sample_count],
+        int count = voice_resample(d, c, &samples[sample_count],
                                    NUM_SAMPLES_PER_FRAME - sample_count, rate);
         if (count < 0) {
             break;
@@ -1623,29 +2003,29 @@ static void voice_process(MCPXAPUState *d,
         sample_count += count;
     }
 
-    int active = voice_get_mask(d, v, NV_PAVS_VOICE_PAR_STATE,
-                                NV_PAVS_VOICE_PAR_STATE_ACTIVE_VOICE);
+    int active = voice_cache_get(c, NV_PAVS_VOICE_PAR_STATE,
+                                 NV_PAVS_VOICE_PAR_STATE_ACTIVE_VOICE);
     if (!active) {
         return;
     }
 
     int bin[8];
-    bin[0] = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_VBIN,
-                            NV_PAVS_VOICE_CFG_VBIN_V0BIN);
-    bin[1] = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_VBIN,
-                            NV_PAVS_VOICE_CFG_VBIN_V1BIN);
-    bin[2] = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_VBIN,
-                            NV_PAVS_VOICE_CFG_VBIN_V2BIN);
-    bin[3] = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_VBIN,
-                            NV_PAVS_VOICE_CFG_VBIN_V3BIN);
-    bin[4] = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_VBIN,
-                            NV_PAVS_VOICE_CFG_VBIN_V4BIN);
-    bin[5] = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_VBIN,
-                            NV_PAVS_VOICE_CFG_VBIN_V5BIN);
-    bin[6] = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_FMT,
-                            NV_PAVS_VOICE_CFG_FMT_V6BIN);
-    bin[7] = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_FMT,
-                            NV_PAVS_VOICE_CFG_FMT_V7BIN);
+    bin[0] = voice_cache_get(c, NV_PAVS_VOICE_CFG_VBIN,
+                             NV_PAVS_VOICE_CFG_VBIN_V0BIN);
+    bin[1] = voice_cache_get(c, NV_PAVS_VOICE_CFG_VBIN,
+                             NV_PAVS_VOICE_CFG_VBIN_V1BIN);
+    bin[2] = voice_cache_get(c, NV_PAVS_VOICE_CFG_VBIN,
+                             NV_PAVS_VOICE_CFG_VBIN_V2BIN);
+    bin[3] = voice_cache_get(c, NV_PAVS_VOICE_CFG_VBIN,
+                             NV_PAVS_VOICE_CFG_VBIN_V3BIN);
+    bin[4] = voice_cache_get(c, NV_PAVS_VOICE_CFG_VBIN,
+                             NV_PAVS_VOICE_CFG_VBIN_V4BIN);
+    bin[5] = voice_cache_get(c, NV_PAVS_VOICE_CFG_VBIN,
+                             NV_PAVS_VOICE_CFG_VBIN_V5BIN);
+    bin[6] = voice_cache_get(c, NV_PAVS_VOICE_CFG_FMT,
+                             NV_PAVS_VOICE_CFG_FMT_V6BIN);
+    bin[7] = voice_cache_get(c, NV_PAVS_VOICE_CFG_FMT,
+                             NV_PAVS_VOICE_CFG_FMT_V7BIN);
 
     if (v < 64) {
         bin[0] = d->vp.hrtf_submix[0];
@@ -1655,31 +2035,31 @@ static void voice_process(MCPXAPUState *d,
     }
 
     uint16_t vol[8];
-    vol[0] = voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLA,
-                            NV_PAVS_VOICE_TAR_VOLA_VOLUME0);
-    vol[1] = voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLA,
-                            NV_PAVS_VOICE_TAR_VOLA_VOLUME1);
-    vol[2] = voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLB,
-                            NV_PAVS_VOICE_TAR_VOLB_VOLUME2);
-    vol[3] = voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLB,
-                            NV_PAVS_VOICE_TAR_VOLB_VOLUME3);
-    vol[4] = voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLC,
-                            NV_PAVS_VOICE_TAR_VOLC_VOLUME4);
-    vol[5] = voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLC,
-                            NV_PAVS_VOICE_TAR_VOLC_VOLUME5);
-
-    vol[6] = voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLC,
-                            NV_PAVS_VOICE_TAR_VOLC_VOLUME6_B11_8) << 8;
-    vol[6] |= voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLB,
-                             NV_PAVS_VOICE_TAR_VOLB_VOLUME6_B7_4) << 4;
-    vol[6] |= voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLA,
-                             NV_PAVS_VOICE_TAR_VOLA_VOLUME6_B3_0);
-    vol[7] = voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLC,
-                            NV_PAVS_VOICE_TAR_VOLC_VOLUME7_B11_8) << 8;
-    vol[7] |= voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLB,
-                             NV_PAVS_VOICE_TAR_VOLB_VOLUME7_B7_4) << 4;
-    vol[7] |= voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLA,
-                             NV_PAVS_VOICE_TAR_VOLA_VOLUME7_B3_0);
+    vol[0] = voice_cache_get(c, NV_PAVS_VOICE_TAR_VOLA,
+                             NV_PAVS_VOICE_TAR_VOLA_VOLUME0);
+    vol[1] = voice_cache_get(c, NV_PAVS_VOICE_TAR_VOLA,
+                             NV_PAVS_VOICE_TAR_VOLA_VOLUME1);
+    vol[2] = voice_cache_get(c, NV_PAVS_VOICE_TAR_VOLB,
+                             NV_PAVS_VOICE_TAR_VOLB_VOLUME2);
+    vol[3] = voice_cache_get(c, NV_PAVS_VOICE_TAR_VOLB,
+                             NV_PAVS_VOICE_TAR_VOLB_VOLUME3);
+    vol[4] = voice_cache_get(c, NV_PAVS_VOICE_TAR_VOLC,
+                             NV_PAVS_VOICE_TAR_VOLC_VOLUME4);
+    vol[5] = voice_cache_get(c, NV_PAVS_VOICE_TAR_VOLC,
+                             NV_PAVS_VOICE_TAR_VOLC_VOLUME5);
+
+    vol[6] = voice_cache_get(c, NV_PAVS_VOICE_TAR_VOLC,
+                             NV_PAVS_VOICE_TAR_VOLC_VOLUME6_B11_8) << 8;
+    vol[6] |= voice_cache_get(c, NV_PAVS_VOICE_TAR_VOLB,
+                              NV_PAVS_VOICE_TAR_VOLB_VOLUME6_B7_4) << 4;
+    vol[6] |= voice_cache_get(c, NV_PAVS_VOICE_TAR_VOLA,
+                              NV_PAVS_VOICE_TAR_VOLA_VOLUME6_B3_0);
+    vol[7] = voice_cache_get(c, NV_PAVS_VOICE_TAR_VOLC,
+                             NV_PAVS_VOICE_TAR_VOLC_VOLUME7_B11_8) << 8;
+    vol[7] |= voice_cache_get(c, NV_PAVS_VOICE_TAR_VOLB,
+                              NV_PAVS_VOICE_TAR_VOLB_VOLUME7_B7_4) << 4;
+    vol[7] |= voice_cache_get(c, NV_PAVS_VOICE_TAR_VOLA,
+                              NV_PAVS_VOICE_TAR_VOLA_VOLUME7_B3_0);
 
     // FIXME: If phase negations means to flip the signal upside down
     //        we should modify volume of bin6 and bin7 here.
@@ -1693,8 +2073,8 @@ static void voice_process(MCPXAPUState *d,
         return;
     }
 
-    int fmode = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_MISC,
-                               NV_PAVS_VOICE_CFG_MISC_FMODE);
+    int fmode = voice_cache_get(c, NV_PAVS_VOICE_CFG_MISC,
+                                NV_PAVS_VOICE_CFG_MISC_FMODE);
 
     // FIXME: Move to function
     bool lpf = false;
@@ -1706,27 +2086,27 @@ static void voice_process(MCPXAPUState *d,
         lpf = stereo ? (fmode == 1) : (fmode & 1);
     }
     if (lpf) {
+        sv_filter *filters = d->vp.filters[v].svf;
         for (int ch = 0; ch < 2; ch++) {
             // FIXME: Cutoff modulation via NV_PAVS_VOICE_CFG_ENV1_EF_FCSCALE
-            int16_t fc = voice_get_mask(
-                d, v, NV_PAVS_VOICE_TAR_FCA + (ch % channels) * 4,
+            int16_t fc = voice_cache_get(
+                c, NV_PAVS_VOICE_TAR_FCA + (ch % channels) * 4,
                 NV_PAVS_VOICE_TAR_FCA_FC0);
             float fc_f = clampf(pow(2, fc / 4096.0), 0.003906f, 1.0f);
-            uint16_t q = voice_get_mask(
-                d, v, NV_PAVS_VOICE_TAR_FCA + (ch % channels) * 4,
+            uint16_t q = voice_cache_get(
+                c, NV_PAVS_VOICE_TAR_FCA + (ch % channels) * 4,
                 NV_PAVS_VOICE_TAR_FCA_FC1);
             float q_f = clampf(q / (1.0 * 0x8000), 0.079407f, 1.0f);
-            sv_filter *filter = &d->vp.filters[v].svf[ch];
-            setup_svf(filter, fc_f, q_f, F_LP);
-            for (int i = 0; i < NUM_SAMPLES_PER_FRAME; i++) {
-                samples[i][ch] = run_svf(filter, samples[i][ch]);
-                samples[i][ch] = fmin(fmax(samples[i][ch], -1.0), 1.0);
-            }
+            setup_svf(&filters[ch], fc_f, q_f, F_LP);
         }
+        vp_svf_lp_stereo(filters, samples, NUM_SAMPLES_PER_FRAME);
     }
 
     // FIXME: ParaEQ
 
+    vp_deinterleave(samples, out->channel_samples[0], out->channel_samples[1],
+                    NUM_SAMPLES_PER_FRAME);
+
     for (int b = 0; b < 8; b++) {
         float g = ea_value;
         float hr;
@@ -1737,13 +2117,13 @@ static void voice_process(MCPXAPUState *d,
         } else {
             hr = 1 << d->vp.submix_headroom[bin[b]];
         }
-        g *= attenuate(vol[b])/hr;
-        for (int i = 0; i < NUM_SAMPLES_PER_FRAME; i++) {
-            mixbins[bin[b]][i] += g*samples[i][b % channels];
-        }
+        g *= vp_attenuate(vol[b])/hr;
+        out->bin[b] = bin[b];
+        out->gain[b] = g;
     }
 
-    if (d->mon == MCPX_APU_DEBUG_MON_VP) {
+    out->monitor = (d->mon == MCPX_APU_DEBUG_MON_VP);
+    if (out->monitor) {
         /* For VP mon, simply mix all voices together here, selecting the
          * maximal volume used for any given mixbin as the overall volume for
          * this voice.
@@ -1751,52 +2131,53 @@ static void voice_process(MCPXAPUState *d,
         float g = 0.0f;
         for (int b = 0; b < 8; b++) {
             float hr = 1 << d->vp.submix_headroom[bin[b]];
-            g = fmax(g, attenuate(vol[b]) / hr);
-        }
-        g *= ea_value;
-        for (int i = 0; i < NUM_SAMPLES_PER_FRAME; i++) {
-            d->vp.sample_buf[i][0] += g*samples[i][0];
-            d->vp.sample_buf[i][1] += g*samples[i][1];
+            g = fmax(g, vp_attenuate(vol[b]) / hr);
         }
+        out->monitor_gain = g * ea_value;
+        memcpy(out->samples, samples, sizeof(out->samples));
     }
+
+    out->channels = channels;
+    out->mixed = true;
 }
 
-static int voice_get_samples(MCPXAPUState *d, uint32_t v, float samples[][2],
-                       int num_samples_requested)
+static int voice_get_samples(MCPXAPUState *d, MCPXAPUVoiceCache *c,
+                             float samples[][2], int num_samples_requested)
 {
+    uint16_t v = c->voice;
     assert(v < MCPX_HW_MAX_VOICES);
-    bool stereo = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_FMT,
-                                 NV_PAVS_VOICE_CFG_FMT_STEREO);
+    bool stereo = voice_cache_get(c, NV_PAVS_VOICE_CFG_FMT,
+                                  NV_PAVS_VOICE_CFG_FMT_STEREO);
     unsigned int channels = stereo ? 2 : 1;
-    unsigned int sample_size = voice_get_mask(
-        d, v, NV_PAVS_VOICE_CFG_FMT, NV_PAVS_VOICE_CFG_FMT_SAMPLE_SIZE);
+    unsigned int sample_size = voice_cache_get(
+        c, NV_PAVS_VOICE_CFG_FMT, NV_PAVS_VOICE_CFG_FMT_SAMPLE_SIZE);
     unsigned int container_sizes[4] = { 1, 2, 0, 4 }; /* B8, B16, ADPCM, B32 */
-    unsigned int container_size_index = voice_get_mask(
-        d, v, NV_PAVS_VOICE_CFG_FMT, NV_PAVS_VOICE_CFG_FMT_CONTAINER_SIZE);
+    unsigned int container_size_index = voice_cache_get(
+        c, NV_PAVS_VOICE_CFG_FMT, NV_PAVS_VOICE_CFG_FMT_CONTAINER_SIZE);
     unsigned int container_size = container_sizes[container_size_index];
-    bool stream = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_FMT,
-                                 NV_PAVS_VOICE_CFG_FMT_DATA_TYPE);
-    bool paused = voice_get_mask(d, v, NV_PAVS_VOICE_PAR_STATE,
-                                 NV_PAVS_VOICE_PAR_STATE_PAUSED);
+    bool stream = voice_cache_get(c, NV_PAVS_VOICE_CFG_FMT,
+                                  NV_PAVS_VOICE_CFG_FMT_DATA_TYPE);
+    bool paused = voice_cache_get(c, NV_PAVS_VOICE_PAR_STATE,
+                                  NV_PAVS_VOICE_PAR_STATE_PAUSED);
     bool loop =
-        voice_get_mask(d, v, NV_PAVS_VOICE_CFG_FMT, NV_PAVS_VOICE_CFG_FMT_LOOP);
-    uint32_t ebo = voice_get_mask(d, v, NV_PAVS_VOICE_PAR_NEXT,
-                                  NV_PAVS_VOICE_PAR_NEXT_EBO);
-    uint32_t cbo = voice_get_mask(d, v, NV_PAVS_VOICE_PAR_OFFSET,
-                                  NV_PAVS_VOICE_PAR_OFFSET_CBO);
-    uint32_t lbo = voice_get_mask(d, v, NV_PAVS_VOICE_CUR_PSH_SAMPLE,
-                                  NV_PAVS_VOICE_CUR_PSH_SAMPLE_LBO);
-    uint32_t ba = voice_get_mask(d, v, NV_PAVS_VOICE_CUR_PSL_START,
-                                 NV_PAVS_VOICE_CUR_PSL_START_BA);
+        voice_cache_get(c, NV_PAVS_VOICE_CFG_FMT, NV_PAVS_VOICE_CFG_FMT_LOOP);
+    uint32_t ebo = voice_cache_get(c, NV_PAVS_VOICE_PAR_NEXT,
+                                   NV_PAVS_VOICE_PAR_NEXT_EBO);
+    uint32_t cbo = voice_cache_get(c, NV_PAVS_VOICE_PAR_OFFSET,
+                                   NV_PAVS_VOICE_PAR_OFFSET_CBO);
+    uint32_t lbo = voice_cache_get(c, NV_PAVS_VOICE_CUR_PSH_SAMPLE,
+                                   NV_PAVS_VOICE_CUR_PSH_SAMPLE_LBO);
+    uint32_t ba = voice_cache_get(c, NV_PAVS_VOICE_CUR_PSL_START,
+                                  NV_PAVS_VOICE_CUR_PSL_START_BA);
     unsigned int samples_per_block =
-        1 + voice_get_mask(d, v, NV_PAVS_VOICE_CFG_FMT,
-                           NV_PAVS_VOICE_CFG_FMT_SAMPLES_PER_BLOCK);
-    bool persist = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_FMT,
-                                  NV_PAVS_VOICE_CFG_FMT_PERSIST);
-    bool multipass = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_FMT,
-                                    NV_PAVS_VOICE_CFG_FMT_MULTIPASS);
-    bool linked = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_FMT,
-                                 NV_PAVS_VOICE_CFG_FMT_LINKED); /* FIXME? */
+        1 + voice_cache_get(c, NV_PAVS_VOICE_CFG_FMT,
+                            NV_PAVS_VOICE_CFG_FMT_SAMPLES_PER_BLOCK);
+    bool persist = voice_cache_get(c, NV_PAVS_VOICE_CFG_FMT,
+                                   NV_PAVS_VOICE_CFG_FMT_PERSIST);
+    bool multipass = voice_cache_get(c, NV_PAVS_VOICE_CFG_FMT,
+                                     NV_PAVS_VOICE_CFG_FMT_MULTIPASS);
+    bool linked = voice_cache_get(c, NV_PAVS_VOICE_CFG_FMT,
+                                  NV_PAVS_VOICE_CFG_FMT_LINKED); /* FIXME? */
 
     int ssl_index = 0;
     int ssl_seg = 0;
@@ -1812,7 +2193,7 @@ static int voice_get_samples(MCPXAPUState *d, uint32_t v, float samples[][2],
 
     int adpcm_block_index = -1;
     uint32_t adpcm_block[36*2/4];
-    int16_t adpcm_decoded[65*2]; // FIXME: Move out of here
+    int16_t adpcm_decoded[65*2];
 
     // FIXME: Only update if necessary
     struct McpxApuDebugVoice *dbg = &g_dbg.vp.v[v];
@@ -1832,8 +2213,8 @@ static int voice_get_samples(MCPXAPUState *d, uint32_t v, float samples[][2],
     // This is probably cleared when the first sample is played
     // FIXME: How will this behave if CBO > EBO on first play?
     // FIXME: How will this behave if paused?
-    voice_set_mask(d, v, NV_PAVS_VOICE_PAR_STATE,
-                   NV_PAVS_VOICE_PAR_STATE_NEW_VOICE, 0);
+    voice_cache_set(c, NV_PAVS_VOICE_PAR_STATE,
+                    NV_PAVS_VOICE_PAR_STATE_NEW_VOICE, 0);
 
     if (paused) {
         return -1;
@@ -1843,13 +2224,13 @@ static int voice_get_samples(MCPXAPUState *d, uint32_t v, float samples[][2],
         if (!persist) {
             // FIXME: Confirm. Unsure if this should wait until end of SSL or
             // terminate immediately. Definitely not before end of envelope.
-            int eacur = voice_get_mask(d, v, NV_PAVS_VOICE_PAR_STATE,
-                                       NV_PAVS_VOICE_PAR_STATE_EACUR);
+            int eacur = voice_cache_get(c, NV_PAVS_VOICE_PAR_STATE,
+                                        NV_PAVS_VOICE_PAR_STATE_EACUR);
             if (eacur < NV_PAVS_VOICE_PAR_STATE_EFCUR_RELEASE) {
                 DPRINTF("Voice %d envelope not in release state (%d) and "
                         "persist is not set. Ending stream now!\n",
                         v, eacur);
-                voice_off(d, v);
+                voice_cache_off(d, c);
                 return -1;
             }
         }
@@ -1865,12 +2246,12 @@ static int voice_get_samples(MCPXAPUState *d, uint32_t v, float samples[][2],
         // Check to see if the stream has ended
         if (count == 0) {
             DPRINTF("Stream has ended\n");
-            voice_set_mask(d, v, NV_PAVS_VOICE_PAR_OFFSET,
-                           NV_PAVS_VOICE_PAR_OFFSET_CBO, 0);
+            voice_cache_set(c, NV_PAVS_VOICE_PAR_OFFSET,
+                            NV_PAVS_VOICE_PAR_OFFSET_CBO, 0);
             d->vp.ssl[v].ssl_seg = 0;
             if (!persist) {
                 d->vp.ssl[v].ssl_index = 0;
-                voice_off(d, v);
+                voice_cache_off(d, c);
             } else {
                 set_notify_status(
                     d, v, MCPX_HW_NOTIFIER_SSLA_DONE + d->vp.ssl[v].ssl_index,
@@ -1952,19 +2333,12 @@ static int voice_get_samples(MCPXAPUState *d, uint32_t v, float samples[][2],
                     assert(linear_addr + block_size <= max_seg_byte);
                     memcpy(adpcm_block, &d->ram_ptr[addr],
                            block_size); // FIXME: Use idiomatic DMA function
+                    adpcm_decode_block(adpcm_decoded, (uint8_t *)adpcm_block,
+                                       block_size, channels);
                 } else {
-                    linear_addr += ba;
-                    for (unsigned int word_index = 0;
-                         word_index < (9 * samples_per_block); word_index++) {
-                        hwaddr addr = get_data_ptr(d->regs[NV_PAPU_VPSGEADDR],
-                                                   0xFFFFFFFF, linear_addr);
-                        adpcm_block[word_index] =
-                            ldl_le_phys(&address_space_memory, addr);
-                        linear_addr += 4;
-                    }
+                    voice_decode_adpcm_block(d, ba + linear_addr, block_size,
+                                             channels, adpcm_decoded);
                 }
-                adpcm_decode_block(adpcm_decoded, (uint8_t *)adpcm_block,
-                                   block_size, channels);
                 adpcm_block_index = block_index;
             }
 
@@ -2039,17 +2413,407 @@ static int voice_get_samples(MCPXAPUState *d, uint32_t v, float samples[][2],
                 cbo = lbo;
             } else {
                 cbo = ebo;
-                voice_off(d, v);
+                voice_cache_off(d, c);
                 DPRINTF("end of buffer!\n");
             }
         }
     }
 
-    voice_set_mask(d, v, NV_PAVS_VOICE_PAR_OFFSET,
-                   NV_PAVS_VOICE_PAR_OFFSET_CBO, cbo);
+    voice_cache_set(c, NV_PAVS_VOICE_PAR_OFFSET,
+                    NV_PAVS_VOICE_PAR_OFFSET_CBO, cbo);
     return sample_count;
 }
 
+static void adpcm_cache_init(MCPXAPUState *d)
+{
+    for (int i = 0; i < MCPX_ADPCM_CACHE_SETS; i++) {
+        qemu_spin_init(&d->vp.adpcm_cache[i].lock);
+    }
+    qemu_spin_init(&d->vp.adpcm_pages_lock);
+    d->vp.adpcm_num_pages = memory_region_size(d->ram) >> TARGET_PAGE_BITS;
+    d->vp.adpcm_page_refs = g_new0(uint16_t, d->vp.adpcm_num_pages);
+    d->vp.adpcm_pages = bitmap_new(d->vp.adpcm_num_pages);
+    d->vp.adpcm_dirty_pages = bitmap_new(d->vp.adpcm_num_pages);
+    adpcm_cache_flush(d);
+    memory_region_set_log(d->ram, true, DIRTY_MEMORY_MCPX);
+}
+
+/* Drops every entry. Must not race with the VP workers. */
+static void adpcm_cache_flush(MCPXAPUState *d)
+{
+    for (int i = 0; i < MCPX_ADPCM_CACHE_SETS; i++) {
+        MCPXAPUADPCMCacheSet *set = &d->vp.adpcm_cache[i];
+        set->next_victim = 0;
+        for (int j = 0; j < MCPX_ADPCM_CACHE_WAYS; j++) {
+            set->blocks[j].valid = false;
+        }
+    }
+    memset(d->vp.adpcm_page_refs, 0,
+           d->vp.adpcm_num_pages * sizeof(d->vp.adpcm_page_refs[0]));
+    bitmap_zero(d->vp.adpcm_pages, d->vp.adpcm_num_pages);
+}
+
+/* Accounts for @block becoming valid (@delta 1) or invalid (@delta -1) */
+static void adpcm_cache_ref_pages(MCPXAPUState *d,
+                                  const MCPXAPUADPCMBlock *block, int delta)
+{
+    unsigned long first = block->addr >> TARGET_PAGE_BITS;
+    unsigned long last = (block->addr + block->block_size - 1) >>
+                         TARGET_PAGE_BITS;
+
+    qemu_spin_lock(&d->vp.adpcm_pages_lock);
+    for (unsigned long page = first; page <= last; page++) {
+        d->vp.adpcm_page_refs[page] += delta;
+        if (d->vp.adpcm_page_refs[page] == 0) {
+            clear_bit(page, d->vp.adpcm_pages);
+        } else {
+            set_bit(page, d->vp.adpcm_pages);
+        }
+    }
+    qemu_spin_unlock(&d->vp.adpcm_pages_lock);
+}
+
+/*
+ * Drops the entries the guest has written to since the last frame. Called
+ * by the APU thread while the VP workers are idle.
+ */
+static void adpcm_cache_invalidate_dirty(MCPXAPUState *d)
+{
+    unsigned long num_pages = d->vp.adpcm_num_pages;
+    unsigned long *dirty = d->vp.adpcm_dirty_pages;
+    bool any_dirty = false;
+
+    /* Check and clear runs of pages holding cached blocks, and nothing else */
+    unsigned long start = find_first_bit(d->vp.adpcm_pages, num_pages);
+    while (start < num_pages) {
+        unsigned long end = find_next_zero_bit(d->vp.adpcm_pages, num_pages,
+                                               start);
+        DirtyBitmapSnapshot *snap = memory_region_snapshot_and_clear_dirty(
+            d->ram, (hwaddr)start << TARGET_PAGE_BITS,
+            (hwaddr)(end - start) << TARGET_PAGE_BITS, DIRTY_MEMORY_MCPX);
+        for (unsigned long page = start; page < end; page++) {
+            if (memory_region_snapshot_get_dirty(
+                    d->ram, snap, (hwaddr)page << TARGET_PAGE_BITS,
+                    TARGET_PAGE_SIZE)) {
+                set_bit(page, dirty);
+                any_dirty = true;
+            }
+        }
+        g_free(snap);
+        start = find_next_bit(d->vp.adpcm_pages, num_pages, end);
+    }
+
+    if (!any_dirty) {
+        return;
+    }
+
+    for (int i = 0; i < MCPX_ADPCM_CACHE_SETS; i++) {
+        MCPXAPUADPCMCacheSet *set = &d->vp.adpcm_cache[i];
+        for (int j = 0; j < MCPX_ADPCM_CACHE_WAYS; j++) {
+            MCPXAPUADPCMBlock *block = &set->blocks[j];
+            if (!block->valid) {
+                continue;
+            }
+            unsigned long first = block->addr >> TARGET_PAGE_BITS;
+            unsigned long last = (block->addr + block->block_size - 1) >>
+                                 TARGET_PAGE_BITS;
+            if (test_bit(first, dirty) || test_bit(last, dirty)) {
+                block->valid = false;
+                adpcm_cache_ref_pages(d, block, -1);
+            }
+        }
+    }
+
+    bitmap_zero(dirty, num_pages);
+}
+
+static MCPXAPUADPCMCacheSet *adpcm_cache_set(MCPXAPUState *d, hwaddr addr)
+{
+    /* Blocks are at least 36 bytes apart, spread them over the sets */
+    uint32_t h = (addr / 4) * 0x9E3779B1;
+    return &d->vp.adpcm_cache[h >> (32 - MCPX_ADPCM_CACHE_SET_BITS)];
+}
+
+static bool adpcm_cache_lookup(MCPXAPUState *d, hwaddr addr,
+                               size_t block_size, unsigned int channels,
+                               int16_t *samples)
+{
+    MCPXAPUADPCMCacheSet *set = adpcm_cache_set(d, addr);
+    bool hit = false;
+
+    qemu_spin_lock(&set->lock);
+    for (int i = 0; i < MCPX_ADPCM_CACHE_WAYS; i++) {
+        MCPXAPUADPCMBlock *block = &set->blocks[i];
+        if (block->valid && block->addr == addr &&
+            block->block_size == block_size && block->channels == channels) {
+            memcpy(samples, block->samples, sizeof(block->samples));
+            hit = true;
+            break;
+        }
+    }
+    qemu_spin_unlock(&set->lock);
+
+    return hit;
+}
+
+static void adpcm_cache_insert(MCPXAPUState *d, hwaddr addr,
+                               size_t block_size, unsigned int channels,
+                               const int16_t *samples)
+{
+    MCPXAPUADPCMCacheSet *set = adpcm_cache_set(d, addr);
+
+    qemu_spin_lock(&set->lock);
+    MCPXAPUADPCMBlock *block = &set->blocks[set->next_victim];
+    set->next_victim = (set->next_victim + 1) % MCPX_ADPCM_CACHE_WAYS;
+    if (block->valid) {
+        adpcm_cache_ref_pages(d, block, -1);
+    }
+    block->addr = addr;
+    block->block_size = block_size;
+    block->channels = channels;
+    block->valid = true;
+    memcpy(block->samples, samples, sizeof(block->samples));
+    adpcm_cache_ref_pages(d, block, 1);
+    qemu_spin_unlock(&set->lock);
+}
+
+/* Reads the ADPCM block at @linear_addr of a buffer voice and decodes it */
+static void voice_decode_adpcm_block(MCPXAPUState *d, uint32_t linear_addr,
+                                     size_t block_size, unsigned int channels,
+                                     int16_t *samples)
+{
+    hwaddr sge_base = d->regs[NV_PAPU_VPSGEADDR];
+    uint32_t adpcm_block[36*2/4];
+    assert(block_size <= sizeof(adpcm_block));
+
+    /* Only blocks that are contiguous in guest memory are cached */
+    hwaddr addr = get_data_ptr(sge_base, 0xFFFFFFFF, linear_addr);
+    hwaddr last = get_data_ptr(sge_base, 0xFFFFFFFF,
+                               linear_addr + block_size - 4);
+    bool cacheable = (last == addr + block_size - 4) &&
+                     (last + 4 <= memory_region_size(d->ram));
+
+    if (cacheable) {
+        if (adpcm_cache_lookup(d, addr, block_size, channels, samples)) {
+            qatomic_inc(&d->vp.adpcm_blocks_cached);
+            return;
+        }
+        memcpy(adpcm_block, &d->ram_ptr[addr], block_size);
+    } else {
+        for (unsigned int word_index = 0; word_index < block_size / 4;
+             word_index++) {
+            hwaddr word_addr = get_data_ptr(sge_base, 0xFFFFFFFF,
+                                            linear_addr + word_index * 4);
+            adpcm_block[word_index] =
+                ldl_le_phys(&address_space_memory, word_addr);
+        }
+    }
+
+    adpcm_decode_block(samples, (uint8_t *)adpcm_block, block_size, channels);
+    qatomic_inc(&d->vp.adpcm_blocks_decoded);
+
+    if (cacheable) {
+        adpcm_cache_insert(d, addr, block_size, channels, samples);
+    }
+}
+
+/* Runs the VP for voice @v, whose spinlock must be held */
+static void vp_process_voice(MCPXAPUState *d, MCPXAPUVPVoiceOut *out,
+                             uint16_t v)
+{
+    MCPXAPUVoiceCache cache;
+
+    voice_cache_load(d, &cache, v);
+    voice_process(d, out, &cache);
+    voice_cache_store(d, &cache);
+}
+
+/*
+ * Claims slices of the frame's voice list until none are left, processing the
+ * voices the guest hasn't locked. Locked voices are marked as deferred and
+ * left to the APU thread, which can wait for them under d->lock.
+ */
+static void vp_process_slices(MCPXAPUState *d)
+{
+    unsigned int num_voices = d->vp.num_voices;
+    unsigned int slice;
+
+    while ((slice = qatomic_fetch_inc(&d->vp.next_slice)) <
+           MCPX_VP_NUM_SLICES) {
+        unsigned int start = num_voices * slice / MCPX_VP_NUM_SLICES;
+        unsigned int end = num_voices * (slice + 1) / MCPX_VP_NUM_SLICES;
+        for (unsigned int i = start; i < end; i++) {
+            uint16_t v = d->vp.voices[i];
+            qemu_spin_lock(&d->vp.voice_spinlocks[v]);
+            d->vp.deferred[i] = is_voice_locked(d, v);
+            if (!d->vp.deferred[i]) {
+                vp_process_voice(d, &d->vp.out[i], v);
+            }
+            qemu_spin_unlock(&d->vp.voice_spinlocks[v]);
+        }
+    }
+}
+
+static void *vp_worker_thread(void *arg)
+{
+    MCPXAPUVPWorker *w = arg;
+    MCPXAPUState *d = w->d;
+    unsigned int frame = 0;
+
+    qemu_mutex_lock(&d->vp.worker_lock);
+    while (true) {
+        while (!d->vp.workers_exiting && d->vp.frame == frame) {
+            qemu_cond_wait(&d->vp.work_cond, &d->vp.worker_lock);
+        }
+        if (d->vp.workers_exiting) {
+            break;
+        }
+        frame = d->vp.frame;
+
+        qemu_mutex_unlock(&d->vp.worker_lock);
+        vp_process_slices(d);
+        qemu_mutex_lock(&d->vp.worker_lock);
+
+        if (++d->vp.num_workers_done == d->vp.num_workers) {
+            qemu_cond_signal(&d->vp.done_cond);
+        }
+    }
+    qemu_mutex_unlock(&d->vp.worker_lock);
+
+    return NULL;
+}
+
+static void vp_workers_init(MCPXAPUState *d)
+{
+    qemu_mutex_init(&d->vp.worker_lock);
+    qemu_cond_init(&d->vp.work_cond);
+    qemu_cond_init(&d->vp.done_cond);
+    d->vp.workers_exiting = false;
+    d->vp.frame = 0;
+    d->vp.num_workers_done = 0;
+
+    /* Leave a core each to the vCPU, the FIFO thread and the APU thread, which
+     * processes slices alongside the workers */
+    d->vp.num_workers = MIN(MAX((int)g_get_num_processors() - 3, 0),
+                            MCPX_VP_MAX_WORKERS);
+    for (int i = 0; i < d->vp.num_workers; i++) {
+        MCPXAPUVPWorker *w = &d->vp.workers[i];
+        w->d = d;
+        qemu_thread_create(&w->thread, "mcpx.vp_worker", vp_worker_thread, w,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void vp_workers_finalize(MCPXAPUState *d)
+{
+    qemu_mutex_lock(&d->vp.worker_lock);
+    d->vp.workers_exiting = true;
+    qemu_cond_broadcast(&d->vp.work_cond);
+    qemu_mutex_unlock(&d->vp.worker_lock);
+
+    for (int i = 0; i < d->vp.num_workers; i++) {
+        qemu_thread_join(&d->vp.workers[i].thread);
+    }
+
+    qemu_cond_destroy(&d->vp.done_cond);
+    qemu_cond_destroy(&d->vp.work_cond);
+    qemu_mutex_destroy(&d->vp.worker_lock);
+}
+
+/*
+ * Processes the voices collected in d->vp.voices, with the help of the workers
+ * on busy frames, and returns their summed MIXBINs. Called with d->lock held.
+ */
+static MCPXAPUVPMix *vp_mix_voices(MCPXAPUState *d)
+{
+    unsigned int num_voices = d->vp.num_voices;
+    bool parallel = d->vp.num_workers > 0 &&
+                    num_voices >= MCPX_VP_MIN_PARALLEL_VOICES;
+
+    qatomic_set(&d->vp.next_slice, 0);
+    if (parallel) {
+        qemu_mutex_lock(&d->vp.worker_lock);
+        d->vp.num_workers_done = 0;
+        d->vp.frame++;
+        qemu_cond_broadcast(&d->vp.work_cond);
+        qemu_mutex_unlock(&d->vp.worker_lock);
+    }
+
+    vp_process_slices(d);
+
+    if (parallel) {
+        qemu_mutex_lock(&d->vp.worker_lock);
+        while (d->vp.num_workers_done < d->vp.num_workers) {
+            qemu_cond_wait(&d->vp.done_cond, &d->vp.worker_lock);
+        }
+        qemu_mutex_unlock(&d->vp.worker_lock);
+    }
+
+    /* Process the voices the guest had locked */
+    for (unsigned int i = 0; i < num_voices; i++) {
+        if (!d->vp.deferred[i]) {
+            continue;
+        }
+        uint16_t v = d->vp.voices[i];
+        qemu_spin_lock(&d->vp.voice_spinlocks[v]);
+        while (is_voice_locked(d, v)) {
+            /* Stall until voice is available */
+            qemu_spin_unlock(&d->vp.voice_spinlocks[v]);
+            qemu_cond_wait(&d->cond, &d->lock);
+            qemu_spin_lock(&d->vp.voice_spinlocks[v]);
+        }
+        vp_process_voice(d, &d->vp.out[i], v);
+        qemu_spin_unlock(&d->vp.voice_spinlocks[v]);
+    }
+
+    /* Mix in voice list order, so the result doesn't depend on thread timing */
+    MCPXAPUVPMix *mix = &d->vp.mix;
+    memset(mix, 0, sizeof(*mix));
+    for (unsigned int i = 0; i < num_voices; i++) {
+        MCPXAPUVPVoiceOut *out = &d->vp.out[i];
+        if (!out->mixed) {
+            continue;
+        }
+        for (int b = 0; b < 8; b++) {
+            vp_accumulate(mix->mixbins[out->bin[b]],
+                          out->channel_samples[b % out->channels],
+                          out->gain[b], NUM_SAMPLES_PER_FRAME);
+        }
+        if (out->monitor) {
+            vp_accumulate(&mix->sample_buf[0][0], &out->samples[0][0],
+                          out->monitor_gain, NUM_SAMPLES_PER_FRAME * 2);
+        }
+    }
+
+    return mix;
+}
+
+/*
+ * Publishes the average time each resampler took for a frame of one voice.
+ * Modes not used since the last update keep their previous figure.
+ */
+static void vp_collect_resampler_stats(MCPXAPUState *d)
+{
+    QEMU_BUILD_BUG_ON(ARRAY_SIZE(g_dbg.vp.resampler_ns) !=
+                      AUDIO_RESAMPLER__COUNT);
+
+    for (int mode = 0; mode < AUDIO_RESAMPLER__COUNT; mode++) {
+        int64_t ns = 0;
+        uint64_t num_samples = 0;
+        for (int v = 0; v < MCPX_HW_MAX_VOICES; v++) {
+            MCPXAPUVoiceFilter *filter = &d->vp.filters[v];
+            ns += filter->resample_ns[mode];
+            num_samples += filter->resample_samples[mode];
+            filter->resample_ns[mode] = 0;
+            filter->resample_samples[mode] = 0;
+        }
+        if (num_samples) {
+            g_dbg.vp.resampler_ns[mode] =
+                (double)ns * NUM_SAMPLES_PER_FRAME / num_samples;
+        }
+    }
+}
+
 static void se_frame(MCPXAPUState *d)
 {
     mcpx_debug_begin_frame();
@@ -2079,6 +2843,11 @@ static void se_frame(MCPXAPUState *d)
         float t = 1.0f - ((double)d->sleep_acc /
                           (double)((now - d->frame_count_time) * 1000));
         g_dbg.utilization = t;
+        g_dbg.vp.adpcm_blocks_cached =
+            qatomic_xchg(&d->vp.adpcm_blocks_cached, 0);
+        g_dbg.vp.adpcm_blocks_decoded =
+            qatomic_xchg(&d->vp.adpcm_blocks_decoded, 0);
+        vp_collect_resampler_stats(d);
 
         d->frame_count_time = now;
         d->frame_count = 0;
@@ -2086,12 +2855,8 @@ static void se_frame(MCPXAPUState *d)
     }
     d->frame_count++;
 
-    /* Buffer for all mixbins for this frame */
-    float mixbins[NUM_MIXBINS][NUM_SAMPLES_PER_FRAME] = { 0 };
-
-    memset(d->vp.sample_buf, 0, sizeof(d->vp.sample_buf));
-
-    /* Process all voices, mixing each into the affected MIXBINs */
+    /* Collect all active voices, then mix each into the affected MIXBINs */
+    d->vp.num_voices = 0;
     for (int list = 0; list < 3; list++) {
         hwaddr top, current, next;
         top = voice_list_regs[list].top;
@@ -2114,33 +2879,28 @@ static void se_frame(MCPXAPUState *d)
             if (!voice_get_mask(d, v, NV_PAVS_VOICE_PAR_STATE,
                                 NV_PAVS_VOICE_PAR_STATE_ACTIVE_VOICE)) {
                 fe_method(d, SE2FE_IDLE_VOICE, v);
-            } else {
-                qemu_spin_lock(&d->vp.voice_spinlocks[v]);
-                while (is_voice_locked(d, v)) {
-                    /* Stall until voice is available */
-                    qemu_spin_unlock(&d->vp.voice_spinlocks[v]);
-                    qemu_cond_wait(&d->cond, &d->lock);
-                    qemu_spin_lock(&d->vp.voice_spinlocks[v]);
-                }
-                voice_process(d, mixbins, v);
-                qemu_spin_unlock(&d->vp.voice_spinlocks[v]);
+            } else if (d->vp.num_voices < MCPX_HW_MAX_VOICES) {
+                d->vp.voices[d->vp.num_voices++] = v;
             }
             d->regs[current] = d->regs[next];
         }
     }
 
+    adpcm_cache_invalidate_dirty(d);
+    d->vp.profiling = qatomic_read(&d->vp.profile_resamplers);
+    MCPXAPUVPMix *mix = vp_mix_voices(d);
+
     if (d->mon == MCPX_APU_DEBUG_MON_VP) {
         /* Mix all voices together to hear any audible voice */
         int16_t isamp[NUM_SAMPLES_PER_FRAME * 2];
-        src_float_to_short_array((float *)d->vp.sample_buf, isamp,
+        src_float_to_short_array((float *)mix->sample_buf, isamp,
                                  NUM_SAMPLES_PER_FRAME * 2);
         int off = (d->ep_frame_div % 8) * NUM_SAMPLES_PER_FRAME;
         for (int i = 0; i < NUM_SAMPLES_PER_FRAME; i++) {
             d->apu_fifo_output[off + i][0] += isamp[2*i];
             d->apu_fifo_output[off + i][1] += isamp[2*i+1];
         }
-        memset(d->vp.sample_buf, 0, sizeof(d->vp.sample_buf));
-        memset(mixbins, 0, sizeof(mixbins));
+        memset(mix->mixbins, 0, sizeof(mix->mixbins));
     }
 
     /* Write VP results to the GP DSP MIXBUF */
@@ -2148,7 +2908,7 @@ static void se_frame(MCPXAPUState *d)
         uint32_t base = GP_DSP_MIXBUF_BASE + mixbin * NUM_SAMPLES_PER_FRAME;
         for (int sample = 0; sample < NUM_SAMPLES_PER_FRAME; sample++) {
             dsp_write_memory(d->gp.dsp, 'X', base + sample,
-                             float_to_24b(mixbins[mixbin][sample]));
+                             float_to_24b(mix->mixbins[mixbin][sample]));
         }
     }
 
@@ -2293,6 +3053,7 @@ static void mcpx_apu_exitfn(PCIDevice *dev)
     d->exiting = true;
     qemu_cond_broadcast(&d->cond);
     qemu_thread_join(&d->apu_thread);
+    vp_workers_finalize(d);
 }
 
 static void mcpx_apu_reset(MCPXAPUState *d)
@@ -2306,6 +3067,7 @@ static void mcpx_apu_reset(MCPXAPUState *d)
     memset(d->vp.hrtf_submix, 0, sizeof(d->vp.hrtf_submix));
     memset(d->vp.submix_headroom, 0, sizeof(d->vp.submix_headroom));
     memset(d->vp.voice_locked, 0, sizeof(d->vp.voice_locked));
+    adpcm_cache_flush(d);
 
     // FIXME: Reset DSP state
     memset(d->gp.dsp->core.pram_opcache, 0,
@@ -2349,6 +3111,8 @@ static int mcpx_apu_pre_load(void *opaque)
 static int mcpx_apu_post_load(void *opaque, int version_id)
 {
     MCPXAPUState *d = opaque;
+    /* Guest memory was replaced without going through the dirty bitmap */
+    adpcm_cache_flush(d);
     qemu_cond_signal(&d->cond);
     qemu_mutex_unlock(&d->lock);
     return 0;
@@ -2617,12 +3381,17 @@ void mcpx_apu_init(PCIBus *bus, int devfn, MemoryRegion *ram)
     qemu_spin_init(&d->vp.out_buf_lock);
     for (int i = 0; i < MCPX_HW_MAX_VOICES; i++) {
         qemu_spin_init(&d->vp.voice_spinlocks[i]);
+        d->vp.filters[i].resampler_mode = AUDIO_RESAMPLER_INVALID;
     }
+    xemu_settings_get_enum(XEMU_SETTINGS_AUDIO_RESAMPLER,
+                           &d->vp.resampler_mode);
     fifo8_create(&d->vp.out_buf, 3 * (256 * 2 * 2));
 
     qemu_mutex_init(&d->lock);
     qemu_cond_init(&d->cond);
     qemu_add_vm_change_state_handler(mcpx_apu_vm_state_change, d);
+    vp_workers_init(d);
+    adpcm_cache_init(d);
 
     /* Until DSP is more performant, a switch to decide whether or not we should
      * use the full audio pipeline or not.
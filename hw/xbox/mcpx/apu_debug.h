@@ -53,6 +53,8 @@ struct McpxApuDebugVoice
 struct McpxApuDebugVp
 {
     struct McpxApuDebugVoice v[256];
+    unsigned int adpcm_blocks_cached, adpcm_blocks_decoded;
+    float resampler_ns[3]; /* per voice and frame, by enum AUDIO_RESAMPLER */
 };
 
 struct McpxApuDebugDsp
@@ -82,6 +84,9 @@ void mcpx_apu_debug_toggle_mute(uint16_t v);
 bool mcpx_apu_debug_is_muted(uint16_t v);
 void mcpx_apu_debug_set_gp_realtime_enabled(bool enable);
 void mcpx_apu_debug_set_ep_realtime_enabled(bool enable);
+void mcpx_apu_set_resampler(int mode);
+int mcpx_apu_get_resampler(void);
+void mcpx_apu_debug_set_resampler_profiling(bool enable);
 
 #ifdef __cplusplus
 }
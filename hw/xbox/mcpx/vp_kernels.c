@@ -0,0 +1,596 @@
+/*
+ * QEMU MCPX Audio Processing Unit voice processor kernels
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include <math.h>
+#include "vp_kernels.h"
+
+/*
+ * Every kernel set performs the same float operations in the same order as
+ * the scalar code, without fused multiply-adds, so all of them produce
+ * bit-identical output.
+ */
+
+typedef struct VPKernelFuncs {
+    void (*svf_lp_stereo)(sv_filter *svf, float samples[][2],
+                          int num_samples);
+    void (*deinterleave)(const float samples[][2], float *left, float *right,
+                         int num_samples);
+    void (*accumulate)(float *dst, const float *src, float gain,
+                       int num_samples);
+    int (*resample_linear)(const float in[][2], int in_len, double *pos,
+                           double step, float out[][2], int num_samples,
+                           unsigned int channels);
+    int (*resample_hermite)(const float in[][2], int in_len, double *pos,
+                            double step, float out[][2], int num_samples,
+                            unsigned int channels);
+} VPKernelFuncs;
+
+float vp_attenuation[0x1000];
+
+static void svf_lp_stereo_scalar(sv_filter *svf, float samples[][2],
+                                 int num_samples)
+{
+    for (int ch = 0; ch < 2; ch++) {
+        assert(svf[ch].op == &svf[ch].l);
+        for (int i = 0; i < num_samples; i++) {
+            float s = run_svf(&svf[ch], samples[i][ch]);
+            samples[i][ch] = fminf(fmaxf(s, -1.0f), 1.0f);
+        }
+    }
+}
+
+static void deinterleave_scalar(const float samples[][2], float *left,
+                                float *right, int num_samples)
+{
+    for (int i = 0; i < num_samples; i++) {
+        left[i] = samples[i][0];
+        right[i] = samples[i][1];
+    }
+}
+
+static void accumulate_scalar(float *dst, const float *src, float gain,
+                              int num_samples)
+{
+    for (int i = 0; i < num_samples; i++) {
+        dst[i] += gain * src[i];
+    }
+}
+
+static inline float interpolate_linear(float x1, float x2, float t)
+{
+    return x1 + t * (x2 - x1);
+}
+
+static inline float interpolate_hermite(float x0, float x1, float x2, float x3,
+                                        float t)
+{
+    float c1 = 0.5f * (x2 - x0);
+    float c2 = x0 - 2.5f * x1 + 2.0f * x2 - 0.5f * x3;
+    float c3 = 0.5f * (x3 - x0) + 1.5f * (x1 - x2);
+    return ((c3 * t + c2) * t + c1) * t + x1;
+}
+
+static int resample_linear_scalar(const float in[][2], int in_len, double *pos,
+                                  double step, float out[][2],
+                                  int num_samples, unsigned int channels)
+{
+    double p = *pos;
+    int n = 0;
+    for (; n < num_samples; n++) {
+        int k = (int)p;
+        if (k + VP_RESAMPLE_TAPS > in_len) {
+            break;
+        }
+        float t = p - k;
+        for (int ch = 0; ch < channels; ch++) {
+            out[n][ch] = interpolate_linear(in[k + 1][ch], in[k + 2][ch], t);
+        }
+        if (channels == 1) {
+            out[n][1] = out[n][0];
+        }
+        p += step;
+    }
+    *pos = p;
+    return n;
+}
+
+static int resample_hermite_scalar(const float in[][2], int in_len,
+                                   double *pos, double step, float out[][2],
+                                   int num_samples, unsigned int channels)
+{
+    double p = *pos;
+    int n = 0;
+    for (; n < num_samples; n++) {
+        int k = (int)p;
+        if (k + VP_RESAMPLE_TAPS > in_len) {
+            break;
+        }
+        float t = p - k;
+        for (int ch = 0; ch < channels; ch++) {
+            out[n][ch] = interpolate_hermite(in[k][ch], in[k + 1][ch],
+                                             in[k + 2][ch], in[k + 3][ch], t);
+        }
+        if (channels == 1) {
+            out[n][1] = out[n][0];
+        }
+        p += step;
+    }
+    *pos = p;
+    return n;
+}
+
+/*
+ * Computes the window offsets and fractions of the next 4 output frames,
+ * advancing the position the same way as the scalar loops. Returns false,
+ * leaving *pos alone, if the last of them would read past @in_len.
+ */
+static inline bool resample_positions4(double *pos, double step, int in_len,
+                                       int k[4], float t[4])
+{
+    double p = *pos;
+    for (int j = 0; j < 4; j++) {
+        k[j] = (int)p;
+        t[j] = p - k[j];
+        p += step;
+    }
+    if (k[3] + VP_RESAMPLE_TAPS > in_len) {
+        return false;
+    }
+    *pos = p;
+    return true;
+}
+
+static const VPKernelFuncs vp_kernels_scalar = {
+    svf_lp_stereo_scalar,
+    deinterleave_scalar,
+    accumulate_scalar,
+    resample_linear_scalar,
+    resample_hermite_scalar,
+};
+
+/* Stores the state of both SVF lanes back into the filters */
+static void svf_store_state(sv_filter *svf, const float h[2],
+                            const float b[2], const float l[2])
+{
+    for (int ch = 0; ch < 2; ch++) {
+        svf[ch].h = h[ch];
+        svf[ch].b = b[ch];
+        svf[ch].l = l[ch];
+        svf[ch].n = l[ch] + h[ch];
+        svf[ch].p = l[ch] - h[ch];
+    }
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+/* The filter is recursive, so run both channels side by side in one vector */
+static void svf_lp_stereo_sse2(sv_filter *svf, float samples[][2],
+                               int num_samples)
+{
+    assert(svf[0].op == &svf[0].l && svf[1].op == &svf[1].l);
+
+    const __m128 f = _mm_setr_ps(svf[0].f, svf[1].f, 0, 0);
+    const __m128 q = _mm_setr_ps(svf[0].q, svf[1].q, 0, 0);
+    const __m128 qnrm = _mm_setr_ps(svf[0].qnrm, svf[1].qnrm, 0, 0);
+    const __m128 shape = _mm_set1_ps(0.001f);
+    const __m128 lo = _mm_set1_ps(-1.0f);
+    const __m128 hi = _mm_set1_ps(1.0f);
+    __m128 h = _mm_setr_ps(svf[0].h, svf[1].h, 0, 0);
+    __m128 b = _mm_setr_ps(svf[0].b, svf[1].b, 0, 0);
+    __m128 l = _mm_setr_ps(svf[0].l, svf[1].l, 0, 0);
+
+    for (int i = 0; i < num_samples; i++) {
+        __m128 in = _mm_castpd_ps(_mm_load_sd((const double *)samples[i]));
+        in = _mm_mul_ps(qnrm, in);
+        b = _mm_sub_ps(b, _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(b, b), b), shape));
+        h = _mm_sub_ps(_mm_sub_ps(in, l), _mm_mul_ps(q, b));
+        b = _mm_add_ps(b, _mm_mul_ps(f, h));
+        l = _mm_add_ps(l, _mm_mul_ps(f, b));
+        __m128 out = _mm_min_ps(_mm_max_ps(l, lo), hi);
+        _mm_store_sd((double *)samples[i], _mm_castps_pd(out));
+    }
+
+    float hv[4], bv[4], lv[4];
+    _mm_storeu_ps(hv, h);
+    _mm_storeu_ps(bv, b);
+    _mm_storeu_ps(lv, l);
+    svf_store_state(svf, hv, bv, lv);
+}
+
+static void deinterleave_sse2(const float samples[][2], float *left,
+                              float *right, int num_samples)
+{
+    int i = 0;
+    for (; i + 4 <= num_samples; i += 4) {
+        __m128 a = _mm_loadu_ps(samples[i]);
+        __m128 b = _mm_loadu_ps(samples[i + 2]);
+        _mm_storeu_ps(left + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm_storeu_ps(right + i,
+                      _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+    deinterleave_scalar(&samples[i], left + i, right + i, num_samples - i);
+}
+
+static void accumulate_sse2(float *dst, const float *src, float gain,
+                            int num_samples)
+{
+    const __m128 g = _mm_set1_ps(gain);
+    int i = 0;
+    for (; i + 4 <= num_samples; i += 4) {
+        __m128 s = _mm_mul_ps(g, _mm_loadu_ps(src + i));
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), s));
+    }
+    accumulate_scalar(dst + i, src + i, gain, num_samples - i);
+}
+
+static inline __m128 gather4_sse2(const float in[][2], const int k[4],
+                                  int offset, int ch)
+{
+    return _mm_setr_ps(in[k[0] + offset][ch], in[k[1] + offset][ch],
+                       in[k[2] + offset][ch], in[k[3] + offset][ch]);
+}
+
+static inline void store4_sse2(float out[][2], __m128 l, __m128 r)
+{
+    _mm_storeu_ps(out[0], _mm_unpacklo_ps(l, r));
+    _mm_storeu_ps(out[2], _mm_unpackhi_ps(l, r));
+}
+
+static int resample_linear_sse2(const float in[][2], int in_len, double *pos,
+                                double step, float out[][2], int num_samples,
+                                unsigned int channels)
+{
+    int n = 0;
+    int k[4];
+    float t[4];
+
+    for (; n + 4 <= num_samples; n += 4) {
+        if (!resample_positions4(pos, step, in_len, k, t)) {
+            break;
+        }
+        __m128 tv = _mm_loadu_ps(t);
+        __m128 y[2];
+        for (int ch = 0; ch < channels; ch++) {
+            __m128 x1 = gather4_sse2(in, k, 1, ch);
+            __m128 x2 = gather4_sse2(in, k, 2, ch);
+            y[ch] = _mm_add_ps(x1, _mm_mul_ps(tv, _mm_sub_ps(x2, x1)));
+        }
+        store4_sse2(&out[n], y[0], y[channels - 1]);
+    }
+
+    return n + resample_linear_scalar(in, in_len, pos, step, &out[n],
+                                      num_samples - n, channels);
+}
+
+static int resample_hermite_sse2(const float in[][2], int in_len, double *pos,
+                                 double step, float out[][2], int num_samples,
+                                 unsigned int channels)
+{
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 one_half = _mm_set1_ps(1.5f);
+    const __m128 two = _mm_set1_ps(2.0f);
+    const __m128 two_half = _mm_set1_ps(2.5f);
+    int n = 0;
+    int k[4];
+    float t[4];
+
+    for (; n + 4 <= num_samples; n += 4) {
+        if (!resample_positions4(pos, step, in_len, k, t)) {
+            break;
+        }
+        __m128 tv = _mm_loadu_ps(t);
+        __m128 y[2];
+        for (int ch = 0; ch < channels; ch++) {
+            __m128 x0 = gather4_sse2(in, k, 0, ch);
+            __m128 x1 = gather4_sse2(in, k, 1, ch);
+            __m128 x2 = gather4_sse2(in, k, 2, ch);
+            __m128 x3 = gather4_sse2(in, k, 3, ch);
+            __m128 c1 = _mm_mul_ps(half, _mm_sub_ps(x2, x0));
+            __m128 c2 = _mm_sub_ps(
+                _mm_add_ps(_mm_sub_ps(x0, _mm_mul_ps(two_half, x1)),
+                           _mm_mul_ps(two, x2)),
+                _mm_mul_ps(half, x3));
+            __m128 c3 = _mm_add_ps(_mm_mul_ps(half, _mm_sub_ps(x3, x0)),
+                                   _mm_mul_ps(one_half, _mm_sub_ps(x1, x2)));
+            __m128 v = _mm_add_ps(_mm_mul_ps(c3, tv), c2);
+            v = _mm_add_ps(_mm_mul_ps(v, tv), c1);
+            y[ch] = _mm_add_ps(_mm_mul_ps(v, tv), x1);
+        }
+        store4_sse2(&out[n], y[0], y[channels - 1]);
+    }
+
+    return n + resample_hermite_scalar(in, in_len, pos, step, &out[n],
+                                       num_samples - n, channels);
+}
+
+static const VPKernelFuncs vp_kernels_sse2 = {
+    svf_lp_stereo_sse2,
+    deinterleave_sse2,
+    accumulate_sse2,
+    resample_linear_sse2,
+    resample_hermite_sse2,
+};
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static void accumulate_avx2(float *dst, const float *src, float gain,
+                            int num_samples)
+{
+    const __m256 g = _mm256_set1_ps(gain);
+    int i = 0;
+    for (; i + 8 <= num_samples; i += 8) {
+        __m256 s = _mm256_mul_ps(g, _mm256_loadu_ps(src + i));
+        _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_loadu_ps(dst + i), s));
+    }
+    accumulate_scalar(dst + i, src + i, gain, num_samples - i);
+}
+#pragma GCC pop_options
+
+/*
+ * Neither the two lane filter nor the deinterleave gain from wider vectors,
+ * and the resamplers are bound by their gathers.
+ */
+static const VPKernelFuncs vp_kernels_avx2 = {
+    svf_lp_stereo_sse2,
+    deinterleave_sse2,
+    accumulate_avx2,
+    resample_linear_sse2,
+    resample_hermite_sse2,
+};
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+
+static void svf_lp_stereo_neon(sv_filter *svf, float samples[][2],
+                               int num_samples)
+{
+    assert(svf[0].op == &svf[0].l && svf[1].op == &svf[1].l);
+
+    float fv[2] = { svf[0].f, svf[1].f };
+    float qv[2] = { svf[0].q, svf[1].q };
+    float qnrmv[2] = { svf[0].qnrm, svf[1].qnrm };
+    float hv[2] = { svf[0].h, svf[1].h };
+    float bv[2] = { svf[0].b, svf[1].b };
+    float lv[2] = { svf[0].l, svf[1].l };
+
+    const float32x2_t f = vld1_f32(fv);
+    const float32x2_t q = vld1_f32(qv);
+    const float32x2_t qnrm = vld1_f32(qnrmv);
+    const float32x2_t shape = vdup_n_f32(0.001f);
+    const float32x2_t lo = vdup_n_f32(-1.0f);
+    const float32x2_t hi = vdup_n_f32(1.0f);
+    float32x2_t h = vld1_f32(hv);
+    float32x2_t b = vld1_f32(bv);
+    float32x2_t l = vld1_f32(lv);
+
+    for (int i = 0; i < num_samples; i++) {
+        float32x2_t in = vmul_f32(qnrm, vld1_f32(samples[i]));
+        b = vsub_f32(b, vmul_f32(vmul_f32(vmul_f32(b, b), b), shape));
+        h = vsub_f32(vsub_f32(in, l), vmul_f32(q, b));
+        b = vadd_f32(b, vmul_f32(f, h));
+        l = vadd_f32(l, vmul_f32(f, b));
+        vst1_f32(samples[i], vminnm_f32(vmaxnm_f32(l, lo), hi));
+    }
+
+    vst1_f32(hv, h);
+    vst1_f32(bv, b);
+    vst1_f32(lv, l);
+    svf_store_state(svf, hv, bv, lv);
+}
+
+static void deinterleave_neon(const float samples[][2], float *left,
+                              float *right, int num_samples)
+{
+    int i = 0;
+    for (; i + 4 <= num_samples; i += 4) {
+        float32x4x2_t s = vld2q_f32(samples[i]);
+        vst1q_f32(left + i, s.val[0]);
+        vst1q_f32(right + i, s.val[1]);
+    }
+    deinterleave_scalar(&samples[i], left + i, right + i, num_samples - i);
+}
+
+static void accumulate_neon(float *dst, const float *src, float gain,
+                            int num_samples)
+{
+    int i = 0;
+    for (; i + 4 <= num_samples; i += 4) {
+        float32x4_t s = vmulq_n_f32(vld1q_f32(src + i), gain);
+        vst1q_f32(dst + i, vaddq_f32(vld1q_f32(dst + i), s));
+    }
+    accumulate_scalar(dst + i, src + i, gain, num_samples - i);
+}
+
+static inline float32x4_t gather4_neon(const float in[][2], const int k[4],
+                                       int offset, int ch)
+{
+    float v[4] = {
+        in[k[0] + offset][ch], in[k[1] + offset][ch],
+        in[k[2] + offset][ch], in[k[3] + offset][ch],
+    };
+    return vld1q_f32(v);
+}
+
+static int resample_linear_neon(const float in[][2], int in_len, double *pos,
+                                double step, float out[][2], int num_samples,
+                                unsigned int channels)
+{
+    int n = 0;
+    int k[4];
+    float t[4];
+
+    for (; n + 4 <= num_samples; n += 4) {
+        if (!resample_positions4(pos, step, in_len, k, t)) {
+            break;
+        }
+        float32x4_t tv = vld1q_f32(t);
+        float32x4x2_t y;
+        for (int ch = 0; ch < channels; ch++) {
+            float32x4_t x1 = gather4_neon(in, k, 1, ch);
+            float32x4_t x2 = gather4_neon(in, k, 2, ch);
+            y.val[ch] = vaddq_f32(x1, vmulq_f32(tv, vsubq_f32(x2, x1)));
+        }
+        if (channels == 1) {
+            y.val[1] = y.val[0];
+        }
+        vst2q_f32(out[n], y);
+    }
+
+    return n + resample_linear_scalar(in, in_len, pos, step, &out[n],
+                                      num_samples - n, channels);
+}
+
+static int resample_hermite_neon(const float in[][2], int in_len, double *pos,
+                                 double step, float out[][2], int num_samples,
+                                 unsigned int channels)
+{
+    int n = 0;
+    int k[4];
+    float t[4];
+
+    for (; n + 4 <= num_samples; n += 4) {
+        if (!resample_positions4(pos, step, in_len, k, t)) {
+            break;
+        }
+        float32x4_t tv = vld1q_f32(t);
+        float32x4x2_t y;
+        for (int ch = 0; ch < channels; ch++) {
+            float32x4_t x0 = gather4_neon(in, k, 0, ch);
+            float32x4_t x1 = gather4_neon(in, k, 1, ch);
+            float32x4_t x2 = gather4_neon(in, k, 2, ch);
+            float32x4_t x3 = gather4_neon(in, k, 3, ch);
+            float32x4_t c1 = vmulq_n_f32(vsubq_f32(x2, x0), 0.5f);
+            float32x4_t c2 = vsubq_f32(
+                vaddq_f32(vsubq_f32(x0, vmulq_n_f32(x1, 2.5f)),
+                          vmulq_n_f32(x2, 2.0f)),
+                vmulq_n_f32(x3, 0.5f));
+            float32x4_t c3 = vaddq_f32(vmulq_n_f32(vsubq_f32(x3, x0), 0.5f),
+                                       vmulq_n_f32(vsubq_f32(x1, x2), 1.5f));
+            float32x4_t v = vaddq_f32(vmulq_f32(c3, tv), c2);
+            v = vaddq_f32(vmulq_f32(v, tv), c1);
+            y.val[ch] = vaddq_f32(vmulq_f32(v, tv), x1);
+        }
+        if (channels == 1) {
+            y.val[1] = y.val[0];
+        }
+        vst2q_f32(out[n], y);
+    }
+
+    return n + resample_hermite_scalar(in, in_len, pos, step, &out[n],
+                                       num_samples - n, channels);
+}
+
+static const VPKernelFuncs vp_kernels_neon = {
+    svf_lp_stereo_neon,
+    deinterleave_neon,
+    accumulate_neon,
+    resample_linear_neon,
+    resample_hermite_neon,
+};
+#endif
+
+static const VPKernelFuncs *vp_kernels = &vp_kernels_scalar;
+
+#ifdef CONFIG_AVX2_OPT
+#include "qemu/cpuid.h"
+
+static bool vp_host_avx2;
+#endif
+
+static void __attribute__((constructor)) vp_kernels_init(void)
+{
+    for (int vol = 0; vol < 0xFFF; vol++) {
+        vp_attenuation[vol] = powf(10.0f, vol/(64.0 * -20.0f));
+    }
+    vp_attenuation[0xFFF] = 0.0f;
+
+#ifdef CONFIG_AVX2_OPT
+    vp_host_avx2 = host_has_avx2();
+#endif
+    if (!vp_kernels_set(VP_KERNELS_AVX2)
+        && !vp_kernels_set(VP_KERNELS_SSE2)) {
+        vp_kernels_set(VP_KERNELS_NEON);
+    }
+}
+
+bool vp_kernels_set(VPKernels kernels)
+{
+    switch (kernels) {
+    case VP_KERNELS_SCALAR:
+        vp_kernels = &vp_kernels_scalar;
+        return true;
+#ifdef __SSE2__
+    case VP_KERNELS_SSE2:
+        vp_kernels = &vp_kernels_sse2;
+        return true;
+#endif
+#ifdef CONFIG_AVX2_OPT
+    case VP_KERNELS_AVX2:
+        if (!vp_host_avx2) {
+            return false;
+        }
+        vp_kernels = &vp_kernels_avx2;
+        return true;
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+    case VP_KERNELS_NEON:
+        vp_kernels = &vp_kernels_neon;
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+void vp_svf_lp_stereo(sv_filter *svf, float samples[][2], int num_samples)
+{
+    vp_kernels->svf_lp_stereo(svf, samples, num_samples);
+}
+
+void vp_deinterleave(const float samples[][2], float *left, float *right,
+                     int num_samples)
+{
+    vp_kernels->deinterleave(samples, left, right, num_samples);
+}
+
+void vp_accumulate(float *dst, const float *src, float gain, int num_samples)
+{
+    vp_kernels->accumulate(dst, src, gain, num_samples);
+}
+
+int vp_resample_linear(const float in[][2], int in_len, double *pos,
+                       double step, float out[][2], int num_samples,
+                       unsigned int channels)
+{
+    return vp_kernels->resample_linear(in, in_len, pos, step, out,
+                                       num_samples, channels);
+}
+
+int vp_resample_hermite(const float in[][2], int in_len, double *pos,
+                        double step, float out[][2], int num_samples,
+                        unsigned int channels)
+{
+    return vp_kernels->resample_hermite(in, in_len, pos, step, out,
+                                        num_samples, channels);
+}
@@ -0,0 +1,73 @@
+/*
+ * QEMU MCPX Audio Processing Unit voice processor kernels
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HW_XBOX_MCPX_VP_KERNELS_H
+#define HW_XBOX_MCPX_VP_KERNELS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "svf.h"
+
+typedef enum VPKernels {
+    VP_KERNELS_SCALAR,
+    VP_KERNELS_SSE2,
+    VP_KERNELS_AVX2,
+    VP_KERNELS_NEON,
+} VPKernels;
+
+/* The fastest kernels of the host are used by default, this switches to
+ * another set for testing. Returns false if the host can't run it. */
+bool vp_kernels_set(VPKernels kernels);
+
+/* Linear gain of each 12-bit volume, in units of -1/64 dB */
+extern float vp_attenuation[0x1000];
+
+static inline float vp_attenuate(uint16_t vol)
+{
+    return vp_attenuation[vol & 0xFFF];
+}
+
+/* Runs both channels of interleaved @samples through the low pass filters
+ * @svf and clamps the result to [-1, 1] */
+void vp_svf_lp_stereo(sv_filter *svf, float samples[][2], int num_samples);
+
+void vp_deinterleave(const float samples[][2], float *left, float *right,
+                     int num_samples);
+
+/* dst[i] += gain * src[i] */
+void vp_accumulate(float *dst, const float *src, float gain, int num_samples);
+
+/*
+ * Interpolating resamplers. The output frame at position p lies between
+ * in[floor(p) + 1] and in[floor(p) + 2], and reads VP_RESAMPLE_TAPS frames
+ * from in[floor(p)]. Frames are produced, advancing *pos by @step each, until
+ * @num_samples are done or the next one would read past @in_len. With one
+ * channel only the first is interpolated and copied to the second. Returns
+ * the number of frames produced.
+ */
+#define VP_RESAMPLE_TAPS 4
+
+int vp_resample_linear(const float in[][2], int in_len, double *pos,
+                       double step, float out[][2], int num_samples,
+                       unsigned int channels);
+
+/* 4-point, 3rd-order Hermite (Catmull-Rom) interpolation */
+int vp_resample_hermite(const float in[][2], int in_len, double *pos,
+                        double step, float out[][2], int num_samples,
+                        unsigned int channels);
+
+#endif
@@ -0,0 +1,494 @@
+/*
+ * QEMU Geforce NV2A pushbuffer capture and replay
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "qemu/timer.h"
+#include "nv2a_int.h"
+
+/* RAMIN has no dirty tracking, it is compared against a shadow copy in
+ * pieces of this size */
+#define NV2A_CAPTURE_RAMIN_CHUNK 4096
+
+static bool nv2a_capture_is_flip(NV2AState *d, unsigned int method)
+{
+    unsigned int graphics_class = GET_MASK(d->pgraph.regs[NV_PGRAPH_CTX_SWITCH1],
+                                           NV_PGRAPH_CTX_SWITCH1_GRCLASS);
+
+    return graphics_class == NV_KELVIN_PRIMITIVE && method == NV097_FLIP_STALL;
+}
+
+void nv2a_capture_init(NV2AState *d)
+{
+    NV2ACapture *c = &d->capture;
+
+    if (!c->path || *c->path == '\x00') {
+        return;
+    }
+    if (d->replay.path && *d->replay.path != '\x00') {
+        fprintf(stderr, "nv2a: cannot capture while replaying, "
+                "ignoring capture %s\n", c->path);
+        return;
+    }
+
+    c->file = qemu_fopen(c->path, "wb");
+    if (!c->file) {
+        fprintf(stderr, "nv2a: failed to open capture %s\n", c->path);
+        return;
+    }
+
+    NV2ACaptureHeader hdr = {
+        .magic = NV2A_CAPTURE_MAGIC,
+        .version = NV2A_CAPTURE_VERSION,
+        .vram_size = memory_region_size(d->vram),
+        .ramin_size = memory_region_size(&d->ramin),
+    };
+    if (fwrite(&hdr, sizeof(hdr), 1, c->file) != 1) {
+        fprintf(stderr, "nv2a: failed to write capture %s\n", c->path);
+        fclose(c->file);
+        c->file = NULL;
+        return;
+    }
+
+    c->ramin_shadow = g_malloc0(hdr.ramin_size);
+    c->synced = false;
+    c->frames = 0;
+}
+
+void nv2a_capture_finalize(NV2AState *d)
+{
+    NV2ACapture *c = &d->capture;
+
+    if (c->file) {
+        fclose(c->file);
+        c->file = NULL;
+    }
+    g_free(c->ramin_shadow);
+    c->ramin_shadow = NULL;
+}
+
+/* A capture only describes a single run from reset */
+void nv2a_capture_reset(NV2AState *d)
+{
+    NV2ACapture *c = &d->capture;
+
+    if (c->file && c->synced) {
+        fprintf(stderr, "nv2a: device reset, capture %s stopped after %u "
+                "frames\n", c->path, c->frames);
+        nv2a_capture_finalize(d);
+    }
+}
+
+static bool nv2a_capture_write(NV2AState *d, const NV2ACaptureRecord *rec,
+                               const void *data, size_t len)
+{
+    NV2ACapture *c = &d->capture;
+
+    if (fwrite(rec, sizeof(*rec), 1, c->file) != 1 ||
+        (len && fwrite(data, len, 1, c->file) != 1)) {
+        fprintf(stderr, "nv2a: failed to write capture %s, stopping\n",
+                c->path);
+        nv2a_capture_finalize(d);
+        return false;
+    }
+
+    return true;
+}
+
+static bool nv2a_capture_memory(NV2AState *d, NV2ACaptureRecordType type,
+                                const uint8_t *base, hwaddr start, hwaddr end)
+{
+    NV2ACaptureRecord rec = {
+        .type = type,
+        .address = start,
+        .length = end - start,
+    };
+
+    return nv2a_capture_write(d, &rec, base + start, end - start);
+}
+
+/*
+ * Record the VRAM pages the guest wrote since the last sync. PGRAPH marks
+ * its own writes for the VGA and texture clients only, so these are the
+ * CPU's writes that a replay has to reproduce. The replay starts from
+ * zeroed VRAM, so the first sync skips pages that are still clear.
+ */
+static bool nv2a_capture_sync_vram(NV2AState *d)
+{
+    NV2ACapture *c = &d->capture;
+    hwaddr size = memory_region_size(d->vram);
+    DirtyBitmapSnapshot *snap = memory_region_snapshot_and_clear_dirty(
+        d->vram, 0, size, DIRTY_MEMORY_NV2A_CAPTURE);
+    hwaddr run_start = size;
+    bool ok = true;
+
+    for (hwaddr page = 0; ok && page < size; page += TARGET_PAGE_SIZE) {
+        bool dirty = memory_region_snapshot_get_dirty(d->vram, snap, page,
+                                                      TARGET_PAGE_SIZE);
+        if (dirty && !c->synced) {
+            dirty = !buffer_is_zero(d->vram_ptr + page, TARGET_PAGE_SIZE);
+        }
+        if (dirty && run_start == size) {
+            run_start = page;
+        } else if (!dirty && run_start != size) {
+            ok = nv2a_capture_memory(d, NV2A_CAPTURE_VRAM, d->vram_ptr,
+                                     run_start, page);
+            run_start = size;
+        }
+    }
+    if (ok && run_start != size) {
+        ok = nv2a_capture_memory(d, NV2A_CAPTURE_VRAM, d->vram_ptr, run_start,
+                                 size);
+    }
+
+    g_free(snap);
+
+    return ok;
+}
+
+static bool nv2a_capture_sync_ramin(NV2AState *d)
+{
+    NV2ACapture *c = &d->capture;
+    hwaddr size = memory_region_size(&d->ramin);
+
+    for (hwaddr offset = 0; offset < size;
+         offset += NV2A_CAPTURE_RAMIN_CHUNK) {
+        if (!memcmp(d->ramin_ptr + offset, c->ramin_shadow + offset,
+                    NV2A_CAPTURE_RAMIN_CHUNK)) {
+            continue;
+        }
+        memcpy(c->ramin_shadow + offset, d->ramin_ptr + offset,
+               NV2A_CAPTURE_RAMIN_CHUNK);
+        if (!nv2a_capture_memory(d, NV2A_CAPTURE_RAMIN, d->ramin_ptr, offset,
+                                 offset + NV2A_CAPTURE_RAMIN_CHUNK)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Must be called with pfifo.lock held, before PGRAPH reads guest memory */
+void nv2a_capture_sync_memory(NV2AState *d)
+{
+    if (nv2a_capture_sync_vram(d) && nv2a_capture_sync_ramin(d)) {
+        d->capture.synced = true;
+    }
+}
+
+/* Must be called with pfifo.lock held */
+void nv2a_capture_pgraph_write(NV2AState *d, hwaddr addr, uint32_t val)
+{
+    nv2a_capture_sync_memory(d);
+    if (!d->capture.file) {
+        return;
+    }
+
+    NV2ACaptureRecord rec = {
+        .type = NV2A_CAPTURE_PGRAPH_WRITE,
+        .address = addr,
+        .value = val,
+    };
+    nv2a_capture_write(d, &rec, NULL, 0);
+}
+
+/*
+ * Record a method the puller retired, with the words pgraph_method()
+ * consumed. Must be called with pfifo.lock held.
+ */
+void nv2a_capture_method(NV2AState *d, const PFIFOCommand *cmd,
+                         size_t num_words)
+{
+    NV2ACapture *c = &d->capture;
+    uint32_t method = cmd->method_entry & 0x1FFC;
+    NV2ACaptureRecord rec = {
+        .type = NV2A_CAPTURE_METHOD,
+        .channel_id = cmd->channel_id,
+        .subchannel = GET_MASK(cmd->method_entry,
+                               NV_PFIFO_CACHE1_METHOD_SUBCHANNEL),
+        .address = method,
+        .value = cmd->parameter,
+        .length = num_words,
+    };
+
+    if (!nv2a_capture_write(d, &rec, cmd->parameters,
+                            num_words * sizeof(uint32_t))) {
+        return;
+    }
+
+    if (nv2a_capture_is_flip(d, method)) {
+        c->frames++;
+        if (c->frames == c->frame_limit) {
+            fprintf(stderr, "nv2a: captured %u frames to %s\n", c->frames,
+                    c->path);
+            nv2a_capture_finalize(d);
+        }
+    }
+}
+
+void nv2a_replay_init(NV2AState *d)
+{
+    NV2AReplay *r = &d->replay;
+
+    if (!r->path || *r->path == '\x00') {
+        return;
+    }
+
+    r->file = qemu_fopen(r->path, "rb");
+    if (!r->file) {
+        fprintf(stderr, "nv2a: failed to open replay %s\n", r->path);
+        return;
+    }
+
+    NV2ACaptureHeader hdr;
+    if (fread(&hdr, sizeof(hdr), 1, r->file) != 1 ||
+        hdr.magic != NV2A_CAPTURE_MAGIC ||
+        hdr.version != NV2A_CAPTURE_VERSION ||
+        hdr.vram_size != memory_region_size(d->vram) ||
+        hdr.ramin_size != memory_region_size(&d->ramin)) {
+        fprintf(stderr, "nv2a: %s is not a capture of this machine\n",
+                r->path);
+        fclose(r->file);
+        r->file = NULL;
+    }
+}
+
+void nv2a_replay_finalize(NV2AState *d)
+{
+    NV2AReplay *r = &d->replay;
+
+    if (r->file) {
+        fclose(r->file);
+        r->file = NULL;
+    }
+    g_free(r->words);
+    r->words = NULL;
+    r->words_capacity = 0;
+    r->active = false;
+}
+
+/*
+ * Begin replaying at the first device reset, which puts PGRAPH in the state
+ * the capture started from. Must be called with pfifo.lock held.
+ */
+void nv2a_replay_start(NV2AState *d)
+{
+    NV2AReplay *r = &d->replay;
+
+    if (!r->file || r->started) {
+        return;
+    }
+
+    memset(d->vram_ptr, 0, memory_region_size(d->vram));
+    memory_region_set_dirty(d->vram, 0, memory_region_size(d->vram));
+    memset(d->ramin_ptr, 0, memory_region_size(&d->ramin));
+
+    memset(r->classes, 0, sizeof(r->classes));
+    r->frames = 0;
+    r->methods = 0;
+    r->start_time = get_clock();
+    r->started = true;
+    r->active = true;
+}
+
+static const char *nv2a_replay_class_name(unsigned int graphics_class)
+{
+    switch (graphics_class) {
+    case NV_MEMORY_TO_MEMORY_FORMAT:
+        return "m2mf";
+    case NV_CONTEXT_PATTERN:
+        return "pattern";
+    case NV_CONTEXT_SURFACES_2D:
+        return "surfaces 2d";
+    case NV_IMAGE_BLIT:
+        return "image blit";
+    case NV_KELVIN_PRIMITIVE:
+        return "kelvin";
+    default:
+        return "";
+    }
+}
+
+static void nv2a_replay_report(NV2AState *d)
+{
+    NV2AReplay *r = &d->replay;
+
+    /* Include the rendering still queued on the GPU */
+    glFinish();
+    int64_t ns = get_clock() - r->start_time;
+
+    if (r->frames <= r->warmup_frames) {
+        fprintf(stderr, "nv2a: replayed %u frames from %s, no frames after "
+                "%u warm-up frames\n", r->frames, r->path, r->warmup_frames);
+        return;
+    }
+
+    unsigned int frames = r->frames - r->warmup_frames;
+    int64_t method_ns = 0;
+    for (int i = 0; i < ARRAY_SIZE(r->classes); i++) {
+        method_ns += r->classes[i].ns;
+    }
+
+    fprintf(stderr, "nv2a: replayed %u frames from %s in %.3f s, "
+            "%.1f frames/s (%u warm-up frames excluded)\n", frames, r->path,
+            ns / 1e9, frames / (ns / 1e9), r->warmup_frames);
+    fprintf(stderr, "nv2a:   class             methods   total ms  "
+            "ns/method  share\n");
+    for (int i = 0; i < ARRAY_SIZE(r->classes); i++) {
+        NV2AReplayClassStats *s = &r->classes[i];
+        if (!s->methods) {
+            continue;
+        }
+        fprintf(stderr, "nv2a:   0x%02x %-12s %10" PRIu64 " %10.2f %10.1f "
+                "%5.1f%%\n", i, nv2a_replay_class_name(i), s->methods,
+                s->ns / 1e6, (double)s->ns / s->methods,
+                method_ns ? 100.0 * s->ns / method_ns : 0);
+    }
+}
+
+static bool nv2a_replay_read_memory(NV2AReplay *r, uint8_t *base,
+                                    hwaddr size,
+                                    const NV2ACaptureRecord *rec)
+{
+    if (rec->address > size || rec->length > size - rec->address) {
+        return false;
+    }
+
+    return !rec->length ||
+           fread(base + rec->address, rec->length, 1, r->file) == 1;
+}
+
+static bool nv2a_replay_read_words(NV2AReplay *r,
+                                   const NV2ACaptureRecord *rec)
+{
+    if (!rec->length || rec->subchannel >= 8) {
+        return false;
+    }
+    if (rec->length > r->words_capacity) {
+        r->words_capacity = MAX(rec->length, r->words_capacity * 2);
+        r->words = g_renew(uint32_t, r->words, r->words_capacity);
+    }
+
+    return fread(r->words, rec->length * sizeof(uint32_t), 1, r->file) == 1;
+}
+
+/* Must be called with pgraph.lock held, returns true at the end of a frame */
+static bool nv2a_replay_method(NV2AState *d, const NV2ACaptureRecord *rec)
+{
+    NV2AReplay *r = &d->replay;
+    PGRAPHState *pg = &d->pgraph;
+    int64_t start = get_clock();
+
+    if (rec->address == 0) {
+        pgraph_context_switch(d, rec->channel_id);
+    }
+    pgraph_method(d, rec->subchannel, rec->address, rec->value, r->words,
+                  rec->length, rec->length);
+
+    int64_t ns = get_clock() - start;
+
+    /* The guest resolved any stall before the next method was captured */
+    pg->waiting_for_nop = false;
+    pg->waiting_for_flip = false;
+    pg->waiting_for_context_switch = false;
+
+    if (r->frames >= r->warmup_frames) {
+        unsigned int graphics_class = GET_MASK(pg->regs[NV_PGRAPH_CTX_SWITCH1],
+                                               NV_PGRAPH_CTX_SWITCH1_GRCLASS);
+        r->classes[graphics_class].methods++;
+        r->classes[graphics_class].ns += ns;
+    }
+    r->methods++;
+
+    if (!nv2a_capture_is_flip(d, rec->address)) {
+        return false;
+    }
+
+    r->frames++;
+    if (r->frames == r->warmup_frames) {
+        r->start_time = get_clock();
+    }
+
+    return true;
+}
+
+/*
+ * Feed the next frame of the capture to PGRAPH as fast as it will take it.
+ * Runs on the FIFO thread in place of the pusher, with pfifo.lock held, and
+ * returns between frames so pending requests (e.g. display syncs) are
+ * handled. When the capture ends the results are printed and the machine is
+ * shut down.
+ */
+void nv2a_replay_run_frame(NV2AState *d)
+{
+    NV2AReplay *r = &d->replay;
+    PGRAPHState *pg = &d->pgraph;
+    NV2ACaptureRecord rec;
+    bool frame_done = false;
+    bool ok = true;
+
+    qemu_mutex_lock(&pg->lock);
+
+    while (ok && !frame_done && fread(&rec, sizeof(rec), 1, r->file) == 1) {
+        switch (rec.type) {
+        case NV2A_CAPTURE_VRAM:
+            ok = nv2a_replay_read_memory(r, d->vram_ptr,
+                                         memory_region_size(d->vram), &rec);
+            if (ok) {
+                memory_region_set_dirty(d->vram, rec.address, rec.length);
+            }
+            break;
+        case NV2A_CAPTURE_RAMIN:
+            ok = nv2a_replay_read_memory(r, d->ramin_ptr,
+                                         memory_region_size(&d->ramin), &rec);
+            break;
+        case NV2A_CAPTURE_PGRAPH_WRITE:
+            ok = rec.address < ARRAY_SIZE(pg->regs);
+            if (ok) {
+                qemu_mutex_unlock(&pg->lock);
+                qemu_mutex_unlock(&d->pfifo.lock);
+                pgraph_write(d, rec.address, rec.value, 4);
+                qemu_mutex_lock(&d->pfifo.lock);
+                qemu_mutex_lock(&pg->lock);
+            }
+            break;
+        case NV2A_CAPTURE_METHOD:
+            ok = nv2a_replay_read_words(r, &rec);
+            if (ok) {
+                frame_done = nv2a_replay_method(d, &rec);
+            }
+            break;
+        default:
+            ok = false;
+            break;
+        }
+    }
+
+    qemu_mutex_unlock(&pg->lock);
+
+    if (frame_done) {
+        return;
+    }
+
+    if (!ok || ferror(r->file)) {
+        fprintf(stderr, "nv2a: replay %s is truncated or corrupt, stopping "
+                "after %" PRIu64 " methods\n", r->path, r->methods);
+    }
+    nv2a_replay_report(d);
+    nv2a_replay_finalize(d);
+    qemu_system_shutdown_request(SHUTDOWN_CAUSE_HOST_UI);
+}
@@ -0,0 +1,87 @@
+/*
+ * QEMU Geforce NV2A pushbuffer capture and replay
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HW_XBOX_NV2A_CAPTURE_H
+#define HW_XBOX_NV2A_CAPTURE_H
+
+/*
+ * A capture starts at device reset and is a header followed by records in
+ * the order PGRAPH saw them, all in host byte order. Replaying it from the
+ * reset state therefore reproduces every method without running the guest.
+ */
+#define NV2A_CAPTURE_MAGIC 0x5041434e /* "NCAP" */
+#define NV2A_CAPTURE_VERSION 1
+
+typedef struct NV2ACaptureHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t vram_size;
+    uint32_t ramin_size;
+} NV2ACaptureHeader;
+
+typedef enum NV2ACaptureRecordType {
+    /* Guest writes to VRAM or RAMIN: address is the offset, length bytes of
+     * data follow */
+    NV2A_CAPTURE_VRAM,
+    NV2A_CAPTURE_RAMIN,
+    /* MMIO write to PGRAPH: address is the register, value what was
+     * written */
+    NV2A_CAPTURE_PGRAPH_WRITE,
+    /* Method run by the puller: address is the method, value the parameter
+     * after RAMHT lookup and length words of the raw pushbuffer follow */
+    NV2A_CAPTURE_METHOD,
+} NV2ACaptureRecordType;
+
+typedef struct NV2ACaptureRecord {
+    uint8_t type;
+    uint8_t channel_id;
+    uint8_t subchannel;
+    uint8_t reserved;
+    uint32_t address;
+    uint32_t value;
+    uint32_t length;
+} NV2ACaptureRecord;
+
+typedef struct NV2ACapture {
+    char *path;
+    uint32_t frame_limit;
+    FILE *file;
+    uint8_t *ramin_shadow;
+    bool synced;
+    unsigned int frames;
+} NV2ACapture;
+
+typedef struct NV2AReplayClassStats {
+    uint64_t methods;
+    int64_t ns;
+} NV2AReplayClassStats;
+
+typedef struct NV2AReplay {
+    char *path;
+    uint32_t warmup_frames;
+    FILE *file;
+    bool started;
+    bool active;
+    uint32_t *words;
+    size_t words_capacity;
+    unsigned int frames;
+    uint64_t methods;
+    int64_t start_time;
+    NV2AReplayClassStats classes[256];
+} NV2AReplay;
+
+#endif
@@ -70,6 +70,21 @@ void gl_debug_frame_terminator(void);
 # define NV2A_GL_DFRAME_TERMINATOR()               do { } while (0)
 #endif
 
+/* Checking for GL errors waits on the driver, so it is only done in GL
+ * validation builds, which also cross-check the shadowed draw state against
+ * the context before every draw. Implied by DEBUG_NV2A_GL.
+ */
+// #define DEBUG_NV2A_GL_VALIDATE
+#if defined(DEBUG_NV2A_GL) && !defined(DEBUG_NV2A_GL_VALIDATE)
+# define DEBUG_NV2A_GL_VALIDATE
+#endif
+
+#ifdef DEBUG_NV2A_GL_VALIDATE
+# define NV2A_GL_CHECK_ERROR() assert(glGetError() == GL_NO_ERROR)
+#else
+# define NV2A_GL_CHECK_ERROR() do { } while (0)
+#endif
+
 /* Debug prints to identify when unimplemented or unconfirmed features
  * are being exercised. These cases likely result in graphical problems of
  * varying degree, but should otherwise not crash the system. Enable this
@@ -103,21 +118,50 @@ void gl_debug_frame_terminator(void);
     _X(NV2A_PROF_INLINE_ARRAYS) \
     _X(NV2A_PROF_INLINE_ELEMENTS) \
     _X(NV2A_PROF_QUERY) \
+    _X(NV2A_PROF_QUERY_REPORT_STALL) \
+    _X(NV2A_PROF_QUERY_LATENCY_LT_1MS) \
+    _X(NV2A_PROF_QUERY_LATENCY_LT_4MS) \
+    _X(NV2A_PROF_QUERY_LATENCY_LT_16MS) \
+    _X(NV2A_PROF_QUERY_LATENCY_GE_16MS) \
+    _X(NV2A_PROF_GL_STATE_CALLS) \
+    _X(NV2A_PROF_GL_STATE_SKIPPED) \
     _X(NV2A_PROF_SHADER_GEN) \
     _X(NV2A_PROF_SHADER_BIND) \
     _X(NV2A_PROF_SHADER_BIND_NOTDIRTY) \
     _X(NV2A_PROF_ATTR_BIND) \
     _X(NV2A_PROF_TEX_UPLOAD) \
+    _X(NV2A_PROF_TEX_PALETTE_UPLOAD) \
+    _X(NV2A_PROF_TEX_DECODE_JOBS) \
+    _X(NV2A_PROF_TEX_DECODE_PARALLEL) \
     _X(NV2A_PROF_TEX_BIND) \
     _X(NV2A_PROF_GEOM_BUFFER_UPDATE_1) \
     _X(NV2A_PROF_GEOM_BUFFER_UPDATE_2) \
     _X(NV2A_PROF_GEOM_BUFFER_UPDATE_3) \
     _X(NV2A_PROF_GEOM_BUFFER_UPDATE_4) \
     _X(NV2A_PROF_GEOM_BUFFER_UPDATE_4_NOTDIRTY) \
+    _X(NV2A_PROF_GEOM_BUFFER_UPLOAD_BYTES) \
+    _X(NV2A_PROF_GEOM_BUFFER_STALL) \
+    _X(NV2A_PROF_GEOM_STREAM_BYTES) \
+    _X(NV2A_PROF_GEOM_STREAM_STALL) \
     _X(NV2A_PROF_SURF_DOWNLOAD) \
+    _X(NV2A_PROF_SURF_DOWNLOAD_EARLY) \
+    _X(NV2A_PROF_SURF_DOWNLOAD_STALE) \
     _X(NV2A_PROF_SURF_UPLOAD) \
     _X(NV2A_PROF_SURF_TO_TEX) \
     _X(NV2A_PROF_SURF_TO_TEX_FALLBACK) \
+    _X(NV2A_PROF_IMAGE_BLIT) \
+    _X(NV2A_PROF_IMAGE_BLIT_FALLBACK) \
+    _X(NV2A_PROF_GPU_SWIZZLE) \
+    _X(NV2A_PROF_GPU_UNSWIZZLE) \
+    _X(NV2A_PROF_FIFO_BATCHES) \
+    _X(NV2A_PROF_FIFO_BATCH_METHODS) \
+    _X(NV2A_PROF_SHADER_ASYNC_QUEUE_DEPTH) \
+    _X(NV2A_PROF_SHADER_ASYNC_FALLBACK) \
+    _X(NV2A_PROF_SHADER_ASYNC_SKIP) \
+    _X(NV2A_PROF_SHADER_COMPILE_LT_16MS) \
+    _X(NV2A_PROF_SHADER_COMPILE_LT_50MS) \
+    _X(NV2A_PROF_SHADER_COMPILE_LT_200MS) \
+    _X(NV2A_PROF_SHADER_COMPILE_GE_200MS) \
 
 enum NV2A_PROF_COUNTERS_ENUM {
     #define _X(x) x,
@@ -137,6 +181,10 @@ typedef struct NV2AStats {
         int counters[NV2A_PROF__COUNT];
     } frame_working, frame_history[NV2A_PROF_NUM_FRAMES];
     unsigned int frame_ptr;
+    struct {
+        unsigned int hits;
+        unsigned int misses;
+    } shader_disk_cache;
 } NV2AStats;
 
 #ifdef __cplusplus
@@ -145,6 +193,25 @@ extern "C" {
 
 extern NV2AStats g_nv2a_stats;
 
+static inline void nv2a_profile_inc_counter(enum NV2A_PROF_COUNTERS_ENUM cnt)
+{
+    g_nv2a_stats.frame_working.counters[cnt] += 1;
+}
+
+static inline void nv2a_profile_add_counter(enum NV2A_PROF_COUNTERS_ENUM cnt,
+                                            int value)
+{
+    g_nv2a_stats.frame_working.counters[cnt] += value;
+}
+
+static inline void nv2a_profile_max_counter(enum NV2A_PROF_COUNTERS_ENUM cnt,
+                                            int value)
+{
+    if (value > g_nv2a_stats.frame_working.counters[cnt]) {
+        g_nv2a_stats.frame_working.counters[cnt] = value;
+    }
+}
+
 const char *nv2a_profile_get_counter_name(unsigned int cnt);
 int nv2a_profile_get_counter_value(unsigned int cnt);
 
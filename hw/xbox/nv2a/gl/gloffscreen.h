@@ -58,9 +58,11 @@ GloContext *glo_context_create(void);
 /* Destroy a previously created OpenGL context */
 void glo_context_destroy(GloContext *context);
 
+/* Read pixels from the current read framebuffer. If a pixel pack buffer is
+ * bound, data is an offset into it and the read does not block. */
 void glo_readpixels(GLenum gl_format, GLenum gl_type,
                     unsigned int bytes_per_pixel, unsigned int stride,
-                    unsigned int width, unsigned int height, bool vflip,
+                    unsigned int width, unsigned int height,
                     void *data);
  
 #endif /* GLOFFSCREEN_H_ */
@@ -33,7 +33,7 @@
 
 void glo_readpixels(GLenum gl_format, GLenum gl_type,
                     unsigned int bytes_per_pixel, unsigned int stride,
-                    unsigned int width, unsigned int height, bool vflip,
+                    unsigned int width, unsigned int height,
                     void *data)
 {
     /* TODO: weird strides */
@@ -48,20 +48,6 @@ void glo_readpixels(GLenum gl_format, GLenum gl_type,
 
     glReadPixels(0, 0, width, height, gl_format, gl_type, data);
 
-    if (vflip) {
-        GLubyte *b = (GLubyte *) data;
-        GLubyte *c = &((GLubyte *) data)[stride * (height - 1)];
-        GLubyte *tmp = (GLubyte *) malloc(width * bytes_per_pixel);
-            for (int irow = 0; irow < height / 2; irow++) {
-            memcpy(tmp, b, width * bytes_per_pixel);
-            memcpy(b, c, width * bytes_per_pixel);
-            memcpy(c, tmp, width * bytes_per_pixel);
-            b += stride;
-            c -= stride;
-        }
-        free(tmp);
-    }
-
     /* Restore GL state */
     glPixelStorei(GL_PACK_ROW_LENGTH, rl);
     glPixelStorei(GL_PACK_ALIGNMENT, pa);
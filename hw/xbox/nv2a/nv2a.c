@@ -20,6 +20,7 @@
  */
 
 #include "hw/xbox/nv2a/nv2a_int.h"
+#include "hw/qdev-properties.h"
 
 #define DBG_IRQ 0
 #define DBG_DMA 0
@@ -226,6 +227,7 @@ static void nv2a_vga_gfx_update(void *opaque)
     d->pcrtc.raster = 0;
 
     nv2a_update_irq(d);
+    pgraph_update_title_id(d);
 }
 
 static void nv2a_init_memory(NV2AState *d, MemoryRegion *ram)
@@ -253,8 +255,12 @@ static void nv2a_init_memory(NV2AState *d, MemoryRegion *ram)
 
     memory_region_set_log(d->vram, true, DIRTY_MEMORY_NV2A);
     memory_region_set_log(d->vram, true, DIRTY_MEMORY_NV2A_TEX);
+    memory_region_set_log(d->vram, true, DIRTY_MEMORY_NV2A_CAPTURE);
     memory_region_set_dirty(d->vram, 0, memory_region_size(d->vram));
 
+    nv2a_capture_init(d);
+    nv2a_replay_init(d);
+
     /* hacky. swap out vga's vram */
     memory_region_destroy(&d->vga.vram);
     // memory_region_unref(&d->vga.vram); // FIXME: Is ths right?
@@ -329,6 +335,9 @@ static void nv2a_reset(NV2AState *d)
     d->ptimer.pending_interrupts = 0;
     d->pcrtc.pending_interrupts = 0;
 
+    nv2a_capture_reset(d);
+    nv2a_replay_start(d);
+
     nv2a_unlock_fifo(d);
 }
 
@@ -381,6 +390,8 @@ static void nv2a_exitfn(PCIDevice *dev)
     qemu_cond_broadcast(&d->pfifo.fifo_cond);
     qemu_thread_join(&d->pfifo.thread);
 
+    nv2a_capture_finalize(d);
+    nv2a_replay_finalize(d);
     pgraph_destroy(&d->pgraph);
 }
 
@@ -566,6 +577,17 @@ static const VMStateDescription vmstate_nv2a = {
     },
 };
 
+static Property nv2a_properties[] = {
+    /* Record the pushbuffer stream from reset, optionally stopping after a
+     * number of frames */
+    DEFINE_PROP_STRING("capture", NV2AState, capture.path),
+    DEFINE_PROP_UINT32("capture-frames", NV2AState, capture.frame_limit, 0),
+    /* Replay a capture and report timings, meant to be run with -S */
+    DEFINE_PROP_STRING("replay", NV2AState, replay.path),
+    DEFINE_PROP_UINT32("replay-warmup", NV2AState, replay.warmup_frames, 0),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void nv2a_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -586,6 +608,7 @@ static void nv2a_class_init(ObjectClass *klass, void *data)
     dc->desc = "GeForce NV2A Integrated Graphics";
     dc->vmsd = &vmstate_nv2a;
     dc->reset = qdev_nv2a_reset;
+    device_class_set_props(dc, nv2a_properties);
 }
 
 static const TypeInfo nv2a_info = {
@@ -26,6 +26,12 @@ void nv2a_gl_context_init(void);
 int nv2a_get_framebuffer_surface(void);
 void nv2a_set_surface_scale_factor(unsigned int scale);
 unsigned int nv2a_get_surface_scale_factor(void);
+void nv2a_set_shader_compile_mode(int mode);
+int nv2a_get_shader_compile_mode(void);
+void nv2a_set_gpu_swizzle(bool enable);
+bool nv2a_get_gpu_swizzle(void);
+void nv2a_set_strict_reports(bool enable);
+bool nv2a_get_strict_reports(void);
 const uint8_t *nv2a_get_dac_palette(void);
 
 #endif
@@ -27,6 +27,7 @@
 #include "qemu/osdep.h"
 #include "qemu/thread.h"
 #include "qemu/queue.h"
+#include "qemu/interval-tree.h"
 #include "qemu/main-loop.h"
 #include "qapi/error.h"
 #include "qemu/error-report.h"
@@ -47,6 +48,8 @@
 #include "nv2a.h"
 #include "debug.h"
 #include "shaders.h"
+#include "texture_decode.h"
+#include "capture.h"
 #include "nv2a_regs.h"
 
 #define GET_MASK(v, mask) (((v) & (mask)) >> ctz32(mask))
@@ -61,6 +64,19 @@
 
 #define NV2A_DEVICE(obj) OBJECT_CHECK(NV2AState, (obj), "nv2a")
 
+/* Fences in flight guarding the persistently mapped VRAM mirror */
+#define NV2A_MEMORY_BUFFER_FENCES 64
+
+/*
+ * Streaming arena for inline geometry, reclaimed a segment at a time. Large
+ * enough for an inline buffer with every attribute populated.
+ */
+#define NV2A_STREAM_BUFFER_SIZE (32 * 1024 * 1024)
+#define NV2A_STREAM_BUFFER_SEGMENTS 8
+
+/* Recently drawn inline element lists, to spot the ones worth caching */
+#define NV2A_ELEMENT_SIGNATURES 1024
+
 enum FIFOEngine {
     ENGINE_SOFTWARE = 0,
     ENGINE_GRAPHICS = 1,
@@ -97,8 +113,6 @@ typedef struct VertexAttribute {
     GLint gl_count;
     GLenum gl_type;
     GLboolean gl_normalize;
-
-    GLuint gl_inline_buffer;
 } VertexAttribute;
 
 typedef struct SurfaceFormatInfo {
@@ -130,6 +144,7 @@ typedef struct SurfaceShape {
 
 typedef struct SurfaceBinding {
     QTAILQ_ENTRY(SurfaceBinding) entry;
+    IntervalTreeNode vram_range;
     MemAccessCallback *access_cb;
 
     hwaddr vram_addr;
@@ -153,6 +168,13 @@ typedef struct SurfaceBinding {
     bool draw_dirty;
     bool download_pending;
     bool upload_pending;
+
+    /* Readback in flight into pbo, complete once download_fence signals */
+    GLuint pbo;
+    size_t pbo_size;
+    GLsync download_fence;
+    unsigned int download_width, download_height, download_pitch;
+    bool download_swizzle;
 } SurfaceBinding;
 
 typedef struct TextureShape {
@@ -173,6 +195,8 @@ typedef struct TextureBinding {
     int draw_time;
     uint64_t data_hash;
     unsigned int scale;
+    unsigned int max_level; /* relative to the base level */
+    unsigned int depth; /* of the base level */
 } TextureBinding;
 
 typedef struct TextureKey {
@@ -188,6 +212,7 @@ typedef struct TextureLruNode {
     TextureKey key;
     TextureBinding *binding;
     bool possibly_dirty;
+    IntervalTreeNode texture_range, palette_range;
 } TextureLruNode;
 
 typedef struct VertexKey {
@@ -209,6 +234,43 @@ typedef struct KelvinState {
     hwaddr object_instance;
 } KelvinState;
 
+/* A GET_REPORT waiting on the occlusion queries issued before it */
+typedef struct QueryReport {
+    QSIMPLEQ_ENTRY(QueryReport) entry;
+    hwaddr vram_addr;
+    bool clear;
+    unsigned int query_count;
+    GLuint *queries;
+    int64_t submit_time;
+} QueryReport;
+
+/*
+ * Last fixed-function state issued to the render context, so draws only emit
+ * what changed. Caps are indexed by pgraph_gl_cap_index(); anything not
+ * marked known is issued unconditionally the next time it is set.
+ */
+typedef struct GLStateShadow {
+    uint32_t caps;
+    uint32_t caps_known;
+    GLboolean color_mask[4];
+    GLboolean depth_mask;
+    GLuint stencil_mask;
+    GLenum blend_sfactor, blend_dfactor;
+    GLenum blend_equation;
+    uint64_t blend_color; /* Register values, wide to never match unknown */
+    GLenum cull_face;
+    GLenum front_face;
+    uint64_t polygon_offset_factor, polygon_offset_units;
+    GLenum depth_func;
+    GLenum stencil_func;
+    GLint stencil_ref;
+    GLuint stencil_func_mask;
+    GLenum stencil_op[3];
+    GLint viewport[4];
+    GLint scissor[4];
+    GLenum active_texture;
+} GLStateShadow;
+
 typedef struct ContextSurfaces2DState {
     hwaddr object_instance;
     hwaddr dma_image_source;
@@ -253,6 +315,26 @@ typedef struct PGRAPHState {
         GLint palette_loc[256];
     } disp_rndr;
 
+    struct swizzle_rndr {
+        GLuint fbo, vao, tex;
+        GLint tex_internal_format;
+        unsigned int tex_width, tex_height;
+        struct {
+            GLuint prog;
+            GLint tex_loc, size_loc, mask_loc, scale_loc, flip_loc;
+        } swizzle, unswizzle;
+    } swizzle_rndr;
+
+    struct blit_rndr {
+        GLuint read_fbo, draw_fbo;
+        /* Native resolution scratch targets used to flip and rescale surface
+         * transfers, indexed by surface->color
+         */
+        GLuint tex[2];
+        GLint tex_internal_format[2];
+        unsigned int tex_width[2], tex_height[2];
+    } blit_rndr;
+
     /* subchannels state we're not sure the location of... */
     ContextSurfaces2DState context_surfaces_2d;
     ImageBlitState image_blit;
@@ -264,6 +346,10 @@ typedef struct PGRAPHState {
     SurfaceShape surface_shape;
     SurfaceShape last_surface_shape;
     QTAILQ_HEAD(, SurfaceBinding) surfaces;
+    /* Surfaces by VRAM range, they never overlap */
+    IntervalTreeRoot surface_ranges;
+    /* Removed surfaces waiting for their access callback to go away */
+    QTAILQ_HEAD(, SurfaceBinding) invalidated_surfaces;
     SurfaceBinding *color_binding, *zeta_binding;
     struct {
         int clip_x;
@@ -277,15 +363,37 @@ typedef struct PGRAPHState {
     hwaddr dma_a, dma_b;
     Lru texture_cache;
     struct TextureLruNode *texture_cache_entries;
+    /* VRAM ranges of in-use texture cache entries, for dirty tracking */
+    IntervalTreeRoot texture_cache_texture_ranges;
+    IntervalTreeRoot texture_cache_palette_ranges;
     bool texture_dirty[NV2A_MAX_TEXTURES];
     TextureBinding *texture_binding[NV2A_MAX_TEXTURES];
 
+    /* Palettes of indexed textures, looked up in the fragment shader */
+    GLuint gl_palette_textures[NV2A_MAX_TEXTURES];
+    uint8_t palette_data[NV2A_MAX_TEXTURES][256 * 4];
+
+    /* Texture misses are decoded by the pool into this pixel buffer */
+    TextureDecodePool texture_decode_pool;
+    GLuint gl_texture_staging_buffer;
+
+    /* DXT volumes are uploaded as compressed 2D arrays if the driver can */
+    bool compressed_volume_arrays;
+
     GHashTable *shader_cache;
+    ShaderDiskCache shader_disk_cache;
+    uint32_t title_id; /* Running XBE, published by pgraph_update_title_id */
+    int64_t title_id_check_time;
+    ShaderCompilePool shader_compile_pool;
+    int shader_compile_mode;
+    bool shader_binding_pending;
+    bool draw_skip;
     ShaderBinding *shader_binding;
 
     bool texture_matrix_enable[NV2A_MAX_TEXTURES];
 
     GLuint gl_framebuffer;
+    GLStateShadow gl_state;
 
     GLuint gl_display_buffer;
     GLint gl_display_buffer_internal_format;
@@ -302,8 +410,11 @@ typedef struct PGRAPHState {
     hwaddr report_offset;
     bool zpass_pixel_count_enable;
     unsigned int zpass_pixel_count_result;
+    bool zpass_pixel_count_clear_pending;
     unsigned int gl_zpass_pixel_count_query_count;
     GLuint *gl_zpass_pixel_count_queries;
+    QSIMPLEQ_HEAD(, QueryReport) report_queue;
+    bool reports_pending;
 
     hwaddr dma_vertex_a, dma_vertex_b;
 
@@ -338,10 +449,24 @@ typedef struct PGRAPHState {
 
     Lru element_cache;
     struct VertexLruNode *element_cache_entries;
+    uint64_t element_signatures[NV2A_ELEMENT_SIGNATURES];
+
+    /*
+     * Inline arrays, buffers and elements are sub-allocated from this ring.
+     * Segments written since the last allocation are fenced by the next one,
+     * once the draws using them have been issued, and waited on before the
+     * ring wraps back into them.
+     */
+    GLuint gl_stream_buffer;
+    uint8_t *stream_buffer_map; /* Persistent mapping or CPU staging copy */
+    bool stream_buffer_persistent;
+    GLsync stream_buffer_fences[NV2A_STREAM_BUFFER_SEGMENTS];
+    size_t stream_buffer_head;
+    int stream_buffer_unfenced_first; /* -1 when nothing is unfenced */
+    int stream_buffer_unfenced_last;
 
     unsigned int inline_array_length;
     uint32_t inline_array[NV2A_MAX_BATCH_LENGTH];
-    GLuint gl_inline_array_buffer;
 
     unsigned int inline_elements_length;
     uint32_t inline_elements[NV2A_MAX_BATCH_LENGTH];
@@ -359,6 +484,25 @@ typedef struct PGRAPHState {
     GLuint gl_memory_buffer;
     GLuint gl_vertex_array;
 
+    /*
+     * Persistent mapping of gl_memory_buffer, or NULL without
+     * ARB_buffer_storage. Draws reading the mirror are grouped into batches
+     * closed by a fence; each region of the mirror records the last batch
+     * that read it so a write only waits for the draws it would disturb.
+     */
+    uint8_t *memory_buffer_map;
+    GLsync memory_buffer_fences[NV2A_MEMORY_BUFFER_FENCES];
+    uint64_t *memory_buffer_region_seq;
+    uint64_t memory_buffer_seq;           /* Open batch */
+    uint64_t memory_buffer_completed_seq; /* Last batch known to be done */
+    unsigned int memory_buffer_batch_draws;
+
+    /* Uniform buffers and the CPU copies they mirror */
+    GLuint gl_transform_constants_buffer;
+    GLuint gl_combiner_constants_buffer;
+    ShaderTransformConstants transform_constants;
+    ShaderCombinerConstants combiner_constants;
+
     uint32_t regs[0x2000];
 
     bool waiting_for_nop;
@@ -374,9 +518,39 @@ typedef struct PGRAPHState {
     QemuEvent gl_sync_complete;
 
     unsigned int surface_scale_factor;
-    uint8_t *scale_buf;
+    bool gpu_swizzle;
+    bool strict_reports;
 } PGRAPHState;
 
+/* Pusher state needed to resume DMA parsing at a queued command */
+typedef struct PFIFOPusherState {
+    uint32_t dma_get;
+    uint32_t dma_state;
+    uint32_t dma_subroutine;
+    uint32_t dma_dcount;
+} PFIFOPusherState;
+
+typedef struct PFIFOCommand {
+    uint32_t method_entry;
+    uint32_t parameter;
+    uint32_t *parameters;
+    size_t num_words_available;
+    size_t max_lookahead_words;
+    unsigned int channel_id;
+    PFIFOPusherState resume;
+
+    /* Filled in by the puller */
+    ssize_t num_words_processed;
+    bool resync;
+} PFIFOCommand;
+
+/* Single-producer/single-consumer ring between DMA pusher and puller */
+typedef struct PFIFOCommandRing {
+    PFIFOCommand cmds[NV2A_PFIFO_RING_SIZE];
+    unsigned int head; /* Written only by the pusher */
+    unsigned int tail; /* Written only by the puller */
+} PFIFOCommandRing;
+
 typedef struct NV2AState {
     /*< private >*/
     PCIDevice parent_obj;
@@ -413,6 +587,7 @@ typedef struct NV2AState {
         QemuCond fifo_idle_cond;
         bool fifo_kick;
         bool halt;
+        PFIFOCommandRing ring;
     } pfifo;
 
     struct {
@@ -460,6 +635,8 @@ typedef struct NV2AState {
         uint8_t palette[256*3];
     } puserdac;
 
+    NV2ACapture capture;
+    NV2AReplay replay;
 } NV2AState;
 
 typedef struct NV2ABlockInfo {
@@ -471,6 +648,7 @@ typedef struct NV2ABlockInfo {
 
 extern GloContext *g_nv2a_context_render;
 extern GloContext *g_nv2a_context_display;
+extern GloContext *g_nv2a_context_shader_compile[SHADER_COMPILE_THREADS];
 
 void nv2a_update_irq(NV2AState *d);
 
@@ -520,9 +698,23 @@ int pgraph_method(NV2AState *d, unsigned int subchannel, unsigned int method,
 void pgraph_gl_sync(NV2AState *d);
 void pgraph_process_pending_downloads(NV2AState *d);
 void pgraph_download_dirty_surfaces(NV2AState *d);
+void pgraph_process_pending_reports(NV2AState *d);
 void pgraph_flush(NV2AState *d);
+void pgraph_update_title_id(NV2AState *d);
 
 void *pfifo_thread(void *arg);
 void pfifo_kick(NV2AState *d);
 
+void nv2a_capture_init(NV2AState *d);
+void nv2a_capture_finalize(NV2AState *d);
+void nv2a_capture_reset(NV2AState *d);
+void nv2a_capture_sync_memory(NV2AState *d);
+void nv2a_capture_pgraph_write(NV2AState *d, hwaddr addr, uint32_t val);
+void nv2a_capture_method(NV2AState *d, const PFIFOCommand *cmd,
+                         size_t num_words);
+void nv2a_replay_init(NV2AState *d);
+void nv2a_replay_finalize(NV2AState *d);
+void nv2a_replay_start(NV2AState *d);
+void nv2a_replay_run_frame(NV2AState *d);
+
 #endif
@@ -1363,6 +1363,7 @@
 #define NV2A_NUM_CHANNELS 32
 #define NV2A_NUM_SUBCHANNELS 8
 #define NV2A_CACHE1_SIZE 128
+#define NV2A_PFIFO_RING_SIZE 512 /* Must be a power of two */
 
 #define NV2A_MAX_BATCH_LENGTH 0x1FFFF
 #define NV2A_VERTEXSHADER_ATTRIBUTES 16
@@ -120,18 +120,17 @@ static bool pgraph_is_flip_stall_complete(NV2AState *d)
     return false;
 }
 
+/* Must be called with pgraph.lock held */
 static bool pfifo_stall_for_flip(NV2AState *d)
 {
     bool should_stall = false;
 
     if (qatomic_read(&d->pgraph.waiting_for_flip)) {
-        qemu_mutex_lock(&d->pgraph.lock);
         if (!pgraph_is_flip_stall_complete(d)) {
             should_stall = true;
         } else {
             d->pgraph.waiting_for_flip = false;
         }
-        qemu_mutex_unlock(&d->pgraph.lock);
     }
 
     return should_stall;
@@ -144,34 +143,174 @@ static bool pfifo_puller_should_stall(NV2AState *d)
            !pgraph_can_fifo_access(d);
 }
 
-static ssize_t pfifo_run_puller(NV2AState *d, uint32_t method_entry,
-                                uint32_t parameter, uint32_t *parameters,
-                                size_t num_words_available,
-                                size_t max_lookahead_words)
+static ssize_t pfifo_puller_run_command(NV2AState *d, PFIFOCommand *cmd)
 {
     if (pfifo_puller_should_stall(d)) {
         return -1;
     }
 
+    uint32_t method = cmd->method_entry & 0x1FFC;
+    uint32_t subchannel =
+        GET_MASK(cmd->method_entry, NV_PFIFO_CACHE1_METHOD_SUBCHANNEL);
+
+    if (method == 0) {
+        // Switch contexts if necessary
+        pgraph_context_switch(d, cmd->channel_id);
+        if (d->pgraph.waiting_for_context_switch) {
+            return -1;
+        }
+    }
+
+    return pgraph_method(d, subchannel, method, cmd->parameter,
+                         cmd->parameters, cmd->num_words_available,
+                         cmd->max_lookahead_words);
+}
+
+/* Lookahead in pgraph_method (e.g. squashing repeated BEGIN,DRAW_ARRAYS,END)
+ * may consume words the pusher has already queued as separate commands. Those
+ * commands can be skipped as long as they lie entirely within the consumed
+ * words and the last of them ends exactly where the lookahead stopped.
+ */
+static bool pfifo_puller_can_absorb(PFIFOCommandRing *ring, unsigned int tail,
+                                    unsigned int head, uint32_t *start,
+                                    uint32_t *end)
+{
+    for (; tail != head; tail++) {
+        PFIFOCommand *cmd = &ring->cmds[tail & (NV2A_PFIFO_RING_SIZE - 1)];
+        uint32_t *cmd_end = cmd->parameters + cmd->num_words_available;
+        if (cmd->parameters < start || cmd_end > end) {
+            return false;
+        }
+        if (cmd_end == end) {
+            return true;
+        }
+        start = cmd_end;
+    }
+
+    return false;
+}
+
+/* Drain the command ring under a single acquisition of pgraph.lock. Commands
+ * are retired until one stalls or consumes a different number of words than
+ * the pusher assumed, after which the pusher's decoding of the remaining
+ * commands is stale and they are left for it to resubmit.
+ */
+static void pfifo_run_puller(NV2AState *d)
+{
+    PFIFOCommandRing *ring = &d->pfifo.ring;
+    unsigned int head = qatomic_load_acquire(&ring->head);
+    unsigned int tail = ring->tail;
+    uint32_t *absorb_end = NULL;
+    bool retiring = true;
+    int num_methods = 0;
+
+    qemu_mutex_lock(&d->pgraph.lock);
+
+    if (d->capture.file) {
+        nv2a_capture_sync_memory(d);
+    }
+
+    for (; tail != head; tail++) {
+        PFIFOCommand *cmd = &ring->cmds[tail & (NV2A_PFIFO_RING_SIZE - 1)];
+        cmd->resync = false;
+
+        if (!retiring) {
+            cmd->num_words_processed = -1;
+            continue;
+        }
+
+        if (absorb_end) {
+            if (cmd->parameters < absorb_end) {
+                cmd->num_words_processed = 0;
+                continue;
+            }
+            absorb_end = NULL;
+        }
+
+        ssize_t num_proc = pfifo_puller_run_command(d, cmd);
+        cmd->num_words_processed = num_proc;
+        if (num_proc < 0) {
+            retiring = false;
+            continue;
+        }
+
+        num_methods++;
+
+        if (d->capture.file) {
+            nv2a_capture_method(d, cmd, num_proc);
+        }
+
+        if ((size_t)num_proc < cmd->num_words_available) {
+            cmd->resync = true;
+            retiring = false;
+        } else if ((size_t)num_proc > cmd->num_words_available) {
+            uint32_t *start = cmd->parameters + cmd->num_words_available;
+            uint32_t *end = cmd->parameters + num_proc;
+            if (pfifo_puller_can_absorb(ring, tail + 1, head, start, end)) {
+                absorb_end = end;
+            } else {
+                cmd->resync = true;
+                retiring = false;
+            }
+        }
+    }
+
+    qemu_mutex_unlock(&d->pgraph.lock);
+
+    qatomic_store_release(&ring->tail, tail);
+
+    nv2a_profile_inc_counter(NV2A_PROF_FIFO_BATCHES);
+    nv2a_profile_add_counter(NV2A_PROF_FIFO_BATCH_METHODS, num_methods);
+}
+
+static bool pfifo_pusher_should_stall(NV2AState *d)
+{
+    return !pgraph_can_fifo_access(d) ||
+           qatomic_read(&d->pgraph.waiting_for_nop);
+}
+
+/* Advance pusher state past the data words of the active method command */
+static void pfifo_pusher_retire_words(PFIFOPusherState *s,
+                                      size_t num_words_processed)
+{
+    uint32_t method_type =
+        GET_MASK(s->dma_state, NV_PFIFO_CACHE1_DMA_STATE_METHOD_TYPE);
+    uint32_t method =
+        GET_MASK(s->dma_state, NV_PFIFO_CACHE1_DMA_STATE_METHOD) << 2;
+    uint32_t method_count =
+        GET_MASK(s->dma_state, NV_PFIFO_CACHE1_DMA_STATE_METHOD_COUNT);
+
+    s->dma_get += num_words_processed * 4;
+
+    if (method_type == NV_PFIFO_CACHE1_DMA_STATE_METHOD_TYPE_INC) {
+        SET_MASK(s->dma_state, NV_PFIFO_CACHE1_DMA_STATE_METHOD,
+                 (method + 4*num_words_processed) >> 2);
+    }
+    SET_MASK(s->dma_state, NV_PFIFO_CACHE1_DMA_STATE_METHOD_COUNT,
+             method_count - MIN(method_count, num_words_processed));
+
+    s->dma_dcount += num_words_processed;
+}
+
+/* Resolve a method for the puller. Returns false if the puller is not
+ * accepting methods.
+ */
+static bool pfifo_pusher_queue_method(NV2AState *d, PFIFOCommand *cmd)
+{
     uint32_t *pull0 = &d->pfifo.regs[NV_PFIFO_CACHE1_PULL0];
     uint32_t *pull1 = &d->pfifo.regs[NV_PFIFO_CACHE1_PULL1];
     uint32_t *engine_reg = &d->pfifo.regs[NV_PFIFO_CACHE1_ENGINE];
-    uint32_t *status = &d->pfifo.regs[NV_PFIFO_CACHE1_STATUS];
-    ssize_t num_proc = -1;
-
-    // TODO think more about locking
 
-    if (!GET_MASK(*pull0, NV_PFIFO_CACHE1_PULL0_ACCESS) ||
-        (*status & NV_PFIFO_CACHE1_STATUS_LOW_MARK)) {
-        return -1;
+    if (!GET_MASK(*pull0, NV_PFIFO_CACHE1_PULL0_ACCESS)) {
+        return false;
     }
 
-    uint32_t method = method_entry & 0x1FFC;
+    uint32_t method = cmd->method_entry & 0x1FFC;
     uint32_t subchannel =
-        GET_MASK(method_entry, NV_PFIFO_CACHE1_METHOD_SUBCHANNEL);
+        GET_MASK(cmd->method_entry, NV_PFIFO_CACHE1_METHOD_SUBCHANNEL);
 
     if (method == 0) {
-        RAMHTEntry entry = ramht_lookup(d, parameter);
+        RAMHTEntry entry = ramht_lookup(d, cmd->parameter);
         assert(entry.valid);
         // assert(entry.channel_id == state->channel_id);
         assert(entry.engine == ENGINE_GRAPHICS);
@@ -181,68 +320,28 @@ static ssize_t pfifo_run_puller(NV2AState *d, uint32_t method_entry,
         SET_MASK(*engine_reg, 3 << (4*subchannel), entry.engine);
         SET_MASK(*pull1, NV_PFIFO_CACHE1_PULL1_ENGINE, entry.engine);
 
-        // TODO: this is fucked
-        qemu_mutex_unlock(&d->pfifo.lock);
-        qemu_mutex_lock(&d->pgraph.lock);
-
-        // Switch contexts if necessary
-        if (pgraph_can_fifo_access(d)) {
-            pgraph_context_switch(d, entry.channel_id);
-            if (!d->pgraph.waiting_for_context_switch) {
-                num_proc =
-                    pgraph_method(d, subchannel, 0, entry.instance, parameters,
-                                  num_words_available, max_lookahead_words);
-            }
-        }
-
-        qemu_mutex_unlock(&d->pgraph.lock);
-        qemu_mutex_lock(&d->pfifo.lock);
-
+        cmd->parameter = entry.instance;
+        cmd->channel_id = entry.channel_id;
     } else if (method >= 0x100) {
         // method passed to engine
 
         /* methods that take objects.
          * TODO: Check this range is correct for the nv2a */
         if (method >= 0x180 && method < 0x200) {
-            //qemu_mutex_lock_iothread();
-            RAMHTEntry entry = ramht_lookup(d, parameter);
+            RAMHTEntry entry = ramht_lookup(d, cmd->parameter);
             assert(entry.valid);
             // assert(entry.channel_id == state->channel_id);
-            parameter = entry.instance;
-            //qemu_mutex_unlock_iothread();
+            cmd->parameter = entry.instance;
         }
 
         enum FIFOEngine engine = GET_MASK(*engine_reg, 3 << (4*subchannel));
         assert(engine == ENGINE_GRAPHICS);
         SET_MASK(*pull1, NV_PFIFO_CACHE1_PULL1_ENGINE, engine);
-
-        // TODO: this is fucked
-        qemu_mutex_unlock(&d->pfifo.lock);
-        qemu_mutex_lock(&d->pgraph.lock);
-
-        if (pgraph_can_fifo_access(d)) {
-            num_proc =
-                pgraph_method(d, subchannel, method, parameter, parameters,
-                              num_words_available, max_lookahead_words);
-        }
-
-        qemu_mutex_unlock(&d->pgraph.lock);
-        qemu_mutex_lock(&d->pfifo.lock);
     } else {
         assert(false);
     }
 
-    if (num_proc > 0) {
-        *status |= NV_PFIFO_CACHE1_STATUS_LOW_MARK;
-    }
-
-    return num_proc;
-}
-
-static bool pfifo_pusher_should_stall(NV2AState *d)
-{
-    return !pgraph_can_fifo_access(d) ||
-           qatomic_read(&d->pgraph.waiting_for_nop);
+    return true;
 }
 
 static void pfifo_run_pusher(NV2AState *d)
@@ -256,6 +355,7 @@ static void pfifo_run_pusher(NV2AState *d)
     uint32_t *dma_put = &d->pfifo.regs[NV_PFIFO_CACHE1_DMA_PUT];
     uint32_t *dma_dcount = &d->pfifo.regs[NV_PFIFO_CACHE1_DMA_DCOUNT];
     uint32_t *status = &d->pfifo.regs[NV_PFIFO_CACHE1_STATUS];
+    PFIFOCommandRing *ring = &d->pfifo.ring;
 
     if (!GET_MASK(*push0, NV_PFIFO_CACHE1_PUSH0_ACCESS) ||
         !GET_MASK(*dma_push, NV_PFIFO_CACHE1_DMA_PUSH_ACCESS) ||
@@ -289,144 +389,205 @@ static void pfifo_run_pusher(NV2AState *d)
     uint8_t *dma = nv_dma_map(d, dma_instance, &dma_len);
 
     while (!pfifo_pusher_should_stall(d)) {
-        uint32_t dma_get_v = *dma_get;
-        uint32_t dma_put_v = *dma_put;
-        if (dma_get_v == dma_put_v) break;
-        if (dma_get_v >= dma_len) {
-            assert(false);
-            SET_MASK(*dma_state, NV_PFIFO_CACHE1_DMA_STATE_ERROR,
-                     NV_PFIFO_CACHE1_DMA_STATE_ERROR_PROTECTION);
-            break;
-        }
+        if (*dma_get == *dma_put) break;
+
+        /* Decode as many commands as fit in the ring, assuming each method
+         * consumes all of the data words available to it.
+         */
+        PFIFOPusherState s = {
+            .dma_get = *dma_get,
+            .dma_state = *dma_state,
+            .dma_subroutine = *dma_subroutine,
+            .dma_dcount = *dma_dcount,
+        };
+        unsigned int batch_start = ring->head;
+        unsigned int head = batch_start;
+        bool blocked = false;
+
+        while ((head - batch_start) < NV2A_PFIFO_RING_SIZE) {
+            uint32_t dma_get_v = s.dma_get;
+            uint32_t dma_put_v = *dma_put;
+            if (dma_get_v == dma_put_v) break;
+            if (dma_get_v >= dma_len) {
+                assert(false);
+                SET_MASK(s.dma_state, NV_PFIFO_CACHE1_DMA_STATE_ERROR,
+                         NV_PFIFO_CACHE1_DMA_STATE_ERROR_PROTECTION);
+                break;
+            }
 
-        size_t num_words_available = dma_put_v - dma_get_v;
-        assert(num_words_available % 4 == 0);
-        num_words_available /= 4;
-
-        uint32_t *word_ptr = (uint32_t*)(dma + dma_get_v);
-        uint32_t word = ldl_le_p(word_ptr);
-        dma_get_v += 4;
-
-        uint32_t method_type =
-            GET_MASK(*dma_state, NV_PFIFO_CACHE1_DMA_STATE_METHOD_TYPE);
-        uint32_t method_subchannel =
-            GET_MASK(*dma_state, NV_PFIFO_CACHE1_DMA_STATE_SUBCHANNEL);
-        uint32_t method =
-            GET_MASK(*dma_state, NV_PFIFO_CACHE1_DMA_STATE_METHOD) << 2;
-        uint32_t method_count =
-            GET_MASK(*dma_state, NV_PFIFO_CACHE1_DMA_STATE_METHOD_COUNT);
-
-        uint32_t subroutine_state =
-            GET_MASK(*dma_subroutine, NV_PFIFO_CACHE1_DMA_SUBROUTINE_STATE);
-
-        if (method_count) {
-            /* data word of methods command */
-            d->pfifo.regs[NV_PFIFO_CACHE1_DMA_DATA_SHADOW] = word;
-
-            assert((method & 3) == 0);
-            uint32_t method_entry = 0;
-            SET_MASK(method_entry, NV_PFIFO_CACHE1_METHOD_ADDRESS, method >> 2);
-            SET_MASK(method_entry, NV_PFIFO_CACHE1_METHOD_TYPE, method_type);
-            SET_MASK(method_entry, NV_PFIFO_CACHE1_METHOD_SUBCHANNEL,
-                     method_subchannel);
+            size_t num_words_available = dma_put_v - dma_get_v;
+            assert(num_words_available % 4 == 0);
+            num_words_available /= 4;
+
+            uint32_t *word_ptr = (uint32_t*)(dma + dma_get_v);
+            uint32_t word = ldl_le_p(word_ptr);
+            dma_get_v += 4;
+
+            uint32_t method_type =
+                GET_MASK(s.dma_state, NV_PFIFO_CACHE1_DMA_STATE_METHOD_TYPE);
+            uint32_t method_subchannel =
+                GET_MASK(s.dma_state, NV_PFIFO_CACHE1_DMA_STATE_SUBCHANNEL);
+            uint32_t method =
+                GET_MASK(s.dma_state, NV_PFIFO_CACHE1_DMA_STATE_METHOD) << 2;
+            uint32_t method_count =
+                GET_MASK(s.dma_state, NV_PFIFO_CACHE1_DMA_STATE_METHOD_COUNT);
+
+            uint32_t subroutine_state =
+                GET_MASK(s.dma_subroutine,
+                         NV_PFIFO_CACHE1_DMA_SUBROUTINE_STATE);
+
+            if (method_count) {
+                /* data word of methods command */
+                d->pfifo.regs[NV_PFIFO_CACHE1_DMA_DATA_SHADOW] = word;
+
+                assert((method & 3) == 0);
+                PFIFOCommand *cmd =
+                    &ring->cmds[head & (NV2A_PFIFO_RING_SIZE - 1)];
+                cmd->method_entry = 0;
+                SET_MASK(cmd->method_entry, NV_PFIFO_CACHE1_METHOD_ADDRESS,
+                         method >> 2);
+                SET_MASK(cmd->method_entry, NV_PFIFO_CACHE1_METHOD_TYPE,
+                         method_type);
+                SET_MASK(cmd->method_entry, NV_PFIFO_CACHE1_METHOD_SUBCHANNEL,
+                         method_subchannel);
+                cmd->parameter = word;
+                cmd->parameters = word_ptr;
+                cmd->num_words_available =
+                    MIN(method_count, num_words_available);
+                cmd->max_lookahead_words = num_words_available;
+                cmd->resume = s;
+
+                if (!pfifo_pusher_queue_method(d, cmd)) {
+                    blocked = true;
+                    break;
+                }
+                head++;
 
-            *status &= ~NV_PFIFO_CACHE1_STATUS_LOW_MARK;
+                pfifo_pusher_retire_words(&s, cmd->num_words_available);
+                dma_get_v = s.dma_get;
+            } else {
+                /* no command active - this is the first word of a new one */
+                d->pfifo.regs[NV_PFIFO_CACHE1_DMA_RSVD_SHADOW] = word;
+
+                /* match all forms */
+                if ((word & 0xe0000003) == 0x20000000) {
+                    /* old jump */
+                    d->pfifo.regs[NV_PFIFO_CACHE1_DMA_GET_JMP_SHADOW] =
+                        dma_get_v;
+                    dma_get_v = word & 0x1fffffff;
+                    NV2A_DPRINTF("pb OLD_JMP 0x%x\n", dma_get_v);
+                } else if ((word & 3) == 1) {
+                    /* jump */
+                    d->pfifo.regs[NV_PFIFO_CACHE1_DMA_GET_JMP_SHADOW] =
+                        dma_get_v;
+                    dma_get_v = word & 0xfffffffc;
+                    NV2A_DPRINTF("pb JMP 0x%x\n", dma_get_v);
+                } else if ((word & 3) == 2) {
+                    /* call */
+                    if (subroutine_state) {
+                        SET_MASK(s.dma_state, NV_PFIFO_CACHE1_DMA_STATE_ERROR,
+                                 NV_PFIFO_CACHE1_DMA_STATE_ERROR_CALL);
+                        break;
+                    } else {
+                        s.dma_subroutine = dma_get_v;
+                        SET_MASK(s.dma_subroutine,
+                                 NV_PFIFO_CACHE1_DMA_SUBROUTINE_STATE, 1);
+                        dma_get_v = word & 0xfffffffc;
+                        NV2A_DPRINTF("pb CALL 0x%x\n", dma_get_v);
+                    }
+                } else if (word == 0x00020000) {
+                    /* return */
+                    if (!subroutine_state) {
+                        SET_MASK(s.dma_state, NV_PFIFO_CACHE1_DMA_STATE_ERROR,
+                                 NV_PFIFO_CACHE1_DMA_STATE_ERROR_RETURN);
+                        // break;
+                    } else {
+                        dma_get_v = s.dma_subroutine & 0xfffffffc;
+                        SET_MASK(s.dma_subroutine,
+                                 NV_PFIFO_CACHE1_DMA_SUBROUTINE_STATE, 0);
+                        NV2A_DPRINTF("pb RET 0x%x\n", dma_get_v);
+                    }
+                } else if ((word & 0xe0030003) == 0) {
+                    /* increasing methods */
+                    SET_MASK(s.dma_state, NV_PFIFO_CACHE1_DMA_STATE_METHOD,
+                             (word & 0x1fff) >> 2 );
+                    SET_MASK(s.dma_state, NV_PFIFO_CACHE1_DMA_STATE_SUBCHANNEL,
+                             (word >> 13) & 7);
+                    SET_MASK(s.dma_state,
+                             NV_PFIFO_CACHE1_DMA_STATE_METHOD_COUNT,
+                             (word >> 18) & 0x7ff);
+                    SET_MASK(s.dma_state, NV_PFIFO_CACHE1_DMA_STATE_METHOD_TYPE,
+                             NV_PFIFO_CACHE1_DMA_STATE_METHOD_TYPE_INC);
+                    s.dma_dcount = 0;
+                } else if ((word & 0xe0030003) == 0x40000000) {
+                    /* non-increasing methods */
+                    SET_MASK(s.dma_state, NV_PFIFO_CACHE1_DMA_STATE_METHOD,
+                             (word & 0x1fff) >> 2 );
+                    SET_MASK(s.dma_state, NV_PFIFO_CACHE1_DMA_STATE_SUBCHANNEL,
+                             (word >> 13) & 7);
+                    SET_MASK(s.dma_state,
+                             NV_PFIFO_CACHE1_DMA_STATE_METHOD_COUNT,
+                             (word >> 18) & 0x7ff);
+                    SET_MASK(s.dma_state, NV_PFIFO_CACHE1_DMA_STATE_METHOD_TYPE,
+                             NV_PFIFO_CACHE1_DMA_STATE_METHOD_TYPE_NON_INC);
+                    s.dma_dcount = 0;
+                } else {
+                    NV2A_DPRINTF("pb reserved cmd 0x%x - 0x%x\n",
+                                 dma_get_v, word);
+                    SET_MASK(s.dma_state, NV_PFIFO_CACHE1_DMA_STATE_ERROR,
+                             NV_PFIFO_CACHE1_DMA_STATE_ERROR_RESERVED_CMD);
+                    // break;
+                    assert(false);
+                }
+            }
+
+            s.dma_get = dma_get_v;
 
-            ssize_t num_words_processed =
-                pfifo_run_puller(d, method_entry, word, word_ptr,
-                                 MIN(method_count, num_words_available),
-                                 num_words_available);
-            if (num_words_processed < 0) {
+            if (GET_MASK(s.dma_state, NV_PFIFO_CACHE1_DMA_STATE_ERROR)) {
                 break;
             }
+        }
 
-            dma_get_v += (num_words_processed-1)*4;
+        /* Hand the batch over to the puller without holding pfifo.lock */
+        bool stalled = false;
+        bool retired_any = false;
+        if (head != batch_start) {
+            qatomic_store_release(&ring->head, head);
+            *status &= ~NV_PFIFO_CACHE1_STATUS_LOW_MARK;
 
-            if (method_type == NV_PFIFO_CACHE1_DMA_STATE_METHOD_TYPE_INC) {
-                SET_MASK(*dma_state, NV_PFIFO_CACHE1_DMA_STATE_METHOD,
-                         (method + 4*num_words_processed) >> 2);
-            }
-            SET_MASK(*dma_state, NV_PFIFO_CACHE1_DMA_STATE_METHOD_COUNT,
-                     method_count - MIN(method_count, num_words_processed));
+            qemu_mutex_unlock(&d->pfifo.lock);
+            pfifo_run_puller(d);
+            qemu_mutex_lock(&d->pfifo.lock);
 
-            (*dma_dcount) += num_words_processed;
-        } else {
-            /* no command active - this is the first word of a new one */
-            d->pfifo.regs[NV_PFIFO_CACHE1_DMA_RSVD_SHADOW] = word;
-
-            /* match all forms */
-            if ((word & 0xe0000003) == 0x20000000) {
-                /* old jump */
-                d->pfifo.regs[NV_PFIFO_CACHE1_DMA_GET_JMP_SHADOW] =
-                    dma_get_v;
-                dma_get_v = word & 0x1fffffff;
-                NV2A_DPRINTF("pb OLD_JMP 0x%x\n", dma_get_v);
-            } else if ((word & 3) == 1) {
-                /* jump */
-                d->pfifo.regs[NV_PFIFO_CACHE1_DMA_GET_JMP_SHADOW] =
-                    dma_get_v;
-                dma_get_v = word & 0xfffffffc;
-                NV2A_DPRINTF("pb JMP 0x%x\n", dma_get_v);
-            } else if ((word & 3) == 2) {
-                /* call */
-                if (subroutine_state) {
-                    SET_MASK(*dma_state, NV_PFIFO_CACHE1_DMA_STATE_ERROR,
-                             NV_PFIFO_CACHE1_DMA_STATE_ERROR_CALL);
+            assert(qatomic_load_acquire(&ring->tail) == head);
+
+            for (unsigned int i = batch_start; i != head; i++) {
+                PFIFOCommand *cmd = &ring->cmds[i & (NV2A_PFIFO_RING_SIZE - 1)];
+                if (cmd->num_words_processed < 0) {
+                    s = cmd->resume;
+                    stalled = true;
                     break;
-                } else {
-                    *dma_subroutine = dma_get_v;
-                    SET_MASK(*dma_subroutine,
-                             NV_PFIFO_CACHE1_DMA_SUBROUTINE_STATE, 1);
-                    dma_get_v = word & 0xfffffffc;
-                    NV2A_DPRINTF("pb CALL 0x%x\n", dma_get_v);
                 }
-            } else if (word == 0x00020000) {
-                /* return */
-                if (!subroutine_state) {
-                    SET_MASK(*dma_state, NV_PFIFO_CACHE1_DMA_STATE_ERROR,
-                             NV_PFIFO_CACHE1_DMA_STATE_ERROR_RETURN);
-                    // break;
-                } else {
-                    dma_get_v = *dma_subroutine & 0xfffffffc;
-                    SET_MASK(*dma_subroutine,
-                             NV_PFIFO_CACHE1_DMA_SUBROUTINE_STATE, 0);
-                    NV2A_DPRINTF("pb RET 0x%x\n", dma_get_v);
+                retired_any = true;
+                if (cmd->resync) {
+                    s = cmd->resume;
+                    pfifo_pusher_retire_words(&s, cmd->num_words_processed);
+                    break;
                 }
-            } else if ((word & 0xe0030003) == 0) {
-                /* increasing methods */
-                SET_MASK(*dma_state, NV_PFIFO_CACHE1_DMA_STATE_METHOD,
-                         (word & 0x1fff) >> 2 );
-                SET_MASK(*dma_state, NV_PFIFO_CACHE1_DMA_STATE_SUBCHANNEL,
-                         (word >> 13) & 7);
-                SET_MASK(*dma_state, NV_PFIFO_CACHE1_DMA_STATE_METHOD_COUNT,
-                         (word >> 18) & 0x7ff);
-                SET_MASK(*dma_state, NV_PFIFO_CACHE1_DMA_STATE_METHOD_TYPE,
-                         NV_PFIFO_CACHE1_DMA_STATE_METHOD_TYPE_INC);
-                *dma_dcount = 0;
-            } else if ((word & 0xe0030003) == 0x40000000) {
-                /* non-increasing methods */
-                SET_MASK(*dma_state, NV_PFIFO_CACHE1_DMA_STATE_METHOD,
-                         (word & 0x1fff) >> 2 );
-                SET_MASK(*dma_state, NV_PFIFO_CACHE1_DMA_STATE_SUBCHANNEL,
-                         (word >> 13) & 7);
-                SET_MASK(*dma_state, NV_PFIFO_CACHE1_DMA_STATE_METHOD_COUNT,
-                         (word >> 18) & 0x7ff);
-                SET_MASK(*dma_state, NV_PFIFO_CACHE1_DMA_STATE_METHOD_TYPE,
-                         NV_PFIFO_CACHE1_DMA_STATE_METHOD_TYPE_NON_INC);
-                *dma_dcount = 0;
-            } else {
-                NV2A_DPRINTF("pb reserved cmd 0x%x - 0x%x\n",
-                             dma_get_v, word);
-                SET_MASK(*dma_state, NV_PFIFO_CACHE1_DMA_STATE_ERROR,
-                         NV_PFIFO_CACHE1_DMA_STATE_ERROR_RESERVED_CMD);
-                // break;
-                assert(false);
+            }
+
+            if (retired_any) {
+                *status |= NV_PFIFO_CACHE1_STATUS_LOW_MARK;
             }
         }
 
-        *dma_get = dma_get_v;
+        *dma_get = s.dma_get;
+        *dma_state = s.dma_state;
+        *dma_subroutine = s.dma_subroutine;
+        *dma_dcount = s.dma_dcount;
 
-        if (GET_MASK(*dma_state, NV_PFIFO_CACHE1_DMA_STATE_ERROR)) {
+        if (stalled || blocked ||
+            GET_MASK(*dma_state, NV_PFIFO_CACHE1_DMA_STATE_ERROR)) {
             break;
         }
     }
@@ -451,7 +612,8 @@ static void process_requests(NV2AState *d)
     if (qatomic_read(&d->pgraph.downloads_pending) ||
         qatomic_read(&d->pgraph.download_dirty_surfaces_pending) ||
         qatomic_read(&d->pgraph.gl_sync_pending) ||
-        qatomic_read(&d->pgraph.flush_pending)) {
+        qatomic_read(&d->pgraph.flush_pending) ||
+        qatomic_read(&d->pgraph.reports_pending)) {
         qemu_mutex_unlock(&d->pfifo.lock);
         qemu_mutex_lock(&d->pgraph.lock);
         if (qatomic_read(&d->pgraph.downloads_pending)) {
@@ -466,6 +628,9 @@ static void process_requests(NV2AState *d)
         if (qatomic_read(&d->pgraph.flush_pending)) {
             pgraph_flush(d);
         }
+        if (qatomic_read(&d->pgraph.reports_pending)) {
+            pgraph_process_pending_reports(d);
+        }
         qemu_mutex_unlock(&d->pgraph.lock);
         qemu_mutex_lock(&d->pfifo.lock);
     }
@@ -484,7 +649,12 @@ void *pfifo_thread(void *arg)
 
         process_requests(d);
 
-        if (!d->pfifo.halt) {
+        if (d->replay.active) {
+            nv2a_replay_run_frame(d);
+            if (d->replay.active) {
+                d->pfifo.fifo_kick = true;
+            }
+        } else if (!d->pfifo.halt) {
             pfifo_run_pusher(d);
         }
 
@@ -492,7 +662,12 @@ void *pfifo_thread(void *arg)
             qemu_cond_broadcast(&d->pfifo.fifo_idle_cond);
 
             // Both the pusher and puller are waiting for some action
-            qemu_cond_wait(&d->pfifo.fifo_cond, &d->pfifo.lock);
+            if (qatomic_read(&d->pgraph.reports_pending)) {
+                /* The guest may be spinning on a report, keep polling */
+                qemu_cond_timedwait(&d->pfifo.fifo_cond, &d->pfifo.lock, 1);
+            } else {
+                qemu_cond_wait(&d->pfifo.fifo_cond, &d->pfifo.lock);
+            }
         }
 
         if (d->exiting) {
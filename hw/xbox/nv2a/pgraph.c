@@ -20,9 +20,10 @@
  */
 
 #include "nv2a_int.h"
-#include "s3tc.h"
 #include "ui/xemu-settings.h"
+#include "xemu-xbe.h"
 #include "qemu/fast-hash.h"
+#include "s3tc.h"
 
 #define DBG_SURFACES 0
 #define DBG_SURFACE_SYNC 0
@@ -30,6 +31,7 @@
 static NV2AState *g_nv2a;
 GloContext *g_nv2a_context_render;
 GloContext *g_nv2a_context_display;
+GloContext *g_nv2a_context_shader_compile[SHADER_COMPILE_THREADS];
 
 NV2AStats g_nv2a_stats;
 
@@ -67,11 +69,6 @@ static void nv2a_profile_flip_stall(void)
     memset(&g_nv2a_stats.frame_working, 0, sizeof(g_nv2a_stats.frame_working));
 }
 
-static void nv2a_profile_inc_counter(enum NV2A_PROF_COUNTERS_ENUM cnt)
-{
-    g_nv2a_stats.frame_working.counters[cnt] += 1;
-}
-
 const char *nv2a_profile_get_counter_name(unsigned int cnt)
 {
     const char *default_names[NV2A_PROF__COUNT] = {
@@ -326,6 +323,10 @@ static const ColorFormatInfo kelvin_color_format_map[66] = {
         {4, true, GL_RGBA8, GL_RGBA, GL_UNSIGNED_INT_8_8_8_8}
 };
 
+/* Raw indices of paletted textures looked up in the fragment shader */
+static const ColorFormatInfo kelvin_indexed_color_format =
+    {1, false, GL_R8, GL_RED, GL_UNSIGNED_BYTE};
+
 static const SurfaceFormatInfo kelvin_surface_color_format_map[] = {
     [NV097_SET_SURFACE_FORMAT_COLOR_LE_X1R5G5B5_Z1R5G5B5] =
         {2, GL_RGB5_A1, GL_BGRA, GL_UNSIGNED_SHORT_1_5_5_5_REV, GL_COLOR_ATTACHMENT0},
@@ -360,14 +361,21 @@ static const SurfaceFormatInfo kelvin_surface_zeta_int_format_map[] = {
 
 // static void pgraph_set_context_user(NV2AState *d, uint32_t val);
 static void pgraph_gl_fence(void);
+static void pgraph_complete_reports(NV2AState *d, bool wait);
+static void pgraph_discard_reports(PGRAPHState *pg);
 static GLuint pgraph_compile_shader(const char *vs_src, const char *fs_src);
 static void pgraph_init_render_to_texture(NV2AState *d);
+static void pgraph_init_swizzle_renderer(NV2AState *d);
+static void pgraph_init_blit_renderer(NV2AState *d);
 static void pgraph_init_display_renderer(NV2AState *d);
 static void pgraph_method_log(unsigned int subchannel, unsigned int graphics_class, unsigned int method, uint32_t parameter);
 static void pgraph_allocate_inline_buffer_vertices(PGRAPHState *pg, unsigned int attr);
 static void pgraph_finish_inline_buffer_vertex(PGRAPHState *pg);
+static void pgraph_init_constant_buffers(PGRAPHState *pg);
+static void pgraph_mark_transform_constants_dirty(PGRAPHState *pg);
 static void pgraph_shader_update_constants(PGRAPHState *pg, ShaderBinding *binding, bool binding_changed, bool vertex_program, bool fixed_function);
 static void pgraph_bind_shaders(PGRAPHState *pg);
+static void pgraph_update_shader_disk_cache_title(PGRAPHState *pg);
 static bool pgraph_framebuffer_dirty(PGRAPHState *pg);
 static bool pgraph_color_write_enabled(PGRAPHState *pg);
 static bool pgraph_zeta_write_enabled(PGRAPHState *pg);
@@ -379,8 +387,11 @@ static SurfaceBinding *pgraph_surface_get(NV2AState *d, hwaddr addr);
 static SurfaceBinding *pgraph_surface_get_within(NV2AState *d, hwaddr addr);
 static void pgraph_unbind_surface(NV2AState *d, bool color);
 static void pgraph_surface_invalidate(NV2AState *d, SurfaceBinding *e);
+static void pgraph_surface_update_access_callbacks(NV2AState *d, SurfaceBinding *added);
 static void pgraph_surface_evict_old(NV2AState *d);
 static void pgraph_download_surface_data_if_dirty(NV2AState *d, SurfaceBinding *surface);
+static void pgraph_surface_download_begin_if_dirty(NV2AState *d, SurfaceBinding *surface);
+static void pgraph_surface_download_cancel(SurfaceBinding *surface);
 static void pgraph_download_surface_data(NV2AState *d, SurfaceBinding *surface, bool force);
 static void pgraph_download_surface_data_to_buffer(NV2AState *d,
                                                    SurfaceBinding *surface,
@@ -391,23 +402,32 @@ static void pgraph_upload_surface_data(NV2AState *d, SurfaceBinding *surface, bo
 static bool pgraph_check_surface_compatibility(SurfaceBinding *s1, SurfaceBinding *s2, bool strict);
 static bool pgraph_check_surface_to_texture_compatibility(SurfaceBinding *surface, TextureShape *shape);
 static void pgraph_render_surface_to_texture(NV2AState *d, SurfaceBinding *surface, TextureBinding *texture, TextureShape *texture_shape, int texture_unit);
+static void pgraph_image_blit(NV2AState *d);
 static void pgraph_update_surface_part(NV2AState *d, bool upload, bool color);
 static void pgraph_update_surface(NV2AState *d, bool upload, bool color_write, bool zeta_write);
 static void pgraph_bind_textures(NV2AState *d);
+static bool pgraph_texture_palette_in_shader(unsigned int color_format, bool cubemap, unsigned int dimensionality);
+static bool pgraph_texture_volume_as_array(PGRAPHState *pg, unsigned int color_format, bool cubemap, unsigned int dimensionality);
+static bool pgraph_probe_compressed_volume_arrays(void);
+static uint8_t pgraph_texture_shader_filter(uint32_t filter);
+static void pgraph_init_palette_textures(PGRAPHState *pg);
+static void pgraph_bind_texture_palette(PGRAPHState *pg, int i, const uint8_t *palette_data, unsigned int palette_length);
 static void pgraph_apply_anti_aliasing_factor(PGRAPHState *pg, unsigned int *width, unsigned int *height);
 static void pgraph_apply_scaling_factor(PGRAPHState *pg, unsigned int *width, unsigned int *height);
 static void pgraph_get_surface_dimensions(PGRAPHState *pg, unsigned int *width, unsigned int *height);
-static void pgraph_update_memory_buffer(NV2AState *d, hwaddr addr, hwaddr size, bool quick);
+static void pgraph_init_memory_buffer(NV2AState *d);
+static void pgraph_init_stream_buffer(PGRAPHState *pg);
+static GLintptr pgraph_stream_buffer_upload(PGRAPHState *pg, const void *data, size_t size);
+static GLintptr pgraph_stream_buffer_alloc(PGRAPHState *pg, size_t size, void **ptr);
+static void pgraph_stream_buffer_commit(PGRAPHState *pg, GLintptr offset, size_t size);
+static void pgraph_sync_memory_buffer(NV2AState *d);
+static void pgraph_update_memory_buffer(NV2AState *d, hwaddr addr, hwaddr end);
 static void pgraph_bind_vertex_attributes(NV2AState *d, unsigned int min_element, unsigned int max_element, bool inline_data, unsigned int inline_stride);
 static unsigned int pgraph_bind_inline_array(NV2AState *d);
+static GLintptr pgraph_bind_inline_elements(PGRAPHState *pg);
 static float convert_f16_to_float(uint16_t f16);
 static float convert_f24_to_float(uint32_t f24);
-static uint8_t cliptobyte(int x);
-static void convert_yuy2_to_rgb(const uint8_t *line, unsigned int ix, uint8_t *r, uint8_t *g, uint8_t* b);
-static void convert_uyvy_to_rgb(const uint8_t *line, unsigned int ix, uint8_t *r, uint8_t *g, uint8_t* b);
-static uint8_t* convert_texture_data(const TextureShape s, const uint8_t *data, const uint8_t *palette_data, unsigned int width, unsigned int height, unsigned int depth, unsigned int row_pitch, unsigned int slice_pitch);
-static void upload_gl_texture(GLenum gl_target, const TextureShape s, const uint8_t *texture_data, const uint8_t *palette_data);
-static TextureBinding* generate_texture(const TextureShape s, const uint8_t *texture_data, const uint8_t *palette_data);
+static TextureBinding* generate_texture(PGRAPHState *pg, const TextureShape s, const uint8_t *texture_data, const uint8_t *palette_data);
 static void texture_binding_destroy(gpointer data);
 static void texture_cache_entry_init(Lru *lru, LruNode *node, void *key);
 static void texture_cache_entry_post_evict(Lru *lru, LruNode *node);
@@ -428,8 +448,6 @@ static bool vertex_cache_entry_compare(Lru *lru, LruNode *node, void *key)
 
 static void pgraph_mark_textures_possibly_dirty(NV2AState *d, hwaddr addr, hwaddr size);
 static bool pgraph_check_texture_dirty(NV2AState *d, hwaddr addr, hwaddr size);
-static guint shader_hash(gconstpointer key);
-static gboolean shader_equal(gconstpointer a, gconstpointer b);
 static unsigned int kelvin_map_stencil_op(uint32_t parameter);
 static unsigned int kelvin_map_polygon_mode(uint32_t parameter);
 static unsigned int kelvin_map_texgen(uint32_t parameter, unsigned int channel);
@@ -525,6 +543,10 @@ void pgraph_write(void *opaque, hwaddr addr, uint64_t val, unsigned int size)
     qemu_mutex_lock(&d->pfifo.lock); // FIXME: Factor out fifo lock here
     qemu_mutex_lock(&pg->lock);
 
+    if (d->capture.file) {
+        nv2a_capture_pgraph_write(d, addr, val);
+    }
+
     switch (addr) {
     case NV_PGRAPH_INTR:
         pg->pending_interrupts &= ~val;
@@ -629,12 +651,16 @@ void pgraph_flush(NV2AState *d)
     QTAILQ_FOREACH_SAFE(s, &d->pgraph.surfaces, entry, next) {
         pgraph_surface_invalidate(d, s);
     }
+    pgraph_surface_update_access_callbacks(d, NULL);
 
     pgraph_mark_textures_possibly_dirty(d, 0, memory_region_size(d->vram));
+    pgraph_mark_transform_constants_dirty(pg);
+
+    /* Guest memory has been restored or reset under any queued reports */
+    pgraph_discard_reports(pg);
 
     /* Sync all RAM */
-    glBindBuffer(GL_ARRAY_BUFFER, d->pgraph.gl_memory_buffer);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, memory_region_size(d->vram), d->vram_ptr);
+    pgraph_sync_memory_buffer(d);
 
     /* FIXME: Flush more? */
 
@@ -741,6 +767,263 @@ static const MethodFunc pgraph_kelvin_method_handlers[0x800] = {
     } \
     *num_words_consumed = param_iter;
 
+/* Fixed-function caps tracked in GLStateShadow::caps */
+static unsigned int pgraph_gl_cap_index(GLenum cap)
+{
+    switch (cap) {
+    case GL_BLEND:                return 0;
+    case GL_CULL_FACE:            return 1;
+    case GL_POLYGON_OFFSET_FILL:  return 2;
+    case GL_POLYGON_OFFSET_LINE:  return 3;
+    case GL_POLYGON_OFFSET_POINT: return 4;
+    case GL_DEPTH_TEST:           return 5;
+    case GL_STENCIL_TEST:         return 6;
+    case GL_DITHER:               return 7;
+    case GL_PROGRAM_POINT_SIZE:   return 8;
+    case GL_LINE_SMOOTH:          return 9;
+    case GL_POLYGON_SMOOTH:       return 10;
+    case GL_SCISSOR_TEST:         return 11;
+    default:
+        assert(!"Unshadowed GL capability");
+        return 0;
+    }
+}
+
+/* Forget everything about the render context, e.g. after it was set up */
+static void pgraph_gl_state_invalidate(PGRAPHState *pg)
+{
+    /* All ones never matches a real value: not a GLboolean, enum or size */
+    memset(&pg->gl_state, 0xff, sizeof(pg->gl_state));
+    pg->gl_state.caps_known = 0;
+}
+
+static bool pgraph_gl_state_changed(bool changed)
+{
+    nv2a_profile_inc_counter(changed ? NV2A_PROF_GL_STATE_CALLS
+                                     : NV2A_PROF_GL_STATE_SKIPPED);
+    return changed;
+}
+
+static void pgraph_gl_set_enabled(PGRAPHState *pg, GLenum cap, bool enable)
+{
+    GLStateShadow *s = &pg->gl_state;
+    uint32_t bit = 1 << pgraph_gl_cap_index(cap);
+
+    if (!pgraph_gl_state_changed(!(s->caps_known & bit) ||
+                                 !!(s->caps & bit) != enable)) {
+        return;
+    }
+
+    if (enable) {
+        glEnable(cap);
+        s->caps |= bit;
+    } else {
+        glDisable(cap);
+        s->caps &= ~bit;
+    }
+    s->caps_known |= bit;
+}
+
+static void pgraph_gl_color_mask(PGRAPHState *pg, bool red, bool green,
+                                 bool blue, bool alpha)
+{
+    GLStateShadow *s = &pg->gl_state;
+    GLboolean mask[4] = { red, green, blue, alpha };
+
+    if (pgraph_gl_state_changed(memcmp(s->color_mask, mask, sizeof(mask)))) {
+        glColorMask(red, green, blue, alpha);
+        memcpy(s->color_mask, mask, sizeof(mask));
+    }
+}
+
+static void pgraph_gl_active_texture(PGRAPHState *pg, GLenum texture)
+{
+    if (pgraph_gl_state_changed(pg->gl_state.active_texture != texture)) {
+        glActiveTexture(texture);
+        pg->gl_state.active_texture = texture;
+    }
+}
+
+static void pgraph_gl_depth_mask(PGRAPHState *pg, bool enable)
+{
+    if (pgraph_gl_state_changed(pg->gl_state.depth_mask != enable)) {
+        glDepthMask(enable);
+        pg->gl_state.depth_mask = enable;
+    }
+}
+
+static void pgraph_gl_stencil_mask(PGRAPHState *pg, GLuint mask)
+{
+    if (pgraph_gl_state_changed(pg->gl_state.stencil_mask != mask)) {
+        glStencilMask(mask);
+        pg->gl_state.stencil_mask = mask;
+    }
+}
+
+static void pgraph_gl_blend_func(PGRAPHState *pg, GLenum sfactor,
+                                 GLenum dfactor)
+{
+    GLStateShadow *s = &pg->gl_state;
+
+    if (pgraph_gl_state_changed(s->blend_sfactor != sfactor ||
+                                s->blend_dfactor != dfactor)) {
+        glBlendFunc(sfactor, dfactor);
+        s->blend_sfactor = sfactor;
+        s->blend_dfactor = dfactor;
+    }
+}
+
+static void pgraph_gl_blend_equation(PGRAPHState *pg, GLenum equation)
+{
+    if (pgraph_gl_state_changed(pg->gl_state.blend_equation != equation)) {
+        glBlendEquation(equation);
+        pg->gl_state.blend_equation = equation;
+    }
+}
+
+/* Takes the NV_PGRAPH_BLENDCOLOR register value */
+static void pgraph_gl_blend_color(PGRAPHState *pg, uint32_t blend_color)
+{
+    if (pgraph_gl_state_changed(pg->gl_state.blend_color != blend_color)) {
+        glBlendColor( ((blend_color >> 16) & 0xFF) / 255.0f, /* red */
+                      ((blend_color >> 8) & 0xFF) / 255.0f,  /* green */
+                      (blend_color & 0xFF) / 255.0f,         /* blue */
+                      ((blend_color >> 24) & 0xFF) / 255.0f);/* alpha */
+        pg->gl_state.blend_color = blend_color;
+    }
+}
+
+static void pgraph_gl_cull_face(PGRAPHState *pg, GLenum mode)
+{
+    if (pgraph_gl_state_changed(pg->gl_state.cull_face != mode)) {
+        glCullFace(mode);
+        pg->gl_state.cull_face = mode;
+    }
+}
+
+static void pgraph_gl_front_face(PGRAPHState *pg, GLenum mode)
+{
+    if (pgraph_gl_state_changed(pg->gl_state.front_face != mode)) {
+        glFrontFace(mode);
+        pg->gl_state.front_face = mode;
+    }
+}
+
+/* Takes the raw bits of the float NV_PGRAPH_ZOFFSET* registers */
+static void pgraph_gl_polygon_offset(PGRAPHState *pg, uint32_t factor,
+                                     uint32_t units)
+{
+    GLStateShadow *s = &pg->gl_state;
+
+    if (pgraph_gl_state_changed(s->polygon_offset_factor != factor ||
+                                s->polygon_offset_units != units)) {
+        glPolygonOffset(*(float *)&factor, *(float *)&units);
+        s->polygon_offset_factor = factor;
+        s->polygon_offset_units = units;
+    }
+}
+
+static void pgraph_gl_depth_func(PGRAPHState *pg, GLenum func)
+{
+    if (pgraph_gl_state_changed(pg->gl_state.depth_func != func)) {
+        glDepthFunc(func);
+        pg->gl_state.depth_func = func;
+    }
+}
+
+static void pgraph_gl_stencil_func(PGRAPHState *pg, GLenum func, GLint ref,
+                                   GLuint mask)
+{
+    GLStateShadow *s = &pg->gl_state;
+
+    if (pgraph_gl_state_changed(s->stencil_func != func ||
+                                s->stencil_ref != ref ||
+                                s->stencil_func_mask != mask)) {
+        glStencilFunc(func, ref, mask);
+        s->stencil_func = func;
+        s->stencil_ref = ref;
+        s->stencil_func_mask = mask;
+    }
+}
+
+static void pgraph_gl_stencil_op(PGRAPHState *pg, GLenum sfail, GLenum dpfail,
+                                 GLenum dppass)
+{
+    GLStateShadow *s = &pg->gl_state;
+    GLenum op[3] = { sfail, dpfail, dppass };
+
+    if (pgraph_gl_state_changed(memcmp(s->stencil_op, op, sizeof(op)))) {
+        glStencilOp(sfail, dpfail, dppass);
+        memcpy(s->stencil_op, op, sizeof(op));
+    }
+}
+
+static void pgraph_gl_viewport(PGRAPHState *pg, GLint x, GLint y,
+                               GLsizei width, GLsizei height)
+{
+    GLStateShadow *s = &pg->gl_state;
+    GLint viewport[4] = { x, y, width, height };
+
+    if (pgraph_gl_state_changed(memcmp(s->viewport, viewport,
+                                       sizeof(viewport)))) {
+        glViewport(x, y, width, height);
+        memcpy(s->viewport, viewport, sizeof(viewport));
+    }
+}
+
+static void pgraph_gl_scissor(PGRAPHState *pg, GLint x, GLint y,
+                              GLsizei width, GLsizei height)
+{
+    GLStateShadow *s = &pg->gl_state;
+    GLint scissor[4] = { x, y, width, height };
+
+    if (pgraph_gl_state_changed(memcmp(s->scissor, scissor,
+                                       sizeof(scissor)))) {
+        glScissor(x, y, width, height);
+        memcpy(s->scissor, scissor, sizeof(scissor));
+    }
+}
+
+#ifdef DEBUG_NV2A_GL_VALIDATE
+/* Catches GL state changed behind the shadow's back */
+static void pgraph_gl_state_validate(PGRAPHState *pg)
+{
+    static const GLenum caps[] = {
+        GL_BLEND, GL_CULL_FACE, GL_POLYGON_OFFSET_FILL,
+        GL_POLYGON_OFFSET_LINE, GL_POLYGON_OFFSET_POINT, GL_DEPTH_TEST,
+        GL_STENCIL_TEST, GL_DITHER, GL_PROGRAM_POINT_SIZE, GL_LINE_SMOOTH,
+        GL_POLYGON_SMOOTH, GL_SCISSOR_TEST,
+    };
+    GLStateShadow *s = &pg->gl_state;
+    GLboolean color_mask[4], depth_mask;
+    GLint value, rect[4];
+
+    for (int i = 0; i < ARRAY_SIZE(caps); i++) {
+        uint32_t bit = 1 << pgraph_gl_cap_index(caps[i]);
+        if (s->caps_known & bit) {
+            assert(!!glIsEnabled(caps[i]) == !!(s->caps & bit));
+        }
+    }
+
+    glGetBooleanv(GL_COLOR_WRITEMASK, color_mask);
+    assert(s->color_mask[0] == 0xff ||
+           !memcmp(color_mask, s->color_mask, sizeof(color_mask)));
+    glGetBooleanv(GL_DEPTH_WRITEMASK, &depth_mask);
+    assert(s->depth_mask == 0xff || depth_mask == s->depth_mask);
+    glGetIntegerv(GL_DEPTH_FUNC, &value);
+    assert(s->depth_func == (GLenum)-1 || (GLenum)value == s->depth_func);
+    glGetIntegerv(GL_VIEWPORT, rect);
+    assert(s->viewport[2] == -1 || !memcmp(rect, s->viewport, sizeof(rect)));
+    glGetIntegerv(GL_SCISSOR_BOX, rect);
+    assert(s->scissor[2] == -1 || !memcmp(rect, s->scissor, sizeof(rect)));
+    glGetIntegerv(GL_ACTIVE_TEXTURE, &value);
+    assert(s->active_texture == (GLenum)-1 ||
+           (GLenum)value == s->active_texture);
+
+    NV2A_GL_CHECK_ERROR();
+}
+#endif
+
 int pgraph_method(NV2AState *d, unsigned int subchannel,
                    unsigned int method, uint32_t parameter,
                    uint32_t *parameters, size_t num_words_available,
@@ -748,7 +1031,7 @@ int pgraph_method(NV2AState *d, unsigned int subchannel,
 {
     int num_processed = 1;
 
-    assert(glGetError() == GL_NO_ERROR);
+    NV2A_GL_CHECK_ERROR();
 
     PGRAPHState *pg = &d->pgraph;
 
@@ -861,86 +1144,10 @@ int pgraph_method(NV2AState *d, unsigned int subchannel,
 
             pgraph_update_surface(d, false, true, true);
 
-            ContextSurfaces2DState *context_surfaces = context_surfaces_2d;
-            assert(context_surfaces->object_instance
+            assert(context_surfaces_2d->object_instance
                     == image_blit->context_surfaces);
 
-            unsigned int bytes_per_pixel;
-            switch (context_surfaces->color_format) {
-            case NV062_SET_COLOR_FORMAT_LE_Y8:
-                bytes_per_pixel = 1;
-                break;
-            case NV062_SET_COLOR_FORMAT_LE_R5G6B5:
-                bytes_per_pixel = 2;
-                break;
-            case NV062_SET_COLOR_FORMAT_LE_A8R8G8B8:
-            case NV062_SET_COLOR_FORMAT_LE_X8R8G8B8:
-            case NV062_SET_COLOR_FORMAT_LE_Y32:
-                bytes_per_pixel = 4;
-                break;
-            default:
-                fprintf(stderr, "Unknown blit surface format: 0x%x\n", context_surfaces->color_format);
-                assert(false);
-                break;
-            }
-
-            hwaddr source_dma_len, dest_dma_len;
-            uint8_t *source, *dest;
-
-            source = (uint8_t*)nv_dma_map(d, context_surfaces->dma_image_source,
-                                          &source_dma_len);
-            assert(context_surfaces->source_offset < source_dma_len);
-            source += context_surfaces->source_offset;
-
-            dest = (uint8_t*)nv_dma_map(d, context_surfaces->dma_image_dest,
-                                        &dest_dma_len);
-            assert(context_surfaces->dest_offset < dest_dma_len);
-            dest += context_surfaces->dest_offset;
-
-            NV2A_DPRINTF("  - 0x%tx -> 0x%tx\n", source - d->vram_ptr,
-                                                 dest - d->vram_ptr);
-
-
-            // FIXME: Blitting from part of a surface
-
-            SurfaceBinding *surf_src = pgraph_surface_get(d, source - d->vram_ptr);
-            if (surf_src) {
-                pgraph_download_surface_data(d, surf_src, true);
-            }
-
-            SurfaceBinding *surf_dest = pgraph_surface_get(d, dest - d->vram_ptr);
-            if (surf_dest) {
-                surf_dest->upload_pending = true;
-            }
-
-            int y;
-            for (y=0; y<image_blit->height; y++) {
-                uint8_t *source_row = source
-                    + (image_blit->in_y + y) * context_surfaces->source_pitch
-                    + image_blit->in_x * bytes_per_pixel;
-
-                uint8_t *dest_row = dest
-                    + (image_blit->out_y + y) * context_surfaces->dest_pitch
-                    + image_blit->out_x * bytes_per_pixel;
-
-                memmove(dest_row, source_row,
-                        image_blit->width * bytes_per_pixel);
-            }
-
-            memory_region_set_client_dirty(d->vram,
-                                           (dest - d->vram_ptr),
-                                           image_blit->height
-                                           * image_blit->width
-                                           * bytes_per_pixel,
-                                           DIRTY_MEMORY_VGA);
-            memory_region_set_client_dirty(d->vram,
-                                           (dest - d->vram_ptr),
-                                           image_blit->height
-                                           * image_blit->width
-                                           * bytes_per_pixel,
-                                           DIRTY_MEMORY_NV2A_TEX);
-
-
+            pgraph_image_blit(d);
         } else {
             assert(false);
         }
@@ -1024,6 +1231,11 @@ DEF_METHOD(NV097, NO_OPERATION)
     pg->regs[NV_PGRAPH_TRAPPED_DATA_LOW] = parameter;
     pg->regs[NV_PGRAPH_NSOURCE] =
         NV_PGRAPH_NSOURCE_NOTIFICATION; /* TODO: check this */
+
+    /* The guest may read reports from its handler, which must not see
+     * ones issued before this method still pending.
+     */
+    pgraph_complete_reports(d, true);
     pg->pending_interrupts |= NV_PGRAPH_INTR_ERROR;
     pg->waiting_for_nop = true;
 
@@ -1074,11 +1286,14 @@ DEF_METHOD(NV097, FLIP_INCREMENT_WRITE)
 
     NV2A_GL_DFRAME_TERMINATOR();
     pg->frame_time++;
+    pgraph_update_shader_disk_cache_title(pg);
 }
 
 DEF_METHOD(NV097, FLIP_STALL)
 {
     pgraph_update_surface(d, false, true, true);
+    /* Reports issued during the frame land before the flip completes */
+    pgraph_complete_reports(d, true);
     nv2a_profile_flip_stall();
     pg->waiting_for_flip = true;
 }
@@ -2283,7 +2498,9 @@ DEF_METHOD(NV097, CLEAR_REPORT_VALUE)
                         pg->gl_zpass_pixel_count_queries);
         pg->gl_zpass_pixel_count_query_count = 0;
     }
-    pg->zpass_pixel_count_result = 0;
+
+    /* Reports still in flight count from before the clear */
+    pg->zpass_pixel_count_clear_pending = true;
 }
 
 DEF_METHOD(NV097, SET_ZPASS_PIXEL_COUNT_ENABLE)
@@ -2302,38 +2519,28 @@ DEF_METHOD(NV097, GET_REPORT)
     assert(type == NV097_GET_REPORT_TYPE_ZPASS_PIXEL_CNT);
     hwaddr offset = GET_MASK(parameter, NV097_GET_REPORT_OFFSET);
 
-    uint64_t timestamp = 0x0011223344556677; /* FIXME: Update timestamp?! */
-    uint32_t done = 0;
-
-    /* FIXME: Multisampling affects this (both: OGL and Xbox GPU),
-     *        not sure if CLEARs also count
-     */
-    /* FIXME: What about clipping regions etc? */
-    for (int i = 0; i < pg->gl_zpass_pixel_count_query_count; i++) {
-        GLuint gl_query_result;
-        glGetQueryObjectuiv(pg->gl_zpass_pixel_count_queries[i],
-                            GL_QUERY_RESULT, &gl_query_result);
-        pg->zpass_pixel_count_result += gl_query_result;
-    }
-
-    pg->zpass_pixel_count_result /=
-        pg->surface_scale_factor * pg->surface_scale_factor;
-
-    if (pg->gl_zpass_pixel_count_query_count) {
-        glDeleteQueries(pg->gl_zpass_pixel_count_query_count,
-                        pg->gl_zpass_pixel_count_queries);
-    }
-    pg->gl_zpass_pixel_count_query_count = 0;
-
     hwaddr report_dma_len;
     uint8_t *report_data =
         (uint8_t *)nv_dma_map(d, pg->dma_report, &report_dma_len);
     assert(offset < report_dma_len);
-    report_data += offset;
 
-    stq_le_p((uint64_t *)&report_data[0], timestamp);
-    stl_le_p((uint32_t *)&report_data[8], pg->zpass_pixel_count_result);
-    stl_le_p((uint32_t *)&report_data[12], done);
+    /* Hand the queries issued so far to the report, which is written once
+     * they have all finished.
+     */
+    QueryReport *report = g_new(QueryReport, 1);
+    report->vram_addr = report_data + offset - d->vram_ptr;
+    report->clear = pg->zpass_pixel_count_clear_pending;
+    report->query_count = pg->gl_zpass_pixel_count_query_count;
+    report->queries = pg->gl_zpass_pixel_count_queries;
+    report->submit_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    QSIMPLEQ_INSERT_TAIL(&pg->report_queue, report, entry);
+    qatomic_set(&pg->reports_pending, true);
+
+    pg->zpass_pixel_count_clear_pending = false;
+    pg->gl_zpass_pixel_count_query_count = 0;
+    pg->gl_zpass_pixel_count_queries = NULL;
+
+    pgraph_complete_reports(d, qatomic_read(&pg->strict_reports));
 }
 
 DEF_METHOD(NV097, SET_EYE_DIRECTION)
@@ -2354,9 +2561,15 @@ DEF_METHOD(NV097, SET_BEGIN_END)
 
         nv2a_profile_inc_counter(NV2A_PROF_BEGIN_ENDS);
 
-        assert(pg->shader_binding);
+        assert(pg->shader_binding || pg->draw_skip);
+
+        if (pg->draw_skip) {
+            NV2A_GL_DPRINTF(false, "Skipped draw, shader still compiling");
 
-        if (pg->draw_arrays_length) {
+            for (int i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
+                pg->vertex_attributes[i].inline_buffer_populated = false;
+            }
+        } else if (pg->draw_arrays_length) {
             nv2a_profile_inc_counter(NV2A_PROF_DRAW_ARRAYS);
 
             NV2A_GL_DPRINTF(false, "Draw Arrays");
@@ -2385,25 +2598,52 @@ DEF_METHOD(NV097, SET_BEGIN_END)
                 pgraph_bind_shaders(pg);
             }
 
+            /* Interleave the populated attributes into one allocation */
+            size_t stride = 0;
+            for (int i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
+                if (pg->vertex_attributes[i].inline_buffer_populated) {
+                    stride += sizeof(float) * 4;
+                }
+            }
+
+            uint8_t *vertices = NULL;
+            GLintptr base = 0;
+            size_t size = pg->inline_buffer_length * stride;
+            if (stride) {
+                nv2a_profile_inc_counter(NV2A_PROF_GEOM_BUFFER_UPDATE_3);
+                base = pgraph_stream_buffer_alloc(pg, size,
+                                                  (void **)&vertices);
+                glBindBuffer(GL_ARRAY_BUFFER, pg->gl_stream_buffer);
+            }
+
+            size_t offset = 0;
             for (int i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
                 VertexAttribute *attr = &pg->vertex_attributes[i];
                 if (attr->inline_buffer_populated) {
-                    nv2a_profile_inc_counter(NV2A_PROF_GEOM_BUFFER_UPDATE_3);
-                    glBindBuffer(GL_ARRAY_BUFFER, attr->gl_inline_buffer);
-                    glBufferData(GL_ARRAY_BUFFER,
-                                 pg->inline_buffer_length * sizeof(float) * 4,
-                                 attr->inline_buffer, GL_STREAM_DRAW);
-                    glVertexAttribPointer(i, 4, GL_FLOAT, GL_FALSE, 0, 0);
+                    for (int v = 0; v < pg->inline_buffer_length; v++) {
+                        memcpy(vertices + v * stride + offset,
+                               &attr->inline_buffer[v * 4],
+                               sizeof(float) * 4);
+                    }
+                    glVertexAttribPointer(i, 4, GL_FLOAT, GL_FALSE, stride,
+                                          (void *)(base + offset));
                     glEnableVertexAttribArray(i);
                     attr->inline_buffer_populated = false;
+                    offset += sizeof(float) * 4;
                 } else {
                     glDisableVertexAttribArray(i);
                     glVertexAttrib4fv(i, attr->inline_value);
                 }
             }
 
-            glDrawArrays(pg->shader_binding->gl_primitive_mode,
-                         0, pg->inline_buffer_length);
+            if (stride) {
+                pgraph_stream_buffer_commit(pg, base, size);
+            }
+
+            if (!pg->draw_skip) {
+                glDrawArrays(pg->shader_binding->gl_primitive_mode,
+                             0, pg->inline_buffer_length);
+            }
         } else if (pg->inline_array_length) {
             nv2a_profile_inc_counter(NV2A_PROF_INLINE_ARRAYS);
 
@@ -2435,30 +2675,10 @@ DEF_METHOD(NV097, SET_BEGIN_END)
             pgraph_bind_vertex_attributes(
                 d, min_element, max_element, false, 0);
 
-            VertexKey k;
-            memset(&k, 0, sizeof(VertexKey));
-            k.count = pg->inline_elements_length;
-            k.gl_type = GL_UNSIGNED_INT;
-            k.gl_normalize = GL_FALSE;
-            k.stride = sizeof(uint32_t);
-            uint64_t h = fast_hash((uint8_t*)pg->inline_elements,
-                                   pg->inline_elements_length * 4);
-
-            LruNode *node = lru_lookup(&pg->element_cache, h, &k);
-            VertexLruNode *found = container_of(node, VertexLruNode, node);
-            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, found->gl_buffer);
-            if (!found->initialized) {
-                nv2a_profile_inc_counter(NV2A_PROF_GEOM_BUFFER_UPDATE_4);
-                glBufferData(GL_ELEMENT_ARRAY_BUFFER,
-                             pg->inline_elements_length * 4,
-                             pg->inline_elements, GL_STATIC_DRAW);
-                found->initialized = true;
-            } else {
-                nv2a_profile_inc_counter(NV2A_PROF_GEOM_BUFFER_UPDATE_4_NOTDIRTY);
-            }
+            GLintptr offset = pgraph_bind_inline_elements(pg);
             glDrawElements(pg->shader_binding->gl_primitive_mode,
                            pg->inline_elements_length, GL_UNSIGNED_INT,
-                           (void *)0);
+                           (void *)offset);
         } else {
             NV2A_GL_DPRINTF(true, "EMPTY NV097_SET_BEGIN_END");
             NV2A_UNCONFIRMED("EMPTY NV097_SET_BEGIN_END");
@@ -2488,34 +2708,30 @@ DEF_METHOD(NV097, SET_BEGIN_END)
         bool red = control_0 & NV_PGRAPH_CONTROL_0_RED_WRITE_ENABLE;
         bool green = control_0 & NV_PGRAPH_CONTROL_0_GREEN_WRITE_ENABLE;
         bool blue = control_0 & NV_PGRAPH_CONTROL_0_BLUE_WRITE_ENABLE;
-        glColorMask(red, green, blue, alpha);
-        glDepthMask(!!(control_0 & NV_PGRAPH_CONTROL_0_ZWRITEENABLE));
-        glStencilMask(GET_MASK(pg->regs[NV_PGRAPH_CONTROL_1],
-                               NV_PGRAPH_CONTROL_1_STENCIL_MASK_WRITE));
+        pgraph_gl_color_mask(pg, red, green, blue, alpha);
+        pgraph_gl_depth_mask(pg, control_0 & NV_PGRAPH_CONTROL_0_ZWRITEENABLE);
+        pgraph_gl_stencil_mask(pg, GET_MASK(pg->regs[NV_PGRAPH_CONTROL_1],
+                                   NV_PGRAPH_CONTROL_1_STENCIL_MASK_WRITE));
 
         if (pg->regs[NV_PGRAPH_BLEND] & NV_PGRAPH_BLEND_EN) {
-            glEnable(GL_BLEND);
+            pgraph_gl_set_enabled(pg, GL_BLEND, true);
             uint32_t sfactor = GET_MASK(pg->regs[NV_PGRAPH_BLEND],
                                         NV_PGRAPH_BLEND_SFACTOR);
             uint32_t dfactor = GET_MASK(pg->regs[NV_PGRAPH_BLEND],
                                         NV_PGRAPH_BLEND_DFACTOR);
             assert(sfactor < ARRAY_SIZE(pgraph_blend_factor_map));
             assert(dfactor < ARRAY_SIZE(pgraph_blend_factor_map));
-            glBlendFunc(pgraph_blend_factor_map[sfactor],
-                        pgraph_blend_factor_map[dfactor]);
+            pgraph_gl_blend_func(pg, pgraph_blend_factor_map[sfactor],
+                                 pgraph_blend_factor_map[dfactor]);
 
             uint32_t equation = GET_MASK(pg->regs[NV_PGRAPH_BLEND],
                                          NV_PGRAPH_BLEND_EQN);
             assert(equation < ARRAY_SIZE(pgraph_blend_equation_map));
-            glBlendEquation(pgraph_blend_equation_map[equation]);
+            pgraph_gl_blend_equation(pg, pgraph_blend_equation_map[equation]);
 
-            uint32_t blend_color = pg->regs[NV_PGRAPH_BLENDCOLOR];
-            glBlendColor( ((blend_color >> 16) & 0xFF) / 255.0f, /* red */
-                          ((blend_color >> 8) & 0xFF) / 255.0f,  /* green */
-                          (blend_color & 0xFF) / 255.0f,         /* blue */
-                          ((blend_color >> 24) & 0xFF) / 255.0f);/* alpha */
+            pgraph_gl_blend_color(pg, pg->regs[NV_PGRAPH_BLENDCOLOR]);
         } else {
-            glDisable(GL_BLEND);
+            pgraph_gl_set_enabled(pg, GL_BLEND, false);
         }
 
         /* Face culling */
@@ -2524,60 +2740,50 @@ DEF_METHOD(NV097, SET_BEGIN_END)
             uint32_t cull_face = GET_MASK(pg->regs[NV_PGRAPH_SETUPRASTER],
                                           NV_PGRAPH_SETUPRASTER_CULLCTRL);
             assert(cull_face < ARRAY_SIZE(pgraph_cull_face_map));
-            glCullFace(pgraph_cull_face_map[cull_face]);
-            glEnable(GL_CULL_FACE);
+            pgraph_gl_cull_face(pg, pgraph_cull_face_map[cull_face]);
+            pgraph_gl_set_enabled(pg, GL_CULL_FACE, true);
         } else {
-            glDisable(GL_CULL_FACE);
+            pgraph_gl_set_enabled(pg, GL_CULL_FACE, false);
         }
 
         /* Front-face select */
-        glFrontFace(pg->regs[NV_PGRAPH_SETUPRASTER]
-                        & NV_PGRAPH_SETUPRASTER_FRONTFACE
-                            ? GL_CCW : GL_CW);
+        pgraph_gl_front_face(pg, pg->regs[NV_PGRAPH_SETUPRASTER]
+                                     & NV_PGRAPH_SETUPRASTER_FRONTFACE
+                                         ? GL_CCW : GL_CW);
 
         /* Polygon offset */
         /* FIXME: GL implementation-specific, maybe do this in VS? */
-        if (pg->regs[NV_PGRAPH_SETUPRASTER] &
-                NV_PGRAPH_SETUPRASTER_POFFSETFILLENABLE) {
-            glEnable(GL_POLYGON_OFFSET_FILL);
-        } else {
-            glDisable(GL_POLYGON_OFFSET_FILL);
-        }
-        if (pg->regs[NV_PGRAPH_SETUPRASTER] &
-                NV_PGRAPH_SETUPRASTER_POFFSETLINEENABLE) {
-            glEnable(GL_POLYGON_OFFSET_LINE);
-        } else {
-            glDisable(GL_POLYGON_OFFSET_LINE);
-        }
-        if (pg->regs[NV_PGRAPH_SETUPRASTER] &
-                NV_PGRAPH_SETUPRASTER_POFFSETPOINTENABLE) {
-            glEnable(GL_POLYGON_OFFSET_POINT);
-        } else {
-            glDisable(GL_POLYGON_OFFSET_POINT);
-        }
+        pgraph_gl_set_enabled(pg, GL_POLYGON_OFFSET_FILL,
+                              pg->regs[NV_PGRAPH_SETUPRASTER] &
+                                  NV_PGRAPH_SETUPRASTER_POFFSETFILLENABLE);
+        pgraph_gl_set_enabled(pg, GL_POLYGON_OFFSET_LINE,
+                              pg->regs[NV_PGRAPH_SETUPRASTER] &
+                                  NV_PGRAPH_SETUPRASTER_POFFSETLINEENABLE);
+        pgraph_gl_set_enabled(pg, GL_POLYGON_OFFSET_POINT,
+                              pg->regs[NV_PGRAPH_SETUPRASTER] &
+                                  NV_PGRAPH_SETUPRASTER_POFFSETPOINTENABLE);
         if (pg->regs[NV_PGRAPH_SETUPRASTER] &
                 (NV_PGRAPH_SETUPRASTER_POFFSETFILLENABLE |
                  NV_PGRAPH_SETUPRASTER_POFFSETLINEENABLE |
                  NV_PGRAPH_SETUPRASTER_POFFSETPOINTENABLE)) {
-            GLfloat zfactor = *(float*)&pg->regs[NV_PGRAPH_ZOFFSETFACTOR];
-            GLfloat zbias = *(float*)&pg->regs[NV_PGRAPH_ZOFFSETBIAS];
-            glPolygonOffset(zfactor, zbias);
+            pgraph_gl_polygon_offset(pg, pg->regs[NV_PGRAPH_ZOFFSETFACTOR],
+                                     pg->regs[NV_PGRAPH_ZOFFSETBIAS]);
         }
 
         /* Depth testing */
         if (depth_test) {
-            glEnable(GL_DEPTH_TEST);
+            pgraph_gl_set_enabled(pg, GL_DEPTH_TEST, true);
 
             uint32_t depth_func = GET_MASK(pg->regs[NV_PGRAPH_CONTROL_0],
                                            NV_PGRAPH_CONTROL_0_ZFUNC);
             assert(depth_func < ARRAY_SIZE(pgraph_depth_func_map));
-            glDepthFunc(pgraph_depth_func_map[depth_func]);
+            pgraph_gl_depth_func(pg, pgraph_depth_func_map[depth_func]);
         } else {
-            glDisable(GL_DEPTH_TEST);
+            pgraph_gl_set_enabled(pg, GL_DEPTH_TEST, false);
         }
 
         if (stencil_test) {
-            glEnable(GL_STENCIL_TEST);
+            pgraph_gl_set_enabled(pg, GL_STENCIL_TEST, true);
 
             uint32_t stencil_func = GET_MASK(pg->regs[NV_PGRAPH_CONTROL_1],
                                         NV_PGRAPH_CONTROL_1_STENCIL_FUNC);
@@ -2597,44 +2803,35 @@ DEF_METHOD(NV097, SET_BEGIN_END)
             assert(op_zfail < ARRAY_SIZE(pgraph_stencil_op_map));
             assert(op_zpass < ARRAY_SIZE(pgraph_stencil_op_map));
 
-            glStencilFunc(
+            pgraph_gl_stencil_func(pg,
                 pgraph_stencil_func_map[stencil_func],
                 stencil_ref,
                 func_mask);
 
-            glStencilOp(
+            pgraph_gl_stencil_op(pg,
                 pgraph_stencil_op_map[op_fail],
                 pgraph_stencil_op_map[op_zfail],
                 pgraph_stencil_op_map[op_zpass]);
 
         } else {
-            glDisable(GL_STENCIL_TEST);
+            pgraph_gl_set_enabled(pg, GL_STENCIL_TEST, false);
         }
 
         /* Dither */
         /* FIXME: GL implementation dependent */
-        if (pg->regs[NV_PGRAPH_CONTROL_0] &
-                NV_PGRAPH_CONTROL_0_DITHERENABLE) {
-            glEnable(GL_DITHER);
-        } else {
-            glDisable(GL_DITHER);
-        }
+        pgraph_gl_set_enabled(pg, GL_DITHER,
+                              pg->regs[NV_PGRAPH_CONTROL_0] &
+                                  NV_PGRAPH_CONTROL_0_DITHERENABLE);
 
-        glEnable(GL_PROGRAM_POINT_SIZE);
+        pgraph_gl_set_enabled(pg, GL_PROGRAM_POINT_SIZE, true);
 
         /* Edge Antialiasing */
-        if (pg->regs[NV_PGRAPH_SETUPRASTER] &
-                NV_PGRAPH_SETUPRASTER_LINESMOOTHENABLE) {
-            glEnable(GL_LINE_SMOOTH);
-        } else {
-            glDisable(GL_LINE_SMOOTH);
-        }
-        if (pg->regs[NV_PGRAPH_SETUPRASTER] &
-                NV_PGRAPH_SETUPRASTER_POLYSMOOTHENABLE) {
-            glEnable(GL_POLYGON_SMOOTH);
-        } else {
-            glDisable(GL_POLYGON_SMOOTH);
-        }
+        pgraph_gl_set_enabled(pg, GL_LINE_SMOOTH,
+                              pg->regs[NV_PGRAPH_SETUPRASTER] &
+                                  NV_PGRAPH_SETUPRASTER_LINESMOOTHENABLE);
+        pgraph_gl_set_enabled(pg, GL_POLYGON_SMOOTH,
+                              pg->regs[NV_PGRAPH_SETUPRASTER] &
+                                  NV_PGRAPH_SETUPRASTER_POLYSMOOTHENABLE);
 
         //glDisableVertexAttribArray(NV2A_VERTEX_ATTR_DIFFUSE);
         //glVertexAttrib4f(NV2A_VERTEX_ATTR_DIFFUSE, 1.0, 1.0, 1.0, 1.0);
@@ -2642,7 +2839,7 @@ DEF_METHOD(NV097, SET_BEGIN_END)
         unsigned int vp_width = pg->surface_binding_dim.width,
                      vp_height = pg->surface_binding_dim.height;
         pgraph_apply_scaling_factor(pg, &vp_width, &vp_height);
-        glViewport(0, 0, vp_width, vp_height);
+        pgraph_gl_viewport(pg, 0, 0, vp_width, vp_height);
 
         /* Surface clip */
         /* FIXME: Consider moving to PSH w/ window clip */
@@ -2659,8 +2856,12 @@ DEF_METHOD(NV097, SET_BEGIN_END)
         pgraph_apply_scaling_factor(pg, &xmin, &ymin);
         pgraph_apply_scaling_factor(pg, &scissor_width, &scissor_height);
 
-        glEnable(GL_SCISSOR_TEST);
-        glScissor(xmin, ymin, scissor_width, scissor_height);
+        pgraph_gl_set_enabled(pg, GL_SCISSOR_TEST, true);
+        pgraph_gl_scissor(pg, xmin, ymin, scissor_width, scissor_height);
+
+#ifdef DEBUG_NV2A_GL_VALIDATE
+        pgraph_gl_state_validate(pg);
+#endif
 
         pg->inline_elements_length = 0;
         pg->inline_array_length = 0;
@@ -2990,6 +3191,12 @@ DEF_METHOD(NV097, BACK_END_WRITE_SEMAPHORE_RELEASE)
     //qemu_mutex_unlock(&d->pgraph.lock);
     //qemu_mutex_lock_iothread();
 
+    /* Hardware writes reports in command order, so a guest waiting on this
+     * semaphore may read any issued before it. Reports left queued by
+     * GET_REPORT must be written out first.
+     */
+    pgraph_complete_reports(d, true);
+
     uint32_t semaphore_offset = pg->regs[NV_PGRAPH_SEMAPHOREOFFSET];
 
     hwaddr semaphore_dma_len;
@@ -3063,25 +3270,21 @@ DEF_METHOD(NV097, CLEAR_SURFACE)
         }
         if (parameter & NV097_CLEAR_SURFACE_Z) {
             gl_mask |= GL_DEPTH_BUFFER_BIT;
-            glDepthMask(GL_TRUE);
+            pgraph_gl_depth_mask(pg, true);
             glClearDepth(gl_clear_depth);
         }
         if (parameter & NV097_CLEAR_SURFACE_STENCIL) {
             gl_mask |= GL_STENCIL_BUFFER_BIT;
-            glStencilMask(0xff);
+            pgraph_gl_stencil_mask(pg, 0xff);
             glClearStencil(gl_clear_stencil);
         }
     }
     if (write_color) {
         gl_mask |= GL_COLOR_BUFFER_BIT;
-        glColorMask((parameter & NV097_CLEAR_SURFACE_R)
-                         ? GL_TRUE : GL_FALSE,
-                    (parameter & NV097_CLEAR_SURFACE_G)
-                         ? GL_TRUE : GL_FALSE,
-                    (parameter & NV097_CLEAR_SURFACE_B)
-                         ? GL_TRUE : GL_FALSE,
-                    (parameter & NV097_CLEAR_SURFACE_A)
-                         ? GL_TRUE : GL_FALSE);
+        pgraph_gl_color_mask(pg, parameter & NV097_CLEAR_SURFACE_R,
+                             parameter & NV097_CLEAR_SURFACE_G,
+                             parameter & NV097_CLEAR_SURFACE_B,
+                             parameter & NV097_CLEAR_SURFACE_A);
         uint32_t clear_color = d->pgraph.regs[NV_PGRAPH_COLORCLEARVALUE];
 
         /* Handle RGB */
@@ -3174,20 +3377,18 @@ DEF_METHOD(NV097, CLEAR_SURFACE)
     pgraph_apply_scaling_factor(pg, &scissor_width, &scissor_height);
 
     /* FIXME: Respect window clip?!?! */
-    glEnable(GL_SCISSOR_TEST);
-    glScissor(xmin, ymin, scissor_width, scissor_height);
+    pgraph_gl_set_enabled(pg, GL_SCISSOR_TEST, true);
+    pgraph_gl_scissor(pg, xmin, ymin, scissor_width, scissor_height);
 
     /* Dither */
     /* FIXME: Maybe also disable it here? + GL implementation dependent */
-    if (pg->regs[NV_PGRAPH_CONTROL_0] & NV_PGRAPH_CONTROL_0_DITHERENABLE) {
-        glEnable(GL_DITHER);
-    } else {
-        glDisable(GL_DITHER);
-    }
+    pgraph_gl_set_enabled(pg, GL_DITHER,
+                          pg->regs[NV_PGRAPH_CONTROL_0] &
+                              NV_PGRAPH_CONTROL_0_DITHERENABLE);
 
     glClear(gl_mask);
 
-    glDisable(GL_SCISSOR_TEST);
+    pgraph_gl_set_enabled(pg, GL_SCISSOR_TEST, false);
 
     pgraph_set_surface_dirty(pg, write_color, write_zeta);
 }
@@ -3398,6 +3599,9 @@ void nv2a_gl_context_init(void)
 {
     g_nv2a_context_render = glo_context_create();
     g_nv2a_context_display = glo_context_create();
+    for (int i = 0; i < SHADER_COMPILE_THREADS; i++) {
+        g_nv2a_context_shader_compile[i] = glo_context_create();
+    }
 }
 
 void nv2a_set_surface_scale_factor(unsigned int scale)
@@ -3445,6 +3649,75 @@ unsigned int nv2a_get_surface_scale_factor(void)
     return g_nv2a->pgraph.surface_scale_factor;
 }
 
+void nv2a_set_shader_compile_mode(int mode)
+{
+    xemu_settings_set_enum(XEMU_SETTINGS_DISPLAY_SHADER_COMPILE, mode);
+    xemu_settings_save();
+
+    /* Jobs already queued are still collected by pgraph_bind_shaders, so the
+     * new mode can simply take effect on the next shader bind.
+     */
+    qatomic_set(&g_nv2a->pgraph.shader_compile_mode, mode);
+}
+
+int nv2a_get_shader_compile_mode(void)
+{
+    return qatomic_read(&g_nv2a->pgraph.shader_compile_mode);
+}
+
+static void pgraph_reload_shader_compile_mode(NV2AState *d)
+{
+    int mode;
+    xemu_settings_get_enum(XEMU_SETTINGS_DISPLAY_SHADER_COMPILE, &mode);
+    d->pgraph.shader_compile_mode = mode;
+}
+
+void nv2a_set_gpu_swizzle(bool enable)
+{
+    xemu_settings_set_bool(XEMU_SETTINGS_DISPLAY_GPU_SWIZZLE, enable);
+    xemu_settings_save();
+
+    /* Both paths produce identical results, so the switch can happen at any
+     * surface or texture transfer.
+     */
+    qatomic_set(&g_nv2a->pgraph.gpu_swizzle, enable);
+}
+
+bool nv2a_get_gpu_swizzle(void)
+{
+    return qatomic_read(&g_nv2a->pgraph.gpu_swizzle);
+}
+
+static void pgraph_reload_gpu_swizzle(NV2AState *d)
+{
+    int enable;
+    xemu_settings_get_bool(XEMU_SETTINGS_DISPLAY_GPU_SWIZZLE, &enable);
+    d->pgraph.gpu_swizzle = enable;
+}
+
+void nv2a_set_strict_reports(bool enable)
+{
+    xemu_settings_set_bool(XEMU_SETTINGS_DISPLAY_STRICT_REPORTS, enable);
+    xemu_settings_save();
+
+    /* Takes effect at the next report, earlier ones are still written once
+     * their results are in.
+     */
+    qatomic_set(&g_nv2a->pgraph.strict_reports, enable);
+}
+
+bool nv2a_get_strict_reports(void)
+{
+    return qatomic_read(&g_nv2a->pgraph.strict_reports);
+}
+
+static void pgraph_reload_strict_reports(NV2AState *d)
+{
+    int enable;
+    xemu_settings_get_bool(XEMU_SETTINGS_DISPLAY_STRICT_REPORTS, &enable);
+    d->pgraph.strict_reports = enable;
+}
+
 static void pgraph_reload_surface_scale_factor(NV2AState *d)
 {
     int factor;
@@ -3460,6 +3733,13 @@ void pgraph_init(NV2AState *d)
     PGRAPHState *pg = &d->pgraph;
 
     pgraph_reload_surface_scale_factor(d);
+    pgraph_reload_shader_compile_mode(d);
+    pgraph_reload_gpu_swizzle(d);
+    pgraph_reload_strict_reports(d);
+
+    QSIMPLEQ_INIT(&pg->report_queue);
+    pg->reports_pending = false;
+    pg->zpass_pixel_count_clear_pending = false;
 
     pg->frame_time = 0;
     pg->draw_time = 0;
@@ -3492,15 +3772,21 @@ void pgraph_init(NV2AState *d)
     glBindFramebuffer(GL_FRAMEBUFFER, pg->gl_framebuffer);
 
     pgraph_init_render_to_texture(d);
+    pgraph_init_swizzle_renderer(d);
+    pgraph_init_blit_renderer(d);
     QTAILQ_INIT(&pg->surfaces);
+    interval_tree_init(&pg->surface_ranges);
+    QTAILQ_INIT(&pg->invalidated_surfaces);
 
     //glPolygonMode( GL_FRONT_AND_BACK, GL_LINE );
 
     // Initialize texture cache
     const size_t texture_cache_size = 512;
     lru_init(&pg->texture_cache);
-    pg->texture_cache_entries = malloc(texture_cache_size * sizeof(TextureLruNode));
+    pg->texture_cache_entries = calloc(texture_cache_size, sizeof(TextureLruNode));
     assert(pg->texture_cache_entries != NULL);
+    interval_tree_init(&pg->texture_cache_texture_ranges);
+    interval_tree_init(&pg->texture_cache_palette_ranges);
     for (i = 0; i < texture_cache_size; i++) {
         lru_add_free(&pg->texture_cache, &pg->texture_cache_entries[i].node);
     }
@@ -3524,25 +3810,44 @@ void pgraph_init(NV2AState *d)
     pg->element_cache.init_node = vertex_cache_entry_init;
     pg->element_cache.compare_nodes = vertex_cache_entry_compare;
 
-    pg->shader_cache = g_hash_table_new(shader_hash, shader_equal);
+    pg->shader_cache = g_hash_table_new(shader_state_hash, shader_state_equal);
+
+    char *config_dir = g_path_get_dirname(xemu_settings_get_path());
+    char *shader_cache_dir = g_build_filename(config_dir, "shader_cache", NULL);
+    shader_disk_cache_init(&pg->shader_disk_cache, shader_cache_dir);
+    g_free(shader_cache_dir);
+    g_free(config_dir);
+
+    shader_compile_pool_init(&pg->shader_compile_pool,
+                             g_nv2a_context_shader_compile);
+    pg->shader_binding_pending = false;
+    pg->draw_skip = false;
 
     for (i=0; i<NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
         VertexAttribute *attribute = &pg->vertex_attributes[i];
-        glGenBuffers(1, &attribute->gl_inline_buffer);
         attribute->inline_buffer = (float*)g_malloc(NV2A_MAX_BATCH_LENGTH
                                               * sizeof(float) * 4);
         attribute->inline_buffer_populated = false;
     }
-    glGenBuffers(1, &pg->gl_inline_array_buffer);
+    memset(pg->element_signatures, 0, sizeof(pg->element_signatures));
 
-    glGenBuffers(1, &pg->gl_memory_buffer);
-    glBindBuffer(GL_ARRAY_BUFFER, pg->gl_memory_buffer);
-    glBufferData(GL_ARRAY_BUFFER, memory_region_size(d->vram),
-                 NULL, GL_DYNAMIC_DRAW);
+    pgraph_init_memory_buffer(d);
+    pgraph_init_stream_buffer(pg);
+    pgraph_init_palette_textures(pg);
+
+    glGenBuffers(1, &pg->gl_texture_staging_buffer);
+    pg->compressed_volume_arrays = pgraph_probe_compressed_volume_arrays();
+    /* Leave a core each to the vCPU and to the FIFO thread, which decodes
+     * alongside the workers */
+    texture_decode_pool_init(&pg->texture_decode_pool,
+                             MAX((int)g_get_num_processors() - 2, 0));
 
     glGenVertexArrays(1, &pg->gl_vertex_array);
     glBindVertexArray(pg->gl_vertex_array);
 
+    pgraph_init_constant_buffers(pg);
+    pgraph_gl_state_invalidate(pg);
+
     assert(glGetError() == GL_NO_ERROR);
 
     glo_set_current(g_nv2a_context_display);
@@ -3562,49 +3867,148 @@ void pgraph_destroy(PGRAPHState *pg)
     glDeleteFramebuffers(1, &pg->gl_framebuffer);
 
     // TODO: clear out shader cached
+    shader_compile_pool_finalize(&pg->shader_compile_pool);
+    texture_decode_pool_finalize(&pg->texture_decode_pool);
+    shader_disk_cache_finalize(&pg->shader_disk_cache);
 
     // Clear out texture cache
     lru_flush(&pg->texture_cache);
     free(pg->texture_cache_entries);
 
+    g_free(pg->memory_buffer_region_seq);
+    if (!pg->stream_buffer_persistent) {
+        g_free(pg->stream_buffer_map);
+    }
+
     glo_set_current(NULL);
     glo_context_destroy(g_nv2a_context_render);
     glo_context_destroy(g_nv2a_context_display);
+    for (int i = 0; i < SHADER_COMPILE_THREADS; i++) {
+        glo_context_destroy(g_nv2a_context_shader_compile[i]);
+    }
 }
 
-static void pgraph_shader_update_constants(PGRAPHState *pg,
-                                           ShaderBinding *binding,
-                                           bool binding_changed,
-                                           bool vertex_program,
-                                           bool fixed_function)
+static void pgraph_mark_transform_constants_dirty(PGRAPHState *pg)
 {
-    int i, j;
+    memset(pg->vsh_constants_dirty, 1, sizeof(pg->vsh_constants_dirty));
+    memset(pg->ltctxa_dirty, 1, sizeof(pg->ltctxa_dirty));
+    memset(pg->ltctxb_dirty, 1, sizeof(pg->ltctxb_dirty));
+    memset(pg->ltc1_dirty, 1, sizeof(pg->ltc1_dirty));
+}
 
-    /* update combiner constants */
-    for (i = 0; i < 9; i++) {
-        uint32_t constant[2];
-        if (i == 8) {
-            /* final combiner */
-            constant[0] = pg->regs[NV_PGRAPH_SPECFOGFACTOR0];
+static void pgraph_init_constant_buffers(PGRAPHState *pg)
+{
+    QEMU_BUILD_BUG_ON(sizeof(ShaderTransformConstants) !=
+                      (NV2A_VERTEXSHADER_CONSTANTS + NV2A_LTCTXA_COUNT +
+                       NV2A_LTCTXB_COUNT + NV2A_LTC1_COUNT) * 16);
+    QEMU_BUILD_BUG_ON(sizeof(ShaderCombinerConstants) != 2 * 9 * 16);
+
+    memset(&pg->transform_constants, 0, sizeof(pg->transform_constants));
+    memset(&pg->combiner_constants, 0, sizeof(pg->combiner_constants));
+
+    glGenBuffers(1, &pg->gl_transform_constants_buffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, pg->gl_transform_constants_buffer);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(pg->transform_constants),
+                 &pg->transform_constants, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, SHADER_TRANSFORM_CONSTANTS_BINDING,
+                     pg->gl_transform_constants_buffer);
+
+    glGenBuffers(1, &pg->gl_combiner_constants_buffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, pg->gl_combiner_constants_buffer);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(pg->combiner_constants),
+                 &pg->combiner_constants, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, SHADER_COMBINER_CONSTANTS_BINDING,
+                     pg->gl_combiner_constants_buffer);
+
+    pgraph_mark_transform_constants_dirty(pg);
+}
+
+/*
+ * The transform constants are shared by all programs. Gather every dirty
+ * row into the CPU copy and upload the range spanning them in one go.
+ */
+static void pgraph_update_transform_constants(PGRAPHState *pg)
+{
+    struct {
+        uint32_t (*v)[4];
+        bool *dirty;
+        size_t len;
+    } segments[] = {
+        { pg->vsh_constants, pg->vsh_constants_dirty,
+          NV2A_VERTEXSHADER_CONSTANTS },
+        { pg->ltctxa, pg->ltctxa_dirty, NV2A_LTCTXA_COUNT },
+        { pg->ltctxb, pg->ltctxb_dirty, NV2A_LTCTXB_COUNT },
+        { pg->ltc1, pg->ltc1_dirty, NV2A_LTC1_COUNT },
+    };
+    uint32_t (*rows)[4] = (uint32_t (*)[4])&pg->transform_constants;
+    size_t base = 0, first = SIZE_MAX, last = 0;
+
+    for (int i = 0; i < ARRAY_SIZE(segments); i++) {
+        for (size_t j = 0; j < segments[i].len; j++) {
+            if (!segments[i].dirty[j]) {
+                continue;
+            }
+            memcpy(rows[base + j], segments[i].v[j], sizeof(rows[0]));
+            segments[i].dirty[j] = false;
+            first = MIN(first, base + j);
+            last = base + j;
+        }
+        base += segments[i].len;
+    }
+
+    if (first == SIZE_MAX) {
+        return;
+    }
+
+    glBindBuffer(GL_UNIFORM_BUFFER, pg->gl_transform_constants_buffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, first * sizeof(rows[0]),
+                    (last - first + 1) * sizeof(rows[0]), rows[first]);
+}
+
+static void pgraph_update_combiner_constants(PGRAPHState *pg)
+{
+    ShaderCombinerConstants constants;
+
+    for (int i = 0; i < 9; i++) {
+        uint32_t constant[2];
+        if (i == 8) {
+            /* final combiner */
+            constant[0] = pg->regs[NV_PGRAPH_SPECFOGFACTOR0];
             constant[1] = pg->regs[NV_PGRAPH_SPECFOGFACTOR1];
         } else {
             constant[0] = pg->regs[NV_PGRAPH_COMBINEFACTOR0 + i * 4];
             constant[1] = pg->regs[NV_PGRAPH_COMBINEFACTOR1 + i * 4];
         }
 
-        for (j = 0; j < 2; j++) {
-            GLint loc = binding->psh_constant_loc[i][j];
-            if (loc != -1) {
-                float value[4];
-                value[0] = (float) ((constant[j] >> 16) & 0xFF) / 255.0f;
-                value[1] = (float) ((constant[j] >> 8) & 0xFF) / 255.0f;
-                value[2] = (float) (constant[j] & 0xFF) / 255.0f;
-                value[3] = (float) ((constant[j] >> 24) & 0xFF) / 255.0f;
-
-                glUniform4fv(loc, 1, value);
-            }
+        float (*value[2])[4] = { &constants.c0[i], &constants.c1[i] };
+        for (int j = 0; j < 2; j++) {
+            (*value[j])[0] = (float) ((constant[j] >> 16) & 0xFF) / 255.0f;
+            (*value[j])[1] = (float) ((constant[j] >> 8) & 0xFF) / 255.0f;
+            (*value[j])[2] = (float) (constant[j] & 0xFF) / 255.0f;
+            (*value[j])[3] = (float) ((constant[j] >> 24) & 0xFF) / 255.0f;
         }
     }
+
+    if (!memcmp(&constants, &pg->combiner_constants, sizeof(constants))) {
+        return;
+    }
+
+    pg->combiner_constants = constants;
+    glBindBuffer(GL_UNIFORM_BUFFER, pg->gl_combiner_constants_buffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(constants), &constants);
+}
+
+static void pgraph_shader_update_constants(PGRAPHState *pg,
+                                           ShaderBinding *binding,
+                                           bool binding_changed,
+                                           bool vertex_program,
+                                           bool fixed_function)
+{
+    int i;
+
+    pgraph_update_combiner_constants(pg);
+    pgraph_update_transform_constants(pg);
+
     if (binding->alpha_ref_loc != -1) {
         float alpha_ref = GET_MASK(pg->regs[NV_PGRAPH_CONTROL_0],
                                    NV_PGRAPH_CONTROL_0_ALPHAREF) / 255.0;
@@ -3644,6 +4048,18 @@ static void pgraph_shader_update_constants(PGRAPHState *pg,
             assert(pg->texture_binding[i] != NULL);
             glUniform1f(loc, (float)pg->texture_binding[i]->scale);
         }
+
+        loc = binding->tex_max_level_loc[i];
+        if (loc != -1) {
+            assert(pg->texture_binding[i] != NULL);
+            glUniform1f(loc, (float)pg->texture_binding[i]->max_level);
+        }
+
+        loc = binding->volume_depth_loc[i];
+        if (loc != -1) {
+            assert(pg->texture_binding[i] != NULL);
+            glUniform1f(loc, (float)pg->texture_binding[i]->depth);
+        }
     }
 
     if (binding->fog_color_loc != -1) {
@@ -3667,33 +4083,6 @@ static void pgraph_shader_update_constants(PGRAPHState *pg,
     float zclip_min = *(float*)&pg->regs[NV_PGRAPH_ZCLIPMIN];
 
     if (fixed_function) {
-        /* update lighting constants */
-        struct {
-            uint32_t* v;
-            bool* dirty;
-            GLint* locs;
-            size_t len;
-        } lighting_arrays[] = {
-            {&pg->ltctxa[0][0], &pg->ltctxa_dirty[0], binding->ltctxa_loc, NV2A_LTCTXA_COUNT},
-            {&pg->ltctxb[0][0], &pg->ltctxb_dirty[0], binding->ltctxb_loc, NV2A_LTCTXB_COUNT},
-            {&pg->ltc1[0][0], &pg->ltc1_dirty[0], binding->ltc1_loc, NV2A_LTC1_COUNT},
-        };
-
-        for (i=0; i<ARRAY_SIZE(lighting_arrays); i++) {
-            uint32_t *lighting_v = lighting_arrays[i].v;
-            bool *lighting_dirty = lighting_arrays[i].dirty;
-            GLint *lighting_locs = lighting_arrays[i].locs;
-            size_t lighting_len = lighting_arrays[i].len;
-            for (j=0; j<lighting_len; j++) {
-                if (!lighting_dirty[j] && !binding_changed) continue;
-                GLint loc = lighting_locs[j];
-                if (loc != -1) {
-                    glUniform4fv(loc, 1, (const GLfloat*)&lighting_v[j*4]);
-                }
-                lighting_dirty[j] = false;
-            }
-        }
-
         for (i = 0; i < NV2A_MAX_LIGHTS; i++) {
             GLint loc;
             loc = binding->light_infinite_half_vector_loc[i];
@@ -3742,22 +4131,6 @@ static void pgraph_shader_update_constants(PGRAPHState *pg,
         }
     }
 
-    /* update vertex program constants */
-    for (i=0; i<NV2A_VERTEXSHADER_CONSTANTS; i++) {
-        if (!pg->vsh_constants_dirty[i] && !binding_changed) continue;
-
-        GLint loc = binding->vsh_constant_loc[i];
-        if ((loc != -1) &&
-            memcmp(binding->vsh_constants[i], pg->vsh_constants[i],
-                   sizeof(pg->vsh_constants[1]))) {
-            glUniform4fv(loc, 1, (const GLfloat *)pg->vsh_constants[i]);
-            memcpy(binding->vsh_constants[i], pg->vsh_constants[i],
-                   sizeof(pg->vsh_constants[i]));
-        }
-
-        pg->vsh_constants_dirty[i] = false;
-    }
-
     if (binding->surface_size_loc != -1) {
         unsigned int aa_width = 1, aa_height = 1;
         pgraph_apply_anti_aliasing_factor(pg, &aa_width, &aa_height);
@@ -3865,6 +4238,73 @@ dirty:
     return true;
 }
 
+static void pgraph_cache_shader_binding(PGRAPHState *pg,
+                                        const ShaderState *state,
+                                        ShaderBinding *binding)
+{
+    ShaderState *cache_state = (ShaderState *)g_malloc(sizeof(*cache_state));
+    memcpy(cache_state, state, sizeof(*cache_state));
+    g_hash_table_insert(pg->shader_cache, cache_state, (gpointer)binding);
+}
+
+/* Move programs linked by the compile pool into the shader cache */
+static void pgraph_collect_compiled_shaders(PGRAPHState *pg)
+{
+    ShaderCompileJob *job;
+    while ((job = shader_compile_pool_take_completed(
+                &pg->shader_compile_pool))) {
+        nv2a_profile_inc_counter(NV2A_PROF_SHADER_GEN);
+
+        int64_t latency_ms = (job->complete_time - job->submit_time) / 1000;
+        if (latency_ms < 16) {
+            nv2a_profile_inc_counter(NV2A_PROF_SHADER_COMPILE_LT_16MS);
+        } else if (latency_ms < 50) {
+            nv2a_profile_inc_counter(NV2A_PROF_SHADER_COMPILE_LT_50MS);
+        } else if (latency_ms < 200) {
+            nv2a_profile_inc_counter(NV2A_PROF_SHADER_COMPILE_LT_200MS);
+        } else {
+            nv2a_profile_inc_counter(NV2A_PROF_SHADER_COMPILE_GE_200MS);
+        }
+
+        if (pg->shader_disk_cache.file) {
+            g_nv2a_stats.shader_disk_cache.misses++;
+            shader_disk_cache_store(&pg->shader_disk_cache, &job->state,
+                                    job->binding);
+        }
+        pgraph_cache_shader_binding(pg, &job->state, job->binding);
+        g_free(job);
+    }
+}
+
+/* The running title can change whenever the guest reboots into a new XBE.
+ * Reading the XBE headers needs the BQL, so the iothread publishes the title
+ * ID from the display refresh, at most once a second.
+ */
+void pgraph_update_title_id(NV2AState *d)
+{
+    PGRAPHState *pg = &d->pgraph;
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    if (!pg->shader_disk_cache.enabled ||
+        now - pg->title_id_check_time < 1000) {
+        return;
+    }
+    pg->title_id_check_time = now;
+
+    struct xbe *xbe = xemu_get_xbe_info();
+    qatomic_set(&pg->title_id, xbe ? ldl_le_p(&xbe->cert->m_titleid) : 0);
+}
+
+/* Switches the disk cache to the published title between frames */
+static void pgraph_update_shader_disk_cache_title(PGRAPHState *pg)
+{
+    uint32_t title_id = qatomic_read(&pg->title_id);
+
+    if (title_id != pg->shader_disk_cache.title_id) {
+        shader_disk_cache_open(&pg->shader_disk_cache, title_id);
+    }
+}
+
 static void pgraph_bind_shaders(PGRAPHState *pg)
 {
     int i, j;
@@ -3882,8 +4322,11 @@ static void pgraph_bind_shaders(PGRAPHState *pg)
                          vertex_program ? "yes" : "no",
                          fixed_function ? "yes" : "no");
 
+    pgraph_collect_compiled_shaders(pg);
+
     bool binding_changed = false;
-    if (!pgraph_bind_shaders_test_dirty(pg) && !pg->program_data_dirty) {
+    if (!pgraph_bind_shaders_test_dirty(pg) && !pg->program_data_dirty &&
+        !pg->shader_binding_pending) {
         nv2a_profile_inc_counter(NV2A_PROF_SHADER_BIND_NOTDIRTY);
         goto update_constants;
     }
@@ -4073,20 +4516,91 @@ static void pgraph_bind_shaders(PGRAPHState *pg)
         }
 
         state.psh.conv_tex[i] = kernel;
+
+        uint32_t fmt = pg->regs[NV_PGRAPH_TEXFMT0 + i*4];
+        bool cubemap = GET_MASK(fmt, NV_PGRAPH_TEXFMT0_CUBEMAPENABLE);
+        unsigned int dimensionality =
+            GET_MASK(fmt, NV_PGRAPH_TEXFMT0_DIMENSIONALITY);
+        if (pgraph_texture_palette_in_shader(color_format, cubemap,
+                                             dimensionality)) {
+            state.psh.palette_tex[i] = true;
+            state.psh.tex_filter[i] = pgraph_texture_shader_filter(filter);
+        } else if (pgraph_texture_volume_as_array(pg, color_format, cubemap,
+                                                  dimensionality)) {
+            unsigned int addrp =
+                GET_MASK(pg->regs[NV_PGRAPH_TEXADDRESS0 + i*4],
+                         NV_PGRAPH_TEXADDRESS0_ADDRP);
+            assert(addrp < ARRAY_SIZE(pgraph_texture_addr_map));
+            switch (pgraph_texture_addr_map[addrp]) {
+            case GL_REPEAT:
+                state.psh.volume_wrap[i] = PSH_VOLUME_WRAP_REPEAT;
+                break;
+            case GL_MIRRORED_REPEAT:
+                state.psh.volume_wrap[i] = PSH_VOLUME_WRAP_MIRROR;
+                break;
+            default:
+                /* FIXME: Border colors are not applied between slices */
+                state.psh.volume_wrap[i] = PSH_VOLUME_WRAP_CLAMP;
+                break;
+            }
+            state.psh.volume_tex[i] = true;
+            state.psh.tex_filter[i] = pgraph_texture_shader_filter(filter);
+        }
     }
 
+    pg->shader_binding_pending = false;
+    pg->draw_skip = false;
+
     ShaderBinding* cached_shader = (ShaderBinding*)g_hash_table_lookup(pg->shader_cache, &state);
     if (cached_shader) {
         pg->shader_binding = cached_shader;
+    } else if (shader_compile_pool_is_pending(&pg->shader_compile_pool,
+                                              &state)) {
+        pg->shader_binding_pending = true;
     } else {
-        pg->shader_binding = generate_shaders(state);
-        nv2a_profile_inc_counter(NV2A_PROF_SHADER_GEN);
+        ShaderBinding *binding =
+            shader_disk_cache_lookup(&pg->shader_disk_cache, &state);
+        if (binding) {
+            g_nv2a_stats.shader_disk_cache.hits++;
+        } else if (qatomic_read(&pg->shader_compile_mode) !=
+                   SHADER_COMPILE_SYNC) {
+            shader_compile_pool_submit(&pg->shader_compile_pool, &state);
+            pg->shader_binding_pending = true;
+        } else {
+            binding = generate_shaders(state);
+            nv2a_profile_inc_counter(NV2A_PROF_SHADER_GEN);
+            if (pg->shader_disk_cache.file) {
+                g_nv2a_stats.shader_disk_cache.misses++;
+                shader_disk_cache_store(&pg->shader_disk_cache, &state,
+                                        binding);
+            }
+        }
+
+        if (binding) {
+            pg->shader_binding = binding;
+            pgraph_cache_shader_binding(pg, &state, binding);
+        }
+    }
 
-        /* cache it */
-        ShaderState *cache_state = (ShaderState *)g_malloc(sizeof(*cache_state));
-        memcpy(cache_state, &state, sizeof(*cache_state));
-        g_hash_table_insert(pg->shader_cache, cache_state,
-                            (gpointer)pg->shader_binding);
+    if (pg->shader_binding_pending) {
+        nv2a_profile_max_counter(
+            NV2A_PROF_SHADER_ASYNC_QUEUE_DEPTH,
+            shader_compile_pool_num_pending(&pg->shader_compile_pool));
+
+        /* Until the program links, draw with whatever program is already
+         * bound as long as it rasterizes the same primitive type.
+         */
+        if (qatomic_read(&pg->shader_compile_mode) ==
+                SHADER_COMPILE_ASYNC_FALLBACK && old_binding &&
+            old_binding->gl_primitive_mode ==
+                shader_get_gl_primitive_mode(&state)) {
+            nv2a_profile_inc_counter(NV2A_PROF_SHADER_ASYNC_FALLBACK);
+        } else {
+            nv2a_profile_inc_counter(NV2A_PROF_SHADER_ASYNC_SKIP);
+            pg->draw_skip = true;
+            NV2A_GL_DGROUP_END();
+            return;
+        }
     }
 
     binding_changed = (pg->shader_binding != old_binding);
@@ -4143,11 +4657,19 @@ static void pgraph_set_surface_dirty(PGRAPHState *pg, bool color, bool zeta)
     if (pg->color_binding) {
         pg->color_binding->draw_dirty |= color;
         pg->color_binding->frame_time = pg->frame_time;
+        if (color && pg->color_binding->download_fence) {
+            nv2a_profile_inc_counter(NV2A_PROF_SURF_DOWNLOAD_STALE);
+            pgraph_surface_download_cancel(pg->color_binding);
+        }
     }
 
     if (pg->zeta_binding) {
         pg->zeta_binding->draw_dirty |= zeta;
         pg->zeta_binding->frame_time = pg->frame_time;
+        if (zeta && pg->zeta_binding->download_fence) {
+            nv2a_profile_inc_counter(NV2A_PROF_SURF_DOWNLOAD_STALE);
+            pgraph_surface_download_cancel(pg->zeta_binding);
+        }
     }
 }
 
@@ -4286,7 +4808,9 @@ static void pgraph_render_surface_to(NV2AState *d, SurfaceBinding *surface,
                                      GLuint gl_texture, unsigned int width,
                                      unsigned int height)
 {
-    glActiveTexture(GL_TEXTURE0 + texture_unit);
+    PGRAPHState *pg = &d->pgraph;
+
+    pgraph_gl_active_texture(pg, GL_TEXTURE0 + texture_unit);
     glBindFramebuffer(GL_FRAMEBUFFER, d->pgraph.s2t_rndr.fbo);
 
     GLenum draw_buffers[1] = { GL_COLOR_ATTACHMENT0 };
@@ -4294,7 +4818,7 @@ static void pgraph_render_surface_to(NV2AState *d, SurfaceBinding *surface,
                            gl_texture, 0);
     glDrawBuffers(1, draw_buffers);
     assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
-    assert(glGetError() == GL_NO_ERROR);
+    NV2A_GL_CHECK_ERROR();
 
     float color[] = { 0.0f, 0.0f, 0.0f, 0.0f };
     glBindTexture(GL_TEXTURE_2D, surface->gl_buffer);
@@ -4310,14 +4834,14 @@ static void pgraph_render_surface_to(NV2AState *d, SurfaceBinding *surface,
     glProgramUniform2f(d->pgraph.s2t_rndr.prog,
                        d->pgraph.s2t_rndr.surface_size_loc, width, height);
 
-    glViewport(0, 0, width, height);
-    glColorMask(true, true, true, true);
-    glDisable(GL_DITHER);
-    glDisable(GL_SCISSOR_TEST);
-    glDisable(GL_BLEND);
-    glDisable(GL_STENCIL_TEST);
-    glDisable(GL_CULL_FACE);
-    glDisable(GL_DEPTH_TEST);
+    pgraph_gl_viewport(pg, 0, 0, width, height);
+    pgraph_gl_color_mask(pg, true, true, true, true);
+    pgraph_gl_set_enabled(pg, GL_DITHER, false);
+    pgraph_gl_set_enabled(pg, GL_SCISSOR_TEST, false);
+    pgraph_gl_set_enabled(pg, GL_BLEND, false);
+    pgraph_gl_set_enabled(pg, GL_STENCIL_TEST, false);
+    pgraph_gl_set_enabled(pg, GL_CULL_FACE, false);
+    pgraph_gl_set_enabled(pg, GL_DEPTH_TEST, false);
     glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
     glClearColor(0.0f, 0.0f, 1.0f, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT);
@@ -4342,7 +4866,7 @@ static void pgraph_render_surface_to_texture_slow(
     assert(texture_shape->color_format < ARRAY_SIZE(kelvin_color_format_map));
     nv2a_profile_inc_counter(NV2A_PROF_SURF_TO_TEX_FALLBACK);
 
-    glActiveTexture(GL_TEXTURE0 + texture_unit);
+    pgraph_gl_active_texture(pg, GL_TEXTURE0 + texture_unit);
     glBindTexture(texture->gl_target, texture->gl_texture);
 
     unsigned int width = surface->width,
@@ -4393,7 +4917,7 @@ static void pgraph_render_surface_to_texture(NV2AState *d,
                  height = texture_shape->height;
     pgraph_apply_scaling_factor(pg, &width, &height);
 
-    glActiveTexture(GL_TEXTURE0 + texture_unit);
+    pgraph_gl_active_texture(pg, GL_TEXTURE0 + texture_unit);
     glBindTexture(texture->gl_target, texture->gl_texture);
     glTexParameteri(texture->gl_target, GL_TEXTURE_BASE_LEVEL, 0);
     glTexParameteri(texture->gl_target, GL_TEXTURE_MAX_LEVEL, 0);
@@ -4417,6 +4941,113 @@ static void pgraph_gl_fence(void)
     glDeleteSync(fence);
 }
 
+static bool pgraph_report_available(QueryReport *report)
+{
+    /* Check the newest query first, it is the last one to finish */
+    for (int i = report->query_count - 1; i >= 0; i--) {
+        GLuint available;
+        glGetQueryObjectuiv(report->queries[i], GL_QUERY_RESULT_AVAILABLE,
+                            &available);
+        if (!available) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void pgraph_free_report(QueryReport *report)
+{
+    if (report->query_count) {
+        glDeleteQueries(report->query_count, report->queries);
+    }
+    g_free(report->queries);
+    g_free(report);
+}
+
+static void pgraph_write_report(NV2AState *d, QueryReport *report)
+{
+    PGRAPHState *pg = &d->pgraph;
+
+    uint64_t timestamp = 0x0011223344556677; /* FIXME: Update timestamp?! */
+    uint32_t done = 0;
+
+    /* FIXME: Multisampling affects this (both: OGL and Xbox GPU),
+     *        not sure if CLEARs also count
+     */
+    /* FIXME: What about clipping regions etc? */
+    unsigned int result = 0;
+    for (int i = 0; i < report->query_count; i++) {
+        GLuint gl_query_result;
+        glGetQueryObjectuiv(report->queries[i], GL_QUERY_RESULT,
+                            &gl_query_result);
+        result += gl_query_result;
+    }
+
+    if (report->clear) {
+        pg->zpass_pixel_count_result = 0;
+    }
+    pg->zpass_pixel_count_result +=
+        result / (pg->surface_scale_factor * pg->surface_scale_factor);
+
+    uint8_t *report_data = d->vram_ptr + report->vram_addr;
+    stq_le_p((uint64_t *)&report_data[0], timestamp);
+    stl_le_p((uint32_t *)&report_data[8], pg->zpass_pixel_count_result);
+    stl_le_p((uint32_t *)&report_data[12], done);
+
+    int64_t latency_us =
+        qemu_clock_get_us(QEMU_CLOCK_REALTIME) - report->submit_time;
+    if (latency_us < 1000) {
+        nv2a_profile_inc_counter(NV2A_PROF_QUERY_LATENCY_LT_1MS);
+    } else if (latency_us < 4000) {
+        nv2a_profile_inc_counter(NV2A_PROF_QUERY_LATENCY_LT_4MS);
+    } else if (latency_us < 16000) {
+        nv2a_profile_inc_counter(NV2A_PROF_QUERY_LATENCY_LT_16MS);
+    } else {
+        nv2a_profile_inc_counter(NV2A_PROF_QUERY_LATENCY_GE_16MS);
+    }
+}
+
+/* Writes out queued reports in order until one is still waiting on the GPU,
+ * or all of them if wait is set.
+ */
+static void pgraph_complete_reports(NV2AState *d, bool wait)
+{
+    PGRAPHState *pg = &d->pgraph;
+    QueryReport *report;
+
+    while ((report = QSIMPLEQ_FIRST(&pg->report_queue))) {
+        if (!pgraph_report_available(report)) {
+            if (!wait) {
+                break;
+            }
+            nv2a_profile_inc_counter(NV2A_PROF_QUERY_REPORT_STALL);
+        }
+        pgraph_write_report(d, report);
+        QSIMPLEQ_REMOVE_HEAD(&pg->report_queue, entry);
+        pgraph_free_report(report);
+    }
+
+    qatomic_set(&pg->reports_pending, !QSIMPLEQ_EMPTY(&pg->report_queue));
+}
+
+static void pgraph_discard_reports(PGRAPHState *pg)
+{
+    QueryReport *report;
+
+    while ((report = QSIMPLEQ_FIRST(&pg->report_queue))) {
+        QSIMPLEQ_REMOVE_HEAD(&pg->report_queue, entry);
+        pgraph_free_report(report);
+    }
+
+    qatomic_set(&pg->reports_pending, false);
+}
+
+void pgraph_process_pending_reports(NV2AState *d)
+{
+    pgraph_complete_reports(d, false);
+}
+
 static void pgraph_init_display_renderer(NV2AState *d)
 {
     struct PGRAPHState *pg = &d->pgraph;
@@ -4663,17 +5294,25 @@ void pgraph_gl_sync(NV2AState *d)
     /* Wait for queued commands to complete */
     pgraph_upload_surface_data(d, surface, !tcg_enabled());
     pgraph_gl_fence();
-    assert(glGetError() == GL_NO_ERROR);
+    NV2A_GL_CHECK_ERROR();
 
     /* Render framebuffer in display context */
     glo_set_current(g_nv2a_context_display);
     pgraph_render_display(d, surface);
     pgraph_gl_fence();
-    assert(glGetError() == GL_NO_ERROR);
+    NV2A_GL_CHECK_ERROR();
 
     /* Switch back to original context */
     glo_set_current(g_nv2a_context_render);
 
+    /* Once rendering has moved on to another buffer the displayed surface is
+     * final, start reading it back in case the guest touches it.
+     */
+    if (surface != d->pgraph.color_binding) {
+        pgraph_surface_download_begin_if_dirty(d, surface);
+        glFlush();
+    }
+
     qatomic_set(&d->pgraph.gl_sync_pending, false);
     qemu_event_set(&d->pgraph.gl_sync_complete);
 }
@@ -4826,48 +5465,38 @@ static SurfaceBinding *pgraph_surface_put(NV2AState *d,
         "Adding surface region at [%" HWADDR_PRIx ": %" HWADDR_PRIx ")\n",
         surface_in->vram_addr, surface_in->vram_addr + surface_in->size);
 
-    SurfaceBinding *surface, *next;
-    uintptr_t e_end = surface_in->vram_addr + surface_in->size - 1;
-    QTAILQ_FOREACH_SAFE(surface, &d->pgraph.surfaces, entry, next) {
-        uintptr_t s_end = surface->vram_addr + surface->size - 1;
-        bool overlapping = !(surface->vram_addr > e_end
-                             || surface_in->vram_addr > s_end);
-        if (overlapping) {
-            NV2A_XPRINTF(DBG_SURFACES,
-                "Evicting overlapping surface @ %" HWADDR_PRIx " (%dx%d)\n",
-                surface->vram_addr, surface->width, surface->height);
-            pgraph_download_surface_data_if_dirty(d, surface);
-            pgraph_surface_invalidate(d, surface);
-        }
+    IntervalTreeNode *node;
+    hwaddr e_end = surface_in->vram_addr + surface_in->size - 1;
+    while ((node = interval_tree_find(&d->pgraph.surface_ranges,
+                                      surface_in->vram_addr, e_end))) {
+        SurfaceBinding *surface = container_of(node, SurfaceBinding,
+                                               vram_range);
+        NV2A_XPRINTF(DBG_SURFACES,
+            "Evicting overlapping surface @ %" HWADDR_PRIx " (%dx%d)\n",
+            surface->vram_addr, surface->width, surface->height);
+        pgraph_download_surface_data_if_dirty(d, surface);
+        pgraph_surface_invalidate(d, surface);
     }
 
     SurfaceBinding *surface_out = g_malloc(sizeof(SurfaceBinding));
     assert(surface_out != NULL);
     *surface_out = *surface_in;
+    memset(&surface_out->vram_range, 0, sizeof(surface_out->vram_range));
 
-    if (tcg_enabled()) {
-        qemu_mutex_unlock(&d->pgraph.lock);
-        qemu_mutex_lock_iothread();
-        mem_access_callback_insert(qemu_get_cpu(0),
-            d->vram, surface_out->vram_addr, surface_out->size,
-            &surface_out->access_cb, &pgraph_surface_access_callback,
-            surface_out);
-        qemu_mutex_unlock_iothread();
-        qemu_mutex_lock(&d->pgraph.lock);
-    }
+    pgraph_surface_update_access_callbacks(d, surface_out);
 
     QTAILQ_INSERT_TAIL(&d->pgraph.surfaces, surface_out, entry);
+    interval_tree_insert(&d->pgraph.surface_ranges, &surface_out->vram_range,
+                         surface_out->vram_addr, e_end);
 
     return surface_out;
 }
 
 static SurfaceBinding *pgraph_surface_get(NV2AState *d, hwaddr addr)
 {
-    SurfaceBinding *surface;
-    QTAILQ_FOREACH (surface, &d->pgraph.surfaces, entry) {
-        if (surface->vram_addr == addr) {
-            return surface;
-        }
+    SurfaceBinding *surface = pgraph_surface_get_within(d, addr);
+    if (surface != NULL && surface->vram_addr == addr) {
+        return surface;
     }
 
     return NULL;
@@ -4875,15 +5504,23 @@ static SurfaceBinding *pgraph_surface_get(NV2AState *d, hwaddr addr)
 
 static SurfaceBinding *pgraph_surface_get_within(NV2AState *d, hwaddr addr)
 {
-    SurfaceBinding *surface;
-    QTAILQ_FOREACH (surface, &d->pgraph.surfaces, entry) {
-        if (addr >= surface->vram_addr &&
-            addr < (surface->vram_addr + surface->size)) {
-            return surface;
-        }
+    /* Surfaces don't overlap, so at most one contains addr */
+    IntervalTreeNode *node = interval_tree_find(&d->pgraph.surface_ranges,
+                                                addr, addr);
+    if (node == NULL) {
+        return NULL;
     }
 
-    return NULL;
+    return container_of(node, SurfaceBinding, vram_range);
+}
+
+static bool pgraph_download_overlapping_surface(IntervalTreeNode *node,
+                                                void *opaque)
+{
+    NV2AState *d = opaque;
+    SurfaceBinding *surface = container_of(node, SurfaceBinding, vram_range);
+    pgraph_download_surface_data_if_dirty(d, surface);
+    return false;
 }
 
 static void pgraph_surface_invalidate(NV2AState *d, SurfaceBinding *surface)
@@ -4894,18 +5531,69 @@ static void pgraph_surface_invalidate(NV2AState *d, SurfaceBinding *surface)
     assert(surface != d->pgraph.color_binding);
     assert(surface != d->pgraph.zeta_binding);
 
-    if (tcg_enabled()) {
-        qemu_mutex_unlock(&d->pgraph.lock);
-        qemu_mutex_lock_iothread();
-        mem_access_callback_remove_by_ref(qemu_get_cpu(0), surface->access_cb);
-        qemu_mutex_unlock_iothread();
-        qemu_mutex_lock(&d->pgraph.lock);
+    pgraph_surface_download_cancel(surface);
+    if (surface->pbo) {
+        glDeleteBuffers(1, &surface->pbo);
     }
-
     glDeleteTextures(1, &surface->gl_buffer);
 
+    interval_tree_remove(&d->pgraph.surface_ranges, &surface->vram_range);
     QTAILQ_REMOVE(&d->pgraph.surfaces, surface, entry);
-    g_free(surface);
+
+    /*
+     * The access callback may still fire until it is unregistered, make sure
+     * it won't wait on a download that is never going to happen. Freed by
+     * pgraph_surface_update_access_callbacks.
+     */
+    qatomic_set(&surface->draw_dirty, false);
+    QTAILQ_INSERT_TAIL(&d->pgraph.invalidated_surfaces, surface, entry);
+}
+
+/*
+ * Unregister the access callbacks of all invalidated surfaces and register
+ * one for @added, if given, taking the iothread lock and flushing the TLB
+ * only once. The invalidated surfaces are freed afterwards.
+ */
+static void pgraph_surface_update_access_callbacks(NV2AState *d,
+                                                   SurfaceBinding *added)
+{
+    PGRAPHState *pg = &d->pgraph;
+    g_autoptr(GPtrArray) invalidated = g_ptr_array_new();
+    SurfaceBinding *surface, *next;
+
+    QTAILQ_FOREACH_SAFE(surface, &pg->invalidated_surfaces, entry, next) {
+        QTAILQ_REMOVE(&pg->invalidated_surfaces, surface, entry);
+        g_ptr_array_add(invalidated, surface);
+    }
+
+    if (tcg_enabled() && (invalidated->len > 0 || added)) {
+        g_autofree MemAccessCallback **remove =
+            g_new(MemAccessCallback *, invalidated->len);
+        for (guint i = 0; i < invalidated->len; i++) {
+            surface = g_ptr_array_index(invalidated, i);
+            remove[i] = surface->access_cb;
+        }
+
+        MemAccessCallback *insert = NULL;
+        if (added) {
+            insert = mem_access_callback_new(d->vram, added->vram_addr,
+                                             added->size,
+                                             &pgraph_surface_access_callback,
+                                             added);
+            added->access_cb = insert;
+        }
+
+        qemu_mutex_unlock(&pg->lock);
+        qemu_mutex_lock_iothread();
+        mem_access_callback_update(qemu_get_cpu(0), remove, invalidated->len,
+                                   &insert, insert ? 1 : 0);
+        qemu_mutex_unlock_iothread();
+        qemu_mutex_lock(&pg->lock);
+    }
+
+    for (guint i = 0; i < invalidated->len; i++) {
+        g_free(g_ptr_array_index(invalidated, i));
+    }
 }
 
 static void pgraph_surface_evict_old(NV2AState *d)
@@ -4921,6 +5609,8 @@ static void pgraph_surface_evict_old(NV2AState *d)
             pgraph_surface_invalidate(d, s);
         }
     }
+
+    pgraph_surface_update_access_callbacks(d, NULL);
 }
 
 static bool pgraph_check_surface_compatibility(SurfaceBinding *s1,
@@ -4973,114 +5663,885 @@ static void pgraph_bind_current_surface(NV2AState *d)
     }
 }
 
-static void surface_copy_shrink_row(uint8_t *out, uint8_t *in,
-                                    unsigned int width,
-                                    unsigned int bytes_per_pixel,
-                                    unsigned int factor)
+/* Swizzled transfers at or above this size go through the GPU, anything
+ * smaller (e.g. the tail of a mipmap chain) is cheaper to do on the CPU.
+ */
+#define GPU_SWIZZLE_MIN_TEXELS (64 * 64)
+
+/* Texture unit not used by the register combiners */
+#define GPU_SWIZZLE_TEXTURE_UNIT NV2A_MAX_TEXTURES
+
+static const GLenum gpu_swizzle_disabled_caps[] = {
+    GL_BLEND,
+    GL_CULL_FACE,
+    GL_DEPTH_TEST,
+    GL_DITHER,
+    GL_POLYGON_SMOOTH,
+    GL_SCISSOR_TEST,
+    GL_STENCIL_TEST,
+};
+
+static void pgraph_init_swizzle_program(GLuint prog, GLuint *out_prog,
+                                        GLint *tex_loc, GLint *size_loc,
+                                        GLint *mask_loc, GLint *scale_loc,
+                                        GLint *flip_loc)
 {
-    if (bytes_per_pixel == 4) {
-        for (unsigned int x = 0; x < width; x++) {
-            *(uint32_t *)out = *(uint32_t *)in;
-            out += 4;
-            in += 4 * factor;
-        }
-    } else if (bytes_per_pixel == 2) {
-        for (unsigned int x = 0; x < width; x++) {
-            *(uint16_t *)out = *(uint16_t *)in;
-            out += 2;
-            in += 2 * factor;
-        }
-    } else {
-        for (unsigned int x = 0; x < width; x++) {
-            memcpy(out, in, bytes_per_pixel);
-            out += bytes_per_pixel;
-            in += bytes_per_pixel * factor;
-        }
-    }
+    *out_prog = prog;
+    *tex_loc = glGetUniformLocation(prog, "tex");
+    *size_loc = glGetUniformLocation(prog, "size");
+    *mask_loc = glGetUniformLocation(prog, "mask");
+    *scale_loc = glGetUniformLocation(prog, "scale");
+    *flip_loc = glGetUniformLocation(prog, "flip");
+    glProgramUniform1i(prog, *tex_loc, GPU_SWIZZLE_TEXTURE_UNIT);
 }
 
-
-static void pgraph_download_surface_data_to_buffer(NV2AState *d,
-                                                   SurfaceBinding *surface,
-                                                   bool swizzle, bool flip,
-                                                   bool downscale,
-                                                   uint8_t *pixels)
+static void pgraph_init_swizzle_renderer(NV2AState *d)
 {
-    PGRAPHState *pg = &d->pgraph;
-    swizzle &= surface->swizzle;
-    downscale &= (pg->surface_scale_factor != 1);
+    struct PGRAPHState *pg = &d->pgraph;
+    struct swizzle_rndr *r = &pg->swizzle_rndr;
 
-    NV2A_XPRINTF(DBG_SURFACE_SYNC,
-                 "[GPU->RAM] %s (%s) surface @ %" HWADDR_PRIx
-                 " (w=%d,h=%d,p=%d,bpp=%d)\n",
+    const char *vs =
+        "#version 330\n"
+        "void main()\n"
+        "{\n"
+        "    float x = -1.0 + float((gl_VertexID & 1) << 2);\n"
+        "    float y = -1.0 + float((gl_VertexID & 2) << 1);\n"
+        "    gl_Position = vec4(x, y, 0, 1);\n"
+        "}\n";
+
+    /* Each fragment of the W*H target is one texel of the swizzled image:
+     * split its linear index back into x and y through the swizzle masks
+     * and fetch that texel from the (possibly scaled and flipped) surface.
+     */
+    const char *swizzle_fs =
+        "#version 330\n"
+        "uniform sampler2D tex;\n"
+        "uniform uvec2 size;\n"
+        "uniform uvec2 mask;\n"
+        "uniform uint scale;\n"
+        "uniform bool flip;\n"
+        "layout(location = 0) out vec4 out_Color;\n"
+        "uint extract_bits(uint value, uint m)\n"
+        "{\n"
+        "    uint result = 0u;\n"
+        "    uint bit = 1u;\n"
+        "    for (; m != 0u; m &= m - 1u) {\n"
+        "        if ((value & m & ~(m - 1u)) != 0u) {\n"
+        "            result |= bit;\n"
+        "        }\n"
+        "        bit <<= 1;\n"
+        "    }\n"
+        "    return result;\n"
+        "}\n"
+        "void main()\n"
+        "{\n"
+        "    uint i = uint(gl_FragCoord.y) * size.x + uint(gl_FragCoord.x);\n"
+        "    ivec2 pos = ivec2(extract_bits(i, mask.x) * scale,\n"
+        "                      extract_bits(i, mask.y) * scale);\n"
+        "    if (flip) {\n"
+        "        pos.y = int(size.y * scale) - 1 - pos.y;\n"
+        "    }\n"
+        "    out_Color = texelFetch(tex, pos, 0);\n"
+        "}\n";
+
+    /* The inverse: scatter the fragment coordinate into a swizzled index and
+     * fetch it from the raw swizzled data uploaded as a W*H texture.
+     */
+    const char *unswizzle_fs =
+        "#version 330\n"
+        "uniform sampler2D tex;\n"
+        "uniform uvec2 size;\n"
+        "uniform uvec2 mask;\n"
+        "uniform uint scale;\n"
+        "uniform bool flip;\n"
+        "layout(location = 0) out vec4 out_Color;\n"
+        "uint deposit_bits(uint value, uint m)\n"
+        "{\n"
+        "    uint result = 0u;\n"
+        "    for (; m != 0u; m &= m - 1u) {\n"
+        "        if ((value & 1u) != 0u) {\n"
+        "            result |= m & ~(m - 1u);\n"
+        "        }\n"
+        "        value >>= 1;\n"
+        "    }\n"
+        "    return result;\n"
+        "}\n"
+        "void main()\n"
+        "{\n"
+        "    uvec2 pos = uvec2(gl_FragCoord.xy) / scale;\n"
+        "    if (flip) {\n"
+        "        pos.y = size.y - 1u - pos.y;\n"
+        "    }\n"
+        "    uint i = deposit_bits(pos.x, mask.x) | deposit_bits(pos.y, mask.y);\n"
+        "    out_Color = texelFetch(tex, ivec2(i % size.x, i / size.x), 0);\n"
+        "}\n";
+
+    pgraph_init_swizzle_program(pgraph_compile_shader(vs, swizzle_fs),
+                                &r->swizzle.prog, &r->swizzle.tex_loc,
+                                &r->swizzle.size_loc, &r->swizzle.mask_loc,
+                                &r->swizzle.scale_loc, &r->swizzle.flip_loc);
+    pgraph_init_swizzle_program(pgraph_compile_shader(vs, unswizzle_fs),
+                                &r->unswizzle.prog, &r->unswizzle.tex_loc,
+                                &r->unswizzle.size_loc, &r->unswizzle.mask_loc,
+                                &r->unswizzle.scale_loc,
+                                &r->unswizzle.flip_loc);
+
+    glGenVertexArrays(1, &r->vao);
+    glGenFramebuffers(1, &r->fbo);
+    glGenTextures(1, &r->tex);
+    r->tex_internal_format = 0;
+    r->tex_width = 0;
+    r->tex_height = 0;
+}
+
+static bool pgraph_gpu_swizzle_format_supported(GLint gl_internal_format)
+{
+    /* Formats that can be rendered to and survive a normalized round trip
+     * through the shader bit-exactly. Depth, stencil and signed formats stay
+     * on the CPU path.
+     */
+    switch (gl_internal_format) {
+    case GL_RGBA8:
+    case GL_RGB5_A1:
+    case GL_RGBA4:
+    case GL_RGB565:
+    case GL_R8:
+    case GL_RG8:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool pgraph_gpu_swizzle_surface_supported(PGRAPHState *pg,
+                                                 SurfaceBinding *surface)
+{
+    /* G8B8 surfaces are transferred as GL_UNSIGNED_SHORT, leave those on the
+     * existing path.
+     */
+    return qatomic_read(&pg->gpu_swizzle) && surface->color &&
+           surface->fmt.gl_internal_format != GL_RG8 &&
+           pgraph_gpu_swizzle_format_supported(
+               surface->fmt.gl_internal_format) &&
+           is_power_of_2(surface->width) && is_power_of_2(surface->height);
+}
+
+/* Points the render context at the swizzle renderer and returns the texture
+ * unit to hand back to pgraph_gpu_swizzle_end. Everything changed here is
+ * either shadowed or known to PGRAPH, so nothing has to be queried from GL.
+ */
+static GLenum pgraph_gpu_swizzle_begin(PGRAPHState *pg)
+{
+    struct swizzle_rndr *r = &pg->swizzle_rndr;
+    GLenum active_texture = pg->gl_state.active_texture;
+
+    for (int i = 0; i < ARRAY_SIZE(gpu_swizzle_disabled_caps); i++) {
+        pgraph_gl_set_enabled(pg, gpu_swizzle_disabled_caps[i], false);
+    }
+    pgraph_gl_color_mask(pg, true, true, true, true);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, r->fbo);
+    glBindVertexArray(r->vao);
+    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    pgraph_gl_active_texture(pg, GL_TEXTURE0 + GPU_SWIZZLE_TEXTURE_UNIT);
+
+    return active_texture;
+}
+
+/* Rebinds PGRAPH's own framebuffer, vertex array and program and the texture
+ * unit that was active before. Caps, color mask and viewport are shadowed and
+ * left to the next draw.
+ */
+static void pgraph_gpu_swizzle_end(PGRAPHState *pg, GLenum active_texture)
+{
+    glBindTexture(GL_TEXTURE_2D, 0);
+    /* The GL default, which every upload puts back */
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    if (active_texture != (GLenum)-1) {
+        pgraph_gl_active_texture(pg, active_texture);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, pg->gl_framebuffer);
+    glBindVertexArray(pg->gl_vertex_array);
+    glUseProgram(pg->shader_binding ? pg->shader_binding->gl_program : 0);
+}
+
+/* Binds the scratch texture, (re)allocating it only when its shape changes */
+static void pgraph_gpu_swizzle_bind_tex(struct swizzle_rndr *r,
+                                        GLint gl_internal_format,
+                                        GLenum gl_format, GLenum gl_type,
+                                        unsigned int width,
+                                        unsigned int height,
+                                        const uint8_t *data)
+{
+    glBindTexture(GL_TEXTURE_2D, r->tex);
+    if (r->tex_internal_format != gl_internal_format ||
+        r->tex_width != width || r->tex_height != height) {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexImage2D(GL_TEXTURE_2D, 0, gl_internal_format, width, height, 0,
+                     gl_format, gl_type, data);
+        r->tex_internal_format = gl_internal_format;
+        r->tex_width = width;
+        r->tex_height = height;
+    } else if (data) {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, gl_format,
+                        gl_type, data);
+    }
+}
+
+/* Renders the texture bound to GPU_SWIZZLE_TEXTURE_UNIT into level
+ * dst_level of dst_texture through the given (un)swizzle program.
+ */
+static void pgraph_gpu_swizzle_draw(PGRAPHState *pg, bool swizzle,
+                                    GLenum dst_target, GLuint dst_texture,
+                                    GLint dst_level, unsigned int width,
+                                    unsigned int height, unsigned int scale,
+                                    bool flip)
+{
+    struct swizzle_rndr *r = &pg->swizzle_rndr;
+    uint32_t mask_x, mask_y, mask_z;
+    generate_swizzle_masks(width, height, 1, &mask_x, &mask_y, &mask_z);
+
+    unsigned int dst_width = width, dst_height = height;
+    if (!swizzle) {
+        dst_width *= scale;
+        dst_height *= scale;
+    }
+
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, dst_target,
+                           dst_texture, dst_level);
+    GLenum draw_buffers[1] = { GL_COLOR_ATTACHMENT0 };
+    glDrawBuffers(1, draw_buffers);
+    assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+
+    GLuint prog = swizzle ? r->swizzle.prog : r->unswizzle.prog;
+    if (swizzle) {
+        glProgramUniform2ui(prog, r->swizzle.size_loc, width, height);
+        glProgramUniform2ui(prog, r->swizzle.mask_loc, mask_x, mask_y);
+        glProgramUniform1ui(prog, r->swizzle.scale_loc, scale);
+        glProgramUniform1i(prog, r->swizzle.flip_loc, flip);
+    } else {
+        glProgramUniform2ui(prog, r->unswizzle.size_loc, width, height);
+        glProgramUniform2ui(prog, r->unswizzle.mask_loc, mask_x, mask_y);
+        glProgramUniform1ui(prog, r->unswizzle.scale_loc, scale);
+        glProgramUniform1i(prog, r->unswizzle.flip_loc, flip);
+    }
+    glUseProgram(prog);
+
+    pgraph_gl_viewport(pg, 0, 0, dst_width, dst_height);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+
+/* Queues a readback of a surface in swizzled order into the bound pixel pack
+ * buffer, scaling it down to its native size and optionally flipping it,
+ * without any CPU-side pixel shuffling.
+ */
+static void pgraph_download_surface_data_gpu_swizzle(PGRAPHState *pg,
+                                                     SurfaceBinding *surface,
+                                                     bool flip)
+{
+    struct swizzle_rndr *r = &pg->swizzle_rndr;
+
+    nv2a_profile_inc_counter(NV2A_PROF_GPU_SWIZZLE);
+
+    GLenum active_texture = pgraph_gpu_swizzle_begin(pg);
+    pgraph_gpu_swizzle_bind_tex(r, surface->fmt.gl_internal_format,
+                                surface->fmt.gl_format, surface->fmt.gl_type,
+                                surface->width, surface->height, NULL);
+    glBindTexture(GL_TEXTURE_2D, surface->gl_buffer);
+    pgraph_gpu_swizzle_draw(pg, true, GL_TEXTURE_2D, r->tex, 0, surface->width,
+                            surface->height, pg->surface_scale_factor, flip);
+
+    glo_readpixels(surface->fmt.gl_format, surface->fmt.gl_type,
+                   surface->fmt.bytes_per_pixel,
+                   surface->width * surface->fmt.bytes_per_pixel,
+                   surface->width, surface->height, NULL);
+
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                           0, 0);
+    pgraph_gpu_swizzle_end(pg, active_texture);
+}
+
+/* Uploads swizzled data and unswizzles it into level dst_level of
+ * dst_texture, which must already be allocated at width*scale x
+ * height*scale. The caller's texture bindings are left untouched.
+ */
+static void pgraph_gpu_unswizzle(PGRAPHState *pg, GLint gl_internal_format,
+                                 GLenum gl_format, GLenum gl_type,
+                                 const uint8_t *data, unsigned int width,
+                                 unsigned int height, GLenum dst_target,
+                                 GLuint dst_texture, GLint dst_level,
+                                 unsigned int scale, bool flip)
+{
+    struct swizzle_rndr *r = &pg->swizzle_rndr;
+
+    nv2a_profile_inc_counter(NV2A_PROF_GPU_UNSWIZZLE);
+
+    GLenum active_texture = pgraph_gpu_swizzle_begin(pg);
+    pgraph_gpu_swizzle_bind_tex(r, gl_internal_format, gl_format, gl_type,
+                                width, height, data);
+    pgraph_gpu_swizzle_draw(pg, false, dst_target, dst_texture, dst_level,
+                            width, height, scale, flip);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, dst_target,
+                           0, 0);
+    pgraph_gpu_swizzle_end(pg, active_texture);
+}
+
+static void pgraph_init_blit_renderer(NV2AState *d)
+{
+    struct blit_rndr *r = &d->pgraph.blit_rndr;
+
+    glGenFramebuffers(1, &r->read_fbo);
+    glGenFramebuffers(1, &r->draw_fbo);
+    glGenTextures(2, r->tex);
+    for (int i = 0; i < 2; i++) {
+        r->tex_internal_format[i] = 0;
+        r->tex_width[i] = 0;
+        r->tex_height[i] = 0;
+    }
+}
+
+static void pgraph_blit_attach(GLenum target, SurfaceBinding *surface,
+                               GLuint texture)
+{
+    glFramebufferTexture2D(target, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, 0, 0);
+    glFramebufferTexture2D(target, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, 0, 0);
+    glFramebufferTexture2D(target, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D,
+                           0, 0);
+    if (texture) {
+        glFramebufferTexture2D(target, surface->fmt.gl_attachment,
+                               GL_TEXTURE_2D, texture, 0);
+    }
+    if (target == GL_READ_FRAMEBUFFER) {
+        glReadBuffer(surface->color ? GL_COLOR_ATTACHMENT0 : GL_NONE);
+    } else {
+        glDrawBuffer(surface->color ? GL_COLOR_ATTACHMENT0 : GL_NONE);
+    }
+}
+
+/* Returns the scratch texture matching the surface format, (re)allocated at
+ * width x height and optionally filled with data. Must be called with
+ * GL_TEXTURE_2D of the active unit free to be clobbered.
+ */
+static GLuint pgraph_blit_scratch_texture(PGRAPHState *pg,
+                                          SurfaceBinding *surface,
+                                          unsigned int width,
+                                          unsigned int height,
+                                          const uint8_t *data)
+{
+    struct blit_rndr *r = &pg->blit_rndr;
+    int i = surface->color;
+
+    if (r->tex_internal_format[i] != surface->fmt.gl_internal_format ||
+        r->tex_width[i] != width || r->tex_height[i] != height) {
+        glBindTexture(GL_TEXTURE_2D, r->tex[i]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+        glTexImage2D(GL_TEXTURE_2D, 0, surface->fmt.gl_internal_format,
+                     width, height, 0, surface->fmt.gl_format,
+                     surface->fmt.gl_type, data);
+        r->tex_internal_format[i] = surface->fmt.gl_internal_format;
+        r->tex_width[i] = width;
+        r->tex_height[i] = height;
+    } else if (data) {
+        glBindTexture(GL_TEXTURE_2D, r->tex[i]);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height,
+                        surface->fmt.gl_format, surface->fmt.gl_type, data);
+    }
+
+    return r->tex[i];
+}
+
+/* Copies a rectangle between whatever is attached to the blit read and draw
+ * framebuffers, flipping it if the destination rectangle is upside down.
+ */
+static void pgraph_blit_surface_rect(PGRAPHState *pg,
+                                     SurfaceBinding *surface,
+                                     GLint src_x0, GLint src_y0,
+                                     GLint src_x1, GLint src_y1,
+                                     GLint dst_x0, GLint dst_y0,
+                                     GLint dst_x1, GLint dst_y1)
+{
+    assert(glCheckFramebufferStatus(GL_READ_FRAMEBUFFER) ==
+           GL_FRAMEBUFFER_COMPLETE);
+    assert(glCheckFramebufferStatus(GL_DRAW_FRAMEBUFFER) ==
+           GL_FRAMEBUFFER_COMPLETE);
+
+    GLbitfield mask;
+    switch (surface->fmt.gl_attachment) {
+    case GL_DEPTH_ATTACHMENT:
+        mask = GL_DEPTH_BUFFER_BIT;
+        break;
+    case GL_DEPTH_STENCIL_ATTACHMENT:
+        mask = GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT;
+        break;
+    default:
+        mask = GL_COLOR_BUFFER_BIT;
+        break;
+    }
+
+    /* Blits are subject to the scissor test, which the next draw sets up
+     * again through the shadow */
+    pgraph_gl_set_enabled(pg, GL_SCISSOR_TEST, false);
+    glBlitFramebuffer(src_x0, src_y0, src_x1, src_y1,
+                      dst_x0, dst_y0, dst_x1, dst_y1, mask, GL_NEAREST);
+}
+
+/* Copies between a surface texture and a scratch texture with a flip and/or
+ * resize, using whatever is attached to the blit read and draw framebuffers.
+ */
+static void pgraph_blit_surface(PGRAPHState *pg, SurfaceBinding *surface,
+                                unsigned int src_width,
+                                unsigned int src_height,
+                                unsigned int dst_width,
+                                unsigned int dst_height, bool flip)
+{
+    pgraph_blit_surface_rect(pg, surface, 0, 0, src_width, src_height,
+                             0, flip ? dst_height : 0,
+                             dst_width, flip ? 0 : dst_height);
+}
+
+/* Returns the surface whose texture holds the whole width x height
+ * rectangle at addr laid out with pitch, and the position of the rectangle
+ * within it, or NULL if there is no such surface or VRAM is newer.
+ */
+static SurfaceBinding *pgraph_image_blit_find_surface(
+    NV2AState *d, hwaddr addr, unsigned int pitch,
+    unsigned int bytes_per_pixel, unsigned int width, unsigned int height,
+    unsigned int *x, unsigned int *y)
+{
+    SurfaceBinding *surface = pgraph_surface_get_within(d, addr);
+    if (surface == NULL || !surface->color || surface->swizzle ||
+        surface->upload_pending || surface->pitch != pitch ||
+        surface->fmt.bytes_per_pixel != bytes_per_pixel) {
+        return NULL;
+    }
+
+    hwaddr offset = addr - surface->vram_addr;
+    if ((offset % pitch) % bytes_per_pixel) {
+        return NULL;
+    }
+    *x = (offset % pitch) / bytes_per_pixel;
+    *y = offset / pitch;
+    if (*x + width > surface->width || *y + height > surface->height) {
+        return NULL;
+    }
+
+    return surface;
+}
+
+/* Surface textures are stored upside down at the render scale */
+static void pgraph_image_blit_gl_rect(PGRAPHState *pg,
+                                      SurfaceBinding *surface,
+                                      unsigned int x, unsigned int y,
+                                      unsigned int width, unsigned int height,
+                                      GLint rect[4])
+{
+    unsigned int x0 = x, y0 = surface->height - y - height;
+    unsigned int x1 = x + width, y1 = surface->height - y;
+    pgraph_apply_scaling_factor(pg, &x0, &y0);
+    pgraph_apply_scaling_factor(pg, &x1, &y1);
+    rect[0] = x0;
+    rect[1] = y0;
+    rect[2] = x1;
+    rect[3] = y1;
+}
+
+/* Copies a rectangle from one surface texture to another, or within one */
+static void pgraph_image_blit_gpu(NV2AState *d, SurfaceBinding *src,
+                                  unsigned int src_x, unsigned int src_y,
+                                  SurfaceBinding *dst,
+                                  unsigned int dst_x, unsigned int dst_y,
+                                  unsigned int width, unsigned int height)
+{
+    PGRAPHState *pg = &d->pgraph;
+    struct blit_rndr *r = &pg->blit_rndr;
+    GLint src_rect[4], dst_rect[4];
+
+    pgraph_image_blit_gl_rect(pg, src, src_x, src_y, width, height, src_rect);
+    pgraph_image_blit_gl_rect(pg, dst, dst_x, dst_y, width, height, dst_rect);
+
+    GLint last_texture_binding;
+    glGetIntegerv(GL_TEXTURE_BINDING_2D, &last_texture_binding);
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, r->read_fbo);
+    pgraph_blit_attach(GL_READ_FRAMEBUFFER, src, src->gl_buffer);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, r->draw_fbo);
+
+    if (src == dst) {
+        /* The rectangles may overlap, go through the scratch texture */
+        unsigned int scaled_width = width, scaled_height = height;
+        pgraph_apply_scaling_factor(pg, &scaled_width, &scaled_height);
+        GLuint tex = pgraph_blit_scratch_texture(pg, src, scaled_width,
+                                                 scaled_height, NULL);
+        pgraph_blit_attach(GL_DRAW_FRAMEBUFFER, dst, tex);
+        pgraph_blit_surface_rect(pg, src, src_rect[0], src_rect[1],
+                                 src_rect[2], src_rect[3], 0, 0,
+                                 scaled_width, scaled_height);
+        pgraph_blit_attach(GL_READ_FRAMEBUFFER, src, tex);
+        src_rect[0] = 0;
+        src_rect[1] = 0;
+        src_rect[2] = scaled_width;
+        src_rect[3] = scaled_height;
+    }
+
+    pgraph_blit_attach(GL_DRAW_FRAMEBUFFER, dst, dst->gl_buffer);
+    pgraph_blit_surface_rect(pg, dst, src_rect[0], src_rect[1], src_rect[2],
+                             src_rect[3], dst_rect[0], dst_rect[1],
+                             dst_rect[2], dst_rect[3]);
+    pgraph_blit_attach(GL_READ_FRAMEBUFFER, src, 0);
+    pgraph_blit_attach(GL_DRAW_FRAMEBUFFER, dst, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, pg->gl_framebuffer);
+
+    glBindTexture(GL_TEXTURE_2D, last_texture_binding);
+}
+
+/* Uploads a rectangle of linear pixels into part of a surface texture */
+static void pgraph_image_blit_upload(NV2AState *d, SurfaceBinding *surface,
+                                     const uint8_t *pixels,
+                                     unsigned int pitch,
+                                     unsigned int x, unsigned int y,
+                                     unsigned int width, unsigned int height)
+{
+    PGRAPHState *pg = &d->pgraph;
+    struct blit_rndr *r = &pg->blit_rndr;
+    GLint rect[4];
+
+    pgraph_image_blit_gl_rect(pg, surface, x, y, width, height, rect);
+
+    GLint last_texture_binding;
+    glGetIntegerv(GL_TEXTURE_BINDING_2D, &last_texture_binding);
+
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, pitch / surface->fmt.bytes_per_pixel);
+    GLuint tex = pgraph_blit_scratch_texture(pg, surface, width, height,
+                                             pixels);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, r->read_fbo);
+    pgraph_blit_attach(GL_READ_FRAMEBUFFER, surface, tex);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, r->draw_fbo);
+    pgraph_blit_attach(GL_DRAW_FRAMEBUFFER, surface, surface->gl_buffer);
+    pgraph_blit_surface_rect(pg, surface, 0, 0, width, height,
+                             rect[0], rect[3], rect[2], rect[1]);
+    pgraph_blit_attach(GL_READ_FRAMEBUFFER, surface, 0);
+    pgraph_blit_attach(GL_DRAW_FRAMEBUFFER, surface, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, pg->gl_framebuffer);
+
+    glBindTexture(GL_TEXTURE_2D, last_texture_binding);
+}
+
+static bool pgraph_mark_surface_upload_pending(IntervalTreeNode *node,
+                                               void *opaque)
+{
+    SurfaceBinding *surface = container_of(node, SurfaceBinding, vram_range);
+    surface->upload_pending = true;
+    return false;
+}
+
+/* NV09F SRCCOPY. When the rectangle lies within cached surfaces on both
+ * sides it is copied between their textures without touching VRAM, which
+ * catches up whenever the destination is next downloaded. Otherwise VRAM
+ * is brought up to date and the copy is done there, patching the
+ * destination texture directly if it is cached.
+ */
+static void pgraph_image_blit(NV2AState *d)
+{
+    PGRAPHState *pg = &d->pgraph;
+    ContextSurfaces2DState *context_surfaces = &pg->context_surfaces_2d;
+    ImageBlitState *image_blit = &pg->image_blit;
+
+    unsigned int bytes_per_pixel;
+    switch (context_surfaces->color_format) {
+    case NV062_SET_COLOR_FORMAT_LE_Y8:
+        bytes_per_pixel = 1;
+        break;
+    case NV062_SET_COLOR_FORMAT_LE_R5G6B5:
+        bytes_per_pixel = 2;
+        break;
+    case NV062_SET_COLOR_FORMAT_LE_A8R8G8B8:
+    case NV062_SET_COLOR_FORMAT_LE_X8R8G8B8:
+    case NV062_SET_COLOR_FORMAT_LE_Y32:
+        bytes_per_pixel = 4;
+        break;
+    default:
+        fprintf(stderr, "Unknown blit surface format: 0x%x\n",
+                context_surfaces->color_format);
+        assert(false);
+        break;
+    }
+
+    hwaddr source_dma_len, dest_dma_len;
+    uint8_t *source, *dest;
+
+    source = (uint8_t*)nv_dma_map(d, context_surfaces->dma_image_source,
+                                  &source_dma_len);
+    assert(context_surfaces->source_offset < source_dma_len);
+    source += context_surfaces->source_offset;
+
+    dest = (uint8_t*)nv_dma_map(d, context_surfaces->dma_image_dest,
+                                &dest_dma_len);
+    assert(context_surfaces->dest_offset < dest_dma_len);
+    dest += context_surfaces->dest_offset;
+
+    NV2A_DPRINTF("  - 0x%tx -> 0x%tx\n", source - d->vram_ptr,
+                                         dest - d->vram_ptr);
+
+    unsigned int width = image_blit->width, height = image_blit->height;
+    if (width == 0 || height == 0) {
+        return;
+    }
+
+    unsigned int source_pitch = context_surfaces->source_pitch;
+    unsigned int dest_pitch = context_surfaces->dest_pitch;
+    uint8_t *source_rect = source + image_blit->in_y * source_pitch
+                           + image_blit->in_x * bytes_per_pixel;
+    uint8_t *dest_rect = dest + image_blit->out_y * dest_pitch
+                         + image_blit->out_x * bytes_per_pixel;
+    hwaddr row_size = width * bytes_per_pixel;
+    hwaddr source_addr = source_rect - d->vram_ptr;
+    hwaddr source_last = source_addr + (height - 1) * source_pitch
+                         + row_size - 1;
+    hwaddr dest_addr = dest_rect - d->vram_ptr;
+    hwaddr dest_len = (height - 1) * dest_pitch + row_size;
+
+    unsigned int src_x, src_y, dst_x, dst_y;
+    SurfaceBinding *surf_src = pgraph_image_blit_find_surface(
+        d, source_addr, source_pitch, bytes_per_pixel, width, height,
+        &src_x, &src_y);
+    SurfaceBinding *surf_dest = pgraph_image_blit_find_surface(
+        d, dest_addr, dest_pitch, bytes_per_pixel, width, height,
+        &dst_x, &dst_y);
+
+    if (surf_src && surf_dest &&
+        surf_src->fmt.gl_internal_format == surf_dest->fmt.gl_internal_format &&
+        surf_src->fmt.gl_format == surf_dest->fmt.gl_format &&
+        surf_src->fmt.gl_type == surf_dest->fmt.gl_type) {
+        nv2a_profile_inc_counter(NV2A_PROF_IMAGE_BLIT);
+
+        pgraph_image_blit_gpu(d, surf_src, src_x, src_y, surf_dest, dst_x,
+                              dst_y, width, height);
+
+        surf_dest->draw_dirty = true;
+        surf_dest->frame_time = pg->frame_time;
+        if (surf_dest->download_fence) {
+            nv2a_profile_inc_counter(NV2A_PROF_SURF_DOWNLOAD_STALE);
+            pgraph_surface_download_cancel(surf_dest);
+        }
+        return;
+    }
+
+    nv2a_profile_inc_counter(NV2A_PROF_IMAGE_BLIT_FALLBACK);
+
+    interval_tree_visit(&pg->surface_ranges, source_addr, source_last,
+                        pgraph_download_overlapping_surface, d);
+    if (!surf_dest) {
+        interval_tree_visit(&pg->surface_ranges, dest_addr,
+                            dest_addr + dest_len - 1,
+                            pgraph_download_overlapping_surface, d);
+    }
+
+    for (unsigned int y = 0; y < height; y++) {
+        memmove(dest_rect + y * dest_pitch, source_rect + y * source_pitch,
+                row_size);
+    }
+
+    memory_region_set_client_dirty(d->vram, dest_addr, dest_len,
+                                   DIRTY_MEMORY_VGA);
+    memory_region_set_client_dirty(d->vram, dest_addr, dest_len,
+                                   DIRTY_MEMORY_NV2A_TEX);
+
+    if (surf_dest) {
+        pgraph_image_blit_upload(d, surf_dest, dest_rect, dest_pitch, dst_x,
+                                 dst_y, width, height);
+        surf_dest->frame_time = pg->frame_time;
+    } else {
+        interval_tree_visit(&pg->surface_ranges, dest_addr,
+                            dest_addr + dest_len - 1,
+                            pgraph_mark_surface_upload_pending, NULL);
+    }
+}
+
+/* Queues a readback of the surface at width x height into the bound pixel
+ * pack buffer. Flipping and scaling down from the render scale are done by
+ * blitting into a scratch target first, so the rows never need to be
+ * touched on the CPU.
+ */
+static void pgraph_surface_download_readback(PGRAPHState *pg,
+                                             SurfaceBinding *surface,
+                                             bool flip, unsigned int width,
+                                             unsigned int height)
+{
+    struct blit_rndr *r = &pg->blit_rndr;
+    unsigned int src_width = surface->width, src_height = surface->height;
+    pgraph_apply_scaling_factor(pg, &src_width, &src_height);
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, r->read_fbo);
+    pgraph_blit_attach(GL_READ_FRAMEBUFFER, surface, surface->gl_buffer);
+
+    if (flip || width != src_width || height != src_height) {
+        GLint last_texture_binding;
+        glGetIntegerv(GL_TEXTURE_BINDING_2D, &last_texture_binding);
+        GLuint tex = pgraph_blit_scratch_texture(pg, surface, width, height,
+                                                 NULL);
+        glBindTexture(GL_TEXTURE_2D, last_texture_binding);
+
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, r->draw_fbo);
+        pgraph_blit_attach(GL_DRAW_FRAMEBUFFER, surface, tex);
+        pgraph_blit_surface(pg, surface, src_width, src_height, width, height,
+                            flip);
+
+        pgraph_blit_attach(GL_READ_FRAMEBUFFER, surface, 0);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, r->draw_fbo);
+        glReadBuffer(surface->color ? GL_COLOR_ATTACHMENT0 : GL_NONE);
+    }
+
+    assert(glCheckFramebufferStatus(GL_READ_FRAMEBUFFER) ==
+           GL_FRAMEBUFFER_COMPLETE);
+    glo_readpixels(surface->fmt.gl_format, surface->fmt.gl_type,
+                   surface->fmt.bytes_per_pixel,
+                   width * surface->fmt.bytes_per_pixel, width, height, NULL);
+
+    pgraph_blit_attach(GL_READ_FRAMEBUFFER, surface, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, pg->gl_framebuffer);
+}
+
+/* Starts an asynchronous download of the surface into its pixel buffer. The
+ * data is only mapped and written out by pgraph_surface_download_end.
+ */
+static void pgraph_surface_download_begin(NV2AState *d,
+                                          SurfaceBinding *surface,
+                                          bool swizzle, bool flip,
+                                          bool downscale)
+{
+    PGRAPHState *pg = &d->pgraph;
+    swizzle &= surface->swizzle;
+    downscale &= (pg->surface_scale_factor != 1);
+
+    NV2A_XPRINTF(DBG_SURFACE_SYNC,
+                 "[GPU->RAM] %s (%s) surface @ %" HWADDR_PRIx
+                 " (w=%d,h=%d,p=%d,bpp=%d)\n",
                  surface->color ? "COLOR" : "ZETA",
                  surface->swizzle ? "sz" : "lin", surface->vram_addr,
                  surface->width, surface->height, surface->pitch,
                  surface->fmt.bytes_per_pixel);
 
-    /*  Bind destination surface to framebuffer */
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
-                           0, 0);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D,
-                           0, 0);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
-                           GL_TEXTURE_2D, 0, 0);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, surface->fmt.gl_attachment,
-                           GL_TEXTURE_2D, surface->gl_buffer, 0);
+    pgraph_surface_download_cancel(surface);
 
-    assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+    bool gpu_swizzle =
+        swizzle && pgraph_gpu_swizzle_surface_supported(pg, surface);
+    unsigned int width = surface->width, height = surface->height;
+    unsigned int pitch = surface->pitch;
 
-    /* Read surface into memory */
-    uint8_t *gl_read_buf = pixels;
+    if (gpu_swizzle) {
+        pitch = width * surface->fmt.bytes_per_pixel;
+    } else if (!downscale) {
+        assert(!swizzle || pg->surface_scale_factor == 1);
+        pgraph_apply_scaling_factor(pg, &width, &height);
+        pitch *= pg->surface_scale_factor;
+    }
 
-    uint8_t *swizzle_buf = pixels;
-    if (swizzle) {
-        /* FIXME: Allocate big buffer up front and re-alloc if necessary.
-         * FIXME: Consider swizzle in shader
-         */
-        assert(pg->surface_scale_factor == 1 || downscale);
-        swizzle_buf = (uint8_t *)g_malloc(surface->height * surface->pitch);
-        gl_read_buf = swizzle_buf;
+    size_t size = width * height * surface->fmt.bytes_per_pixel;
+    if (!surface->pbo) {
+        glGenBuffers(1, &surface->pbo);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, surface->pbo);
+    if (surface->pbo_size < size) {
+        glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+        surface->pbo_size = size;
     }
 
-    if (downscale) {
-        pg->scale_buf = (uint8_t *)g_realloc(
-            pg->scale_buf, pg->surface_scale_factor * pg->surface_scale_factor *
-                               surface->height * surface->pitch *
-                               surface->fmt.bytes_per_pixel);
-        gl_read_buf = pg->scale_buf;
+    if (gpu_swizzle) {
+        pgraph_download_surface_data_gpu_swizzle(pg, surface, flip);
+    } else {
+        pgraph_surface_download_readback(pg, surface, flip, width, height);
     }
 
-    glo_readpixels(
-        surface->fmt.gl_format, surface->fmt.gl_type, surface->fmt.bytes_per_pixel,
-        pg->surface_scale_factor * surface->pitch,
-        pg->surface_scale_factor * surface->width,
-        pg->surface_scale_factor * surface->height, flip, gl_read_buf);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    surface->download_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    surface->download_width = width;
+    surface->download_height = height;
+    surface->download_pitch = pitch;
+    surface->download_swizzle = swizzle && !gpu_swizzle;
+}
+
+/* Waits for the download started by pgraph_surface_download_begin and writes
+ * it out to pixels, swizzling it on the CPU if that was left to do.
+ */
+static void pgraph_surface_download_end(SurfaceBinding *surface,
+                                        uint8_t *pixels)
+{
+    assert(surface->download_fence != NULL);
+    GLenum result = glClientWaitSync(surface->download_fence,
+                                     GL_SYNC_FLUSH_COMMANDS_BIT,
+                                     (GLuint64)(5000000000));
+    assert(result == GL_CONDITION_SATISFIED || result == GL_ALREADY_SIGNALED);
+    glDeleteSync(surface->download_fence);
+    surface->download_fence = NULL;
+
+    unsigned int bytes_per_pixel = surface->fmt.bytes_per_pixel;
+    unsigned int width = surface->download_width;
+    unsigned int height = surface->download_height;
+    unsigned int pitch = surface->download_pitch;
+    size_t row_size = width * bytes_per_pixel;
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, surface->pbo);
+    const uint8_t *in = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+                                         row_size * height, GL_MAP_READ_BIT);
+    assert(in != NULL);
 
-    /* FIXME: Replace this with a hw accelerated version */
-    if (downscale) {
-        assert(surface->pitch >= (surface->width * surface->fmt.bytes_per_pixel));
-        uint8_t *out = swizzle_buf, *in = pg->scale_buf;
-        for (unsigned int y = 0; y < surface->height; y++) {
-            surface_copy_shrink_row(out, in, surface->width,
-                                    surface->fmt.bytes_per_pixel,
-                                    pg->surface_scale_factor);
-            in += surface->pitch * pg->surface_scale_factor *
-                  pg->surface_scale_factor;
-            out += surface->pitch;
+    uint8_t *out = pixels;
+    if (surface->download_swizzle) {
+        out = (uint8_t *)g_malloc(height * pitch);
+    }
+
+    assert(pitch >= row_size);
+    if (pitch == row_size) {
+        memcpy(out, in, row_size * height);
+    } else {
+        for (unsigned int y = 0; y < height; y++) {
+            memcpy(out + y * pitch, in + y * row_size, row_size);
         }
     }
 
-    if (swizzle) {
-        swizzle_rect(swizzle_buf, surface->width, surface->height, pixels,
-                     surface->pitch, surface->fmt.bytes_per_pixel);
-        g_free(swizzle_buf);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    if (surface->download_swizzle) {
+        swizzle_rect(out, width, height, pixels, pitch, bytes_per_pixel);
+        g_free(out);
     }
+}
 
-    /* Re-bind original framebuffer target */
-    glFramebufferTexture2D(GL_FRAMEBUFFER, surface->fmt.gl_attachment,
-                           GL_TEXTURE_2D, 0, 0);
-    pgraph_bind_current_surface(d);
+static void pgraph_surface_download_cancel(SurfaceBinding *surface)
+{
+    if (surface->download_fence) {
+        glDeleteSync(surface->download_fence);
+        surface->download_fence = NULL;
+    }
+}
+
+/* Kicks off the download of a dirty surface ahead of the CPU touching it */
+static void pgraph_surface_download_begin_if_dirty(NV2AState *d,
+                                                   SurfaceBinding *surface)
+{
+    if (surface->draw_dirty && !surface->download_fence) {
+        nv2a_profile_inc_counter(NV2A_PROF_SURF_DOWNLOAD_EARLY);
+        pgraph_surface_download_begin(d, surface, true, true, true);
+    }
+}
+
+static void pgraph_download_surface_data_to_buffer(NV2AState *d,
+                                                   SurfaceBinding *surface,
+                                                   bool swizzle, bool flip,
+                                                   bool downscale,
+                                                   uint8_t *pixels)
+{
+    pgraph_surface_download_begin(d, surface, swizzle, flip, downscale);
+    pgraph_surface_download_end(surface, pixels);
 }
 
 static void pgraph_download_surface_data(NV2AState *d, SurfaceBinding *surface,
@@ -5094,8 +6555,13 @@ static void pgraph_download_surface_data(NV2AState *d, SurfaceBinding *surface,
 
     nv2a_profile_inc_counter(NV2A_PROF_SURF_DOWNLOAD);
 
-    pgraph_download_surface_data_to_buffer(
-        d, surface, true, true, true, d->vram_ptr + surface->vram_addr);
+    /* Reuse a download started early, it is discarded if the surface has
+     * been drawn to since.
+     */
+    if (!surface->download_fence) {
+        pgraph_surface_download_begin(d, surface, true, true, true);
+    }
+    pgraph_surface_download_end(surface, d->vram_ptr + surface->vram_addr);
 
     memory_region_set_client_dirty(d->vram, surface->vram_addr,
                                    surface->pitch * surface->height,
@@ -5122,6 +6588,16 @@ void pgraph_process_pending_downloads(NV2AState *d)
 void pgraph_download_dirty_surfaces(NV2AState *d)
 {
     SurfaceBinding *surface;
+
+    /* Reports are part of the VRAM state being brought up to date */
+    pgraph_complete_reports(d, true);
+
+    /* Queue every readback before waiting on the first one */
+    QTAILQ_FOREACH(surface, &d->pgraph.surfaces, entry) {
+        pgraph_surface_download_begin_if_dirty(d, surface);
+    }
+    glFlush();
+
     QTAILQ_FOREACH(surface, &d->pgraph.surfaces, entry) {
         pgraph_download_surface_data_if_dirty(d, surface);
     }
@@ -5131,57 +6607,6 @@ void pgraph_download_dirty_surfaces(NV2AState *d)
 }
 
 
-static void surface_copy_expand_row(uint8_t *out, uint8_t *in,
-                                    unsigned int width,
-                                    unsigned int bytes_per_pixel,
-                                    unsigned int factor)
-{
-    if (bytes_per_pixel == 4) {
-        for (unsigned int x = 0; x < width; x++) {
-            for (unsigned int i = 0; i < factor; i++) {
-                *(uint32_t *)out = *(uint32_t *)in;
-                out += bytes_per_pixel;
-            }
-            in += bytes_per_pixel;
-        }
-    } else if (bytes_per_pixel == 2) {
-        for (unsigned int x = 0; x < width; x++) {
-            for (unsigned int i = 0; i < factor; i++) {
-                *(uint16_t *)out = *(uint16_t *)in;
-                out += bytes_per_pixel;
-            }
-            in += bytes_per_pixel;
-        }
-    } else {
-        for (unsigned int x = 0; x < width; x++) {
-            for (unsigned int i = 0; i < factor; i++) {
-                memcpy(out, in, bytes_per_pixel);
-                out += bytes_per_pixel;
-            }
-            in += bytes_per_pixel;
-        }
-    }
-}
-
-static void surface_copy_expand(uint8_t *out, uint8_t *in, unsigned int width,
-                                unsigned int height,
-                                unsigned int bytes_per_pixel,
-                                unsigned int factor)
-{
-    size_t out_pitch = width * bytes_per_pixel * factor;
-
-    for (unsigned int y = 0; y < height; y++) {
-        surface_copy_expand_row(out, in, width, bytes_per_pixel, factor);
-        uint8_t *row_in = out;
-        for (unsigned int i = 1; i < factor; i++) {
-            out += out_pitch;
-            memcpy(out, row_in, out_pitch);
-        }
-        in += width * bytes_per_pixel;
-        out += out_pitch;
-    }
-}
-
 static void pgraph_upload_surface_data(NV2AState *d, SurfaceBinding *surface,
                                        bool force)
 {
@@ -5202,6 +6627,7 @@ static void pgraph_upload_surface_data(NV2AState *d, SurfaceBinding *surface,
     PGRAPHState *pg = &d->pgraph;
 
     surface->upload_pending = false;
+    pgraph_surface_download_cancel(surface);
 
     // FIXME: Don't query GL for texture binding
     GLint last_texture_binding;
@@ -5218,6 +6644,23 @@ static void pgraph_upload_surface_data(NV2AState *d, SurfaceBinding *surface,
     uint8_t *data = d->vram_ptr;
     uint8_t *buf = data + surface->vram_addr;
 
+    if (surface->swizzle && pgraph_gpu_swizzle_surface_supported(pg, surface)) {
+        unsigned int width = surface->width, height = surface->height;
+        pgraph_apply_scaling_factor(pg, &width, &height);
+        glBindTexture(GL_TEXTURE_2D, surface->gl_buffer);
+        glTexImage2D(GL_TEXTURE_2D, 0, surface->fmt.gl_internal_format, width,
+                     height, 0, surface->fmt.gl_format, surface->fmt.gl_type,
+                     NULL);
+        pgraph_gpu_unswizzle(pg, surface->fmt.gl_internal_format,
+                             surface->fmt.gl_format, surface->fmt.gl_type, buf,
+                             surface->width, surface->height, GL_TEXTURE_2D,
+                             surface->gl_buffer, 0, pg->surface_scale_factor,
+                             true);
+        glBindTexture(GL_TEXTURE_2D, last_texture_binding);
+        pgraph_bind_current_surface(d);
+        return;
+    }
+
     if (surface->swizzle) {
         buf = (uint8_t*)g_malloc(surface->size);
         unswizzle_rect(data + surface->vram_addr,
@@ -5227,41 +6670,37 @@ static void pgraph_upload_surface_data(NV2AState *d, SurfaceBinding *surface,
                        surface->fmt.bytes_per_pixel);
     }
 
-    /* FIXME: Replace this flip/scaling */
+    /* Upload at native resolution, then flip and scale up to the render scale
+     * with a blit.
+     */
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH,
+                  surface->pitch / surface->fmt.bytes_per_pixel);
+    GLuint tex = pgraph_blit_scratch_texture(pg, surface, surface->width,
+                                             surface->height, buf);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
 
-    // This is VRAM so we can't do this inplace!
-    uint8_t *flipped_buf = (uint8_t *)g_malloc(
-        surface->height * surface->width * surface->fmt.bytes_per_pixel);
-    unsigned int irow;
-    for (irow = 0; irow < surface->height; irow++) {
-        memcpy(&flipped_buf[surface->width * (surface->height - irow - 1)
-                                 * surface->fmt.bytes_per_pixel],
-               &buf[surface->pitch * irow],
-               surface->width * surface->fmt.bytes_per_pixel);
+    if (surface->swizzle) {
+        g_free(buf);
     }
 
-    uint8_t *gl_read_buf = flipped_buf;
     unsigned int width = surface->width, height = surface->height;
-
-    if (pg->surface_scale_factor > 1) {
-        pgraph_apply_scaling_factor(pg, &width, &height);
-        pg->scale_buf = (uint8_t *)g_realloc(
-            pg->scale_buf, width * height * surface->fmt.bytes_per_pixel);
-        gl_read_buf = pg->scale_buf;
-        uint8_t *out = gl_read_buf, *in = flipped_buf;
-        surface_copy_expand(out, in, surface->width, surface->height,
-                            surface->fmt.bytes_per_pixel,
-                            d->pgraph.surface_scale_factor);
-    }
-
+    pgraph_apply_scaling_factor(pg, &width, &height);
     glBindTexture(GL_TEXTURE_2D, surface->gl_buffer);
     glTexImage2D(GL_TEXTURE_2D, 0, surface->fmt.gl_internal_format, width,
                  height, 0, surface->fmt.gl_format, surface->fmt.gl_type,
-                 gl_read_buf);
-    g_free(flipped_buf);
-    if (surface->swizzle) {
-        g_free(buf);
-    }
+                 NULL);
+
+    struct blit_rndr *r = &pg->blit_rndr;
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, r->read_fbo);
+    pgraph_blit_attach(GL_READ_FRAMEBUFFER, surface, tex);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, r->draw_fbo);
+    pgraph_blit_attach(GL_DRAW_FRAMEBUFFER, surface, surface->gl_buffer);
+    pgraph_blit_surface(pg, surface, surface->width, surface->height, width,
+                        height, true);
+    pgraph_blit_attach(GL_DRAW_FRAMEBUFFER, surface, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, pg->gl_framebuffer);
 
     // Rebind previous framebuffer binding
     glBindTexture(GL_TEXTURE_2D, last_texture_binding);
@@ -5363,6 +6802,9 @@ static void pgraph_populate_surface_binding_entry_sized(NV2AState *d,
     entry->upload_pending = true;
     entry->download_pending = false;
     entry->draw_dirty = false;
+    entry->pbo = 0;
+    entry->pbo_size = 0;
+    entry->download_fence = NULL;
     entry->dma_addr = dma.address;
     entry->dma_len = dma.limit;
     entry->frame_time = pg->frame_time;
@@ -5648,49 +7090,39 @@ static void pgraph_update_surface(NV2AState *d, bool upload,
     pgraph_surface_evict_old(d);
 }
 
-struct pgraph_texture_possibly_dirty_struct {
-    hwaddr addr, end;
-};
-
-static void pgraph_mark_textures_possibly_dirty_visitor(Lru *lru, LruNode *node, void *opaque)
+static bool pgraph_mark_texture_range_possibly_dirty(IntervalTreeNode *node,
+                                                     void *opaque)
 {
-    struct pgraph_texture_possibly_dirty_struct *test =
-        (struct pgraph_texture_possibly_dirty_struct *)opaque;
-
-    struct TextureLruNode *tnode = container_of(node, TextureLruNode, node);
-    if (tnode->binding == NULL || tnode->possibly_dirty) {
-        return;
+    TextureLruNode *tnode = container_of(node, TextureLruNode, texture_range);
+    if (tnode->binding) {
+        tnode->possibly_dirty = true;
     }
+    return false;
+}
 
-    uintptr_t k_tex_addr = tnode->key.texture_vram_offset;
-    uintptr_t k_tex_end = k_tex_addr + tnode->key.texture_length - 1;
-    bool overlapping = !(test->addr > k_tex_end || k_tex_addr > test->end);
-
-    if (tnode->key.palette_length > 0) {
-        uintptr_t k_pal_addr = tnode->key.palette_vram_offset;
-        uintptr_t k_pal_end = k_pal_addr + tnode->key.palette_length - 1;
-        overlapping |= !(test->addr > k_pal_end || k_pal_addr > test->end);
+static bool pgraph_mark_palette_range_possibly_dirty(IntervalTreeNode *node,
+                                                     void *opaque)
+{
+    TextureLruNode *tnode = container_of(node, TextureLruNode, palette_range);
+    if (tnode->binding) {
+        tnode->possibly_dirty = true;
     }
-
-    tnode->possibly_dirty |= overlapping;
+    return false;
 }
 
-
 static void pgraph_mark_textures_possibly_dirty(NV2AState *d,
     hwaddr addr, hwaddr size)
 {
+    PGRAPHState *pg = &d->pgraph;
     hwaddr end = TARGET_PAGE_ALIGN(addr + size) - 1;
     addr &= TARGET_PAGE_MASK;
     assert(end <= memory_region_size(d->vram));
 
-    struct pgraph_texture_possibly_dirty_struct test = {
-        .addr = addr,
-        .end = end,
-    };
-
-    lru_visit_active(&d->pgraph.texture_cache,
-                     pgraph_mark_textures_possibly_dirty_visitor,
-                     &test);
+    /* Only visit cache entries whose texture or palette overlaps */
+    interval_tree_visit(&pg->texture_cache_texture_ranges, addr, end,
+                        pgraph_mark_texture_range_possibly_dirty, NULL);
+    interval_tree_visit(&pg->texture_cache_palette_ranges, addr, end,
+                        pgraph_mark_palette_range_possibly_dirty, NULL);
 }
 
 static bool pgraph_check_texture_dirty(NV2AState *d, hwaddr addr, hwaddr size)
@@ -5784,13 +7216,14 @@ static void pgraph_bind_textures(NV2AState *d)
         if (filter & NV_PGRAPH_TEXFILTER0_GSIGNED) NV2A_UNIMPLEMENTED("NV_PGRAPH_TEXFILTER0_GSIGNED");
         if (filter & NV_PGRAPH_TEXFILTER0_BSIGNED) NV2A_UNIMPLEMENTED("NV_PGRAPH_TEXFILTER0_BSIGNED");
 
-        glActiveTexture(GL_TEXTURE0 + i);
+        pgraph_gl_active_texture(pg, GL_TEXTURE0 + i);
         if (!enabled) {
             glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
             glBindTexture(GL_TEXTURE_RECTANGLE, 0);
             glBindTexture(GL_TEXTURE_1D, 0);
             glBindTexture(GL_TEXTURE_2D, 0);
             glBindTexture(GL_TEXTURE_3D, 0);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
             continue;
         }
 
@@ -5975,26 +7408,28 @@ static void pgraph_bind_textures(NV2AState *d)
             // FIXME: Restructure to support rendering surfaces to cubemap faces
 
             // Writeback any surfaces which this texture may index
-            hwaddr tex_vram_end = texture_vram_offset + length - 1;
-            QTAILQ_FOREACH(surface, &d->pgraph.surfaces, entry) {
-                hwaddr surf_vram_end = surface->vram_addr + surface->size - 1;
-                bool overlapping = !(surface->vram_addr >= tex_vram_end
-                                     || texture_vram_offset >= surf_vram_end);
-                if (overlapping) {
-                    pgraph_download_surface_data_if_dirty(d, surface);
-                }
-            }
+            hwaddr tex_vram_end = texture_vram_offset + length - 1;
+            interval_tree_visit(&pg->surface_ranges, texture_vram_offset,
+                                tex_vram_end,
+                                pgraph_download_overlapping_surface, d);
         }
 
         bool is_indexed = (color_format ==
             NV097_SET_TEXTURE_FORMAT_COLOR_SZ_I8_A8R8G8B8);
 
+        /* Only indexed textures expanded on the CPU depend on the palette,
+         * the others look it up in the shader */
+        bool palette_in_shader = is_indexed &&
+            pgraph_texture_palette_in_shader(color_format, cubemap,
+                                             dimensionality);
+        bool expand_palette = is_indexed && !palette_in_shader;
+
         TextureKey key;
         memset(&key, 0, sizeof(TextureKey));
         key.state = state;
         key.texture_vram_offset = texture_vram_offset;
         key.texture_length = length;
-        if (is_indexed) {
+        if (expand_palette) {
             key.palette_vram_offset = palette_vram_offset;
             key.palette_length = palette_length;
         }
@@ -6015,8 +7450,9 @@ static void pgraph_bind_textures(NV2AState *d)
                                                        length);
             }
 
-            if (is_indexed && pgraph_check_texture_dirty(d, palette_vram_offset,
-                                                            palette_length)) {
+            if (expand_palette &&
+                pgraph_check_texture_dirty(d, palette_vram_offset,
+                                           palette_length)) {
                 possibly_dirty = true;
                 pgraph_mark_textures_possibly_dirty(d, palette_vram_offset,
                                                        palette_length);
@@ -6027,7 +7463,7 @@ static void pgraph_bind_textures(NV2AState *d)
         uint64_t tex_data_hash = 0;
         if (!surf_to_tex && possibly_dirty) {
             tex_data_hash = fast_hash(texture_data, length);
-            if (is_indexed) {
+            if (expand_palette) {
                 tex_data_hash ^= fast_hash(palette_data, palette_length);
             }
         }
@@ -6043,7 +7479,8 @@ static void pgraph_bind_textures(NV2AState *d)
 
         if (key_out->binding == NULL) {
             // Must create the texture
-            key_out->binding = generate_texture(state, texture_data, palette_data);
+            key_out->binding = generate_texture(pg, state, texture_data,
+                                                 palette_data);
             key_out->binding->data_hash = tex_data_hash;
             key_out->binding->scale = 1;
         } else {
@@ -6084,10 +7521,38 @@ static void pgraph_bind_textures(NV2AState *d)
             }
         }
 
-        glTexParameteri(binding->gl_target, GL_TEXTURE_MIN_FILTER,
-            pgraph_texture_min_filter_map[min_filter]);
-        glTexParameteri(binding->gl_target, GL_TEXTURE_MAG_FILTER,
-            pgraph_texture_mag_filter_map[mag_filter]);
+        if (palette_in_shader) {
+            /* Filtering indices would mix unrelated palette entries, the
+             * shader filters the looked up colors instead */
+            GLenum gl_min_filter = pgraph_texture_min_filter_map[min_filter];
+            bool mipmap = gl_min_filter != GL_NEAREST
+                          && gl_min_filter != GL_LINEAR;
+            glTexParameteri(binding->gl_target, GL_TEXTURE_MIN_FILTER,
+                mipmap ? GL_NEAREST_MIPMAP_NEAREST : GL_NEAREST);
+            glTexParameteri(binding->gl_target, GL_TEXTURE_MAG_FILTER,
+                GL_NEAREST);
+            assert(palette_vram_offset + palette_length * 4
+                   <= memory_region_size(d->vram));
+            pgraph_bind_texture_palette(pg, i, palette_data, palette_length);
+        } else if (binding->gl_target == GL_TEXTURE_2D_ARRAY) {
+            /* Each slice range of a volume mipmap level is picked by the
+             * shader, which also blends between the levels */
+            GLenum gl_min_filter = pgraph_texture_min_filter_map[min_filter];
+            if (gl_min_filter == GL_NEAREST_MIPMAP_LINEAR) {
+                gl_min_filter = GL_NEAREST_MIPMAP_NEAREST;
+            } else if (gl_min_filter == GL_LINEAR_MIPMAP_LINEAR) {
+                gl_min_filter = GL_LINEAR_MIPMAP_NEAREST;
+            }
+            glTexParameteri(binding->gl_target, GL_TEXTURE_MIN_FILTER,
+                gl_min_filter);
+            glTexParameteri(binding->gl_target, GL_TEXTURE_MAG_FILTER,
+                pgraph_texture_mag_filter_map[mag_filter]);
+        } else {
+            glTexParameteri(binding->gl_target, GL_TEXTURE_MIN_FILTER,
+                pgraph_texture_min_filter_map[min_filter]);
+            glTexParameteri(binding->gl_target, GL_TEXTURE_MAG_FILTER,
+                pgraph_texture_mag_filter_map[mag_filter]);
+        }
 
         /* Texture wrapping */
         assert(addru < ARRAY_SIZE(pgraph_texture_addr_map));
@@ -6098,7 +7563,7 @@ static void pgraph_bind_textures(NV2AState *d)
             glTexParameteri(binding->gl_target, GL_TEXTURE_WRAP_T,
                 pgraph_texture_addr_map[addrv]);
         }
-        if (dimensionality > 2) {
+        if (dimensionality > 2 && binding->gl_target != GL_TEXTURE_2D_ARRAY) {
             assert(addrp < ARRAY_SIZE(pgraph_texture_addr_map));
             glTexParameteri(binding->gl_target, GL_TEXTURE_WRAP_R,
                 pgraph_texture_addr_map[addrp]);
@@ -6129,6 +7594,118 @@ static void pgraph_bind_textures(NV2AState *d)
     NV2A_GL_DGROUP_END();
 }
 
+static bool pgraph_texture_palette_in_shader(unsigned int color_format,
+                                             bool cubemap,
+                                             unsigned int dimensionality)
+{
+    /* FIXME: Cubemap and volume indexed textures are still expanded on the
+     * CPU */
+    return color_format == NV097_SET_TEXTURE_FORMAT_COLOR_SZ_I8_A8R8G8B8
+           && !cubemap && dimensionality == 2;
+}
+
+/* Filtering done in the shader for textures it samples one level at a time */
+static uint8_t pgraph_texture_shader_filter(uint32_t filter)
+{
+    unsigned int min_filter = GET_MASK(filter, NV_PGRAPH_TEXFILTER0_MIN);
+    unsigned int mag_filter = GET_MASK(filter, NV_PGRAPH_TEXFILTER0_MAG);
+    uint8_t shader_filter = 0;
+
+    if (pgraph_texture_mag_filter_map[mag_filter] == GL_LINEAR) {
+        shader_filter |= PSH_FILTER_MAG_LINEAR;
+    }
+    switch (pgraph_texture_min_filter_map[min_filter]) {
+    case GL_LINEAR:
+        shader_filter |= PSH_FILTER_MIN_LINEAR;
+        break;
+    case GL_NEAREST_MIPMAP_NEAREST:
+        shader_filter |= PSH_FILTER_MIPMAP;
+        break;
+    case GL_LINEAR_MIPMAP_NEAREST:
+        shader_filter |= PSH_FILTER_MIN_LINEAR | PSH_FILTER_MIPMAP;
+        break;
+    case GL_NEAREST_MIPMAP_LINEAR:
+        shader_filter |= PSH_FILTER_MIPMAP | PSH_FILTER_MIPMAP_LINEAR;
+        break;
+    case GL_LINEAR_MIPMAP_LINEAR:
+        shader_filter |= PSH_FILTER_MIN_LINEAR | PSH_FILTER_MIPMAP
+                         | PSH_FILTER_MIPMAP_LINEAR;
+        break;
+    }
+    return shader_filter;
+}
+
+/*
+ * DXT volumes are uploaded as compressed 2D array slices, filtered between
+ * slices in the shader, instead of being decoded to RGBA8 on the CPU.
+ */
+static bool pgraph_texture_volume_as_array(PGRAPHState *pg,
+                                           unsigned int color_format,
+                                           bool cubemap,
+                                           unsigned int dimensionality)
+{
+    return pg->compressed_volume_arrays && !cubemap && dimensionality == 3
+           && kelvin_color_format_map[color_format].gl_format == 0;
+}
+
+/* S3TC 2D arrays also need EXT_texture_array support from the driver */
+static bool pgraph_probe_compressed_volume_arrays(void)
+{
+    static const uint8_t block[8];
+    GLuint gl_texture;
+
+    glGenTextures(1, &gl_texture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, gl_texture);
+    glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, 0,
+                           GL_COMPRESSED_RGBA_S3TC_DXT1_EXT, 4, 4, 1, 0,
+                           sizeof(block), block);
+    bool supported = glGetError() == GL_NO_ERROR;
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    glDeleteTextures(1, &gl_texture);
+
+    return supported;
+}
+
+static void pgraph_init_palette_textures(PGRAPHState *pg)
+{
+    memset(pg->palette_data, 0, sizeof(pg->palette_data));
+    glGenTextures(NV2A_MAX_TEXTURES, pg->gl_palette_textures);
+
+    /* The palette units are not used for anything else, so the textures
+     * stay bound there */
+    for (int i = 0; i < NV2A_MAX_TEXTURES; i++) {
+        pgraph_gl_active_texture(pg,
+                                 GL_TEXTURE0 + SHADER_PALETTE_TEXTURE_UNIT(i));
+        glBindTexture(GL_TEXTURE_2D, pg->gl_palette_textures[i]);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 256, 1, 0, GL_BGRA,
+                     GL_UNSIGNED_INT_8_8_8_8_REV, pg->palette_data[i]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    }
+    pgraph_gl_active_texture(pg, GL_TEXTURE0);
+}
+
+static void pgraph_bind_texture_palette(PGRAPHState *pg, int i,
+                                        const uint8_t *palette_data,
+                                        unsigned int palette_length)
+{
+    size_t size = palette_length * 4;
+
+    /* Switching palettes only costs an upload of the palette itself */
+    if (!memcmp(pg->palette_data[i], palette_data, size)) {
+        return;
+    }
+    memcpy(pg->palette_data[i], palette_data, size);
+
+    pgraph_gl_active_texture(pg, GL_TEXTURE0 + SHADER_PALETTE_TEXTURE_UNIT(i));
+    glBindTexture(GL_TEXTURE_2D, pg->gl_palette_textures[i]);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, palette_length, 1, GL_BGRA,
+                    GL_UNSIGNED_INT_8_8_8_8_REV, palette_data);
+    pgraph_gl_active_texture(pg, GL_TEXTURE0 + i);
+    nv2a_profile_inc_counter(NV2A_PROF_TEX_PALETTE_UPLOAD);
+}
+
 static void pgraph_apply_anti_aliasing_factor(PGRAPHState *pg,
                                               unsigned int *width,
                                               unsigned int *height)
@@ -6171,29 +7748,301 @@ static void pgraph_get_surface_dimensions(PGRAPHState *pg,
     }
 }
 
-static void pgraph_update_memory_buffer(NV2AState *d, hwaddr addr, hwaddr size,
-                                        bool quick)
+/* Granularity at which draws are tracked against writes to the mirror */
+#define MEMORY_BUFFER_REGION_SHIFT 16
+/* Draws grouped under a single fence */
+#define MEMORY_BUFFER_BATCH_DRAWS 32
+
+#define STREAM_BUFFER_SEGMENT_SIZE \
+    (NV2A_STREAM_BUFFER_SIZE / NV2A_STREAM_BUFFER_SEGMENTS)
+/* Keeps every vertex attribute and index offset suitably aligned */
+#define STREAM_BUFFER_ALIGN 256
+
+static void pgraph_init_stream_buffer(PGRAPHState *pg)
 {
-    glBindBuffer(GL_ARRAY_BUFFER, d->pgraph.gl_memory_buffer);
+    glGenBuffers(1, &pg->gl_stream_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, pg->gl_stream_buffer);
 
-    hwaddr end = TARGET_PAGE_ALIGN(addr + size);
-    addr &= TARGET_PAGE_MASK;
-    assert(end < memory_region_size(d->vram));
+    pg->stream_buffer_persistent =
+        glo_check_extension("GL_ARB_buffer_storage");
+    if (pg->stream_buffer_persistent) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT |
+                           GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_ARRAY_BUFFER, NV2A_STREAM_BUFFER_SIZE, NULL, flags);
+        pg->stream_buffer_map = glMapBufferRange(
+            GL_ARRAY_BUFFER, 0, NV2A_STREAM_BUFFER_SIZE, flags);
+        assert(pg->stream_buffer_map != NULL);
+    } else {
+        glBufferData(GL_ARRAY_BUFFER, NV2A_STREAM_BUFFER_SIZE, NULL,
+                     GL_STREAM_DRAW);
+        pg->stream_buffer_map = g_malloc(NV2A_STREAM_BUFFER_SIZE);
+    }
 
-    static hwaddr last_addr, last_end;
-    if (quick && (addr >= last_addr) && (end <= last_end)) {
-        return;
+    memset(pg->stream_buffer_fences, 0, sizeof(pg->stream_buffer_fences));
+    pg->stream_buffer_head = 0;
+    pg->stream_buffer_unfenced_first = -1;
+    pg->stream_buffer_unfenced_last = -1;
+}
+
+static void pgraph_init_memory_buffer(NV2AState *d)
+{
+    PGRAPHState *pg = &d->pgraph;
+    hwaddr size = memory_region_size(d->vram);
+
+    glGenBuffers(1, &pg->gl_memory_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, pg->gl_memory_buffer);
+
+    pg->memory_buffer_map = NULL;
+    if (glo_check_extension("GL_ARB_buffer_storage")) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT |
+                           GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_ARRAY_BUFFER, size, NULL, flags);
+        pg->memory_buffer_map = glMapBufferRange(GL_ARRAY_BUFFER, 0, size,
+                                                 flags);
+        assert(pg->memory_buffer_map != NULL);
+    } else {
+        glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+    }
+
+    memset(pg->memory_buffer_fences, 0, sizeof(pg->memory_buffer_fences));
+    pg->memory_buffer_region_seq =
+        g_new0(uint64_t, size >> MEMORY_BUFFER_REGION_SHIFT);
+    pg->memory_buffer_seq = 1;
+    pg->memory_buffer_completed_seq = 0;
+    pg->memory_buffer_batch_draws = 0;
+}
+
+/* Wait until every draw of batch @seq and older has read the mirror */
+static void pgraph_memory_buffer_wait(PGRAPHState *pg, uint64_t seq)
+{
+    assert(seq < pg->memory_buffer_seq);
+
+    while (pg->memory_buffer_completed_seq < seq) {
+        uint64_t next = pg->memory_buffer_completed_seq + 1;
+        GLsync *fence =
+            &pg->memory_buffer_fences[next % NV2A_MEMORY_BUFFER_FENCES];
+        assert(*fence != NULL);
+
+        GLenum result = glClientWaitSync(*fence, 0, 0);
+        if (result == GL_TIMEOUT_EXPIRED) {
+            nv2a_profile_inc_counter(NV2A_PROF_GEOM_BUFFER_STALL);
+            result = glClientWaitSync(*fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                                      (GLuint64)(5000000000));
+        }
+        assert(result == GL_CONDITION_SATISFIED ||
+               result == GL_ALREADY_SIGNALED);
+        glDeleteSync(*fence);
+        *fence = NULL;
+        pg->memory_buffer_completed_seq = next;
     }
-    last_addr = addr;
-    last_end = end;
+}
+
+/* Close the open batch of draws with a fence */
+static void pgraph_memory_buffer_fence(PGRAPHState *pg)
+{
+    uint64_t seq = pg->memory_buffer_seq;
+
+    if (seq > NV2A_MEMORY_BUFFER_FENCES) {
+        /* Retire the fence whose slot is being reused */
+        pgraph_memory_buffer_wait(pg, seq - NV2A_MEMORY_BUFFER_FENCES);
+    }
+    pg->memory_buffer_fences[seq % NV2A_MEMORY_BUFFER_FENCES] =
+        glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    pg->memory_buffer_seq++;
+    pg->memory_buffer_batch_draws = 0;
+}
+
+/* Wait for the draws reading [addr, end) of the mirror */
+static void pgraph_memory_buffer_wait_range(PGRAPHState *pg, hwaddr addr,
+                                            hwaddr end)
+{
+    uint64_t seq = 0;
+
+    for (hwaddr r = addr >> MEMORY_BUFFER_REGION_SHIFT;
+         r <= (end - 1) >> MEMORY_BUFFER_REGION_SHIFT; r++) {
+        seq = MAX(seq, pg->memory_buffer_region_seq[r]);
+    }
+
+    if (seq == pg->memory_buffer_seq) {
+        pgraph_memory_buffer_fence(pg);
+    }
+    if (seq > pg->memory_buffer_completed_seq) {
+        pgraph_memory_buffer_wait(pg, seq);
+    }
+}
+
+/* Record that the draw about to be issued reads [addr, end) of the mirror */
+static void pgraph_memory_buffer_mark_read(PGRAPHState *pg, hwaddr addr,
+                                           hwaddr end)
+{
+    for (hwaddr r = addr >> MEMORY_BUFFER_REGION_SHIFT;
+         r <= (end - 1) >> MEMORY_BUFFER_REGION_SHIFT; r++) {
+        pg->memory_buffer_region_seq[r] = pg->memory_buffer_seq;
+    }
+}
+
+static void pgraph_upload_memory_buffer(NV2AState *d, hwaddr addr,
+                                        hwaddr end)
+{
+    PGRAPHState *pg = &d->pgraph;
 
-    size = end - addr;
-    if (memory_region_test_and_clear_dirty(d->vram, addr, size,
-                                           DIRTY_MEMORY_NV2A)) {
-        glBufferSubData(GL_ARRAY_BUFFER, addr, size,
+    if (pg->memory_buffer_map) {
+        pgraph_memory_buffer_wait_range(pg, addr, end);
+        memcpy(pg->memory_buffer_map + addr, d->vram_ptr + addr, end - addr);
+    } else {
+        glBindBuffer(GL_ARRAY_BUFFER, pg->gl_memory_buffer);
+        glBufferSubData(GL_ARRAY_BUFFER, addr, end - addr,
                         d->vram_ptr + addr);
-        nv2a_profile_inc_counter(NV2A_PROF_GEOM_BUFFER_UPDATE_1);
     }
+
+    nv2a_profile_inc_counter(NV2A_PROF_GEOM_BUFFER_UPDATE_1);
+    nv2a_profile_add_counter(NV2A_PROF_GEOM_BUFFER_UPLOAD_BYTES, end - addr);
+}
+
+/* Copy all of VRAM into the mirror */
+static void pgraph_sync_memory_buffer(NV2AState *d)
+{
+    pgraph_upload_memory_buffer(d, 0, memory_region_size(d->vram));
+}
+
+/*
+ * Widen [*addr, *end) to the span memory_region_snapshot_and_clear_dirty()
+ * will clear, which is rounded out to whole words of the dirty bitmap.
+ */
+static void pgraph_memory_buffer_dirty_span(NV2AState *d, hwaddr *addr,
+                                            hwaddr *end)
+{
+    ram_addr_t base = memory_region_get_ram_addr(d->vram);
+    ram_addr_t align = (ram_addr_t)TARGET_PAGE_SIZE * BITS_PER_LONG;
+    ram_addr_t first = QEMU_ALIGN_DOWN(base + *addr, align);
+    ram_addr_t last = QEMU_ALIGN_UP(base + *end, align);
+
+    *addr = first > base ? first - base : 0;
+    *end = MIN(last - base, memory_region_size(d->vram));
+}
+
+/*
+ * Upload the dirty pages of [addr, end), which must be a span returned by
+ * pgraph_memory_buffer_dirty_span, as one copy per run of dirty pages.
+ */
+static void pgraph_update_memory_buffer(NV2AState *d, hwaddr addr, hwaddr end)
+{
+    DirtyBitmapSnapshot *snap = memory_region_snapshot_and_clear_dirty(
+        d->vram, addr, end - addr, DIRTY_MEMORY_NV2A);
+    hwaddr run_start = end;
+
+    for (hwaddr page = addr; page < end; page += TARGET_PAGE_SIZE) {
+        bool dirty = memory_region_snapshot_get_dirty(d->vram, snap, page,
+                                                      TARGET_PAGE_SIZE);
+        if (dirty && run_start == end) {
+            run_start = page;
+        } else if (!dirty && run_start != end) {
+            pgraph_upload_memory_buffer(d, run_start, page);
+            run_start = end;
+        }
+    }
+    if (run_start != end) {
+        pgraph_upload_memory_buffer(d, run_start, end);
+    }
+
+    g_free(snap);
+}
+
+/* Wait until the GPU is done with a segment of the streaming arena */
+static void pgraph_stream_buffer_wait_segment(PGRAPHState *pg, int segment)
+{
+    GLsync *fence = &pg->stream_buffer_fences[segment];
+
+    if (*fence == NULL) {
+        return;
+    }
+
+    GLenum result = glClientWaitSync(*fence, 0, 0);
+    if (result == GL_TIMEOUT_EXPIRED) {
+        nv2a_profile_inc_counter(NV2A_PROF_GEOM_STREAM_STALL);
+        result = glClientWaitSync(*fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                                  (GLuint64)(5000000000));
+    }
+    assert(result == GL_CONDITION_SATISFIED || result == GL_ALREADY_SIGNALED);
+    glDeleteSync(*fence);
+    *fence = NULL;
+}
+
+/*
+ * Reserve @size bytes of the streaming arena for the next draw, returning
+ * their offset in gl_stream_buffer and a pointer to fill them through, which
+ * must be followed by pgraph_stream_buffer_commit().
+ */
+static GLintptr pgraph_stream_buffer_alloc(PGRAPHState *pg, size_t size,
+                                           void **ptr)
+{
+    assert(size > 0 && size <= NV2A_STREAM_BUFFER_SIZE);
+
+    size_t start = ROUND_UP(pg->stream_buffer_head, STREAM_BUFFER_ALIGN);
+    bool wrap = start + size > NV2A_STREAM_BUFFER_SIZE;
+    if (wrap) {
+        start = 0;
+    }
+    int first = start / STREAM_BUFFER_SEGMENT_SIZE;
+    int last = (start + size - 1) / STREAM_BUFFER_SEGMENT_SIZE;
+    int first_new = first;
+
+    /* Draws using the previous allocations have been issued by now, fence
+     * the segments they occupy unless this allocation continues in one.
+     */
+    if (pg->stream_buffer_unfenced_first >= 0) {
+        int fence_last = pg->stream_buffer_unfenced_last;
+        if (!wrap && first == fence_last) {
+            fence_last--;
+            first_new++;
+        }
+        for (int s = pg->stream_buffer_unfenced_first; s <= fence_last; s++) {
+            assert(pg->stream_buffer_fences[s] == NULL);
+            pg->stream_buffer_fences[s] =
+                glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        }
+    }
+
+    for (int s = first_new; s <= last; s++) {
+        pgraph_stream_buffer_wait_segment(pg, s);
+    }
+
+    pg->stream_buffer_unfenced_first = first;
+    pg->stream_buffer_unfenced_last = last;
+    pg->stream_buffer_head = start + size;
+
+    nv2a_profile_add_counter(NV2A_PROF_GEOM_STREAM_BYTES, size);
+
+    *ptr = pg->stream_buffer_map + start;
+    return start;
+}
+
+/* Make data written to a streaming allocation visible to the GPU */
+static void pgraph_stream_buffer_commit(PGRAPHState *pg, GLintptr offset,
+                                        size_t size)
+{
+    if (!pg->stream_buffer_persistent) {
+        glBindBuffer(GL_ARRAY_BUFFER, pg->gl_stream_buffer);
+        glBufferSubData(GL_ARRAY_BUFFER, offset, size,
+                        pg->stream_buffer_map + offset);
+    }
+}
+
+static GLintptr pgraph_stream_buffer_upload(PGRAPHState *pg, const void *data,
+                                            size_t size)
+{
+    void *ptr;
+    GLintptr offset = pgraph_stream_buffer_alloc(pg, size, &ptr);
+
+    memcpy(ptr, data, size);
+    pgraph_stream_buffer_commit(pg, offset, size);
+    return offset;
+}
+
+static int pgraph_compare_memory_ranges(const void *a, const void *b)
+{
+    const hwaddr *ra = a, *rb = b;
+    return ra[0] < rb[0] ? -1 : ra[0] > rb[0];
 }
 
 static void pgraph_bind_vertex_attributes(NV2AState *d,
@@ -6203,8 +8052,10 @@ static void pgraph_bind_vertex_attributes(NV2AState *d,
                                           unsigned int inline_stride)
 {
     PGRAPHState *pg = &d->pgraph;
-    bool updated_memory_buffer = false;
     unsigned int num_elements = max_element - min_element + 1;
+    hwaddr reads[NV2A_VERTEXSHADER_ATTRIBUTES][2];
+    hwaddr ranges[NV2A_VERTEXSHADER_ATTRIBUTES][2];
+    int num_reads = 0;
 
     if (inline_data) {
         NV2A_GL_DGROUP_BEGIN("%s (num_elements: %d inline stride: %d)",
@@ -6233,10 +8084,11 @@ static void pgraph_bind_vertex_attributes(NV2AState *d,
         }
 
         if (inline_data) {
-            glBindBuffer(GL_ARRAY_BUFFER, pg->gl_inline_array_buffer);
+            glBindBuffer(GL_ARRAY_BUFFER, pg->gl_stream_buffer);
             attrib_data_addr = attr->inline_array_offset;
             stride = inline_stride;
         } else {
+            glBindBuffer(GL_ARRAY_BUFFER, pg->gl_memory_buffer);
             hwaddr dma_len;
             uint8_t *attr_data = (uint8_t *)nv_dma_map(
                 d, attr->dma_select ? pg->dma_vertex_b : pg->dma_vertex_a,
@@ -6245,9 +8097,11 @@ static void pgraph_bind_vertex_attributes(NV2AState *d,
             attrib_data_addr = attr_data + attr->offset - d->vram_ptr;
             stride = attr->stride;
             hwaddr start = attrib_data_addr + min_element * stride;
-            pgraph_update_memory_buffer(d, start, num_elements * stride,
-                                        updated_memory_buffer);
-            updated_memory_buffer = true;
+            hwaddr end = TARGET_PAGE_ALIGN(start + num_elements * stride);
+            assert(end < memory_region_size(d->vram));
+            reads[num_reads][0] = start & TARGET_PAGE_MASK;
+            reads[num_reads][1] = end;
+            num_reads++;
         }
 
         if (attr->needs_conversion) {
@@ -6262,6 +8116,41 @@ static void pgraph_bind_vertex_attributes(NV2AState *d,
         glEnableVertexAttribArray(i);
     }
 
+    if (num_reads) {
+        if (pg->memory_buffer_batch_draws >= MEMORY_BUFFER_BATCH_DRAWS) {
+            pgraph_memory_buffer_fence(pg);
+        }
+
+        /* Bring the mirror up to date with one pass per disjoint span */
+        memcpy(ranges, reads, num_reads * sizeof(ranges[0]));
+        for (int i = 0; i < num_reads; i++) {
+            pgraph_memory_buffer_dirty_span(d, &ranges[i][0], &ranges[i][1]);
+        }
+        qsort(ranges, num_reads, sizeof(ranges[0]),
+              pgraph_compare_memory_ranges);
+
+        int merged = 0;
+        for (int i = 1; i < num_reads; i++) {
+            if (ranges[i][0] <= ranges[merged][1]) {
+                ranges[merged][1] = MAX(ranges[merged][1], ranges[i][1]);
+            } else {
+                merged++;
+                ranges[merged][0] = ranges[i][0];
+                ranges[merged][1] = ranges[i][1];
+            }
+        }
+        for (int i = 0; i <= merged; i++) {
+            pgraph_update_memory_buffer(d, ranges[i][0], ranges[i][1]);
+        }
+
+        if (pg->memory_buffer_map) {
+            for (int i = 0; i < num_reads; i++) {
+                pgraph_memory_buffer_mark_read(pg, reads[i][0], reads[i][1]);
+            }
+            pg->memory_buffer_batch_draws++;
+        }
+    }
+
     NV2A_GL_DGROUP_END();
 }
 
@@ -6269,6 +8158,10 @@ static unsigned int pgraph_bind_inline_array(NV2AState *d)
 {
     PGRAPHState *pg = &d->pgraph;
 
+    nv2a_profile_inc_counter(NV2A_PROF_GEOM_BUFFER_UPDATE_2);
+    GLintptr base = pgraph_stream_buffer_upload(pg, pg->inline_array,
+                                                pg->inline_array_length * 4);
+
     unsigned int offset = 0;
     for (int i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
         VertexAttribute *attr = &pg->vertex_attributes[i];
@@ -6278,7 +8171,7 @@ static unsigned int pgraph_bind_inline_array(NV2AState *d)
 
         /* FIXME: Double check */
         offset = ROUND_UP(offset, attr->size);
-        attr->inline_array_offset = offset;
+        attr->inline_array_offset = base + offset;
         NV2A_DPRINTF("bind inline attribute %d size=%d, count=%d\n",
             i, attr->size, attr->count);
         offset += attr->size * attr->count;
@@ -6291,16 +8184,66 @@ static unsigned int pgraph_bind_inline_array(NV2AState *d)
 
     NV2A_DPRINTF("draw inline array %d, %d\n", vertex_size, index_count);
 
-    nv2a_profile_inc_counter(NV2A_PROF_GEOM_BUFFER_UPDATE_2);
-    glBindBuffer(GL_ARRAY_BUFFER, pg->gl_inline_array_buffer);
-    glBufferData(GL_ARRAY_BUFFER, NV2A_MAX_BATCH_LENGTH * sizeof(uint32_t),
-                 NULL, GL_STREAM_DRAW);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, pg->inline_array_length*4, pg->inline_array);
     pgraph_bind_vertex_attributes(d, 0, index_count-1, true, vertex_size);
 
     return index_count;
 }
 
+/* Cheap fingerprint of the inline element list from a sample of indices */
+static uint64_t pgraph_inline_elements_signature(PGRAPHState *pg)
+{
+    unsigned int count = pg->inline_elements_length;
+    unsigned int step = MAX(count / 16, 1);
+    uint64_t sig = count;
+
+    for (unsigned int i = 0; i < count; i += step) {
+        sig = (sig ^ pg->inline_elements[i]) * 0x100000001b3ULL;
+    }
+    return (sig ^ pg->inline_elements[count - 1]) * 0x100000001b3ULL;
+}
+
+/*
+ * Bind the index buffer for the inline elements and return their offset in
+ * it. Most lists are drawn once, so they are streamed; only a list seen
+ * again is hashed in full and kept in the element cache.
+ */
+static GLintptr pgraph_bind_inline_elements(PGRAPHState *pg)
+{
+    size_t size = pg->inline_elements_length * sizeof(uint32_t);
+    uint64_t sig = pgraph_inline_elements_signature(pg);
+    uint64_t *seen = &pg->element_signatures[sig % NV2A_ELEMENT_SIGNATURES];
+
+    if (*seen != sig) {
+        *seen = sig;
+        nv2a_profile_inc_counter(NV2A_PROF_GEOM_BUFFER_UPDATE_4);
+        GLintptr offset =
+            pgraph_stream_buffer_upload(pg, pg->inline_elements, size);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, pg->gl_stream_buffer);
+        return offset;
+    }
+
+    VertexKey k;
+    memset(&k, 0, sizeof(VertexKey));
+    k.count = pg->inline_elements_length;
+    k.gl_type = GL_UNSIGNED_INT;
+    k.gl_normalize = GL_FALSE;
+    k.stride = sizeof(uint32_t);
+    uint64_t h = fast_hash((uint8_t*)pg->inline_elements, size);
+
+    LruNode *node = lru_lookup(&pg->element_cache, h, &k);
+    VertexLruNode *found = container_of(node, VertexLruNode, node);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, found->gl_buffer);
+    if (!found->initialized) {
+        nv2a_profile_inc_counter(NV2A_PROF_GEOM_BUFFER_UPDATE_4);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, size, pg->inline_elements,
+                     GL_STATIC_DRAW);
+        found->initialized = true;
+    } else {
+        nv2a_profile_inc_counter(NV2A_PROF_GEOM_BUFFER_UPDATE_4_NOTDIRTY);
+    }
+    return 0;
+}
+
 /* 16 bit to [0.0, F16_MAX = 511.9375] */
 static float convert_f16_to_float(uint16_t f16) {
     if (f16 == 0x0000) { return 0.0; }
@@ -6317,116 +8260,144 @@ static float convert_f24_to_float(uint32_t f24) {
     return *(float*)&i;
 }
 
-static uint8_t cliptobyte(int x)
-{
-    return (uint8_t)((x < 0) ? 0 : ((x > 255) ? 255 : x));
+/* A texture image decoded on the CPU, waiting to be uploaded */
+typedef struct TextureUpload {
+    GLenum gl_target;
+    GLint level;
+    GLenum gl_format;
+    GLenum gl_type;
+    unsigned int width, height, depth;
+    size_t offset;
+} TextureUpload;
+
+/* Decode jobs of a texture, uploaded from one pixel buffer once all done */
+typedef struct TextureUploadBatch {
+    GArray *images; /* TextureDecodeImage */
+    GArray *uploads; /* TextureUpload */
+    size_t size;
+} TextureUploadBatch;
+
+static TextureDecodeConversion pgraph_texture_decode_conversion(
+    const TextureShape *s)
+{
+    switch (s->color_format) {
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_I8_A8R8G8B8:
+        if (pgraph_texture_palette_in_shader(s->color_format, s->cubemap,
+                                             s->dimensionality)) {
+            return TEXTURE_DECODE_COPY;
+        }
+        return TEXTURE_DECODE_PALETTE;
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LC_IMAGE_CR8YB8CB8YA8:
+        // FIXME: only valid if control0 register allows for colorspace conversion
+        return TEXTURE_DECODE_YUY2;
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LC_IMAGE_YB8CR8YA8CB8:
+        return TEXTURE_DECODE_UYVY;
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_R6G5B5:
+        return TEXTURE_DECODE_R6G5B5;
+    default:
+        return TEXTURE_DECODE_COPY;
+    }
 }
 
-static void convert_yuy2_to_rgb(const uint8_t *line, unsigned int ix,
-                                uint8_t *r, uint8_t *g, uint8_t* b) {
-    int c, d, e;
-    c = (int)line[ix * 2] - 16;
-    if (ix % 2) {
-        d = (int)line[ix * 2 - 1] - 128;
-        e = (int)line[ix * 2 + 1] - 128;
+/*
+ * Allocates the storage of a texture image and queues its decode. The texels
+ * are filled in by pgraph_flush_texture_uploads().
+ */
+static void pgraph_queue_texture_upload(TextureUploadBatch *batch,
+                                        GLenum gl_target, GLint level,
+                                        GLint gl_internal_format,
+                                        GLenum gl_format, GLenum gl_type,
+                                        const TextureDecodeImage *image)
+{
+    TextureUpload upload = {
+        .gl_target = gl_target,
+        .level = level,
+        .gl_format = gl_format,
+        .gl_type = gl_type,
+        .width = image->width,
+        .height = image->height,
+        .depth = image->depth,
+        .offset = batch->size,
+    };
+
+    if (gl_target == GL_TEXTURE_3D) {
+        glTexImage3D(gl_target, level, gl_internal_format,
+                     image->width, image->height, image->depth, 0,
+                     gl_format, gl_type, NULL);
     } else {
-        d = (int)line[ix * 2 + 1] - 128;
-        e = (int)line[ix * 2 + 3] - 128;
+        glTexImage2D(gl_target, level, gl_internal_format,
+                     image->width, image->height, 0,
+                     gl_format, gl_type, NULL);
     }
-    *r = cliptobyte((298 * c + 409 * e + 128) >> 8);
-    *g = cliptobyte((298 * c - 100 * d - 208 * e + 128) >> 8);
-    *b = cliptobyte((298 * c + 516 * d + 128) >> 8);
+
+    TextureDecodeImage decode = *image;
+    decode.dst_offset = batch->size;
+    texture_decode_add(batch->images, &decode);
+    g_array_append_val(batch->uploads, upload);
+    batch->size += ROUND_UP(texture_decode_size(image), TEXTURE_DECODE_ALIGN);
 }
 
-static void convert_uyvy_to_rgb(const uint8_t *line, unsigned int ix,
-                                uint8_t *r, uint8_t *g, uint8_t* b) {
-    int c, d, e;
-    c = (int)line[ix * 2 + 1] - 16;
-    if (ix % 2) {
-        d = (int)line[ix * 2 - 2] - 128;
-        e = (int)line[ix * 2 + 0] - 128;
-    } else {
-        d = (int)line[ix * 2 + 0] - 128;
-        e = (int)line[ix * 2 + 2] - 128;
-    }
-    *r = cliptobyte((298 * c + 409 * e + 128) >> 8);
-    *g = cliptobyte((298 * c - 100 * d - 208 * e + 128) >> 8);
-    *b = cliptobyte((298 * c + 516 * d + 128) >> 8);
-}
-
-static uint8_t* convert_texture_data(const TextureShape s,
-                                     const uint8_t *data,
-                                     const uint8_t *palette_data,
-                                     unsigned int width,
-                                     unsigned int height,
-                                     unsigned int depth,
-                                     unsigned int row_pitch,
-                                     unsigned int slice_pitch)
-{
-    if (s.color_format == NV097_SET_TEXTURE_FORMAT_COLOR_SZ_I8_A8R8G8B8) {
-        assert(depth == 1); /* FIXME */
-        uint8_t* converted_data = (uint8_t*)g_malloc(width * height * 4);
-        int x, y;
-        for (y = 0; y < height; y++) {
-            for (x = 0; x < width; x++) {
-                uint8_t index = data[y * row_pitch + x];
-                uint32_t color = *(uint32_t*)(palette_data + index * 4);
-                *(uint32_t*)(converted_data + y * width * 4 + x * 4) = color;
-            }
-        }
-        return converted_data;
-    } else if (s.color_format
-                   == NV097_SET_TEXTURE_FORMAT_COLOR_LC_IMAGE_CR8YB8CB8YA8 ||
-                   s.color_format
-                   == NV097_SET_TEXTURE_FORMAT_COLOR_LC_IMAGE_YB8CR8YA8CB8) {
-        assert(depth == 1); /* FIXME */
-        // FIXME: only valid if control0 register allows for colorspace conversion
-        uint8_t* converted_data = (uint8_t*)g_malloc(width * height * 4);
-        int x, y;
-        uint8_t* pixel = converted_data;
-        for (y = 0; y < height; y++) {
-            const uint8_t* line = &data[y * row_pitch * depth];
-            for (x = 0; x < width; x++, pixel += 4) {
-                if (s.color_format
-                    == NV097_SET_TEXTURE_FORMAT_COLOR_LC_IMAGE_CR8YB8CB8YA8) {
-                    convert_yuy2_to_rgb(line, x, &pixel[0], &pixel[1], &pixel[2]);
-                } else {
-                    convert_uyvy_to_rgb(line, x, &pixel[0], &pixel[1], &pixel[2]);
-                }
-                pixel[3] = 255;
-          }
-        }
-        return converted_data;
-    } else if (s.color_format
-                   == NV097_SET_TEXTURE_FORMAT_COLOR_SZ_R6G5B5) {
-        assert(depth == 1); /* FIXME */
-        uint8_t *converted_data = (uint8_t*)g_malloc(width * height * 3);
-        int x, y;
-        for (y = 0; y < height; y++) {
-            for (x = 0; x < width; x++) {
-                uint16_t rgb655 = *(uint16_t*)(data + y * row_pitch + x * 2);
-                int8_t *pixel = (int8_t*)&converted_data[(y * width + x) * 3];
-                /* Maps 5 bit G and B signed value range to 8 bit
-                 * signed values. R is probably unsigned.
-                 */
-                rgb655 ^= (1 << 9) | (1 << 4);
-                pixel[0] = ((rgb655 & 0xFC00) >> 10) * 0x7F / 0x3F;
-                pixel[1] = ((rgb655 & 0x03E0) >> 5) * 0xFF / 0x1F - 0x80;
-                pixel[2] = (rgb655 & 0x001F) * 0xFF / 0x1F - 0x80;
-            }
+/*
+ * Decodes all queued images straight into a pixel buffer, spread over the
+ * texture decode workers, then uploads them from there.
+ */
+static void pgraph_flush_texture_uploads(PGRAPHState *pg,
+                                         TextureUploadBatch *batch,
+                                         GLenum gl_target, GLuint gl_texture)
+{
+    if (batch->uploads->len == 0) {
+        return;
+    }
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pg->gl_texture_staging_buffer);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, batch->size, NULL, GL_STREAM_DRAW);
+    uint8_t *staging = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0,
+                                        batch->size,
+                                        GL_MAP_WRITE_BIT
+                                        | GL_MAP_INVALIDATE_BUFFER_BIT);
+    assert(staging != NULL);
+
+    unsigned int num_parallel = texture_decode_pool_run(
+        &pg->texture_decode_pool, (TextureDecodeImage *)batch->images->data,
+        batch->images->len, staging);
+    nv2a_profile_add_counter(NV2A_PROF_TEX_DECODE_JOBS, batch->images->len);
+    nv2a_profile_add_counter(NV2A_PROF_TEX_DECODE_PARALLEL, num_parallel);
+
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+    glBindTexture(gl_target, gl_texture);
+    for (int i = 0; i < batch->uploads->len; i++) {
+        TextureUpload *upload = &g_array_index(batch->uploads, TextureUpload,
+                                               i);
+        if (upload->gl_target == GL_TEXTURE_3D) {
+            glTexSubImage3D(upload->gl_target, upload->level, 0, 0, 0,
+                            upload->width, upload->height, upload->depth,
+                            upload->gl_format, upload->gl_type,
+                            (void *)upload->offset);
+        } else {
+            glTexSubImage2D(upload->gl_target, upload->level, 0, 0,
+                            upload->width, upload->height,
+                            upload->gl_format, upload->gl_type,
+                            (void *)upload->offset);
         }
-        return converted_data;
-    } else {
-        return NULL;
     }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 }
 
 static void upload_gl_texture(GLenum gl_target,
+                              GLuint gl_texture,
                               const TextureShape s,
                               const uint8_t *texture_data,
-                              const uint8_t *palette_data)
+                              const uint8_t *palette_data,
+                              TextureUploadBatch *batch)
 {
     ColorFormatInfo f = kelvin_color_format_map[s.color_format];
+    bool palette_in_shader = pgraph_texture_palette_in_shader(
+        s.color_format, s.cubemap, s.dimensionality);
+    if (palette_in_shader) {
+        f = kelvin_indexed_color_format;
+    }
+    TextureDecodeConversion conversion = pgraph_texture_decode_conversion(&s);
     nv2a_profile_inc_counter(NV2A_PROF_TEX_UPLOAD);
 
     switch(gl_target) {
@@ -6437,21 +8408,30 @@ static void upload_gl_texture(GLenum gl_target,
         /* Can't handle strides unaligned to pixels */
         assert(s.pitch % f.bytes_per_pixel == 0);
 
-        uint8_t *converted = convert_texture_data(s, texture_data,
-                                                  palette_data,
-                                                  s.width, s.height, 1,
-                                                  s.pitch, 0);
-        glPixelStorei(GL_UNPACK_ROW_LENGTH, converted ? 0 : s.pitch / f.bytes_per_pixel);
-        glTexImage2D(gl_target, 0, f.gl_internal_format,
-                     s.width, s.height, 0,
-                     f.gl_format, f.gl_type,
-                     converted ? converted : texture_data);
-
-        if (converted) {
-          g_free(converted);
+        if (conversion == TEXTURE_DECODE_COPY) {
+            /* Nothing to decode, upload straight from guest memory */
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, s.pitch / f.bytes_per_pixel);
+            glTexImage2D(gl_target, 0, f.gl_internal_format,
+                         s.width, s.height, 0,
+                         f.gl_format, f.gl_type,
+                         texture_data);
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        } else {
+            TextureDecodeImage image = {
+                .src = texture_data,
+                .swizzled = false,
+                .width = s.width,
+                .height = s.height,
+                .depth = 1,
+                .src_pitch = s.pitch,
+                .bytes_per_pixel = f.bytes_per_pixel,
+                .conversion = conversion,
+                .palette = palette_data,
+            };
+            pgraph_queue_texture_upload(batch, gl_target, 0,
+                                        f.gl_internal_format,
+                                        f.gl_format, f.gl_type, &image);
         }
-
-        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
         break;
     }
     case GL_TEXTURE_2D:
@@ -6483,29 +8463,38 @@ static void upload_gl_texture(GLenum gl_target,
                                        texture_data);
 
                 texture_data += width/4 * height/4 * block_size;
-            } else {
-
-                width = MAX(width, 1); height = MAX(height, 1);
-
-                unsigned int pitch = width * f.bytes_per_pixel;
-                uint8_t *unswizzled = (uint8_t*)g_malloc(height * pitch);
-                unswizzle_rect(texture_data, width, height,
-                               unswizzled, pitch, f.bytes_per_pixel);
-
-                uint8_t *converted = convert_texture_data(s, unswizzled,
-                                                          palette_data,
-                                                          width, height, 1,
-                                                          pitch, 0);
+            } else if (width * height >= GPU_SWIZZLE_MIN_TEXELS &&
+                       conversion == TEXTURE_DECODE_COPY &&
+                       pgraph_gpu_swizzle_format_supported(
+                           f.gl_internal_format) &&
+                       qatomic_read(&g_nv2a->pgraph.gpu_swizzle)) {
 
                 glTexImage2D(gl_target, level, f.gl_internal_format,
                              width, height, 0,
-                             f.gl_format, f.gl_type,
-                             converted ? converted : unswizzled);
+                             f.gl_format, f.gl_type, NULL);
+                pgraph_gpu_unswizzle(&g_nv2a->pgraph, f.gl_internal_format,
+                                     f.gl_format, f.gl_type, texture_data,
+                                     width, height, gl_target, gl_texture,
+                                     level, 1, false);
 
-                if (converted) {
-                    g_free(converted);
-                }
-                g_free(unswizzled);
+                texture_data += width * height * f.bytes_per_pixel;
+            } else {
+
+                width = MAX(width, 1); height = MAX(height, 1);
+
+                TextureDecodeImage image = {
+                    .src = texture_data,
+                    .swizzled = true,
+                    .width = width,
+                    .height = height,
+                    .depth = 1,
+                    .bytes_per_pixel = f.bytes_per_pixel,
+                    .conversion = conversion,
+                    .palette = palette_data,
+                };
+                pgraph_queue_texture_upload(batch, gl_target, level,
+                                            f.gl_internal_format,
+                                            f.gl_format, f.gl_type, &image);
 
                 texture_data += width * height * f.bytes_per_pixel;
             }
@@ -6531,49 +8520,91 @@ static void upload_gl_texture(GLenum gl_target,
                 depth = MAX(depth, 1);
 
                 unsigned int block_size;
+                TextureDecodeConversion dxt;
                 if (f.gl_internal_format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT) {
                     block_size = 8;
+                    dxt = TEXTURE_DECODE_DXT1;
+                } else if (f.gl_internal_format ==
+                           GL_COMPRESSED_RGBA_S3TC_DXT3_EXT) {
+                    block_size = 16;
+                    dxt = TEXTURE_DECODE_DXT3;
                 } else {
                     block_size = 16;
+                    dxt = TEXTURE_DECODE_DXT5;
                 }
 
                 size_t texture_size = width/4 * height/4 * depth * block_size;
 
-                uint8_t *converted = decompress_3d_texture_data(f.gl_internal_format, texture_data, width, height, depth);
-
-                glTexImage3D(gl_target, level,  GL_RGBA8,
-                             width, height, depth, 0,
-                             GL_RGBA, GL_UNSIGNED_INT_8_8_8_8,
-                             converted);
-
-                g_free(converted);
+                TextureDecodeImage image = {
+                    .src = texture_data,
+                    .width = width,
+                    .height = height,
+                    .depth = depth,
+                    .conversion = dxt,
+                };
+                pgraph_queue_texture_upload(batch, gl_target, level, GL_RGBA8,
+                                            GL_RGBA, GL_UNSIGNED_INT_8_8_8_8,
+                                            &image);
 
                 texture_data += texture_size;
             } else {
 
-                unsigned int row_pitch = width * f.bytes_per_pixel;
-                unsigned int slice_pitch = row_pitch * height;
-                uint8_t *unswizzled = (uint8_t*)g_malloc(slice_pitch * depth);
-                unswizzle_box(texture_data, width, height, depth, unswizzled,
-                               row_pitch, slice_pitch, f.bytes_per_pixel);
+                TextureDecodeImage image = {
+                    .src = texture_data,
+                    .swizzled = true,
+                    .width = width,
+                    .height = height,
+                    .depth = depth,
+                    .bytes_per_pixel = f.bytes_per_pixel,
+                    .conversion = conversion,
+                    .palette = palette_data,
+                };
+                pgraph_queue_texture_upload(batch, gl_target, level,
+                                            f.gl_internal_format,
+                                            f.gl_format, f.gl_type, &image);
+
+                texture_data += width * height * depth * f.bytes_per_pixel;
+            }
+
+            width /= 2;
+            height /= 2;
+            depth /= 2;
+        }
+        break;
+    }
+    case GL_TEXTURE_2D_ARRAY: {
+        /* A DXT volume, each level has as many slices as the base level for
+         * the array to be complete, of which the first depth are filled */
+        unsigned int width = s.width, height = s.height, depth = s.depth;
+        unsigned int block_size =
+            f.gl_internal_format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT ? 8 : 16;
+
+        assert(f.gl_format == 0);
 
-                uint8_t *converted = convert_texture_data(s, unswizzled,
-                                                          palette_data,
-                                                          width, height, depth,
-                                                          row_pitch, slice_pitch);
+        int level;
+        for (level = 0; level < s.levels; level++) {
+            width = MAX(width, 1);
+            height = MAX(height, 1);
+            depth = MAX(depth, 1);
 
-                glTexImage3D(gl_target, level, f.gl_internal_format,
-                             width, height, depth, 0,
-                             f.gl_format, f.gl_type,
-                             converted ? converted : unswizzled);
+            unsigned int block_width = MAX(width, 4);
+            unsigned int block_height = MAX(height, 4);
+            size_t slice_size = block_width/4 * block_height/4 * block_size;
 
-                if (converted) {
-                    g_free(converted);
-                }
-                g_free(unswizzled);
+            glCompressedTexImage3D(gl_target, level, f.gl_internal_format,
+                                   width, height, s.depth, 0,
+                                   slice_size * s.depth, NULL);
 
-                texture_data += width * height * depth * f.bytes_per_pixel;
-            }
+            uint8_t *slices = g_malloc(slice_size * depth);
+            split_3d_texture_data(f.gl_internal_format, texture_data,
+                                  block_width, block_height, depth, slices);
+            glCompressedTexSubImage3D(gl_target, level, 0, 0, 0,
+                                      width, height, depth,
+                                      f.gl_internal_format,
+                                      slice_size * depth, slices);
+            g_free(slices);
+
+            texture_data += slice_size * depth;
 
             width /= 2;
             height /= 2;
@@ -6587,7 +8618,8 @@ static void upload_gl_texture(GLenum gl_target,
     }
 }
 
-static TextureBinding* generate_texture(const TextureShape s,
+static TextureBinding* generate_texture(PGRAPHState *pg,
+                                        const TextureShape s,
                                         const uint8_t *texture_data,
                                         const uint8_t *palette_data)
 {
@@ -6618,7 +8650,15 @@ static TextureBinding* generate_texture(const TextureShape s,
             switch(s.dimensionality) {
             case 1: gl_target = GL_TEXTURE_1D; break;
             case 2: gl_target = GL_TEXTURE_2D; break;
-            case 3: gl_target = GL_TEXTURE_3D; break;
+            case 3:
+                if (pgraph_texture_volume_as_array(pg, s.color_format,
+                                                   s.cubemap,
+                                                   s.dimensionality)) {
+                    gl_target = GL_TEXTURE_2D_ARRAY;
+                } else {
+                    gl_target = GL_TEXTURE_3D;
+                }
+                break;
             default:
                 assert(false);
                 break;
@@ -6636,6 +8676,12 @@ static TextureBinding* generate_texture(const TextureShape s,
                    s.dimensionality, s.cubemap ? " (Cubemap)" : "",
                    s.width, s.height, s.depth);
 
+    TextureUploadBatch batch = {
+        .images = g_array_new(false, false, sizeof(TextureDecodeImage)),
+        .uploads = g_array_new(false, false, sizeof(TextureUpload)),
+        .size = 0,
+    };
+
     if (gl_target == GL_TEXTURE_CUBE_MAP) {
 
         ColorFormatInfo f = kelvin_color_format_map[s.color_format];
@@ -6662,22 +8708,33 @@ static TextureBinding* generate_texture(const TextureShape s,
 
         length = (length + NV2A_CUBEMAP_FACE_ALIGNMENT - 1) & ~(NV2A_CUBEMAP_FACE_ALIGNMENT - 1);
 
-        upload_gl_texture(GL_TEXTURE_CUBE_MAP_POSITIVE_X,
-                          s, texture_data + 0 * length, palette_data);
-        upload_gl_texture(GL_TEXTURE_CUBE_MAP_NEGATIVE_X,
-                          s, texture_data + 1 * length, palette_data);
-        upload_gl_texture(GL_TEXTURE_CUBE_MAP_POSITIVE_Y,
-                          s, texture_data + 2 * length, palette_data);
-        upload_gl_texture(GL_TEXTURE_CUBE_MAP_NEGATIVE_Y,
-                          s, texture_data + 3 * length, palette_data);
-        upload_gl_texture(GL_TEXTURE_CUBE_MAP_POSITIVE_Z,
-                          s, texture_data + 4 * length, palette_data);
-        upload_gl_texture(GL_TEXTURE_CUBE_MAP_NEGATIVE_Z,
-                          s, texture_data + 5 * length, palette_data);
+        upload_gl_texture(GL_TEXTURE_CUBE_MAP_POSITIVE_X, gl_texture,
+                          s, texture_data + 0 * length, palette_data,
+                          &batch);
+        upload_gl_texture(GL_TEXTURE_CUBE_MAP_NEGATIVE_X, gl_texture,
+                          s, texture_data + 1 * length, palette_data,
+                          &batch);
+        upload_gl_texture(GL_TEXTURE_CUBE_MAP_POSITIVE_Y, gl_texture,
+                          s, texture_data + 2 * length, palette_data,
+                          &batch);
+        upload_gl_texture(GL_TEXTURE_CUBE_MAP_NEGATIVE_Y, gl_texture,
+                          s, texture_data + 3 * length, palette_data,
+                          &batch);
+        upload_gl_texture(GL_TEXTURE_CUBE_MAP_POSITIVE_Z, gl_texture,
+                          s, texture_data + 4 * length, palette_data,
+                          &batch);
+        upload_gl_texture(GL_TEXTURE_CUBE_MAP_NEGATIVE_Z, gl_texture,
+                          s, texture_data + 5 * length, palette_data,
+                          &batch);
     } else {
-        upload_gl_texture(gl_target, s, texture_data, palette_data);
+        upload_gl_texture(gl_target, gl_texture, s, texture_data,
+                          palette_data, &batch);
     }
 
+    pgraph_flush_texture_uploads(pg, &batch, gl_target, gl_texture);
+    g_array_free(batch.images, true);
+    g_array_free(batch.uploads, true);
+
     /* Linear textures don't support mipmapping */
     if (!f.linear) {
         glTexParameteri(gl_target, GL_TEXTURE_BASE_LEVEL,
@@ -6698,6 +8755,9 @@ static TextureBinding* generate_texture(const TextureShape s,
     ret->refcnt = 1;
     ret->draw_time = 0;
     ret->data_hash = 0;
+    ret->max_level = f.linear ? 0 : MAX((int)s.levels - 1
+                                        - (int)s.min_mipmap_level, 0);
+    ret->depth = MAX(s.depth >> s.min_mipmap_level, 1);
     return ret;
 }
 
@@ -6716,15 +8776,38 @@ static void texture_binding_destroy(gpointer data)
 static void texture_cache_entry_init(Lru *lru, LruNode *node, void *key)
 {
     TextureLruNode *tnode = container_of(node, TextureLruNode, node);
+    PGRAPHState *pg = container_of(lru, PGRAPHState, texture_cache);
     memcpy(&tnode->key, key, sizeof(TextureKey));
 
     tnode->binding = NULL;
     tnode->possibly_dirty = false;
+
+    interval_tree_insert(&pg->texture_cache_texture_ranges,
+                         &tnode->texture_range,
+                         tnode->key.texture_vram_offset,
+                         tnode->key.texture_vram_offset
+                             + tnode->key.texture_length - 1);
+    if (tnode->key.palette_length > 0) {
+        interval_tree_insert(&pg->texture_cache_palette_ranges,
+                             &tnode->palette_range,
+                             tnode->key.palette_vram_offset,
+                             tnode->key.palette_vram_offset
+                                 + tnode->key.palette_length - 1);
+    }
 }
 
 static void texture_cache_entry_post_evict(Lru *lru, LruNode *node)
 {
     TextureLruNode *tnode = container_of(node, TextureLruNode, node);
+    PGRAPHState *pg = container_of(lru, PGRAPHState, texture_cache);
+
+    interval_tree_remove(&pg->texture_cache_texture_ranges,
+                         &tnode->texture_range);
+    if (interval_tree_node_in_tree(&tnode->palette_range)) {
+        interval_tree_remove(&pg->texture_cache_palette_ranges,
+                             &tnode->palette_range);
+    }
+
     if (tnode->binding) {
         texture_binding_destroy(tnode->binding);
         tnode->binding = NULL;
@@ -6738,17 +8821,6 @@ static bool texture_cache_entry_compare(Lru *lru, LruNode *node, void *key)
     return memcmp(&tnode->key, key, sizeof(TextureKey));
 }
 
-/* hash and equality for shader cache hash table */
-static guint shader_hash(gconstpointer key)
-{
-    return fast_hash((const uint8_t *)key, sizeof(ShaderState));
-}
-static gboolean shader_equal(gconstpointer a, gconstpointer b)
-{
-    const ShaderState *as = (const ShaderState *)a, *bs = (const ShaderState *)b;
-    return memcmp(as, bs, sizeof(ShaderState)) == 0;
-}
-
 static unsigned int kelvin_map_stencil_op(uint32_t parameter)
 {
     unsigned int op;
@@ -522,6 +522,171 @@ static void add_final_stage_code(struct PixelShader *ps, struct FCInputInfo fina
     ps->varE = ps->varF = NULL;
 }
 
+/*
+ * Emits the end of a texture lookup function that has computed the level of
+ * detail of its coordinates, choosing and blending mipmap levels the way the
+ * GL would. <filter_func><i>(coords, level, minified) filters one level.
+ */
+static void append_level_selection(MString *preflight, uint8_t filter,
+                                   const char *filter_func,
+                                   const char *coords, int i)
+{
+    mstring_append_fmt(preflight,
+        "    if (lod <= 0.0) {\n"
+        "        return %s%d(%s, 0.0, false);\n"
+        "    }\n",
+        filter_func, i, coords);
+
+    if (!(filter & PSH_FILTER_MIPMAP)) {
+        mstring_append_fmt(preflight,
+            "    return %s%d(%s, 0.0, true);\n",
+            filter_func, i, coords);
+    } else if (!(filter & PSH_FILTER_MIPMAP_LINEAR)) {
+        mstring_append_fmt(preflight,
+            "    float level = min(floor(lod + 0.5), texMaxLevel%d);\n"
+            "    return %s%d(%s, level, true);\n",
+            i, filter_func, i, coords);
+    } else {
+        mstring_append_fmt(preflight,
+            "    float level = min(lod, texMaxLevel%d);\n"
+            "    float base = floor(level);\n"
+            "    return mix(%s%d(%s, base, true),\n"
+            "               %s%d(%s, min(base + 1.0, texMaxLevel%d), true),\n"
+            "               level - base);\n",
+            i, filter_func, i, coords, filter_func, i, coords, i);
+    }
+    mstring_append(preflight, "}\n");
+}
+
+/*
+ * Indexed textures are bound as their raw 8-bit indices next to a 256x1
+ * palette texture. Filtering the indices would blend unrelated palette
+ * entries, so the index texture is sampled with nearest filtering and the
+ * filtering the game asked for is done here on the looked up colors.
+ */
+static void define_palette_lookup(MString *preflight, const PshState *state,
+                                  int i)
+{
+    uint8_t filter = state->tex_filter[i];
+    const char *mag_linear =
+        (filter & PSH_FILTER_MAG_LINEAR) ? "true" : "false";
+    const char *min_linear =
+        (filter & PSH_FILTER_MIN_LINEAR) ? "true" : "false";
+
+    mstring_append_fmt(preflight,
+        "uniform sampler2D palette%d;\n"
+        "uniform float texMaxLevel%d;\n"
+        "vec4 paletteFetch%d(vec2 uv, float level) {\n"
+        "    float index = textureLod(texSamp%d, uv, level).r;\n"
+        "    return texelFetch(palette%d, ivec2(int(index * 255.0 + 0.5), 0), 0);\n"
+        "}\n"
+        "vec4 paletteFilter%d(vec2 uv, float level, bool minified) {\n"
+        "    if (!(minified ? %s : %s)) {\n"
+        "        return paletteFetch%d(uv, level);\n"
+        "    }\n"
+        "    vec2 size = vec2(textureSize(texSamp%d, int(level)));\n"
+        "    vec2 st = uv * size - 0.5;\n"
+        "    vec2 f = fract(st);\n"
+        "    vec2 p = (floor(st) + 0.5) / size;\n"
+        "    vec2 d = 1.0 / size;\n"
+        "    return mix(mix(paletteFetch%d(p, level),\n"
+        "                   paletteFetch%d(p + vec2(d.x, 0.0), level), f.x),\n"
+        "               mix(paletteFetch%d(p + vec2(0.0, d.y), level),\n"
+        "                   paletteFetch%d(p + d, level), f.x),\n"
+        "               f.y);\n"
+        "}\n"
+        "vec4 texturePalette%d(vec2 uv) {\n"
+        "    vec2 texels = uv * vec2(textureSize(texSamp%d, 0));\n"
+        "    vec2 dx = dFdx(texels);\n"
+        "    vec2 dy = dFdy(texels);\n"
+        "    float lod = 0.5 * log2(max(dot(dx, dx), dot(dy, dy)));\n",
+        i, i, i, i, i, i, min_linear, mag_linear, i, i, i, i, i, i, i, i);
+
+    append_level_selection(preflight, filter, "paletteFilter", "uv", i);
+}
+
+/*
+ * Compressed volumes are bound as 2D arrays of their slices, so that they
+ * don't have to be decoded on the CPU. Every mipmap level of the array has
+ * as many slices as the base level, of which only the first
+ * max(depth >> level, 1) are used. The GL filters within a slice and the
+ * filtering between slices and mipmap levels is done here.
+ */
+static void define_volume_lookup(MString *preflight, const PshState *state,
+                                 int i)
+{
+    uint8_t filter = state->tex_filter[i];
+    const char *mag_linear =
+        (filter & PSH_FILTER_MAG_LINEAR) ? "true" : "false";
+    const char *min_linear =
+        (filter & PSH_FILTER_MIN_LINEAR) ? "true" : "false";
+    const char *wrap;
+
+    switch (state->volume_wrap[i]) {
+    case PSH_VOLUME_WRAP_REPEAT:
+        wrap = "    return mod(layer, depth);\n";
+        break;
+    case PSH_VOLUME_WRAP_MIRROR:
+        wrap = "    float m = mod(layer, 2.0 * depth);\n"
+               "    return m < depth ? m : 2.0 * depth - 1.0 - m;\n";
+        break;
+    default:
+        wrap = "    return clamp(layer, 0.0, depth - 1.0);\n";
+        break;
+    }
+
+    /* Levels are picked here, the GL samples the requested one with its
+     * min filter at level + 0.25 given *_MIPMAP_NEAREST filtering */
+    mstring_append_fmt(preflight,
+        "uniform float texMaxLevel%d;\n"
+        "uniform float volumeDepth%d;\n"
+        "float volumeLayer%d(float layer, float depth) {\n"
+        "%s"
+        "}\n"
+        "vec4 volumeFilter%d(vec3 uvw, float level, bool minified) {\n"
+        "    float lambda = minified ? level + 0.25 : 0.0;\n"
+        "    float depth = max(floor(volumeDepth%d / exp2(level)), 1.0);\n"
+        "    float w = uvw.z * depth - 0.5;\n"
+        "    if (!(minified ? %s : %s)) {\n"
+        "        float layer = volumeLayer%d(floor(w + 0.5), depth);\n"
+        "        return textureLod(texSamp%d, vec3(uvw.xy, layer), lambda);\n"
+        "    }\n"
+        "    float base = floor(w);\n"
+        "    float layer0 = volumeLayer%d(base, depth);\n"
+        "    float layer1 = volumeLayer%d(base + 1.0, depth);\n"
+        "    return mix(textureLod(texSamp%d, vec3(uvw.xy, layer0), lambda),\n"
+        "               textureLod(texSamp%d, vec3(uvw.xy, layer1), lambda),\n"
+        "               w - base);\n"
+        "}\n"
+        "vec4 textureVolume%d(vec3 uvw) {\n"
+        "    vec3 texels = uvw * vec3(vec2(textureSize(texSamp%d, 0).xy),\n"
+        "                             volumeDepth%d);\n"
+        "    vec3 dx = dFdx(texels);\n"
+        "    vec3 dy = dFdy(texels);\n"
+        "    float lod = 0.5 * log2(max(dot(dx, dx), dot(dy, dy)));\n",
+        i, i, i, wrap, i, i, min_linear, mag_linear, i, i, i, i, i, i, i, i,
+        i);
+
+    append_level_selection(preflight, filter, "volumeFilter", "uvw", i);
+}
+
+/* Emits t<i> as a 2D texture lookup, through the palette if there is one */
+static void append_texture_2d(MString *vars, const struct PixelShader *ps,
+                              int i, const char *coords_fmt, ...)
+{
+    va_list va;
+
+    if (ps->state.palette_tex[i]) {
+        mstring_append_fmt(vars, "vec4 t%d = texturePalette%d(", i, i);
+    } else {
+        mstring_append_fmt(vars, "vec4 t%d = texture(texSamp%d, ", i, i);
+    }
+    va_start(va, coords_fmt);
+    mstring_append_va(vars, coords_fmt, va);
+    va_end(va);
+    mstring_append(vars, ");\n");
+}
+
 static MString* psh_convert(struct PixelShader *ps)
 {
     int i;
@@ -687,14 +852,24 @@ static MString* psh_convert(struct PixelShader *ps)
                 }
             }
             mstring_append_fmt(vars, "pT%d.xy = texScale%d * pT%d.xy;\n", i, i, i);
-            mstring_append_fmt(vars, "vec4 t%d = %s(texSamp%d, pT%d.xyw);\n",
-                               i, lookup, i, i);
+            if (ps->state.palette_tex[i]) {
+                append_texture_2d(vars, ps, i, "pT%d.xy / pT%d.w", i, i);
+            } else {
+                mstring_append_fmt(vars, "vec4 t%d = %s(texSamp%d, pT%d.xyw);\n",
+                                   i, lookup, i, i);
+            }
             break;
         }
         case PS_TEXTUREMODES_PROJECT3D:
-            sampler_type = "sampler3D";
-            mstring_append_fmt(vars, "vec4 t%d = textureProj(texSamp%d, pT%d.xyzw);\n",
-                               i, i, i);
+            if (ps->state.volume_tex[i]) {
+                sampler_type = "sampler2DArray";
+                mstring_append_fmt(vars, "vec4 t%d = textureVolume%d(pT%d.xyz / pT%d.w);\n",
+                                   i, i, i, i);
+            } else {
+                sampler_type = "sampler3D";
+                mstring_append_fmt(vars, "vec4 t%d = textureProj(texSamp%d, pT%d.xyzw);\n",
+                                   i, i, i);
+            }
             break;
         case PS_TEXTUREMODES_CUBEMAP:
             sampler_type = "samplerCube";
@@ -732,8 +907,8 @@ static MString* psh_convert(struct PixelShader *ps)
 
             mstring_append_fmt(vars, "dsdt%d = bumpMat%d * dsdt%d;\n",
                 i, i, i, i);
-            mstring_append_fmt(vars, "vec4 t%d = texture(texSamp%d, texScale%d * (pT%d.xy + dsdt%d));\n",
-                i, i, i, i, i);
+            append_texture_2d(vars, ps, i, "texScale%d * (pT%d.xy + dsdt%d)",
+                              i, i, i);
             break;
         case PS_TEXTUREMODES_BUMPENVMAP_LUM:
             assert(i >= 1);
@@ -754,8 +929,8 @@ static MString* psh_convert(struct PixelShader *ps)
 
             mstring_append_fmt(vars, "dsdtl%d.st = bumpMat%d * dsdtl%d.st;\n",
                 i, i, i, i);
-            mstring_append_fmt(vars, "vec4 t%d = texture(texSamp%d, texScale%d * (pT%d.xy + dsdtl%d.st));\n",
-                i, i, i, i, i);
+            append_texture_2d(vars, ps, i, "texScale%d * (pT%d.xy + dsdtl%d.st)",
+                              i, i, i);
             mstring_append_fmt(vars, "t%d = t%d * (bumpScale%d * dsdtl%d.p + bumpOffset%d);\n",
                 i, i, i, i, i);
             break;
@@ -771,8 +946,8 @@ static MString* psh_convert(struct PixelShader *ps)
             mstring_append_fmt(vars, "/* PS_TEXTUREMODES_DOT_ST */\n");
             mstring_append_fmt(vars, "float dot%d = dot(pT%d.xyz, %s(t%d.rgb));\n",
                 i, i, dotmap_func, ps->input_tex[i]);
-            mstring_append_fmt(vars, "vec4 t%d = texture(texSamp%d, texScale%d * vec2(dot%d, dot%d));\n",
-                i, i, i, i-1, i);
+            append_texture_2d(vars, ps, i, "texScale%d * vec2(dot%d, dot%d)",
+                              i, i-1, i);
             break;
         case PS_TEXTUREMODES_DOT_ZW:
             assert(i >= 2);
@@ -813,12 +988,18 @@ static MString* psh_convert(struct PixelShader *ps)
             break;
         case PS_TEXTUREMODES_DOT_STR_3D:
             assert(i == 3);
-            sampler_type = "sampler3D";
+            sampler_type = ps->state.volume_tex[i] ? "sampler2DArray"
+                                                   : "sampler3D";
             mstring_append_fmt(vars, "/* PS_TEXTUREMODES_DOT_STR_3D */\n");
             mstring_append_fmt(vars, "float dot%d = dot(pT%d.xyz, %s(t%d.rgb));\n",
                 i, i, dotmap_func, ps->input_tex[i]);
-            mstring_append_fmt(vars, "vec4 t%d = texture(texSamp%d, vec3(dot%d, dot%d, dot%d));\n",
-                i, i, i-2, i-1, i);
+            if (ps->state.volume_tex[i]) {
+                mstring_append_fmt(vars, "vec4 t%d = textureVolume%d(vec3(dot%d, dot%d, dot%d));\n",
+                    i, i, i-2, i-1, i);
+            } else {
+                mstring_append_fmt(vars, "vec4 t%d = texture(texSamp%d, vec3(dot%d, dot%d, dot%d));\n",
+                    i, i, i-2, i-1, i);
+            }
             break;
         case PS_TEXTUREMODES_DOT_STR_CUBE:
             assert(i == 3);
@@ -833,15 +1014,13 @@ static MString* psh_convert(struct PixelShader *ps)
             assert(i >= 1);
             assert(!ps->state.rect_tex[i]);
             sampler_type = "sampler2D";
-            mstring_append_fmt(vars, "vec4 t%d = texture(texSamp%d, t%d.ar);\n",
-                i, i, ps->input_tex[i]);
+            append_texture_2d(vars, ps, i, "t%d.ar", ps->input_tex[i]);
             break;
         case PS_TEXTUREMODES_DPNDNT_GB:
             assert(i >= 1);
             assert(!ps->state.rect_tex[i]);
             sampler_type = "sampler2D";
-            mstring_append_fmt(vars, "vec4 t%d = texture(texSamp%d, t%d.gb);\n",
-                i, i, ps->input_tex[i]);
+            append_texture_2d(vars, ps, i, "t%d.gb", ps->input_tex[i]);
             break;
         case PS_TEXTUREMODES_DOTPRODUCT:
             assert(i == 1 || i == 2);
@@ -865,6 +1044,13 @@ static MString* psh_convert(struct PixelShader *ps)
         mstring_append_fmt(preflight, "uniform float texScale%d;\n", i);
         if (sampler_type != NULL) {
             mstring_append_fmt(preflight, "uniform %s texSamp%d;\n", sampler_type, i);
+            if (ps->state.palette_tex[i]
+                && !strcmp(sampler_type, "sampler2D")) {
+                define_palette_lookup(preflight, &ps->state, i);
+            } else if (ps->state.volume_tex[i]
+                       && !strcmp(sampler_type, "sampler2DArray")) {
+                define_volume_lookup(preflight, &ps->state, i);
+            }
 
             /* As this means a texture fetch does happen, do alphakill */
             if (ps->state.alphakill[i]) {
@@ -909,8 +1095,18 @@ static MString* psh_convert(struct PixelShader *ps)
         }
     }
 
+    /* Laid out as ShaderCombinerConstants */
+    mstring_append(preflight,
+                   "layout(std140) uniform CombinerConstants {\n"
+                   "    vec4 combinerConstant0[9];\n"
+                   "    vec4 combinerConstant1[9];\n"
+                   "};\n");
     for (i = 0; i < ps->num_const_refs; i++) {
-        mstring_append_fmt(preflight, "uniform vec4 %s;\n", ps->const_refs[i]);
+        /* c<n>_<stage> */
+        mstring_append_fmt(preflight,
+                           "#define %s combinerConstant%c[%s]\n",
+                           ps->const_refs[i], ps->const_refs[i][1],
+                           &ps->const_refs[i][3]);
     }
 
     for (i = 0; i < ps->num_var_refs; i++) {
@@ -39,6 +39,19 @@ enum ConvolutionFilter {
     CONVOLUTION_FILTER_GAUSSIAN,
 };
 
+/* Filtering applied in the shader to textures sampled through a palette
+ * and to volumes sampled from 2D array slices */
+#define PSH_FILTER_MAG_LINEAR    (1 << 0)
+#define PSH_FILTER_MIN_LINEAR    (1 << 1)
+#define PSH_FILTER_MIPMAP        (1 << 2)
+#define PSH_FILTER_MIPMAP_LINEAR (1 << 3)
+
+enum PshVolumeWrap {
+    PSH_VOLUME_WRAP_REPEAT,
+    PSH_VOLUME_WRAP_MIRROR,
+    PSH_VOLUME_WRAP_CLAMP,
+};
+
 typedef struct PshState {
     /* fragment shader - register combiner stuff */
     uint32_t combiner_control;
@@ -56,6 +69,10 @@ typedef struct PshState {
     bool compare_mode[4][4];
     bool alphakill[4];
     enum ConvolutionFilter conv_tex[4];
+    bool palette_tex[4];
+    bool volume_tex[4];
+    uint8_t tex_filter[4];
+    enum PshVolumeWrap volume_wrap[4];
 
     bool alpha_test;
     enum PshAlphaFunc alpha_func;
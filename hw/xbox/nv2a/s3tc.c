@@ -23,6 +23,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/host-utils.h"
 #include "s3tc.h"
 
 static inline void decode_bc1_colors(uint16_t c0,
@@ -173,45 +174,693 @@ static inline void decompress_dxt5_block(const uint8_t block_data[16],
                            r, g, b, a, true);
 }
 
-uint8_t *decompress_3d_texture_data(GLint color_format,
-                                    const uint8_t *data,
-                                    unsigned int width,
-                                    unsigned int height,
-                                    unsigned int depth)
+/*
+ * The blocks of a volume texture are stored in groups of up to 4 slices, with
+ * the slices of each block next to each other. The decoders below work on one
+ * block row of such a group at a time, that is @num_blocks consecutive blocks
+ * of which block m lands at column m / block_depth of slice m % block_depth.
+ * @dst points at the first texel of the row in the first slice.
+ */
+typedef void (*S3TCDecodeRowFunc)(GLint color_format,
+                                  const uint8_t *data,
+                                  unsigned int num_blocks,
+                                  unsigned int block_depth,
+                                  uint8_t *dst,
+                                  unsigned int width,
+                                  size_t slice_pitch);
+
+static void decode_row_scalar(GLint color_format,
+                              const uint8_t *data,
+                              unsigned int num_blocks,
+                              unsigned int block_depth,
+                              uint8_t *dst,
+                              unsigned int width,
+                              size_t slice_pitch)
+{
+    for (unsigned int m = 0; m < num_blocks; m++) {
+        int i = m / block_depth;
+        int z_pos_factor = (m % block_depth) * slice_pitch / 4;
+
+        if (color_format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT) {
+            decompress_dxt1_block(data + 8 * m, dst, i, 0, width,
+                                  z_pos_factor);
+        } else if (color_format == GL_COMPRESSED_RGBA_S3TC_DXT3_EXT) {
+            decompress_dxt3_block(data + 16 * m, dst, i, 0, width,
+                                  z_pos_factor);
+        } else if (color_format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT) {
+            decompress_dxt5_block(data + 16 * m, dst, i, 0, width,
+                                  z_pos_factor);
+        } else {
+            assert(false);
+        }
+    }
+}
+
+/*
+ * The vector decoders compute the color and alpha palettes of
+ * S3TC_SIMD_BLOCKS blocks at once in 16-bit lanes, then expand the texels of
+ * each block from its palettes. All divisions are done as multiplications
+ * that give the same results as the scalar code for the whole input range:
+ *
+ *   r5 * 255 / 31 == (r5 * 1053) >> 7
+ *   g6 * 255 / 63 == (g6 << 2) + ((g6 * 49) >> 10)
+ *   x / 3 == (x * 21846) >> 16 for x <= 765
+ *   x / 5 == (x * 13108) >> 16 for x <= 1275
+ *   x / 7 == (x * 9363) >> 16 for x <= 1785
+ */
+#define S3TC_SIMD_BLOCKS 8
+
+typedef struct S3TCPalettes {
+    /* Colors as stored to the texture, alpha is 0 for DXT3 and DXT5 */
+    uint32_t colors[S3TC_SIMD_BLOCKS][4] QEMU_ALIGNED(16);
+    /* DXT5 only */
+    uint8_t alphas[S3TC_SIMD_BLOCKS][8] QEMU_ALIGNED(16);
+} S3TCPalettes;
+
+typedef struct S3TCEndpoints {
+    uint16_t c0[S3TC_SIMD_BLOCKS], c1[S3TC_SIMD_BLOCKS];
+    uint16_t a0[S3TC_SIMD_BLOCKS], a1[S3TC_SIMD_BLOCKS];
+} S3TCEndpoints;
+
+/*
+ * Gathers the endpoints of up to S3TC_SIMD_BLOCKS blocks, the lanes of
+ * missing blocks decode to garbage that is never stored. This and the
+ * palette stage are always inlined so that the AVX2 decoder gets them VEX
+ * encoded, mixing in legacy SSE code made it slower than the SSE2 one.
+ */
+static inline QEMU_ALWAYS_INLINE
+void load_endpoints(GLint color_format, const uint8_t *data,
+                    unsigned int count, S3TCEndpoints *e)
+{
+    memset(e, 0, sizeof(*e));
+    for (unsigned int n = 0; n < count; n++) {
+        if (color_format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT) {
+            const uint16_t *block = (const uint16_t *)(data + 8 * n);
+            e->c0[n] = block[0];
+            e->c1[n] = block[1];
+        } else {
+            const uint16_t *block = (const uint16_t *)(data + 16 * n);
+            e->c0[n] = block[4];
+            e->c1[n] = block[5];
+            e->a0[n] = data[16 * n];
+            e->a1[n] = data[16 * n + 1];
+        }
+    }
+}
+
+static inline const uint8_t *block_pointer(GLint color_format,
+                                           const uint8_t *data,
+                                           unsigned int m)
+{
+    return data + m * (color_format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT
+                       ? 8 : 16);
+}
+
+/* Groups have 1, 2 or 4 slices, so this avoids a division per block */
+static inline uint8_t *block_destination(uint8_t *dst, unsigned int m,
+                                         unsigned int depth_shift,
+                                         size_t slice_pitch)
+{
+    return dst + (m & ((1 << depth_shift) - 1)) * slice_pitch
+           + (m >> depth_shift) * 16;
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+static inline __m128i mulhi_const_sse2(__m128i x, uint16_t m)
+{
+    return _mm_mulhi_epu16(x, _mm_set1_epi16(m));
+}
+
+static inline __m128i select_sse2(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+/* Stores the 4 colors given as 16-bit halves of 8 blocks to palettes */
+static inline void store_colors_sse2(const __m128i lo[4], const __m128i hi[4],
+                                     S3TCPalettes *p)
+{
+    for (int half = 0; half < 2; half++) {
+        __m128i c[4];
+        for (int k = 0; k < 4; k++) {
+            c[k] = half ? _mm_unpackhi_epi16(lo[k], hi[k])
+                        : _mm_unpacklo_epi16(lo[k], hi[k]);
+        }
+        __m128i t0 = _mm_unpacklo_epi32(c[0], c[1]);
+        __m128i t1 = _mm_unpacklo_epi32(c[2], c[3]);
+        __m128i t2 = _mm_unpackhi_epi32(c[0], c[1]);
+        __m128i t3 = _mm_unpackhi_epi32(c[2], c[3]);
+        __m128i *out = (__m128i *)p->colors[half * 4];
+        _mm_store_si128(out + 0, _mm_unpacklo_epi64(t0, t1));
+        _mm_store_si128(out + 1, _mm_unpackhi_epi64(t0, t1));
+        _mm_store_si128(out + 2, _mm_unpacklo_epi64(t2, t3));
+        _mm_store_si128(out + 3, _mm_unpackhi_epi64(t2, t3));
+    }
+}
+
+static inline void decode_colors_sse2(__m128i c, __m128i *r, __m128i *g,
+                                      __m128i *b)
+{
+    __m128i r5 = _mm_srli_epi16(c, 11);
+    __m128i g6 = _mm_and_si128(_mm_srli_epi16(c, 5), _mm_set1_epi16(0x3F));
+    __m128i b5 = _mm_and_si128(c, _mm_set1_epi16(0x1F));
+    *r = _mm_srli_epi16(_mm_mullo_epi16(r5, _mm_set1_epi16(1053)), 7);
+    *g = _mm_add_epi16(_mm_slli_epi16(g6, 2),
+                       _mm_srli_epi16(_mm_mullo_epi16(g6, _mm_set1_epi16(49)),
+                                      10));
+    *b = _mm_srli_epi16(_mm_mullo_epi16(b5, _mm_set1_epi16(1053)), 7);
+}
+
+static inline QEMU_ALWAYS_INLINE
+void compute_palettes_sse2(GLint color_format, const S3TCEndpoints *e,
+                           S3TCPalettes *p)
+{
+    bool dxt1 = color_format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+    __m128i c0 = _mm_loadu_si128((const __m128i *)e->c0);
+    __m128i c1 = _mm_loadu_si128((const __m128i *)e->c1);
+    __m128i r[4], g[4], b[4], lo[4], hi[4];
+
+    decode_colors_sse2(c0, &r[0], &g[0], &b[0]);
+    decode_colors_sse2(c1, &r[1], &g[1], &b[1]);
+
+    /* Unsigned c0 <= c1 selects the 3 color mode of DXT1 */
+    __m128i bias = _mm_set1_epi16(-0x8000);
+    __m128i transparent = dxt1 ? _mm_andnot_si128(
+        _mm_cmpgt_epi16(_mm_xor_si128(c0, bias), _mm_xor_si128(c1, bias)),
+        _mm_set1_epi16(-1)) : _mm_setzero_si128();
+    __m128i alpha = dxt1 ? _mm_set1_epi16(0xFF) : _mm_setzero_si128();
+
+    __m128i *ch[3] = { r, g, b };
+    for (int k = 0; k < 3; k++) {
+        __m128i *v = ch[k];
+        __m128i third = mulhi_const_sse2(
+            _mm_add_epi16(_mm_add_epi16(v[0], v[0]), v[1]), 21846);
+        __m128i half = _mm_srli_epi16(_mm_add_epi16(v[0], v[1]), 1);
+        v[2] = select_sse2(transparent, half, third);
+        v[3] = _mm_andnot_si128(transparent, mulhi_const_sse2(
+            _mm_add_epi16(_mm_add_epi16(v[1], v[1]), v[0]), 21846));
+    }
+
+    for (int k = 0; k < 4; k++) {
+        __m128i a = k == 3 ? _mm_andnot_si128(transparent, alpha) : alpha;
+        lo[k] = _mm_or_si128(a, _mm_slli_epi16(b[k], 8));
+        hi[k] = _mm_or_si128(g[k], _mm_slli_epi16(r[k], 8));
+    }
+    store_colors_sse2(lo, hi, p);
+
+    if (color_format != GL_COMPRESSED_RGBA_S3TC_DXT5_EXT) {
+        return;
+    }
+
+    __m128i a0 = _mm_loadu_si128((const __m128i *)e->a0);
+    __m128i a1 = _mm_loadu_si128((const __m128i *)e->a1);
+    __m128i eight_alphas = _mm_cmpgt_epi16(a0, a1);
+    __m128i a[8];
+    a[0] = a0;
+    a[1] = a1;
+    for (int k = 2; k < 8; k++) {
+        __m128i a7 = mulhi_const_sse2(
+            _mm_add_epi16(_mm_mullo_epi16(a0, _mm_set1_epi16(8 - k)),
+                          _mm_mullo_epi16(a1, _mm_set1_epi16(k - 1))),
+            9363);
+        __m128i a5;
+        if (k < 6) {
+            a5 = mulhi_const_sse2(
+                _mm_add_epi16(_mm_mullo_epi16(a0, _mm_set1_epi16(6 - k)),
+                              _mm_mullo_epi16(a1, _mm_set1_epi16(k - 1))),
+                13108);
+        } else {
+            a5 = _mm_set1_epi16(k == 6 ? 0 : 255);
+        }
+        a[k] = select_sse2(eight_alphas, a7, a5);
+    }
+
+    /* Transpose to 8 alphas per block */
+    __m128i s[8], u[8];
+    for (int k = 0; k < 4; k++) {
+        s[2 * k] = _mm_unpacklo_epi16(a[2 * k], a[2 * k + 1]);
+        s[2 * k + 1] = _mm_unpackhi_epi16(a[2 * k], a[2 * k + 1]);
+    }
+    u[0] = _mm_unpacklo_epi32(s[0], s[2]);
+    u[1] = _mm_unpackhi_epi32(s[0], s[2]);
+    u[2] = _mm_unpacklo_epi32(s[4], s[6]);
+    u[3] = _mm_unpackhi_epi32(s[4], s[6]);
+    u[4] = _mm_unpacklo_epi32(s[1], s[3]);
+    u[5] = _mm_unpackhi_epi32(s[1], s[3]);
+    u[6] = _mm_unpacklo_epi32(s[5], s[7]);
+    u[7] = _mm_unpackhi_epi32(s[5], s[7]);
+    __m128i *out = (__m128i *)p->alphas;
+    for (int k = 0; k < 4; k++) {
+        __m128i lo_half = u[(k / 2) * 4 + (k % 2)];
+        __m128i hi_half = u[(k / 2) * 4 + (k % 2) + 2];
+        _mm_store_si128(out + k,
+                        _mm_packus_epi16(_mm_unpacklo_epi64(lo_half, hi_half),
+                                         _mm_unpackhi_epi64(lo_half,
+                                                            hi_half)));
+    }
+}
+
+/* Returns the alpha of each texel of a DXT3 or DXT5 block */
+static inline __m128i block_alphas_sse2(GLint color_format,
+                                        const uint8_t *block,
+                                        const uint8_t alphas[8])
+{
+    if (color_format == GL_COMPRESSED_RGBA_S3TC_DXT3_EXT) {
+        __m128i packed = _mm_loadl_epi64((const __m128i *)block);
+        __m128i nibble = _mm_set1_epi8(0x0F);
+        __m128i n = _mm_unpacklo_epi8(_mm_and_si128(packed, nibble),
+                                      _mm_and_si128(_mm_srli_epi16(packed, 4),
+                                                    nibble));
+        return _mm_or_si128(n, _mm_slli_epi16(n, 4));
+    }
+
+    uint64_t indices = *(const uint64_t *)block >> 16;
+    uint8_t a[16];
+    for (int t = 0; t < 16; t++) {
+        a[t] = alphas[(indices >> (3 * t)) & 7];
+    }
+    return _mm_loadu_si128((const __m128i *)a);
+}
+
+static void decode_row_sse2(GLint color_format,
+                            const uint8_t *data,
+                            unsigned int num_blocks,
+                            unsigned int block_depth,
+                            uint8_t *dst,
+                            unsigned int width,
+                            size_t slice_pitch)
+{
+    bool dxt1 = color_format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+    unsigned int depth_shift = ctz32(block_depth);
+    size_t pitch = width * 4;
+    const __m128i lo_bits = _mm_setr_epi32(1 << 0, 1 << 2, 1 << 4, 1 << 6);
+    const __m128i hi_bits = _mm_slli_epi32(lo_bits, 1);
+    S3TCEndpoints e;
+    S3TCPalettes p;
+
+    for (unsigned int m0 = 0; m0 < num_blocks; m0 += S3TC_SIMD_BLOCKS) {
+        unsigned int count = MIN(S3TC_SIMD_BLOCKS, num_blocks - m0);
+        load_endpoints(color_format, block_pointer(color_format, data, m0),
+                       count, &e);
+        compute_palettes_sse2(color_format, &e, &p);
+
+        for (unsigned int n = 0; n < count; n++) {
+            const uint8_t *block = block_pointer(color_format, data, m0 + n);
+            uint8_t *out = block_destination(dst, m0 + n, depth_shift,
+                                             slice_pitch);
+            __m128i palette = _mm_load_si128((const __m128i *)p.colors[n]);
+            __m128i p0 = _mm_shuffle_epi32(palette, 0x00);
+            __m128i p1 = _mm_shuffle_epi32(palette, 0x55);
+            __m128i p2 = _mm_shuffle_epi32(palette, 0xAA);
+            __m128i p3 = _mm_shuffle_epi32(palette, 0xFF);
+            __m128i indices = _mm_set1_epi32(
+                *(const uint32_t *)(block + (dxt1 ? 4 : 12)));
+            __m128i a16[2] = { _mm_setzero_si128(), _mm_setzero_si128() };
+
+            if (!dxt1) {
+                __m128i a = block_alphas_sse2(color_format, block,
+                                              p.alphas[n]);
+                a16[0] = _mm_unpacklo_epi8(a, _mm_setzero_si128());
+                a16[1] = _mm_unpackhi_epi8(a, _mm_setzero_si128());
+            }
+
+            for (int y = 0; y < 4; y++) {
+                __m128i lo_mask = _mm_slli_epi32(lo_bits, 8 * y);
+                __m128i hi_mask = _mm_slli_epi32(hi_bits, 8 * y);
+                __m128i lo = _mm_cmpeq_epi32(_mm_and_si128(indices, lo_mask),
+                                             lo_mask);
+                __m128i hi = _mm_cmpeq_epi32(_mm_and_si128(indices, hi_mask),
+                                             hi_mask);
+                __m128i color = select_sse2(hi, select_sse2(lo, p3, p2),
+                                            select_sse2(lo, p1, p0));
+                __m128i a = (y & 1) ? _mm_unpackhi_epi16(a16[y / 2],
+                                                         _mm_setzero_si128())
+                                    : _mm_unpacklo_epi16(a16[y / 2],
+                                                         _mm_setzero_si128());
+                _mm_storeu_si128((__m128i *)(out + y * pitch),
+                                 _mm_or_si128(color, a));
+            }
+        }
+    }
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+/* Same as decode_row_sse2(), with a block in each half of the registers */
+static void decode_row_avx2(GLint color_format,
+                            const uint8_t *data,
+                            unsigned int num_blocks,
+                            unsigned int block_depth,
+                            uint8_t *dst,
+                            unsigned int width,
+                            size_t slice_pitch)
+{
+    bool dxt1 = color_format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+    unsigned int depth_shift = ctz32(block_depth);
+    size_t pitch = width * 4;
+    const __m256i lo_bits = _mm256_setr_epi32(1 << 0, 1 << 2, 1 << 4, 1 << 6,
+                                              1 << 0, 1 << 2, 1 << 4, 1 << 6);
+    const __m256i hi_bits = _mm256_slli_epi32(lo_bits, 1);
+    S3TCEndpoints e;
+    S3TCPalettes p;
+
+    for (unsigned int m0 = 0; m0 < num_blocks; m0 += S3TC_SIMD_BLOCKS) {
+        unsigned int count = MIN(S3TC_SIMD_BLOCKS, num_blocks - m0);
+        load_endpoints(color_format, block_pointer(color_format, data, m0),
+                       count, &e);
+        compute_palettes_sse2(color_format, &e, &p);
+
+        for (unsigned int n = 0; n < count; n += 2) {
+            /* An odd last block is decoded twice into the same place */
+            unsigned int n1 = MIN(n + 1, count - 1);
+            const uint8_t *block[2] = {
+                block_pointer(color_format, data, m0 + n),
+                block_pointer(color_format, data, m0 + n1),
+            };
+            uint8_t *out[2] = {
+                block_destination(dst, m0 + n, depth_shift, slice_pitch),
+                block_destination(dst, m0 + n1, depth_shift, slice_pitch),
+            };
+            __m256i palette = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(
+                    _mm_load_si128((const __m128i *)p.colors[n])),
+                _mm_load_si128((const __m128i *)p.colors[n1]), 1);
+            __m256i p0 = _mm256_shuffle_epi32(palette, 0x00);
+            __m256i p1 = _mm256_shuffle_epi32(palette, 0x55);
+            __m256i p2 = _mm256_shuffle_epi32(palette, 0xAA);
+            __m256i p3 = _mm256_shuffle_epi32(palette, 0xFF);
+            unsigned int offset = dxt1 ? 4 : 12;
+            __m256i indices = _mm256_inserti128_si256(
+                _mm256_set1_epi32(*(const uint32_t *)(block[0] + offset)),
+                _mm_set1_epi32(*(const uint32_t *)(block[1] + offset)), 1);
+            __m256i a16[2] = { _mm256_setzero_si256(),
+                               _mm256_setzero_si256() };
+
+            if (!dxt1) {
+                __m256i a = _mm256_inserti128_si256(
+                    _mm256_castsi128_si256(block_alphas_sse2(
+                        color_format, block[0], p.alphas[n])),
+                    block_alphas_sse2(color_format, block[1], p.alphas[n1]),
+                    1);
+                a16[0] = _mm256_unpacklo_epi8(a, _mm256_setzero_si256());
+                a16[1] = _mm256_unpackhi_epi8(a, _mm256_setzero_si256());
+            }
+
+            for (int y = 0; y < 4; y++) {
+                __m256i lo_mask = _mm256_slli_epi32(lo_bits, 8 * y);
+                __m256i hi_mask = _mm256_slli_epi32(hi_bits, 8 * y);
+                __m256i lo = _mm256_cmpeq_epi32(
+                    _mm256_and_si256(indices, lo_mask), lo_mask);
+                __m256i hi = _mm256_cmpeq_epi32(
+                    _mm256_and_si256(indices, hi_mask), hi_mask);
+                __m256i color = _mm256_blendv_epi8(
+                    _mm256_blendv_epi8(p0, p1, lo),
+                    _mm256_blendv_epi8(p2, p3, lo), hi);
+                __m256i a = (y & 1) ? _mm256_unpackhi_epi16(
+                                          a16[y / 2], _mm256_setzero_si256())
+                                    : _mm256_unpacklo_epi16(
+                                          a16[y / 2], _mm256_setzero_si256());
+                color = _mm256_or_si256(color, a);
+                _mm_storeu_si128((__m128i *)(out[0] + y * pitch),
+                                 _mm256_castsi256_si128(color));
+                _mm_storeu_si128((__m128i *)(out[1] + y * pitch),
+                                 _mm256_extracti128_si256(color, 1));
+            }
+        }
+    }
+}
+#pragma GCC pop_options
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+
+static inline uint16x8_t mulhi_const_neon(uint16x8_t x, uint16_t m)
+{
+    uint16x8_t mv = vdupq_n_u16(m);
+    return vcombine_u16(vshrn_n_u32(vmull_u16(vget_low_u16(x),
+                                              vget_low_u16(mv)), 16),
+                        vshrn_n_u32(vmull_high_u16(x, mv), 16));
+}
+
+static inline void decode_colors_neon(uint16x8_t c, uint16x8_t *r,
+                                      uint16x8_t *g, uint16x8_t *b)
+{
+    uint16x8_t r5 = vshrq_n_u16(c, 11);
+    uint16x8_t g6 = vandq_u16(vshrq_n_u16(c, 5), vdupq_n_u16(0x3F));
+    uint16x8_t b5 = vandq_u16(c, vdupq_n_u16(0x1F));
+    *r = vshrq_n_u16(vmulq_n_u16(r5, 1053), 7);
+    *g = vaddq_u16(vshlq_n_u16(g6, 2), vshrq_n_u16(vmulq_n_u16(g6, 49), 10));
+    *b = vshrq_n_u16(vmulq_n_u16(b5, 1053), 7);
+}
+
+static void compute_palettes_neon(GLint color_format, const S3TCEndpoints *e,
+                                  S3TCPalettes *p)
+{
+    bool dxt1 = color_format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+    uint16x8_t c0 = vld1q_u16(e->c0);
+    uint16x8_t c1 = vld1q_u16(e->c1);
+    uint16x8_t r[4], g[4], b[4];
+
+    decode_colors_neon(c0, &r[0], &g[0], &b[0]);
+    decode_colors_neon(c1, &r[1], &g[1], &b[1]);
+
+    uint16x8_t transparent = dxt1 ? vcleq_u16(c0, c1) : vdupq_n_u16(0);
+    uint16x8_t alpha = vdupq_n_u16(dxt1 ? 0xFF : 0);
+
+    uint16x8_t *ch[3] = { r, g, b };
+    for (int k = 0; k < 3; k++) {
+        uint16x8_t *v = ch[k];
+        uint16x8_t third = mulhi_const_neon(
+            vaddq_u16(vaddq_u16(v[0], v[0]), v[1]), 21846);
+        uint16x8_t half = vshrq_n_u16(vaddq_u16(v[0], v[1]), 1);
+        v[2] = vbslq_u16(transparent, half, third);
+        v[3] = vbicq_u16(mulhi_const_neon(
+            vaddq_u16(vaddq_u16(v[1], v[1]), v[0]), 21846), transparent);
+    }
+
+    uint32x4x4_t colors[2];
+    for (int k = 0; k < 4; k++) {
+        uint16x8_t a = k == 3 ? vbicq_u16(alpha, transparent) : alpha;
+        uint16x8_t lo = vorrq_u16(a, vshlq_n_u16(b[k], 8));
+        uint16x8_t hi = vorrq_u16(g[k], vshlq_n_u16(r[k], 8));
+        colors[0].val[k] = vreinterpretq_u32_u16(vzip1q_u16(lo, hi));
+        colors[1].val[k] = vreinterpretq_u32_u16(vzip2q_u16(lo, hi));
+    }
+    /* Interleaving stores transpose to 4 colors per block */
+    vst4q_u32(p->colors[0], colors[0]);
+    vst4q_u32(p->colors[4], colors[1]);
+
+    if (color_format != GL_COMPRESSED_RGBA_S3TC_DXT5_EXT) {
+        return;
+    }
+
+    uint16x8_t a0 = vld1q_u16(e->a0);
+    uint16x8_t a1 = vld1q_u16(e->a1);
+    uint16x8_t eight_alphas = vcgtq_u16(a0, a1);
+    uint8x8x4_t a[2];
+    a[0].val[0] = vmovn_u16(a0);
+    a[0].val[1] = vmovn_u16(a1);
+    for (int k = 2; k < 8; k++) {
+        uint16x8_t a7 = mulhi_const_neon(
+            vmlaq_n_u16(vmulq_n_u16(a0, 8 - k), a1, k - 1), 9363);
+        uint16x8_t a5;
+        if (k < 6) {
+            a5 = mulhi_const_neon(
+                vmlaq_n_u16(vmulq_n_u16(a0, 6 - k), a1, k - 1), 13108);
+        } else {
+            a5 = vdupq_n_u16(k == 6 ? 0 : 255);
+        }
+        a[k / 4].val[k % 4] = vmovn_u16(vbslq_u16(eight_alphas, a7, a5));
+    }
+
+    uint32_t lo[S3TC_SIMD_BLOCKS], hi[S3TC_SIMD_BLOCKS];
+    vst4_u8((uint8_t *)lo, a[0]);
+    vst4_u8((uint8_t *)hi, a[1]);
+    for (int n = 0; n < S3TC_SIMD_BLOCKS; n++) {
+        memcpy(p->alphas[n], &lo[n], 4);
+        memcpy(p->alphas[n] + 4, &hi[n], 4);
+    }
+}
+
+/* Expands the texels a row at a time with byte table lookups */
+static void decode_row_neon(GLint color_format,
+                            const uint8_t *data,
+                            unsigned int num_blocks,
+                            unsigned int block_depth,
+                            uint8_t *dst,
+                            unsigned int width,
+                            size_t slice_pitch)
+{
+    bool dxt1 = color_format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+    unsigned int depth_shift = ctz32(block_depth);
+    size_t pitch = width * 4;
+    const int32_t color_shifts[4] = { 0, -2, -4, -6 };
+    const int32_t dxt3_shifts[4] = { 0, -4, -8, -12 };
+    const int32_t dxt5_shifts[4] = { 0, -3, -6, -9 };
+    const uint32x4_t byte_offsets = vdupq_n_u32(0x03020100);
+    S3TCEndpoints e;
+    S3TCPalettes p;
+
+    for (unsigned int m0 = 0; m0 < num_blocks; m0 += S3TC_SIMD_BLOCKS) {
+        unsigned int count = MIN(S3TC_SIMD_BLOCKS, num_blocks - m0);
+        load_endpoints(color_format, block_pointer(color_format, data, m0),
+                       count, &e);
+        compute_palettes_neon(color_format, &e, &p);
+
+        for (unsigned int n = 0; n < count; n++) {
+            const uint8_t *block = block_pointer(color_format, data, m0 + n);
+            uint8_t *out = block_destination(dst, m0 + n, depth_shift,
+                                             slice_pitch);
+            uint8x16_t palette = vld1q_u8((const uint8_t *)p.colors[n]);
+            uint8x16_t alphas = vcombine_u8(vld1_u8(p.alphas[n]),
+                                            vld1_u8(p.alphas[n]));
+            uint32_t indices = *(const uint32_t *)(block + (dxt1 ? 4 : 12));
+            uint64_t alpha_bits = dxt1 ? 0 : *(const uint64_t *)block;
+
+            for (int y = 0; y < 4; y++) {
+                uint32x4_t ci = vandq_u32(
+                    vshlq_u32(vdupq_n_u32(indices >> (8 * y)),
+                              vld1q_s32(color_shifts)),
+                    vdupq_n_u32(3));
+                uint32x4_t color = vreinterpretq_u32_u8(vqtbl1q_u8(
+                    palette, vreinterpretq_u8_u32(
+                        vmlaq_n_u32(byte_offsets, ci, 0x04040404))));
+
+                if (color_format == GL_COMPRESSED_RGBA_S3TC_DXT3_EXT) {
+                    uint32x4_t n4 = vandq_u32(
+                        vshlq_u32(vdupq_n_u32(alpha_bits >> (16 * y)),
+                                  vld1q_s32(dxt3_shifts)),
+                        vdupq_n_u32(0x0F));
+                    color = vorrq_u32(color,
+                                      vorrq_u32(n4, vshlq_n_u32(n4, 4)));
+                } else if (color_format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT) {
+                    /* Out of range indices in the upper bytes look up 0 */
+                    uint32x4_t ai = vorrq_u32(
+                        vandq_u32(
+                            vshlq_u32(vdupq_n_u32(alpha_bits >> (16 + 12 * y)),
+                                      vld1q_s32(dxt5_shifts)),
+                            vdupq_n_u32(7)),
+                        vdupq_n_u32(0xFFFFFF00));
+                    color = vorrq_u32(color, vreinterpretq_u32_u8(
+                        vqtbl1q_u8(alphas, vreinterpretq_u8_u32(ai))));
+                }
+
+                vst1q_u8(out + y * pitch, vreinterpretq_u8_u32(color));
+            }
+        }
+    }
+}
+#endif
+
+static S3TCDecodeRowFunc s3tc_decode_row = decode_row_scalar;
+
+#ifdef CONFIG_AVX2_OPT
+#include "qemu/cpuid.h"
+
+static bool s3tc_host_avx2;
+#endif
+
+static void __attribute__((constructor)) s3tc_init(void)
+{
+#ifdef CONFIG_AVX2_OPT
+    s3tc_host_avx2 = host_has_avx2();
+#endif
+    if (!s3tc_set_decoder(S3TC_DECODER_AVX2)
+        && !s3tc_set_decoder(S3TC_DECODER_SSE2)) {
+        s3tc_set_decoder(S3TC_DECODER_NEON);
+    }
+}
+
+bool s3tc_set_decoder(S3TCDecoder decoder)
+{
+    switch (decoder) {
+    case S3TC_DECODER_SCALAR:
+        s3tc_decode_row = decode_row_scalar;
+        return true;
+#ifdef __SSE2__
+    case S3TC_DECODER_SSE2:
+        s3tc_decode_row = decode_row_sse2;
+        return true;
+#endif
+#ifdef CONFIG_AVX2_OPT
+    case S3TC_DECODER_AVX2:
+        if (!s3tc_host_avx2) {
+            return false;
+        }
+        s3tc_decode_row = decode_row_avx2;
+        return true;
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+    case S3TC_DECODER_NEON:
+        s3tc_decode_row = decode_row_neon;
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+void decompress_3d_texture_data(GLint color_format,
+                                const uint8_t *data,
+                                unsigned int width,
+                                unsigned int height,
+                                unsigned int depth,
+                                uint8_t *converted_data)
 {
     assert((width > 0) && (width % 4 == 0));
     assert((height > 0) && (height % 4 == 0));
     assert((depth > 0) && (depth < 4 || depth % 4 == 0));
+    assert(color_format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT
+           || color_format == GL_COMPRESSED_RGBA_S3TC_DXT3_EXT
+           || color_format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT);
+    int block_size = color_format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT ? 8 : 16;
     int block_depth = MIN(depth, 4);
     int num_blocks_x = width/4,
         num_blocks_y = height/4,
         num_blocks_z = depth/block_depth;
-    uint8_t *converted_data = (uint8_t*)g_malloc(width * height * depth * 4);
+    size_t slice_pitch = (size_t)width * height * 4;
     for (int k = 0; k < num_blocks_z; k++) {
         for (int j = 0; j < num_blocks_y; j++) {
-            for (int i = 0; i < num_blocks_x; i++) {
-                for (int slice = 0; slice < block_depth; slice++) {
-
-                    int block_index = k * num_blocks_y * num_blocks_x + j * num_blocks_x + i;
-                    int sub_block_index = block_index * block_depth + slice;
-                    int z_pos_factor = (k * block_depth + slice) * width * height;
-
-                    if (color_format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT) {
-                        decompress_dxt1_block(data + 8 * sub_block_index, converted_data,
-                                              i, j, width, z_pos_factor);
-                    } else if (color_format == GL_COMPRESSED_RGBA_S3TC_DXT3_EXT) {
-                        decompress_dxt3_block(data + 16 * sub_block_index, converted_data,
-                                              i, j, width, z_pos_factor);
-                    } else if (color_format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT) {
-                        decompress_dxt5_block(data + 16 * sub_block_index, converted_data,
-                                              i, j, width, z_pos_factor);
-                    } else {
-                        assert(false);
-                    }
+            int block_index = k * num_blocks_y * num_blocks_x + j * num_blocks_x;
+            s3tc_decode_row(color_format,
+                            data + block_size * block_index * block_depth,
+                            num_blocks_x * block_depth, block_depth,
+                            converted_data + k * block_depth * slice_pitch
+                                + j * 4 * width * 4,
+                            width, slice_pitch);
+        }
+    }
+}
 
-                }
+void split_3d_texture_data(GLint color_format,
+                           const uint8_t *data,
+                           unsigned int width,
+                           unsigned int height,
+                           unsigned int depth,
+                           uint8_t *slices)
+{
+    assert((width > 0) && (width % 4 == 0));
+    assert((height > 0) && (height % 4 == 0));
+    assert((depth > 0) && (depth < 4 || depth % 4 == 0));
+    int block_size = color_format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT ? 8 : 16;
+    int block_depth = MIN(depth, 4);
+    int num_blocks = width/4 * height/4;
+    size_t slice_size = (size_t)num_blocks * block_size;
+    for (int k = 0; k < depth / block_depth; k++) {
+        for (int b = 0; b < num_blocks; b++) {
+            for (int slice = 0; slice < block_depth; slice++) {
+                memcpy(slices + (k * block_depth + slice) * slice_size
+                           + b * block_size,
+                       data, block_size);
+                data += block_size;
             }
         }
     }
-    return converted_data;
 }
@@ -27,9 +27,29 @@
 
 #include "gl/gloffscreen.h"
 
-uint8_t *decompress_3d_texture_data(GLint color_format,
-                                    const uint8_t *data,
-                                    unsigned int width,
-                                    unsigned int height,
-                                    unsigned int depth);
+typedef enum S3TCDecoder {
+    S3TC_DECODER_SCALAR,
+    S3TC_DECODER_SSE2,
+    S3TC_DECODER_AVX2,
+    S3TC_DECODER_NEON,
+} S3TCDecoder;
+
+/* The fastest decoder of the host is used by default, this switches to
+ * another one for testing. Returns false if the host can't run it. */
+bool s3tc_set_decoder(S3TCDecoder decoder);
+
+void decompress_3d_texture_data(GLint color_format,
+                                const uint8_t *data,
+                                unsigned int width,
+                                unsigned int height,
+                                unsigned int depth,
+                                uint8_t *converted_data);
+
+/* Reorders the blocks of a volume texture into depth consecutive 2D images */
+void split_3d_texture_data(GLint color_format,
+                           const uint8_t *data,
+                           unsigned int width,
+                           unsigned int height,
+                           unsigned int depth,
+                           uint8_t *slices);
 #endif
@@ -21,10 +21,18 @@
 
 #include "qemu/osdep.h"
 #include "qemu-common.h"
+#include "qemu/fast-hash.h"
+#include "qemu/timer.h"
+#include "xemu-version.h"
 
 #include "shaders_common.h"
 #include "shaders.h"
 
+static bool shader_binary_retrievable;
+
+static ShaderBinding *create_shader_binding(GLuint program,
+                                            GLenum gl_primitive_mode);
+
 void mstring_append_fmt(MString *qstring, const char *fmt, ...)
 {
     va_list ap;
@@ -311,10 +319,6 @@ static void generate_fixed_function(const ShaderState state,
 "#define reserved2     v14\n"
 "#define reserved3     v15\n"
 "\n"
-"uniform vec4 ltctxa[" stringify(NV2A_LTCTXA_COUNT) "];\n"
-"uniform vec4 ltctxb[" stringify(NV2A_LTCTXB_COUNT) "];\n"
-"uniform vec4 ltc1[" stringify(NV2A_LTC1_COUNT) "];\n"
-"\n"
 GLSL_DEFINE(projectionMat, GLSL_C_MAT4(NV_IGRAPH_XF_XFCTX_PMAT0))
 GLSL_DEFINE(compositeMat, GLSL_C_MAT4(NV_IGRAPH_XF_XFCTX_CMAT0))
 "\n"
@@ -685,8 +689,13 @@ static MString *generate_vertex_shader(const ShaderState state,
 "uniform vec2 clipRange;\n"
 "uniform vec2 surfaceSize;\n"
 "\n"
-/* All constants in 1 array declaration */
-"uniform vec4 c[" stringify(NV2A_VERTEXSHADER_CONSTANTS) "];\n"
+/* Laid out as ShaderTransformConstants */
+"layout(std140) uniform TransformConstants {\n"
+"    vec4 c[" stringify(NV2A_VERTEXSHADER_CONSTANTS) "];\n"
+"    vec4 ltctxa[" stringify(NV2A_LTCTXA_COUNT) "];\n"
+"    vec4 ltctxb[" stringify(NV2A_LTCTXB_COUNT) "];\n"
+"    vec4 ltc1[" stringify(NV2A_LTC1_COUNT) "];\n"
+"};\n"
 "\n"
 "uniform vec4 fogColor;\n"
 "uniform float fogParam[2];\n"
@@ -905,9 +914,6 @@ static GLuint create_gl_shader(GLenum gl_shader_type,
 
 ShaderBinding* generate_shaders(const ShaderState state)
 {
-    int i, j;
-    char tmp[64];
-
     char vtx_prefix;
     GLuint program = glCreateProgram();
 
@@ -949,6 +955,10 @@ ShaderBinding* generate_shaders(const ShaderState state)
     mstring_unref(fragment_shader_code);
 
     /* link the program */
+    if (shader_binary_retrievable) {
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT,
+                            GL_TRUE);
+    }
     glLinkProgram(program);
     GLint linked = 0;
     glGetProgramiv(program, GL_LINK_STATUS, &linked);
@@ -959,6 +969,30 @@ ShaderBinding* generate_shaders(const ShaderState state)
         abort();
     }
 
+    return create_shader_binding(program, gl_primitive_mode);
+}
+
+/* Draw mode a binding generated for this state would use */
+GLenum shader_get_gl_primitive_mode(const ShaderState *state)
+{
+    GLenum gl_primitive_mode;
+    MString *geometry_shader_code =
+        generate_geometry_shader(state->polygon_front_mode,
+                                 state->polygon_back_mode,
+                                 state->primitive_mode,
+                                 &gl_primitive_mode);
+    if (geometry_shader_code) {
+        mstring_unref(geometry_shader_code);
+    }
+    return gl_primitive_mode;
+}
+
+static ShaderBinding *create_shader_binding(GLuint program,
+                                            GLenum gl_primitive_mode)
+{
+    int i;
+    char tmp[64];
+
     glUseProgram(program);
 
     /* set texture samplers */
@@ -969,6 +1003,11 @@ ShaderBinding* generate_shaders(const ShaderState state)
         if (texSampLoc >= 0) {
             glUniform1i(texSampLoc, i);
         }
+        snprintf(samplerName, sizeof(samplerName), "palette%d", i);
+        GLint paletteLoc = glGetUniformLocation(program, samplerName);
+        if (paletteLoc >= 0) {
+            glUniform1i(paletteLoc, SHADER_PALETTE_TEXTURE_UNIT(i));
+        }
     }
 
     /* validate the program */
@@ -986,13 +1025,19 @@ ShaderBinding* generate_shaders(const ShaderState state)
     ret->gl_program = program;
     ret->gl_primitive_mode = gl_primitive_mode;
 
-    /* lookup fragment shader uniforms */
-    for (i = 0; i < 9; i++) {
-        for (j = 0; j < 2; j++) {
-            snprintf(tmp, sizeof(tmp), "c%d_%d", j, i);
-            ret->psh_constant_loc[i][j] = glGetUniformLocation(program, tmp);
-        }
+    /* attach constant blocks to the buffers shared by all programs */
+    GLuint block = glGetUniformBlockIndex(program, "TransformConstants");
+    if (block != GL_INVALID_INDEX) {
+        glUniformBlockBinding(program, block,
+                              SHADER_TRANSFORM_CONSTANTS_BINDING);
     }
+    block = glGetUniformBlockIndex(program, "CombinerConstants");
+    if (block != GL_INVALID_INDEX) {
+        glUniformBlockBinding(program, block,
+                              SHADER_COMBINER_CONSTANTS_BINDING);
+    }
+
+    /* lookup fragment shader uniforms */
     ret->alpha_ref_loc = glGetUniformLocation(program, "alphaRef");
     for (i = 1; i < NV2A_MAX_TEXTURES; i++) {
         snprintf(tmp, sizeof(tmp), "bumpMat%d", i);
@@ -1006,13 +1051,13 @@ ShaderBinding* generate_shaders(const ShaderState state)
     for (int i = 0; i < NV2A_MAX_TEXTURES; i++) {
         snprintf(tmp, sizeof(tmp), "texScale%d", i);
         ret->tex_scale_loc[i] = glGetUniformLocation(program, tmp);
+        snprintf(tmp, sizeof(tmp), "texMaxLevel%d", i);
+        ret->tex_max_level_loc[i] = glGetUniformLocation(program, tmp);
+        snprintf(tmp, sizeof(tmp), "volumeDepth%d", i);
+        ret->volume_depth_loc[i] = glGetUniformLocation(program, tmp);
     }
 
     /* lookup vertex shader uniforms */
-    for(i = 0; i < NV2A_VERTEXSHADER_CONSTANTS; i++) {
-        snprintf(tmp, sizeof(tmp), "c[%d]", i);
-        ret->vsh_constant_loc[i] = glGetUniformLocation(program, tmp);
-    }
     ret->surface_size_loc = glGetUniformLocation(program, "surfaceSize");
     ret->clip_range_loc = glGetUniformLocation(program, "clipRange");
     ret->fog_color_loc = glGetUniformLocation(program, "fogColor");
@@ -1020,18 +1065,6 @@ ShaderBinding* generate_shaders(const ShaderState state)
     ret->fog_param_loc[1] = glGetUniformLocation(program, "fogParam[1]");
 
     ret->inv_viewport_loc = glGetUniformLocation(program, "invViewport");
-    for (i = 0; i < NV2A_LTCTXA_COUNT; i++) {
-        snprintf(tmp, sizeof(tmp), "ltctxa[%d]", i);
-        ret->ltctxa_loc[i] = glGetUniformLocation(program, tmp);
-    }
-    for (i = 0; i < NV2A_LTCTXB_COUNT; i++) {
-        snprintf(tmp, sizeof(tmp), "ltctxb[%d]", i);
-        ret->ltctxb_loc[i] = glGetUniformLocation(program, tmp);
-    }
-    for (i = 0; i < NV2A_LTC1_COUNT; i++) {
-        snprintf(tmp, sizeof(tmp), "ltc1[%d]", i);
-        ret->ltc1_loc[i] = glGetUniformLocation(program, tmp);
-    }
     for (i = 0; i < NV2A_MAX_LIGHTS; i++) {
         snprintf(tmp, sizeof(tmp), "lightInfiniteHalfVector%d", i);
         ret->light_infinite_half_vector_loc[i] = glGetUniformLocation(program, tmp);
@@ -1050,3 +1083,413 @@ ShaderBinding* generate_shaders(const ShaderState state)
 
     return ret;
 }
+
+/* hash and equality for shader state hash tables */
+guint shader_state_hash(gconstpointer key)
+{
+    return fast_hash((const uint8_t *)key, sizeof(ShaderState));
+}
+
+gboolean shader_state_equal(gconstpointer a, gconstpointer b)
+{
+    const ShaderState *as = (const ShaderState *)a, *bs = (const ShaderState *)b;
+    return memcmp(as, bs, sizeof(ShaderState)) == 0;
+}
+
+/*
+ * Persistent program binary cache
+ *
+ * One file per title, consisting of a header identifying the GL driver and
+ * emulator build the binaries were produced with, followed by records of
+ * { ShaderDiskCacheRecord, ShaderState, program binary }. New programs are
+ * appended as they are generated. Records are only turned back into programs
+ * when their ShaderState is first requested.
+ */
+
+#define SHADER_DISK_CACHE_MAGIC   0x43485358 /* 'XSHC' */
+#define SHADER_DISK_CACHE_VERSION 2
+
+/* Larger binaries are neither written nor trusted when read back */
+#define SHADER_DISK_CACHE_MAX_BINARY_LEN (16 * 1024 * 1024)
+
+typedef struct ShaderDiskCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t state_size;
+    uint32_t ident_len;
+} ShaderDiskCacheHeader;
+
+typedef struct ShaderDiskCacheRecord {
+    uint32_t binary_format;
+    uint32_t gl_primitive_mode;
+    uint32_t binary_len;
+} ShaderDiskCacheRecord;
+
+typedef struct ShaderDiskCacheEntry {
+    ShaderDiskCacheRecord rec;
+    uint8_t binary[];
+} ShaderDiskCacheEntry;
+
+void shader_disk_cache_init(ShaderDiskCache *cache, const char *dir)
+{
+    memset(cache, 0, sizeof(*cache));
+
+    GLint num_formats = 0;
+    if (glo_check_extension("GL_ARB_get_program_binary")) {
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+    }
+    if (num_formats < 1) {
+        fprintf(stderr, "nv2a: program binaries unsupported, "
+                        "shader disk cache disabled\n");
+        return;
+    }
+
+    if (g_mkdir_with_parents(dir, 0755) != 0) {
+        fprintf(stderr, "nv2a: failed to create shader cache directory %s\n",
+                dir);
+        return;
+    }
+
+    cache->enabled = true;
+    cache->dir = g_strdup(dir);
+    cache->ident = g_strdup_printf("%s\n%s\n%s\n%s %s",
+                                   (const char *)glGetString(GL_VENDOR),
+                                   (const char *)glGetString(GL_RENDERER),
+                                   (const char *)glGetString(GL_VERSION),
+                                   xemu_version, xemu_commit);
+    cache->entries = g_hash_table_new_full(shader_state_hash,
+                                           shader_state_equal,
+                                           g_free, g_free);
+    shader_binary_retrievable = true;
+}
+
+static bool shader_disk_cache_check_header(ShaderDiskCache *cache, FILE *f)
+{
+    ShaderDiskCacheHeader hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1) {
+        return false;
+    }
+
+    size_t ident_len = strlen(cache->ident);
+    if (hdr.magic != SHADER_DISK_CACHE_MAGIC ||
+        hdr.version != SHADER_DISK_CACHE_VERSION ||
+        hdr.state_size != sizeof(ShaderState) ||
+        hdr.ident_len != ident_len) {
+        return false;
+    }
+
+    char *ident = g_malloc(ident_len);
+    bool match = fread(ident, ident_len, 1, f) == 1 &&
+                 memcmp(ident, cache->ident, ident_len) == 0;
+    g_free(ident);
+
+    return match;
+}
+
+static void shader_disk_cache_write_header(ShaderDiskCache *cache, FILE *f)
+{
+    ShaderDiskCacheHeader hdr = {
+        .magic = SHADER_DISK_CACHE_MAGIC,
+        .version = SHADER_DISK_CACHE_VERSION,
+        .state_size = sizeof(ShaderState),
+        .ident_len = strlen(cache->ident),
+    };
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    fwrite(cache->ident, hdr.ident_len, 1, f);
+    fflush(f);
+}
+
+static void shader_disk_cache_close(ShaderDiskCache *cache)
+{
+    if (cache->file) {
+        fclose(cache->file);
+        cache->file = NULL;
+    }
+    g_hash_table_remove_all(cache->entries);
+}
+
+void shader_disk_cache_open(ShaderDiskCache *cache, uint32_t title_id)
+{
+    if (!cache->enabled) {
+        return;
+    }
+
+    shader_disk_cache_close(cache);
+    cache->title_id = title_id;
+    if (title_id == 0) {
+        return;
+    }
+
+    char *path = g_strdup_printf("%s/%08x.bin", cache->dir, title_id);
+    FILE *f = qemu_fopen(path, "r+b");
+    long valid_len = 0;
+
+    if (f && shader_disk_cache_check_header(cache, f)) {
+        long records_start = ftell(f);
+        fseek(f, 0, SEEK_END);
+        long file_len = ftell(f);
+        fseek(f, records_start, SEEK_SET);
+
+        /* Load records until the end of the file or a truncated or corrupt
+         * record, which invalidates the rest of the file */
+        while (true) {
+            valid_len = ftell(f);
+
+            ShaderDiskCacheRecord rec;
+            if (fread(&rec, sizeof(rec), 1, f) != 1) {
+                break;
+            }
+            long remaining = file_len - valid_len - (long)sizeof(rec) -
+                             (long)sizeof(ShaderState);
+            if (rec.binary_len == 0 ||
+                rec.binary_len > SHADER_DISK_CACHE_MAX_BINARY_LEN ||
+                (long)rec.binary_len > remaining) {
+                break;
+            }
+            ShaderState *state = g_malloc(sizeof(ShaderState));
+            ShaderDiskCacheEntry *entry =
+                g_malloc(sizeof(ShaderDiskCacheEntry) + rec.binary_len);
+            entry->rec = rec;
+            if (fread(state, sizeof(ShaderState), 1, f) != 1 ||
+                fread(entry->binary, rec.binary_len, 1, f) != 1) {
+                g_free(state);
+                g_free(entry);
+                break;
+            }
+            g_hash_table_replace(cache->entries, state, entry);
+        }
+
+        /* Drop any partially written record so new ones can be appended */
+        fseek(f, valid_len, SEEK_SET);
+        if (ftruncate(fileno(f), valid_len) != 0) {
+            fprintf(stderr, "nv2a: failed to truncate shader cache %s\n", path);
+        }
+    } else {
+        if (f) {
+            fclose(f);
+        }
+        f = qemu_fopen(path, "w+b");
+        if (f) {
+            shader_disk_cache_write_header(cache, f);
+        } else {
+            fprintf(stderr, "nv2a: failed to open shader cache %s\n", path);
+        }
+    }
+
+    NV2A_DPRINTF("shader cache %s: %u programs\n", path,
+                 g_hash_table_size(cache->entries));
+
+    cache->file = f;
+    g_free(path);
+}
+
+ShaderBinding *shader_disk_cache_lookup(ShaderDiskCache *cache,
+                                        const ShaderState *state)
+{
+    if (!cache->file) {
+        return NULL;
+    }
+
+    ShaderDiskCacheEntry *entry = g_hash_table_lookup(cache->entries, state);
+    if (!entry) {
+        return NULL;
+    }
+
+    GLuint program = glCreateProgram();
+    glProgramBinary(program, entry->rec.binary_format, entry->binary,
+                    entry->rec.binary_len);
+    GLint linked = 0;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+
+    ShaderBinding *binding = NULL;
+    if (linked) {
+        binding = create_shader_binding(program, entry->rec.gl_primitive_mode);
+    } else {
+        /* The driver rejected it, a freshly generated program will be
+         * appended in its place */
+        glDeleteProgram(program);
+    }
+
+    /* Now owned by the in-memory shader cache */
+    g_hash_table_remove(cache->entries, state);
+
+    return binding;
+}
+
+void shader_disk_cache_store(ShaderDiskCache *cache, const ShaderState *state,
+                             const ShaderBinding *binding)
+{
+    if (!cache->file) {
+        return;
+    }
+
+    GLint binary_len = 0;
+    glGetProgramiv(binding->gl_program, GL_PROGRAM_BINARY_LENGTH, &binary_len);
+    if (binary_len <= 0 || binary_len > SHADER_DISK_CACHE_MAX_BINARY_LEN) {
+        return;
+    }
+
+    uint8_t *binary = g_malloc(binary_len);
+    GLenum binary_format;
+    glGetProgramBinary(binding->gl_program, binary_len, &binary_len,
+                       &binary_format, binary);
+
+    ShaderDiskCacheRecord rec = {
+        .binary_format = binary_format,
+        .gl_primitive_mode = binding->gl_primitive_mode,
+        .binary_len = binary_len,
+    };
+    if (fwrite(&rec, sizeof(rec), 1, cache->file) != 1 ||
+        fwrite(state, sizeof(ShaderState), 1, cache->file) != 1 ||
+        fwrite(binary, binary_len, 1, cache->file) != 1) {
+        fprintf(stderr, "nv2a: failed to write shader cache, disabling\n");
+        shader_disk_cache_close(cache);
+    } else {
+        fflush(cache->file);
+    }
+
+    g_free(binary);
+}
+
+void shader_disk_cache_finalize(ShaderDiskCache *cache)
+{
+    if (!cache->enabled) {
+        return;
+    }
+
+    shader_disk_cache_close(cache);
+    g_hash_table_destroy(cache->entries);
+    g_free(cache->dir);
+    g_free(cache->ident);
+    cache->enabled = false;
+}
+
+static void *shader_compile_thread(void *opaque)
+{
+    ShaderCompileWorker *worker = opaque;
+    ShaderCompilePool *pool = worker->pool;
+
+    glo_set_current(worker->context);
+
+    qemu_mutex_lock(&pool->lock);
+    while (true) {
+        while (!pool->shutdown && QSIMPLEQ_EMPTY(&pool->queue)) {
+            qemu_cond_wait(&pool->cond, &pool->lock);
+        }
+        if (pool->shutdown) {
+            break;
+        }
+
+        ShaderCompileJob *job = QSIMPLEQ_FIRST(&pool->queue);
+        QSIMPLEQ_REMOVE_HEAD(&pool->queue, entry);
+        qemu_mutex_unlock(&pool->lock);
+
+        job->binding = generate_shaders(job->state);
+
+        /* The program is used from the render context as soon as it is
+         * handed back, make sure the link has actually completed here.
+         */
+        glFinish();
+        job->complete_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+
+        qemu_mutex_lock(&pool->lock);
+        QSIMPLEQ_INSERT_TAIL(&pool->completed, job, entry);
+    }
+    qemu_mutex_unlock(&pool->lock);
+
+    glo_set_current(NULL);
+
+    return NULL;
+}
+
+void shader_compile_pool_init(ShaderCompilePool *pool,
+                              GloContext *contexts[SHADER_COMPILE_THREADS])
+{
+    qemu_mutex_init(&pool->lock);
+    qemu_cond_init(&pool->cond);
+    pool->shutdown = false;
+    QSIMPLEQ_INIT(&pool->queue);
+    QSIMPLEQ_INIT(&pool->completed);
+    pool->pending = g_hash_table_new(shader_state_hash, shader_state_equal);
+
+    for (int i = 0; i < SHADER_COMPILE_THREADS; i++) {
+        ShaderCompileWorker *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->context = contexts[i];
+        qemu_thread_create(&worker->thread, "nv2a.shader_compile",
+                           shader_compile_thread, worker,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+bool shader_compile_pool_is_pending(ShaderCompilePool *pool,
+                                    const ShaderState *state)
+{
+    return g_hash_table_contains(pool->pending, state);
+}
+
+void shader_compile_pool_submit(ShaderCompilePool *pool,
+                                const ShaderState *state)
+{
+    assert(!shader_compile_pool_is_pending(pool, state));
+
+    ShaderCompileJob *job = g_malloc0(sizeof(*job));
+    memcpy(&job->state, state, sizeof(*state));
+    job->submit_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    g_hash_table_insert(pool->pending, &job->state, job);
+
+    qemu_mutex_lock(&pool->lock);
+    QSIMPLEQ_INSERT_TAIL(&pool->queue, job, entry);
+    qemu_cond_signal(&pool->cond);
+    qemu_mutex_unlock(&pool->lock);
+}
+
+/* Returns the next finished job, or NULL. The caller owns the job. */
+ShaderCompileJob *shader_compile_pool_take_completed(ShaderCompilePool *pool)
+{
+    if (g_hash_table_size(pool->pending) == 0) {
+        return NULL;
+    }
+
+    qemu_mutex_lock(&pool->lock);
+    ShaderCompileJob *job = QSIMPLEQ_FIRST(&pool->completed);
+    if (job) {
+        QSIMPLEQ_REMOVE_HEAD(&pool->completed, entry);
+    }
+    qemu_mutex_unlock(&pool->lock);
+
+    if (job) {
+        g_hash_table_remove(pool->pending, &job->state);
+    }
+
+    return job;
+}
+
+unsigned int shader_compile_pool_num_pending(ShaderCompilePool *pool)
+{
+    return g_hash_table_size(pool->pending);
+}
+
+void shader_compile_pool_finalize(ShaderCompilePool *pool)
+{
+    qemu_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    qemu_cond_broadcast(&pool->cond);
+    qemu_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < SHADER_COMPILE_THREADS; i++) {
+        qemu_thread_join(&pool->workers[i].thread);
+    }
+
+    ShaderCompileJob *job, *next;
+    QSIMPLEQ_FOREACH_SAFE(job, &pool->queue, entry, next) {
+        g_free(job);
+    }
+    QSIMPLEQ_FOREACH_SAFE(job, &pool->completed, entry, next) {
+        g_free(job);
+    }
+    g_hash_table_destroy(pool->pending);
+
+    qemu_cond_destroy(&pool->cond);
+    qemu_mutex_destroy(&pool->lock);
+}
@@ -22,6 +22,8 @@
 #define HW_NV2A_SHADERS_H
 
 #include "qapi/qmp/qstring.h"
+#include "qemu/thread.h"
+#include "qemu/queue.h"
 #include "gl/gloffscreen.h"
 
 #include "nv2a_regs.h"
@@ -97,28 +99,45 @@ typedef struct ShaderState {
     float point_params[8];
 } ShaderState;
 
+/* Uniform buffer binding points shared by all generated programs */
+#define SHADER_TRANSFORM_CONSTANTS_BINDING 0
+#define SHADER_COMBINER_CONSTANTS_BINDING 1
+
+/* Texture units of the palettes of indexed textures, after the scratch unit
+ * used for GPU swizzling */
+#define SHADER_PALETTE_TEXTURE_UNIT(i) (NV2A_MAX_TEXTURES + 1 + (i))
+
+/* std140 layout of the TransformConstants uniform block */
+typedef struct ShaderTransformConstants {
+    uint32_t c[NV2A_VERTEXSHADER_CONSTANTS][4];
+    uint32_t ltctxa[NV2A_LTCTXA_COUNT][4];
+    uint32_t ltctxb[NV2A_LTCTXB_COUNT][4];
+    uint32_t ltc1[NV2A_LTC1_COUNT][4];
+} ShaderTransformConstants;
+
+/* std140 layout of the CombinerConstants uniform block */
+typedef struct ShaderCombinerConstants {
+    float c0[9][4];
+    float c1[9][4];
+} ShaderCombinerConstants;
+
 typedef struct ShaderBinding {
     GLuint gl_program;
     GLenum gl_primitive_mode;
 
-    GLint psh_constant_loc[9][2];
     GLint alpha_ref_loc;
 
     GLint bump_mat_loc[NV2A_MAX_TEXTURES];
     GLint bump_scale_loc[NV2A_MAX_TEXTURES];
     GLint bump_offset_loc[NV2A_MAX_TEXTURES];
     GLint tex_scale_loc[NV2A_MAX_TEXTURES];
+    GLint tex_max_level_loc[NV2A_MAX_TEXTURES];
+    GLint volume_depth_loc[NV2A_MAX_TEXTURES];
 
     GLint surface_size_loc;
     GLint clip_range_loc;
 
-    GLint vsh_constant_loc[NV2A_VERTEXSHADER_CONSTANTS];
-    uint32_t vsh_constants[NV2A_VERTEXSHADER_CONSTANTS][4];
-
     GLint inv_viewport_loc;
-    GLint ltctxa_loc[NV2A_LTCTXA_COUNT];
-    GLint ltctxb_loc[NV2A_LTCTXB_COUNT];
-    GLint ltc1_loc[NV2A_LTC1_COUNT];
 
     GLint fog_color_loc;
     GLint fog_param_loc[2];
@@ -130,6 +149,63 @@ typedef struct ShaderBinding {
     GLint clip_region_loc[8];
 } ShaderBinding;
 
+typedef struct ShaderDiskCache {
+    bool enabled;
+    char *dir;
+    char *ident;
+    uint32_t title_id;
+    FILE *file;
+    GHashTable *entries;
+} ShaderDiskCache;
+
+#define SHADER_COMPILE_THREADS 2
+
+typedef struct ShaderCompileJob {
+    ShaderState state;
+    ShaderBinding *binding;
+    int64_t submit_time;
+    int64_t complete_time;
+    QSIMPLEQ_ENTRY(ShaderCompileJob) entry;
+} ShaderCompileJob;
+
+typedef struct ShaderCompileWorker {
+    struct ShaderCompilePool *pool;
+    GloContext *context;
+    QemuThread thread;
+} ShaderCompileWorker;
+
+typedef struct ShaderCompilePool {
+    QemuMutex lock;
+    QemuCond cond;
+    bool shutdown;
+    ShaderCompileWorker workers[SHADER_COMPILE_THREADS];
+    QSIMPLEQ_HEAD(, ShaderCompileJob) queue;
+    QSIMPLEQ_HEAD(, ShaderCompileJob) completed;
+    GHashTable *pending; // Only accessed by the submitting thread
+} ShaderCompilePool;
+
 ShaderBinding* generate_shaders(const ShaderState state);
+GLenum shader_get_gl_primitive_mode(const ShaderState *state);
+
+void shader_compile_pool_init(ShaderCompilePool *pool,
+                              GloContext *contexts[SHADER_COMPILE_THREADS]);
+bool shader_compile_pool_is_pending(ShaderCompilePool *pool,
+                                    const ShaderState *state);
+void shader_compile_pool_submit(ShaderCompilePool *pool,
+                                const ShaderState *state);
+ShaderCompileJob *shader_compile_pool_take_completed(ShaderCompilePool *pool);
+unsigned int shader_compile_pool_num_pending(ShaderCompilePool *pool);
+void shader_compile_pool_finalize(ShaderCompilePool *pool);
+
+guint shader_state_hash(gconstpointer key);
+gboolean shader_state_equal(gconstpointer a, gconstpointer b);
+
+void shader_disk_cache_init(ShaderDiskCache *cache, const char *dir);
+void shader_disk_cache_open(ShaderDiskCache *cache, uint32_t title_id);
+ShaderBinding *shader_disk_cache_lookup(ShaderDiskCache *cache,
+                                        const ShaderState *state);
+void shader_disk_cache_store(ShaderDiskCache *cache, const ShaderState *state,
+                             const ShaderBinding *binding);
+void shader_disk_cache_finalize(ShaderDiskCache *cache);
 
 #endif
@@ -31,12 +31,12 @@
  * If there are no bits left from any component it will pack the other masks
  * more tighly (Example: zzxzxzyx = Fewer x than z and even fewer y)
  */
-static void generate_swizzle_masks(unsigned int width,
-                                   unsigned int height,
-                                   unsigned int depth,
-                                   uint32_t* mask_x,
-                                   uint32_t* mask_y,
-                                   uint32_t* mask_z)
+void generate_swizzle_masks(unsigned int width,
+                            unsigned int height,
+                            unsigned int depth,
+                            uint32_t* mask_x,
+                            uint32_t* mask_y,
+                            uint32_t* mask_z)
 {
     uint32_t x = 0, y = 0, z = 0;
     uint32_t bit = 1;
@@ -55,64 +55,364 @@ static void generate_swizzle_masks(unsigned int width,
     *mask_z = z;
 }
 
-/* This fills a pattern with a value if your value has bits abcd and your
- * pattern is 11010100100 this will return: 0a0b0c00d00
+/* Fills table[i] with the byte offset of coordinate i along the axis selected
+ * by mask. Rather than scattering the bits of every coordinate, step the
+ * masked bits of the Morton code directly: subtracting the mask carries
+ * through the bits belonging to the other axes.
  */
-static uint32_t fill_pattern(uint32_t pattern, uint32_t value)
+static void generate_swizzle_offsets(uint32_t *table,
+                                     unsigned int count,
+                                     uint32_t mask,
+                                     unsigned int bytes_per_pixel)
 {
-    uint32_t result = 0;
-    uint32_t bit = 1;
-    while(value) {
-        if (pattern & bit) {
-            /* Copy bit to result */
-            result |= value & 1 ? bit : 0;
-            value >>= 1;
+    uint32_t offset = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        table[i] = offset * bytes_per_pixel;
+        offset = (offset - mask) & mask;
+    }
+}
+
+#ifdef CONFIG_AVX2_OPT
+static bool swizzle_use_avx2;
+#endif
+
+/* Copies one linear row from/to swizzled memory, one texel at a time */
+static inline QEMU_ALWAYS_INLINE void swizzle_row(
+    uint8_t *swz,
+    uint8_t *lin,
+    const uint32_t *offs_x,
+    unsigned int width,
+    unsigned int bytes_per_pixel,
+    bool swizzle)
+{
+    for (unsigned int x = 0; x < width; x++) {
+        if (swizzle) {
+            memcpy(swz + offs_x[x], lin + x * bytes_per_pixel,
+                   bytes_per_pixel);
+        } else {
+            memcpy(lin + x * bytes_per_pixel, swz + offs_x[x],
+                   bytes_per_pixel);
         }
-        bit <<= 1;
     }
-    return result;
 }
 
-static unsigned int get_swizzled_offset(
-    unsigned int x, unsigned int y, unsigned int z,
-    uint32_t mask_x, uint32_t mask_y, uint32_t mask_z,
-    unsigned int bytes_per_pixel)
+/* When x occupies bit 0 and y bit 1 of the swizzled address, every 2x2
+ * block is stored as two contiguous runs of 2 texels from consecutive rows.
+ */
+static inline QEMU_ALWAYS_INLINE void swizzle_row_pair_scalar(
+    uint8_t *swz,
+    uint8_t *lin0,
+    uint8_t *lin1,
+    const uint32_t *offs_x,
+    unsigned int width,
+    unsigned int bytes_per_pixel,
+    bool swizzle)
 {
-    return bytes_per_pixel * (fill_pattern(mask_x, x)
-                           | fill_pattern(mask_y, y)
-                           | fill_pattern(mask_z, z));
+    unsigned int run = 2 * bytes_per_pixel;
+    for (unsigned int x = 0; x < width; x += 2) {
+        uint8_t *block = swz + offs_x[x];
+        unsigned int lin_offset = x * bytes_per_pixel;
+        if (swizzle) {
+            memcpy(block, lin0 + lin_offset, run);
+            memcpy(block + run, lin1 + lin_offset, run);
+        } else {
+            memcpy(lin0 + lin_offset, block, run);
+            memcpy(lin1 + lin_offset, block + run, run);
+        }
+    }
 }
 
-void swizzle_box(
-    const uint8_t *src_buf,
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+/* The SSE2/AVX2 kernels below additionally require x in bit 2, so that each
+ * 4x2 block of texels is contiguous in swizzled memory.
+ */
+
+static inline QEMU_ALWAYS_INLINE void swizzle_row_pair_1bpp_sse2(
+    uint8_t *swz,
+    uint8_t *lin0,
+    uint8_t *lin1,
+    const uint32_t *offs_x,
+    unsigned int width,
+    bool swizzle)
+{
+    for (unsigned int x = 0; x < width; x += 16) {
+        __m128i *l0 = (__m128i *)(lin0 + x);
+        __m128i *l1 = (__m128i *)(lin1 + x);
+        __m128i *b0 = (__m128i *)(swz + offs_x[x]);
+        __m128i *b1 = (__m128i *)(swz + offs_x[x + 4]);
+        __m128i *b2 = (__m128i *)(swz + offs_x[x + 8]);
+        __m128i *b3 = (__m128i *)(swz + offs_x[x + 12]);
+        if (swizzle) {
+            __m128i r0 = _mm_loadu_si128(l0);
+            __m128i r1 = _mm_loadu_si128(l1);
+            __m128i lo = _mm_unpacklo_epi16(r0, r1);
+            __m128i hi = _mm_unpackhi_epi16(r0, r1);
+            _mm_storel_epi64(b0, lo);
+            _mm_storel_epi64(b1, _mm_unpackhi_epi64(lo, lo));
+            _mm_storel_epi64(b2, hi);
+            _mm_storel_epi64(b3, _mm_unpackhi_epi64(hi, hi));
+        } else {
+            __m128i a = _mm_unpacklo_epi64(_mm_loadl_epi64(b0),
+                                           _mm_loadl_epi64(b1));
+            __m128i b = _mm_unpacklo_epi64(_mm_loadl_epi64(b2),
+                                           _mm_loadl_epi64(b3));
+            /* Separate the 16-bit runs of each row into the two halves */
+            a = _mm_shufflelo_epi16(a, _MM_SHUFFLE(3, 1, 2, 0));
+            a = _mm_shufflehi_epi16(a, _MM_SHUFFLE(3, 1, 2, 0));
+            a = _mm_shuffle_epi32(a, _MM_SHUFFLE(3, 1, 2, 0));
+            b = _mm_shufflelo_epi16(b, _MM_SHUFFLE(3, 1, 2, 0));
+            b = _mm_shufflehi_epi16(b, _MM_SHUFFLE(3, 1, 2, 0));
+            b = _mm_shuffle_epi32(b, _MM_SHUFFLE(3, 1, 2, 0));
+            _mm_storeu_si128(l0, _mm_unpacklo_epi64(a, b));
+            _mm_storeu_si128(l1, _mm_unpackhi_epi64(a, b));
+        }
+    }
+}
+
+static inline QEMU_ALWAYS_INLINE void swizzle_row_pair_2bpp_sse2(
+    uint8_t *swz,
+    uint8_t *lin0,
+    uint8_t *lin1,
+    const uint32_t *offs_x,
+    unsigned int width,
+    bool swizzle)
+{
+    for (unsigned int x = 0; x < width; x += 8) {
+        __m128i *l0 = (__m128i *)(lin0 + x * 2);
+        __m128i *l1 = (__m128i *)(lin1 + x * 2);
+        __m128i *b0 = (__m128i *)(swz + offs_x[x]);
+        __m128i *b1 = (__m128i *)(swz + offs_x[x + 4]);
+        if (swizzle) {
+            __m128i r0 = _mm_loadu_si128(l0);
+            __m128i r1 = _mm_loadu_si128(l1);
+            _mm_storeu_si128(b0, _mm_unpacklo_epi32(r0, r1));
+            _mm_storeu_si128(b1, _mm_unpackhi_epi32(r0, r1));
+        } else {
+            __m128i a = _mm_shuffle_epi32(_mm_loadu_si128(b0),
+                                          _MM_SHUFFLE(3, 1, 2, 0));
+            __m128i b = _mm_shuffle_epi32(_mm_loadu_si128(b1),
+                                          _MM_SHUFFLE(3, 1, 2, 0));
+            _mm_storeu_si128(l0, _mm_unpacklo_epi64(a, b));
+            _mm_storeu_si128(l1, _mm_unpackhi_epi64(a, b));
+        }
+    }
+}
+
+static inline QEMU_ALWAYS_INLINE void swizzle_row_pair_4bpp_sse2(
+    uint8_t *swz,
+    uint8_t *lin0,
+    uint8_t *lin1,
+    const uint32_t *offs_x,
+    unsigned int width,
+    bool swizzle)
+{
+    for (unsigned int x = 0; x < width; x += 4) {
+        __m128i *l0 = (__m128i *)(lin0 + x * 4);
+        __m128i *l1 = (__m128i *)(lin1 + x * 4);
+        __m128i *block = (__m128i *)(swz + offs_x[x]);
+        if (swizzle) {
+            __m128i r0 = _mm_loadu_si128(l0);
+            __m128i r1 = _mm_loadu_si128(l1);
+            _mm_storeu_si128(block, _mm_unpacklo_epi64(r0, r1));
+            _mm_storeu_si128(block + 1, _mm_unpackhi_epi64(r0, r1));
+        } else {
+            __m128i a = _mm_loadu_si128(block);
+            __m128i b = _mm_loadu_si128(block + 1);
+            _mm_storeu_si128(l0, _mm_unpacklo_epi64(a, b));
+            _mm_storeu_si128(l1, _mm_unpackhi_epi64(a, b));
+        }
+    }
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static void swizzle_row_pair_4bpp_avx2(
+    uint8_t *swz,
+    uint8_t *lin0,
+    uint8_t *lin1,
+    const uint32_t *offs_x,
+    unsigned int width,
+    bool swizzle)
+{
+    for (unsigned int x = 0; x < width; x += 8) {
+        __m256i *l0 = (__m256i *)(lin0 + x * 4);
+        __m256i *l1 = (__m256i *)(lin1 + x * 4);
+        __m256i *b0 = (__m256i *)(swz + offs_x[x]);
+        __m256i *b1 = (__m256i *)(swz + offs_x[x + 4]);
+        if (swizzle) {
+            __m256i r0 = _mm256_loadu_si256(l0);
+            __m256i r1 = _mm256_loadu_si256(l1);
+            __m256i lo = _mm256_unpacklo_epi64(r0, r1);
+            __m256i hi = _mm256_unpackhi_epi64(r0, r1);
+            _mm256_storeu_si256(b0, _mm256_permute2x128_si256(lo, hi, 0x20));
+            _mm256_storeu_si256(b1, _mm256_permute2x128_si256(lo, hi, 0x31));
+        } else {
+            __m256i a = _mm256_loadu_si256(b0);
+            __m256i b = _mm256_loadu_si256(b1);
+            __m256i lo = _mm256_permute2x128_si256(a, b, 0x20);
+            __m256i hi = _mm256_permute2x128_si256(a, b, 0x31);
+            _mm256_storeu_si256(l0, _mm256_unpacklo_epi64(lo, hi));
+            _mm256_storeu_si256(l1, _mm256_unpackhi_epi64(lo, hi));
+        }
+    }
+}
+
+static void swizzle_row_pair_8bpp_avx2(
+    uint8_t *swz,
+    uint8_t *lin0,
+    uint8_t *lin1,
+    const uint32_t *offs_x,
+    unsigned int width,
+    bool swizzle)
+{
+    for (unsigned int x = 0; x < width; x += 4) {
+        __m256i *l0 = (__m256i *)(lin0 + x * 8);
+        __m256i *l1 = (__m256i *)(lin1 + x * 8);
+        __m256i *block = (__m256i *)(swz + offs_x[x]);
+        if (swizzle) {
+            __m256i r0 = _mm256_loadu_si256(l0);
+            __m256i r1 = _mm256_loadu_si256(l1);
+            _mm256_storeu_si256(block,
+                                _mm256_permute2x128_si256(r0, r1, 0x20));
+            _mm256_storeu_si256(block + 1,
+                                _mm256_permute2x128_si256(r0, r1, 0x31));
+        } else {
+            __m256i a = _mm256_loadu_si256(block);
+            __m256i b = _mm256_loadu_si256(block + 1);
+            _mm256_storeu_si256(l0, _mm256_permute2x128_si256(a, b, 0x20));
+            _mm256_storeu_si256(l1, _mm256_permute2x128_si256(a, b, 0x31));
+        }
+    }
+}
+#pragma GCC pop_options
+
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) swizzle_init_cpuid(void)
+{
+    swizzle_use_avx2 = host_has_avx2();
+}
+#endif
+
+static inline QEMU_ALWAYS_INLINE void swizzle_row_pair(
+    uint8_t *swz,
+    uint8_t *lin0,
+    uint8_t *lin1,
+    const uint32_t *offs_x,
+    unsigned int width,
+    unsigned int bytes_per_pixel,
+    bool quads,
+    bool swizzle)
+{
+#ifdef CONFIG_AVX2_OPT
+    if (quads && swizzle_use_avx2) {
+        if (bytes_per_pixel == 4 && !(width & 7)) {
+            swizzle_row_pair_4bpp_avx2(swz, lin0, lin1, offs_x, width,
+                                       swizzle);
+            return;
+        } else if (bytes_per_pixel == 8 && !(width & 3)) {
+            swizzle_row_pair_8bpp_avx2(swz, lin0, lin1, offs_x, width,
+                                       swizzle);
+            return;
+        }
+    }
+#endif
+#ifdef __SSE2__
+    if (quads) {
+        if (bytes_per_pixel == 1 && !(width & 15)) {
+            swizzle_row_pair_1bpp_sse2(swz, lin0, lin1, offs_x, width,
+                                       swizzle);
+            return;
+        } else if (bytes_per_pixel == 2 && !(width & 7)) {
+            swizzle_row_pair_2bpp_sse2(swz, lin0, lin1, offs_x, width,
+                                       swizzle);
+            return;
+        } else if (bytes_per_pixel == 4 && !(width & 3)) {
+            swizzle_row_pair_4bpp_sse2(swz, lin0, lin1, offs_x, width,
+                                       swizzle);
+            return;
+        }
+    }
+#endif
+
+    /* Specialize the copies for the common texel sizes */
+    switch (bytes_per_pixel) {
+    case 1:
+        swizzle_row_pair_scalar(swz, lin0, lin1, offs_x, width, 1, swizzle);
+        break;
+    case 2:
+        swizzle_row_pair_scalar(swz, lin0, lin1, offs_x, width, 2, swizzle);
+        break;
+    case 4:
+        swizzle_row_pair_scalar(swz, lin0, lin1, offs_x, width, 4, swizzle);
+        break;
+    case 8:
+        swizzle_row_pair_scalar(swz, lin0, lin1, offs_x, width, 8, swizzle);
+        break;
+    case 16:
+        swizzle_row_pair_scalar(swz, lin0, lin1, offs_x, width, 16, swizzle);
+        break;
+    default:
+        swizzle_row_pair_scalar(swz, lin0, lin1, offs_x, width,
+                                bytes_per_pixel, swizzle);
+        break;
+    }
+}
+
+static inline QEMU_ALWAYS_INLINE void swizzle_box_internal(
+    uint8_t *swz_buf,
+    uint8_t *lin_buf,
     unsigned int width,
     unsigned int height,
     unsigned int depth,
-    uint8_t *dst_buf,
     unsigned int row_pitch,
     unsigned int slice_pitch,
-    unsigned int bytes_per_pixel)
+    unsigned int bytes_per_pixel,
+    bool swizzle)
 {
     uint32_t mask_x, mask_y, mask_z;
     generate_swizzle_masks(width, height, depth, &mask_x, &mask_y, &mask_z);
 
-    int x, y, z;
-    for (z = 0; z < depth; z++) {
-        for (y = 0; y < height; y++) {
-            for (x = 0; x < width; x++) {
-                const uint8_t *src = src_buf
-                                         + y * row_pitch + x * bytes_per_pixel;
-                uint8_t *dst = dst_buf + get_swizzled_offset(x, y, 0,
-                                                             mask_x, mask_y, 0,
-                                                             bytes_per_pixel);
-                memcpy(dst, src, bytes_per_pixel);
+    uint32_t *offs_x = g_new(uint32_t, width + height + depth);
+    uint32_t *offs_y = offs_x + width;
+    uint32_t *offs_z = offs_y + height;
+    generate_swizzle_offsets(offs_x, width, mask_x, bytes_per_pixel);
+    generate_swizzle_offsets(offs_y, height, mask_y, bytes_per_pixel);
+    generate_swizzle_offsets(offs_z, depth, mask_z, bytes_per_pixel);
+
+    bool pairs = (mask_x & 1) && (mask_y & 2)
+                 && !(width & 1) && !(height & 1);
+    bool quads = pairs && (mask_x & 4);
+
+    for (unsigned int z = 0; z < depth; z++) {
+        uint8_t *swz = swz_buf + offs_z[z];
+        uint8_t *lin = lin_buf + z * slice_pitch;
+
+        if (!pairs) {
+            for (unsigned int y = 0; y < height; y++) {
+                swizzle_row(swz + offs_y[y], lin + y * row_pitch, offs_x,
+                            width, bytes_per_pixel, swizzle);
             }
+            continue;
+        }
+
+        for (unsigned int y = 0; y < height; y += 2) {
+            uint8_t *lin0 = lin + y * row_pitch;
+            swizzle_row_pair(swz + offs_y[y], lin0, lin0 + row_pitch,
+                             offs_x, width, bytes_per_pixel, quads, swizzle);
         }
-        src_buf += slice_pitch;
     }
+
+    g_free(offs_x);
 }
 
-void unswizzle_box(
+void swizzle_box(
     const uint8_t *src_buf,
     unsigned int width,
     unsigned int height,
@@ -122,22 +422,22 @@ void unswizzle_box(
     unsigned int slice_pitch,
     unsigned int bytes_per_pixel)
 {
-    uint32_t mask_x, mask_y, mask_z;
-    generate_swizzle_masks(width, height, depth, &mask_x, &mask_y, &mask_z);
+    swizzle_box_internal(dst_buf, (uint8_t *)src_buf, width, height, depth,
+                         row_pitch, slice_pitch, bytes_per_pixel, true);
+}
 
-    int x, y, z;
-    for (z = 0; z < depth; z++) {
-        for (y = 0; y < height; y++) {
-            for (x = 0; x < width; x++) {
-                const uint8_t *src = src_buf
-                    + get_swizzled_offset(x, y, z, mask_x, mask_y, mask_z,
-                                          bytes_per_pixel);
-                uint8_t *dst = dst_buf + y * row_pitch + x * bytes_per_pixel;
-                memcpy(dst, src, bytes_per_pixel);
-            }
-        }
-        dst_buf += slice_pitch;
-    }
+void unswizzle_box(
+    const uint8_t *src_buf,
+    unsigned int width,
+    unsigned int height,
+    unsigned int depth,
+    uint8_t *dst_buf,
+    unsigned int row_pitch,
+    unsigned int slice_pitch,
+    unsigned int bytes_per_pixel)
+{
+    swizzle_box_internal((uint8_t *)src_buf, dst_buf, width, height, depth,
+                         row_pitch, slice_pitch, bytes_per_pixel, false);
 }
 
 void unswizzle_rect(
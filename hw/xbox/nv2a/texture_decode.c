@@ -0,0 +1,383 @@
+/*
+ * QEMU Geforce NV2A texture decoding
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "swizzle.h"
+#include "s3tc.h"
+#include "texture_decode.h"
+
+/* Images are split into pieces of about this size for the workers */
+#define TEXTURE_DECODE_SPLIT_SIZE (256 * 1024)
+
+/* Batches smaller than this are not worth waking the workers for */
+#define TEXTURE_DECODE_MIN_PARALLEL_SIZE (128 * 1024)
+
+static uint8_t cliptobyte(int x)
+{
+    return (uint8_t)((x < 0) ? 0 : ((x > 255) ? 255 : x));
+}
+
+void convert_yuy2_to_rgb(const uint8_t *line, unsigned int ix,
+                         uint8_t *r, uint8_t *g, uint8_t* b) {
+    int c, d, e;
+    c = (int)line[ix * 2] - 16;
+    if (ix % 2) {
+        d = (int)line[ix * 2 - 1] - 128;
+        e = (int)line[ix * 2 + 1] - 128;
+    } else {
+        d = (int)line[ix * 2 + 1] - 128;
+        e = (int)line[ix * 2 + 3] - 128;
+    }
+    *r = cliptobyte((298 * c + 409 * e + 128) >> 8);
+    *g = cliptobyte((298 * c - 100 * d - 208 * e + 128) >> 8);
+    *b = cliptobyte((298 * c + 516 * d + 128) >> 8);
+}
+
+void convert_uyvy_to_rgb(const uint8_t *line, unsigned int ix,
+                         uint8_t *r, uint8_t *g, uint8_t* b) {
+    int c, d, e;
+    c = (int)line[ix * 2 + 1] - 16;
+    if (ix % 2) {
+        d = (int)line[ix * 2 - 2] - 128;
+        e = (int)line[ix * 2 + 0] - 128;
+    } else {
+        d = (int)line[ix * 2 + 0] - 128;
+        e = (int)line[ix * 2 + 2] - 128;
+    }
+    *r = cliptobyte((298 * c + 409 * e + 128) >> 8);
+    *g = cliptobyte((298 * c - 100 * d - 208 * e + 128) >> 8);
+    *b = cliptobyte((298 * c + 516 * d + 128) >> 8);
+}
+
+static bool is_s3tc(TextureDecodeConversion conversion)
+{
+    return conversion == TEXTURE_DECODE_DXT1
+           || conversion == TEXTURE_DECODE_DXT3
+           || conversion == TEXTURE_DECODE_DXT5;
+}
+
+static unsigned int output_bytes_per_pixel(const TextureDecodeImage *image)
+{
+    switch (image->conversion) {
+    case TEXTURE_DECODE_COPY:
+        return image->bytes_per_pixel;
+    case TEXTURE_DECODE_R6G5B5:
+        return 3;
+    default:
+        return 4;
+    }
+}
+
+size_t texture_decode_size(const TextureDecodeImage *image)
+{
+    return (size_t)image->width * image->height * image->depth
+           * output_bytes_per_pixel(image);
+}
+
+static size_t source_size(const TextureDecodeImage *image)
+{
+    if (is_s3tc(image->conversion)) {
+        unsigned int block_size =
+            image->conversion == TEXTURE_DECODE_DXT1 ? 8 : 16;
+        return (size_t)image->width / 4 * image->height / 4 * image->depth
+               * block_size;
+    }
+    if (!image->swizzled) {
+        return (size_t)image->src_pitch * image->height * image->depth;
+    }
+    return (size_t)image->width * image->height * image->depth
+           * image->bytes_per_pixel;
+}
+
+/*
+ * Splits @image in two along the dimension that can be decoded in
+ * independent halves, or returns false. Volume S3TC textures are stored as
+ * groups of 4 slices. Swizzled images can be cut along the dimension that
+ * owns the top address bit, which is the last of the largest dimensions in
+ * x, y, z order. Linear images can be cut between any two rows.
+ */
+static bool split_image(const TextureDecodeImage *image,
+                        TextureDecodeImage *a, TextureDecodeImage *b)
+{
+    *a = *image;
+    *b = *image;
+
+    if (is_s3tc(image->conversion)) {
+        if (image->depth <= 4) {
+            return false;
+        }
+        a->depth = b->depth = image->depth / 2;
+    } else if (image->swizzled) {
+        if (image->depth > 1) {
+            if (image->depth < image->width || image->depth < image->height) {
+                return false;
+            }
+            a->depth = b->depth = image->depth / 2;
+        } else {
+            if (image->height < 2 || image->height < image->width) {
+                return false;
+            }
+            a->height = b->height = image->height / 2;
+        }
+    } else {
+        if (image->depth > 1 || image->height < 2) {
+            return false;
+        }
+        a->height = image->height / 2;
+        b->height = image->height - a->height;
+        b->src += (size_t)a->height * image->src_pitch;
+        b->dst_offset += texture_decode_size(a);
+        return true;
+    }
+
+    b->src += source_size(a);
+    b->dst_offset += texture_decode_size(a);
+    return true;
+}
+
+void texture_decode_add(GArray *images, const TextureDecodeImage *image)
+{
+    TextureDecodeImage a, b;
+
+    if (texture_decode_size(image) > TEXTURE_DECODE_SPLIT_SIZE
+        && split_image(image, &a, &b)) {
+        texture_decode_add(images, &a);
+        texture_decode_add(images, &b);
+        return;
+    }
+
+    g_array_append_val(images, *image);
+}
+
+void texture_decode_image(const TextureDecodeImage *image, uint8_t *dst_base)
+{
+    unsigned int width = image->width;
+    unsigned int height = image->height;
+    unsigned int depth = image->depth;
+    unsigned int bytes_per_pixel = image->bytes_per_pixel;
+    const uint8_t *src = image->src;
+    unsigned int src_pitch = image->src_pitch;
+    uint8_t *dst = dst_base + image->dst_offset;
+    uint8_t *scratch = NULL;
+
+    switch (image->conversion) {
+    case TEXTURE_DECODE_DXT1:
+        decompress_3d_texture_data(GL_COMPRESSED_RGBA_S3TC_DXT1_EXT, src,
+                                   width, height, depth, dst);
+        return;
+    case TEXTURE_DECODE_DXT3:
+        decompress_3d_texture_data(GL_COMPRESSED_RGBA_S3TC_DXT3_EXT, src,
+                                   width, height, depth, dst);
+        return;
+    case TEXTURE_DECODE_DXT5:
+        decompress_3d_texture_data(GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, src,
+                                   width, height, depth, dst);
+        return;
+    case TEXTURE_DECODE_COPY:
+        if (image->swizzled) {
+            unswizzle_box(src, width, height, depth, dst,
+                          width * bytes_per_pixel,
+                          width * height * bytes_per_pixel, bytes_per_pixel);
+        } else {
+            for (unsigned int y = 0; y < height * depth; y++) {
+                memcpy(dst + y * width * bytes_per_pixel, src + y * src_pitch,
+                       width * bytes_per_pixel);
+            }
+        }
+        return;
+    default:
+        break;
+    }
+
+    /* The destination may be write-combined staging memory, so anything
+     * that has to be read back is unswizzled into ordinary memory first */
+    if (image->swizzled) {
+        src_pitch = width * bytes_per_pixel;
+        scratch = g_malloc((size_t)src_pitch * height * depth);
+        unswizzle_box(src, width, height, depth, scratch, src_pitch,
+                      src_pitch * height, bytes_per_pixel);
+        src = scratch;
+    }
+
+    uint8_t *pixel = dst;
+    for (unsigned int y = 0; y < height * depth; y++) {
+        const uint8_t *line = src + y * src_pitch;
+        unsigned int x;
+
+        switch (image->conversion) {
+        case TEXTURE_DECODE_PALETTE:
+            for (x = 0; x < width; x++, pixel += 4) {
+                memcpy(pixel, image->palette + line[x] * 4, 4);
+            }
+            break;
+        case TEXTURE_DECODE_YUY2:
+            for (x = 0; x < width; x++, pixel += 4) {
+                convert_yuy2_to_rgb(line, x, &pixel[0], &pixel[1], &pixel[2]);
+                pixel[3] = 255;
+            }
+            break;
+        case TEXTURE_DECODE_UYVY:
+            for (x = 0; x < width; x++, pixel += 4) {
+                convert_uyvy_to_rgb(line, x, &pixel[0], &pixel[1], &pixel[2]);
+                pixel[3] = 255;
+            }
+            break;
+        case TEXTURE_DECODE_R6G5B5:
+            for (x = 0; x < width; x++, pixel += 3) {
+                uint16_t rgb655 = *(uint16_t *)(line + x * 2);
+                int8_t *p = (int8_t *)pixel;
+                /* Maps 5 bit G and B signed value range to 8 bit
+                 * signed values. R is probably unsigned.
+                 */
+                rgb655 ^= (1 << 9) | (1 << 4);
+                p[0] = ((rgb655 & 0xFC00) >> 10) * 0x7F / 0x3F;
+                p[1] = ((rgb655 & 0x03E0) >> 5) * 0xFF / 0x1F - 0x80;
+                p[2] = (rgb655 & 0x001F) * 0xFF / 0x1F - 0x80;
+            }
+            break;
+        default:
+            assert(false);
+            break;
+        }
+    }
+
+    g_free(scratch);
+}
+
+/* Takes images of the current batch until there are none left. Called, and
+ * returns, with the lock held. Returns the number of images taken. */
+static unsigned int decode_batch(TextureDecodePool *pool)
+{
+    unsigned int num_taken = 0;
+
+    while (pool->next_image < pool->num_images) {
+        num_taken++;
+        const TextureDecodeImage *image = &pool->images[pool->next_image++];
+        qemu_mutex_unlock(&pool->lock);
+
+        texture_decode_image(image, pool->dst_base);
+
+        qemu_mutex_lock(&pool->lock);
+        if (++pool->num_done == pool->num_images) {
+            qemu_cond_signal(&pool->done_cond);
+        }
+    }
+
+    return num_taken;
+}
+
+static void *texture_decode_thread(void *opaque)
+{
+    TextureDecodePool *pool = opaque;
+
+    qemu_mutex_lock(&pool->lock);
+    while (true) {
+        while (!pool->shutdown && pool->next_image >= pool->num_images) {
+            qemu_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        if (pool->shutdown) {
+            break;
+        }
+        decode_batch(pool);
+    }
+    qemu_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+void texture_decode_pool_init(TextureDecodePool *pool,
+                              unsigned int num_threads)
+{
+    qemu_mutex_init(&pool->lock);
+    qemu_cond_init(&pool->work_cond);
+    qemu_cond_init(&pool->done_cond);
+    pool->shutdown = false;
+    pool->num_threads = MIN(num_threads, TEXTURE_DECODE_MAX_THREADS);
+    pool->images = NULL;
+    pool->num_images = 0;
+    pool->next_image = 0;
+    pool->num_done = 0;
+    pool->dst_base = NULL;
+
+    for (int i = 0; i < pool->num_threads; i++) {
+        qemu_thread_create(&pool->threads[i], "nv2a.texture_decode",
+                           texture_decode_thread, pool,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+/*
+ * Decodes @images into @dst_base and returns once all of them are done. The
+ * calling thread decodes alongside the workers rather than waiting idle.
+ * Returns the number of images that were decoded by the workers.
+ */
+unsigned int texture_decode_pool_run(TextureDecodePool *pool,
+                                     const TextureDecodeImage *images,
+                                     unsigned int num_images,
+                                     uint8_t *dst_base)
+{
+    size_t size = 0;
+    for (int i = 0; i < num_images; i++) {
+        size += texture_decode_size(&images[i]);
+    }
+
+    if (pool->num_threads == 0 || num_images < 2
+        || size < TEXTURE_DECODE_MIN_PARALLEL_SIZE) {
+        for (int i = 0; i < num_images; i++) {
+            texture_decode_image(&images[i], dst_base);
+        }
+        return 0;
+    }
+
+    qemu_mutex_lock(&pool->lock);
+    pool->images = images;
+    pool->num_images = num_images;
+    pool->next_image = 0;
+    pool->num_done = 0;
+    pool->dst_base = dst_base;
+    qemu_cond_broadcast(&pool->work_cond);
+
+    unsigned int num_decoded_here = decode_batch(pool);
+
+    while (pool->num_done < pool->num_images) {
+        qemu_cond_wait(&pool->done_cond, &pool->lock);
+    }
+
+    pool->images = NULL;
+    pool->num_images = 0;
+    pool->next_image = 0;
+    pool->dst_base = NULL;
+    qemu_mutex_unlock(&pool->lock);
+
+    return num_images - num_decoded_here;
+}
+
+void texture_decode_pool_finalize(TextureDecodePool *pool)
+{
+    qemu_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    qemu_cond_broadcast(&pool->work_cond);
+    qemu_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->num_threads; i++) {
+        qemu_thread_join(&pool->threads[i]);
+    }
+
+    qemu_cond_destroy(&pool->done_cond);
+    qemu_cond_destroy(&pool->work_cond);
+    qemu_mutex_destroy(&pool->lock);
+}
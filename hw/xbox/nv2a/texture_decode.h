@@ -0,0 +1,88 @@
+/*
+ * QEMU Geforce NV2A texture decoding
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HW_XBOX_NV2A_TEXTURE_DECODE_H
+#define HW_XBOX_NV2A_TEXTURE_DECODE_H
+
+#include "qemu/thread.h"
+
+#define TEXTURE_DECODE_MAX_THREADS 4
+
+/* Images are placed at this alignment in staging buffers so that workers
+ * never write to the same cache line */
+#define TEXTURE_DECODE_ALIGN 64
+
+typedef enum TextureDecodeConversion {
+    TEXTURE_DECODE_COPY,    /* texels are only unswizzled or repacked */
+    TEXTURE_DECODE_PALETTE, /* I8 indices to A8R8G8B8 */
+    TEXTURE_DECODE_YUY2,    /* CR8YB8CB8YA8 to RGBA8 */
+    TEXTURE_DECODE_UYVY,    /* YB8CR8YA8CB8 to RGBA8 */
+    TEXTURE_DECODE_R6G5B5,  /* to signed RGB8 */
+    TEXTURE_DECODE_DXT1,    /* S3TC blocks to RGBA8 */
+    TEXTURE_DECODE_DXT3,
+    TEXTURE_DECODE_DXT5,
+} TextureDecodeConversion;
+
+/*
+ * A mipmap level of a texture or cube face, or a part of one, decoded into
+ * tightly packed texels at dst_offset in a staging buffer.
+ */
+typedef struct TextureDecodeImage {
+    const uint8_t *src;
+    bool swizzled;
+    unsigned int width, height, depth;
+    unsigned int src_pitch; /* row pitch of linear sources */
+    unsigned int bytes_per_pixel; /* of the source, ignored for S3TC */
+    TextureDecodeConversion conversion;
+    const uint8_t *palette;
+    size_t dst_offset;
+} TextureDecodeImage;
+
+typedef struct TextureDecodePool {
+    QemuMutex lock;
+    QemuCond work_cond;
+    QemuCond done_cond;
+    bool shutdown;
+    unsigned int num_threads;
+    QemuThread threads[TEXTURE_DECODE_MAX_THREADS];
+
+    /* The batch being decoded, only one at a time */
+    const TextureDecodeImage *images;
+    unsigned int num_images;
+    unsigned int next_image;
+    unsigned int num_done;
+    uint8_t *dst_base;
+} TextureDecodePool;
+
+size_t texture_decode_size(const TextureDecodeImage *image);
+void texture_decode_add(GArray *images, const TextureDecodeImage *image);
+void texture_decode_image(const TextureDecodeImage *image, uint8_t *dst_base);
+
+void texture_decode_pool_init(TextureDecodePool *pool,
+                              unsigned int num_threads);
+unsigned int texture_decode_pool_run(TextureDecodePool *pool,
+                                     const TextureDecodeImage *images,
+                                     unsigned int num_images,
+                                     uint8_t *dst_base);
+void texture_decode_pool_finalize(TextureDecodePool *pool);
+
+void convert_yuy2_to_rgb(const uint8_t *line, unsigned int ix,
+                         uint8_t *r, uint8_t *g, uint8_t *b);
+void convert_uyvy_to_rgb(const uint8_t *line, unsigned int ix,
+                         uint8_t *r, uint8_t *g, uint8_t *b);
+
+#endif
@@ -236,11 +236,15 @@ static inline bool cpu_physical_memory_is_clean(ram_addr_t addr)
 {
     bool nv2a = cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_NV2A);
     bool nv2a_tex = cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_NV2A_TEX);
+    bool nv2a_capture =
+        cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_NV2A_CAPTURE);
+    bool mcpx = cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_MCPX);
     bool vga = cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_VGA);
     bool code = cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_CODE);
     bool migration =
         cpu_physical_memory_get_dirty_flag(addr, DIRTY_MEMORY_MIGRATION);
-    return !(nv2a && nv2a_tex && vga && code && migration);
+    return !(nv2a && nv2a_tex && nv2a_capture && mcpx && vga && code &&
+             migration);
 }
 
 static inline uint8_t cpu_physical_memory_range_includes_clean(ram_addr_t start,
@@ -257,6 +261,15 @@ static inline uint8_t cpu_physical_memory_range_includes_clean(ram_addr_t start,
         !cpu_physical_memory_all_dirty(start, length, DIRTY_MEMORY_NV2A_TEX)) {
         ret |= (1 << DIRTY_MEMORY_NV2A_TEX);
     }
+    if (mask & (1 << DIRTY_MEMORY_NV2A_CAPTURE) &&
+        !cpu_physical_memory_all_dirty(start, length,
+                                       DIRTY_MEMORY_NV2A_CAPTURE)) {
+        ret |= (1 << DIRTY_MEMORY_NV2A_CAPTURE);
+    }
+    if (mask & (1 << DIRTY_MEMORY_MCPX) &&
+        !cpu_physical_memory_all_dirty(start, length, DIRTY_MEMORY_MCPX)) {
+        ret |= (1 << DIRTY_MEMORY_MCPX);
+    }
     if (mask & (1 << DIRTY_MEMORY_VGA) &&
         !cpu_physical_memory_all_dirty(start, length, DIRTY_MEMORY_VGA)) {
         ret |= (1 << DIRTY_MEMORY_VGA);
@@ -338,6 +351,15 @@ static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
                 bitmap_set_atomic(blocks[DIRTY_MEMORY_NV2A_TEX]->blocks[idx],
                                   offset, next - page);
             }
+            if (unlikely(mask & (1 << DIRTY_MEMORY_NV2A_CAPTURE))) {
+                bitmap_set_atomic(
+                    blocks[DIRTY_MEMORY_NV2A_CAPTURE]->blocks[idx],
+                    offset, next - page);
+            }
+            if (unlikely(mask & (1 << DIRTY_MEMORY_MCPX))) {
+                bitmap_set_atomic(blocks[DIRTY_MEMORY_MCPX]->blocks[idx],
+                                  offset, next - page);
+            }
 
             page = next;
             idx++;
@@ -388,6 +410,9 @@ static inline void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
                     qatomic_or(&blocks[DIRTY_MEMORY_VGA][idx][offset], temp);
                     qatomic_or(&blocks[DIRTY_MEMORY_NV2A][idx][offset], temp);
                     qatomic_or(&blocks[DIRTY_MEMORY_NV2A_TEX][idx][offset], temp);
+                    qatomic_or(&blocks[DIRTY_MEMORY_NV2A_CAPTURE][idx][offset],
+                               temp);
+                    qatomic_or(&blocks[DIRTY_MEMORY_MCPX][idx][offset], temp);
 
                     if (global_dirty_log) {
                         qatomic_or(
@@ -456,6 +481,9 @@ static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
     cpu_physical_memory_test_and_clear_dirty(start, length, DIRTY_MEMORY_VGA);
     cpu_physical_memory_test_and_clear_dirty(start, length, DIRTY_MEMORY_NV2A);
     cpu_physical_memory_test_and_clear_dirty(start, length, DIRTY_MEMORY_NV2A_TEX);
+    cpu_physical_memory_test_and_clear_dirty(start, length,
+                                             DIRTY_MEMORY_NV2A_CAPTURE);
+    cpu_physical_memory_test_and_clear_dirty(start, length, DIRTY_MEMORY_MCPX);
     cpu_physical_memory_test_and_clear_dirty(start, length, DIRTY_MEMORY_CODE);
 }
 
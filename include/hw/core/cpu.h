@@ -26,6 +26,7 @@
 #include "exec/memattrs.h"
 #include "qapi/qapi-types-run-state.h"
 #include "qemu/bitmap.h"
+#include "qemu/interval-tree.h"
 #include "qemu/rcu_queue.h"
 #include "qemu/queue.h"
 #include "qemu/thread.h"
@@ -202,7 +203,7 @@ typedef struct MemAccessCallback {
     hwaddr len;
     MemAccessCallbackFunc func;
     void *opaque;
-    QTAILQ_ENTRY(MemAccessCallback) entry;
+    IntervalTreeNode range;
 } MemAccessCallback;
 #endif
 
@@ -378,7 +379,8 @@ struct CPUState {
     QTAILQ_HEAD(, CPUWatchpoint) watchpoints;
     CPUWatchpoint *watchpoint_hit;
 
-    QTAILQ_HEAD(, MemAccessCallback) mem_access_callbacks;
+    /* MemAccessCallbacks indexed by ram_addr range */
+    IntervalTreeRoot mem_access_callbacks;
 
     void *opaque;
 
@@ -1013,6 +1015,11 @@ int cpu_watchpoint_address_matches(CPUState *cpu, vaddr addr, vaddr len);
  * Note: Access to this watched memory can be slow: each access results in a
  * callback. This can be made faster, but for now just accept that CPU blitting
  * to a surface will be slower.
+ *
+ * Callbacks are kept in an interval tree, so matching an access costs
+ * O(log n) in the number of registered callbacks. Changes to the registry
+ * must be made with the iothread lock held and each one flushes the TLB;
+ * use mem_access_callback_update() to apply many of them at once.
  */
 
 int mem_access_callback_insert(CPUState *cpu, MemoryRegion *mr,
@@ -1020,6 +1027,24 @@ int mem_access_callback_insert(CPUState *cpu, MemoryRegion *mr,
                                MemAccessCallback **cb,
                                MemAccessCallbackFunc func, void *opaque);
 void mem_access_callback_remove_by_ref(CPUState *cpu, MemAccessCallback *cb);
+
+/*
+ * Allocate a callback without registering it. This does not need the
+ * iothread lock, pass the result to mem_access_callback_update().
+ */
+MemAccessCallback *mem_access_callback_new(MemoryRegion *mr, hwaddr offset,
+                                           hwaddr len,
+                                           MemAccessCallbackFunc func,
+                                           void *opaque);
+/*
+ * Unregister and free the @num_remove callbacks in @remove, then register
+ * the @num_insert callbacks in @insert, with a single TLB flush.
+ */
+void mem_access_callback_update(CPUState *cpu,
+                                MemAccessCallback *const *remove,
+                                size_t num_remove,
+                                MemAccessCallback *const *insert,
+                                size_t num_insert);
 int mem_access_callback_address_matches(CPUState *cpu, hwaddr addr, hwaddr len);
 void mem_check_access_callback_ramaddr(CPUState *cpu,
                                        hwaddr ram_addr, vaddr len, int flags);
@@ -57,4 +57,27 @@
 #define bit_LZCNT       (1 << 5)
 #endif
 
+/*
+ * True if the host has AVX2 and the OS saves the YMM registers, i.e. AVX2
+ * code is not just available but usable.
+ */
+static inline bool host_has_avx2(void)
+{
+    int a, b, c, d, bv;
+
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return false;
+    }
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_OSXSAVE) || !(c & bit_AVX)) {
+        return false;
+    }
+    __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+    if ((bv & 0x6) != 0x6) {
+        return false;
+    }
+    __cpuid_count(7, 0, a, b, c, d);
+    return b & bit_AVX2;
+}
+
 #endif /* QEMU_CPUID_H */
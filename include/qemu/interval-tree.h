@@ -0,0 +1,83 @@
+/*
+ * Augmented interval tree over 64-bit address ranges
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_INTERVAL_TREE_H
+#define QEMU_INTERVAL_TREE_H
+
+/*
+ * An intrusive, height-balanced binary search tree of closed intervals
+ * [start, last], ordered by start address. Each node caches the largest
+ * @last in its subtree so that overlap queries only descend into subtrees
+ * that can contain a match, costing O(log n + k) for k results.
+ *
+ * Intervals may overlap and may be identical; nodes are told apart by
+ * their address. Embed an IntervalTreeNode in the indexed object and use
+ * container_of() to get back to it. Nodes must be zero-initialized before
+ * their first insertion. The tree does no allocation and no locking of its
+ * own.
+ */
+
+typedef struct IntervalTreeNode {
+    struct IntervalTreeNode *left, *right;
+    uint64_t start;        /* inclusive */
+    uint64_t last;         /* inclusive */
+    uint64_t subtree_last; /* private */
+    int height;            /* private, 0 when not in a tree */
+} IntervalTreeNode;
+
+typedef struct IntervalTreeRoot {
+    IntervalTreeNode *node;
+} IntervalTreeRoot;
+
+/*
+ * Visitor for interval_tree_visit(). Return true to stop the walk at
+ * @node. The tree must not be modified from within the visitor.
+ */
+typedef bool (*IntervalTreeVisitFunc)(IntervalTreeNode *node, void *opaque);
+
+static inline void interval_tree_init(IntervalTreeRoot *root)
+{
+    root->node = NULL;
+}
+
+static inline bool interval_tree_is_empty(const IntervalTreeRoot *root)
+{
+    return root->node == NULL;
+}
+
+static inline bool interval_tree_node_in_tree(const IntervalTreeNode *node)
+{
+    return node->height != 0;
+}
+
+/* Insert @node covering [@start, @last]. @node must not be in a tree. */
+void interval_tree_insert(IntervalTreeRoot *root, IntervalTreeNode *node,
+                          uint64_t start, uint64_t last);
+
+/* Remove @node, which must currently be in the tree at @root. */
+void interval_tree_remove(IntervalTreeRoot *root, IntervalTreeNode *node);
+
+/*
+ * Call @func on every node overlapping [@start, @last] in ascending order
+ * of start address. Returns the node the walk stopped at, or NULL if the
+ * visitor never returned true. With a NULL @func the walk stops at the
+ * first overlapping node.
+ */
+IntervalTreeNode *interval_tree_visit(IntervalTreeRoot *root,
+                                      uint64_t start, uint64_t last,
+                                      IntervalTreeVisitFunc func,
+                                      void *opaque);
+
+/* Lowest-addressed node overlapping [@start, @last], or NULL */
+static inline IntervalTreeNode *interval_tree_find(IntervalTreeRoot *root,
+                                                   uint64_t start,
+                                                   uint64_t last)
+{
+    return interval_tree_visit(root, start, last, NULL, NULL);
+}
+
+#endif /* QEMU_INTERVAL_TREE_H */
@@ -2112,7 +2112,9 @@ void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client)
 #ifdef XBOX
     assert((client == DIRTY_MEMORY_VGA) \
         || (client == DIRTY_MEMORY_NV2A) \
-        || (client == DIRTY_MEMORY_NV2A_TEX));
+        || (client == DIRTY_MEMORY_NV2A_TEX) \
+        || (client == DIRTY_MEMORY_NV2A_CAPTURE) \
+        || (client == DIRTY_MEMORY_MCPX));
     if (mr->alias) {
         memory_region_set_log(mr->alias, log, client);
         return;
@@ -844,59 +844,72 @@ void cpu_watchpoint_remove_all(CPUState *cpu, int mask)
 
 #ifdef XBOX
 
-static inline bool access_callback_address_matches(MemAccessCallback *cb,
-                                                   hwaddr addr, hwaddr len)
+int mem_access_callback_address_matches(CPUState *cpu, hwaddr addr, hwaddr len)
 {
-    hwaddr watch_end = cb->addr + cb->len - 1;
-    hwaddr access_end = addr + len - 1;
+    if (interval_tree_find(&cpu->mem_access_callbacks, addr, addr + len - 1)) {
+        return BP_MEM_READ | BP_MEM_WRITE;
+    }
 
-    return !(addr > watch_end || cb->addr > access_end);
+    return 0;
 }
 
-int mem_access_callback_address_matches(CPUState *cpu, hwaddr addr, hwaddr len)
+MemAccessCallback *mem_access_callback_new(MemoryRegion *mr, hwaddr offset,
+                                           hwaddr len,
+                                           MemAccessCallbackFunc func,
+                                           void *opaque)
 {
-    int ret = 0;
+    assert(len > 0);
 
-    MemAccessCallback *cb;
-    QTAILQ_FOREACH(cb, &cpu->mem_access_callbacks, entry) {
-        if (access_callback_address_matches(cb, addr, len)) {
-            ret |= BP_MEM_READ | BP_MEM_WRITE;
-        }
+    MemAccessCallback *cb = g_malloc0(sizeof(*cb));
+    cb->mr = mr;
+    cb->addr = memory_region_get_ram_addr(mr) + offset;
+    cb->len = len;
+    cb->func = func;
+    cb->opaque = opaque;
+
+    return cb;
+}
+
+void mem_access_callback_update(CPUState *cpu,
+                                MemAccessCallback *const *remove,
+                                size_t num_remove,
+                                MemAccessCallback *const *insert,
+                                size_t num_insert)
+{
+    for (size_t i = 0; i < num_remove; i++) {
+        interval_tree_remove(&cpu->mem_access_callbacks, &remove[i]->range);
+        g_free(remove[i]);
     }
 
-    return ret;
+    for (size_t i = 0; i < num_insert; i++) {
+        MemAccessCallback *cb = insert[i];
+        interval_tree_insert(&cpu->mem_access_callbacks, &cb->range,
+                             cb->addr, cb->addr + cb->len - 1);
+    }
+
+    if (num_remove || num_insert) {
+        // FIXME: flush only applicable pages
+        tlb_flush(cpu);
+    }
 }
 
 int mem_access_callback_insert(CPUState *cpu, MemoryRegion *mr, hwaddr offset,
                                hwaddr len, MemAccessCallback **cb,
                                MemAccessCallbackFunc func, void *opaque)
 {
-    assert(len > 0);
-
-    MemAccessCallback *cb_ = g_malloc(sizeof(*cb_));
-    cb_->mr = mr;
-    cb_->addr = memory_region_get_ram_addr(mr) + offset;
-    cb_->len = len;
-    cb_->func = func;
-    cb_->opaque = opaque;
-    QTAILQ_INSERT_TAIL(&cpu->mem_access_callbacks, cb_, entry);
+    MemAccessCallback *cb_ = mem_access_callback_new(mr, offset, len, func,
+                                                     opaque);
+    mem_access_callback_update(cpu, NULL, 0, &cb_, 1);
     if (cb) {
         *cb = cb_;
     }
 
-    // FIXME: flush only applicable pages
-    tlb_flush(cpu);
-
     return 0;
 }
 
 void mem_access_callback_remove_by_ref(CPUState *cpu, MemAccessCallback *cb)
 {
-    QTAILQ_REMOVE(&cpu->mem_access_callbacks, cb, entry);
-    g_free(cb);
-
-    // FIXME: flush only applicable pages
-    tlb_flush(cpu);
+    mem_access_callback_update(cpu, &cb, 1, NULL, 0);
 }
 
 void mem_check_access_callback_vaddr(CPUState *cpu,
@@ -908,20 +921,36 @@ void mem_check_access_callback_vaddr(CPUState *cpu,
     mem_check_access_callback_ramaddr(cpu, ram_addr, len, flags);
 }
 
+struct mem_access_callback_hit {
+    hwaddr ram_addr;
+    vaddr len;
+    bool is_write;
+};
+
+static bool mem_access_callback_call(IntervalTreeNode *node, void *opaque)
+{
+    struct mem_access_callback_hit *hit = opaque;
+    MemAccessCallback *cb = container_of(node, MemAccessCallback, range);
+
+    ram_addr_t ram_addr_base = memory_region_get_ram_addr(cb->mr);
+    assert(ram_addr_base != RAM_ADDR_INVALID);
+    ram_addr_t hit_addr = MAX(hit->ram_addr, cb->addr);
+    hwaddr mr_offset = hit_addr - ram_addr_base;
+    cb->func(cb->opaque, cb->mr, mr_offset, hit->len, hit->is_write);
+    return false;
+}
+
 void mem_check_access_callback_ramaddr(CPUState *cpu,
                                        hwaddr ram_addr, vaddr len, int flags)
 {
-    MemAccessCallback *cb;
-    QTAILQ_FOREACH(cb, &cpu->mem_access_callbacks, entry) {
-        if (access_callback_address_matches(cb, ram_addr, len)) {
-            ram_addr_t ram_addr_base = memory_region_get_ram_addr(cb->mr);
-            assert(ram_addr_base != RAM_ADDR_INVALID);
-            ram_addr_t hit_addr = MAX(ram_addr, cb->addr);
-            hwaddr mr_offset = hit_addr - ram_addr_base;
-            bool is_write = (flags & BP_MEM_WRITE) != 0;
-            cb->func(cb->opaque, cb->mr, mr_offset, len, is_write);
-        }
-    }
+    struct mem_access_callback_hit hit = {
+        .ram_addr = ram_addr,
+        .len = len,
+        .is_write = (flags & BP_MEM_WRITE) != 0,
+    };
+
+    interval_tree_visit(&cpu->mem_access_callbacks, ram_addr,
+                        ram_addr + len - 1, mem_access_callback_call, &hit);
 }
 
 #endif // ifdef XBOX
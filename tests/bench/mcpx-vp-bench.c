@@ -0,0 +1,310 @@
+/*
+ * Benchmark for the MCPX APU voice processor kernels
+ *
+ * Runs the tail of voice_process() (low pass filter, gain and MIXBIN
+ * accumulation) for a frame of 256 voices, with the previous scalar code as
+ * reference and every kernel set the host supports. The linear and Hermite
+ * resamplers are timed the same way, against the scalar kernels.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "hw/xbox/mcpx/vp_kernels.h"
+
+/* As in hw/xbox/mcpx/apu_regs.h, which needs the rest of the device model */
+#define NUM_SAMPLES_PER_FRAME 32
+#define NUM_MIXBINS 32
+
+#define NUM_VOICES 256
+
+static unsigned int duration_ms = 200;
+static bool check_reference = true;
+
+static const char commands_string[] =
+    " -d = duration of each measurement in milliseconds\n"
+    " -n = skip verification against the reference implementation";
+
+typedef struct BenchVoice {
+    float samples[NUM_SAMPLES_PER_FRAME][2];
+    sv_filter svf[2];
+    float fc[2], q[2];
+    bool stereo;
+    bool lpf;
+    int bin[8];
+    uint16_t vol[8];
+    float hr[8];
+    double step;
+    float resampled[NUM_SAMPLES_PER_FRAME][2];
+} BenchVoice;
+
+typedef struct BenchFrame {
+    BenchVoice voices[NUM_VOICES];
+    float mixbins[NUM_MIXBINS][NUM_SAMPLES_PER_FRAME];
+} BenchFrame;
+
+static const struct {
+    const char *name;
+    VPKernels kernels;
+} kernel_sets[] = {
+    { "scalar", VP_KERNELS_SCALAR },
+    { "sse2", VP_KERNELS_SSE2 },
+    { "avx2", VP_KERNELS_AVX2 },
+    { "neon", VP_KERNELS_NEON },
+};
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+static float random_float(float min, float max)
+{
+    return min + (max - min) * (float)g_random_double();
+}
+
+static void build_frame(BenchFrame *f)
+{
+    memset(f, 0, sizeof(*f));
+    for (int v = 0; v < NUM_VOICES; v++) {
+        BenchVoice *voice = &f->voices[v];
+        voice->stereo = g_random_boolean();
+        voice->lpf = g_random_int_range(0, 4) != 0;
+        for (int i = 0; i < NUM_SAMPLES_PER_FRAME; i++) {
+            voice->samples[i][0] = random_float(-1.0f, 1.0f);
+            voice->samples[i][1] = voice->stereo ? random_float(-1.0f, 1.0f)
+                                                 : voice->samples[i][0];
+        }
+        for (int ch = 0; ch < 2; ch++) {
+            voice->fc[ch] = random_float(0.003906f, 1.0f);
+            voice->q[ch] = random_float(0.079407f, 1.0f);
+        }
+        voice->step = random_float(0.25f, 2.0f);
+        for (int b = 0; b < 8; b++) {
+            voice->bin[b] = g_random_int_range(0, NUM_MIXBINS);
+            voice->vol[b] = g_random_int_range(0, 0x1000);
+            voice->hr[b] = 1 << g_random_int_range(0, 8);
+        }
+    }
+}
+
+static float ref_attenuate(uint16_t vol)
+{
+    vol &= 0xFFF;
+    return (vol == 0xFFF) ? 0.0 : powf(10.0f, vol/(64.0 * -20.0f));
+}
+
+/* voice_process() before the kernels were introduced */
+static void ref_process_voice(BenchVoice *voice,
+                              float mixbins[][NUM_SAMPLES_PER_FRAME])
+{
+    float samples[NUM_SAMPLES_PER_FRAME][2];
+    unsigned int channels = voice->stereo ? 2 : 1;
+
+    memcpy(samples, voice->samples, sizeof(samples));
+    if (voice->lpf) {
+        for (int ch = 0; ch < 2; ch++) {
+            sv_filter *filter = &voice->svf[ch];
+            setup_svf(filter, voice->fc[ch], voice->q[ch], F_LP);
+            for (int i = 0; i < NUM_SAMPLES_PER_FRAME; i++) {
+                samples[i][ch] = run_svf(filter, samples[i][ch]);
+                samples[i][ch] = fmin(fmax(samples[i][ch], -1.0), 1.0);
+            }
+        }
+    }
+
+    for (int b = 0; b < 8; b++) {
+        float g = 0.5f * ref_attenuate(voice->vol[b]) / voice->hr[b];
+        for (int i = 0; i < NUM_SAMPLES_PER_FRAME; i++) {
+            mixbins[voice->bin[b]][i] += g*samples[i][b % channels];
+        }
+    }
+}
+
+static void process_voice(BenchVoice *voice,
+                          float mixbins[][NUM_SAMPLES_PER_FRAME])
+{
+    float samples[NUM_SAMPLES_PER_FRAME][2];
+    unsigned int channels = voice->stereo ? 2 : 1;
+
+    memcpy(samples, voice->samples, sizeof(samples));
+    if (voice->lpf) {
+        for (int ch = 0; ch < 2; ch++) {
+            setup_svf(&voice->svf[ch], voice->fc[ch], voice->q[ch], F_LP);
+        }
+        vp_svf_lp_stereo(voice->svf, samples, NUM_SAMPLES_PER_FRAME);
+    }
+
+    float channel_samples[2][NUM_SAMPLES_PER_FRAME];
+    vp_deinterleave(samples, channel_samples[0], channel_samples[1],
+                    NUM_SAMPLES_PER_FRAME);
+
+    for (int b = 0; b < 8; b++) {
+        float g = 0.5f * vp_attenuate(voice->vol[b]) / voice->hr[b];
+        vp_accumulate(mixbins[voice->bin[b]], channel_samples[b % channels],
+                      g, NUM_SAMPLES_PER_FRAME);
+    }
+}
+
+static void resample_voice(BenchVoice *voice,
+                           int (*fn)(const float [][2], int, double *, double,
+                                     float [][2], int, unsigned int))
+{
+    double pos = 0;
+    fn(voice->samples, NUM_SAMPLES_PER_FRAME, &pos, voice->step,
+       voice->resampled, NUM_SAMPLES_PER_FRAME, voice->stereo ? 2 : 1);
+}
+
+static void resample_voice_linear(BenchVoice *voice,
+                                  float mixbins[][NUM_SAMPLES_PER_FRAME])
+{
+    resample_voice(voice, vp_resample_linear);
+}
+
+static void resample_voice_hermite(BenchVoice *voice,
+                                   float mixbins[][NUM_SAMPLES_PER_FRAME])
+{
+    resample_voice(voice, vp_resample_hermite);
+}
+
+static const struct {
+    const char *name;
+    void (*fn)(BenchVoice *, float [][NUM_SAMPLES_PER_FRAME]);
+} resamplers[] = {
+    { "linear", resample_voice_linear },
+    { "hermite", resample_voice_hermite },
+};
+
+static bool resampled_equal(const BenchFrame *a, const BenchFrame *b)
+{
+    for (int v = 0; v < NUM_VOICES; v++) {
+        if (memcmp(a->voices[v].resampled, b->voices[v].resampled,
+                   sizeof(a->voices[v].resampled))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void process_frame(BenchFrame *f,
+                          void (*fn)(BenchVoice *,
+                                     float [][NUM_SAMPLES_PER_FRAME]))
+{
+    memset(f->mixbins, 0, sizeof(f->mixbins));
+    for (int v = 0; v < NUM_VOICES; v++) {
+        fn(&f->voices[v], f->mixbins);
+    }
+}
+
+static double measure(BenchFrame *f,
+                      void (*fn)(BenchVoice *,
+                                 float [][NUM_SAMPLES_PER_FRAME]))
+{
+    int64_t start = g_get_monotonic_time();
+    int64_t end = start + duration_ms * 1000;
+    int64_t now;
+    unsigned long iterations = 0;
+
+    do {
+        process_frame(f, fn);
+        iterations++;
+        now = g_get_monotonic_time();
+    } while (now < end);
+
+    /* ns per voice */
+    return (double)(now - start) * 1000 / iterations / NUM_VOICES;
+}
+
+int main(int argc, char *argv[])
+{
+    BenchFrame *initial = g_new(BenchFrame, 1);
+    BenchFrame *reference = g_new(BenchFrame, 1);
+    BenchFrame *frame = g_new(BenchFrame, 1);
+    bool ok = true;
+    int c;
+
+    while ((c = getopt(argc, argv, "hd:n")) != -1) {
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            return 0;
+        case 'd':
+            duration_ms = atoi(optarg);
+            break;
+        case 'n':
+            check_reference = false;
+            break;
+        default:
+            usage_complete(argv);
+            return 1;
+        }
+    }
+
+    build_frame(initial);
+
+    /* Two frames, so filter state carried over between frames is checked */
+    *reference = *initial;
+    process_frame(reference, ref_process_voice);
+    process_frame(reference, ref_process_voice);
+
+    *frame = *initial;
+    double ref_ns = measure(frame, ref_process_voice);
+    printf("%-10s %8.1f ns/voice\n", "reference", ref_ns);
+
+    for (int i = 0; i < ARRAY_SIZE(kernel_sets); i++) {
+        if (!vp_kernels_set(kernel_sets[i].kernels)) {
+            continue;
+        }
+
+        if (check_reference) {
+            *frame = *initial;
+            process_frame(frame, process_voice);
+            process_frame(frame, process_voice);
+            if (memcmp(frame->mixbins, reference->mixbins,
+                       sizeof(frame->mixbins))) {
+                fprintf(stderr, "mismatch: %s kernels\n", kernel_sets[i].name);
+                ok = false;
+            }
+        }
+
+        *frame = *initial;
+        double ns = measure(frame, process_voice);
+        printf("%-10s %8.1f ns/voice  speedup %.2fx\n", kernel_sets[i].name,
+               ns, ref_ns / ns);
+    }
+
+    for (int r = 0; r < ARRAY_SIZE(resamplers); r++) {
+        double scalar_ns = 0;
+
+        for (int i = 0; i < ARRAY_SIZE(kernel_sets); i++) {
+            if (!vp_kernels_set(kernel_sets[i].kernels)) {
+                continue;
+            }
+
+            *frame = *initial;
+            process_frame(frame, resamplers[r].fn);
+            if (kernel_sets[i].kernels == VP_KERNELS_SCALAR) {
+                *reference = *frame;
+            } else if (check_reference && !resampled_equal(frame, reference)) {
+                fprintf(stderr, "mismatch: %s %s kernels\n", resamplers[r].name,
+                        kernel_sets[i].name);
+                ok = false;
+            }
+
+            double ns = measure(frame, resamplers[r].fn);
+            if (kernel_sets[i].kernels == VP_KERNELS_SCALAR) {
+                scalar_ns = ns;
+            }
+            printf("%-7s %-6s %6.1f ns/voice  speedup %.2fx\n",
+                   resamplers[r].name, kernel_sets[i].name, ns, scalar_ns / ns);
+        }
+    }
+
+    g_free(frame);
+    g_free(reference);
+    g_free(initial);
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,194 @@
+/*
+ * Benchmark for the nv2a texture swizzling routines
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "hw/xbox/nv2a/swizzle.h"
+
+static unsigned int duration_ms = 200;
+static bool check_reference = true;
+
+static const char commands_string[] =
+    " -d = duration of each measurement in milliseconds\n"
+    " -n = skip verification against the reference implementation";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+/* Straightforward bit-by-bit implementation the kernels must match */
+static uint32_t ref_fill_pattern(uint32_t pattern, uint32_t value)
+{
+    uint32_t result = 0;
+    uint32_t bit = 1;
+    while (value) {
+        if (pattern & bit) {
+            result |= value & 1 ? bit : 0;
+            value >>= 1;
+        }
+        bit <<= 1;
+    }
+    return result;
+}
+
+static void ref_swizzle_box(const uint8_t *src_buf, unsigned int width,
+                            unsigned int height, unsigned int depth,
+                            uint8_t *dst_buf, unsigned int row_pitch,
+                            unsigned int slice_pitch,
+                            unsigned int bytes_per_pixel)
+{
+    uint32_t mask_x = 0, mask_y = 0, mask_z = 0;
+    uint32_t bit = 1, mask_bit = 1;
+    bool done;
+    do {
+        done = true;
+        if (bit < width) { mask_x |= mask_bit; mask_bit <<= 1; done = false; }
+        if (bit < height) { mask_y |= mask_bit; mask_bit <<= 1; done = false; }
+        if (bit < depth) { mask_z |= mask_bit; mask_bit <<= 1; done = false; }
+        bit <<= 1;
+    } while (!done);
+
+    for (unsigned int z = 0; z < depth; z++) {
+        for (unsigned int y = 0; y < height; y++) {
+            for (unsigned int x = 0; x < width; x++) {
+                uint32_t offset = ref_fill_pattern(mask_x, x)
+                                  | ref_fill_pattern(mask_y, y)
+                                  | ref_fill_pattern(mask_z, z);
+                memcpy(dst_buf + offset * bytes_per_pixel,
+                       src_buf + z * slice_pitch + y * row_pitch
+                               + x * bytes_per_pixel,
+                       bytes_per_pixel);
+            }
+        }
+    }
+}
+
+static double measure(void (*fn)(const uint8_t *, unsigned int, unsigned int,
+                                 unsigned int, uint8_t *, unsigned int,
+                                 unsigned int, unsigned int),
+                      const uint8_t *src, unsigned int width,
+                      unsigned int height, unsigned int depth, uint8_t *dst,
+                      unsigned int bytes_per_pixel)
+{
+    unsigned int row_pitch = width * bytes_per_pixel;
+    unsigned int slice_pitch = row_pitch * height;
+    size_t size = (size_t)slice_pitch * depth;
+    int64_t start = g_get_monotonic_time();
+    int64_t end = start + duration_ms * 1000;
+    int64_t now;
+    unsigned long iterations = 0;
+
+    do {
+        fn(src, width, height, depth, dst, row_pitch, slice_pitch,
+           bytes_per_pixel);
+        iterations++;
+        now = g_get_monotonic_time();
+    } while (now < end);
+
+    /* MiB/s */
+    return (double)size * iterations / (now - start) * 1e6 / (1 << 20);
+}
+
+static bool run(unsigned int width, unsigned int height, unsigned int depth,
+                unsigned int bytes_per_pixel)
+{
+    unsigned int row_pitch = width * bytes_per_pixel;
+    unsigned int slice_pitch = row_pitch * height;
+    size_t size = (size_t)slice_pitch * depth;
+    uint8_t *linear = g_malloc(size);
+    uint8_t *swizzled = g_malloc(size);
+    uint8_t *scratch = g_malloc(size);
+    bool ok = true;
+
+    for (size_t i = 0; i < size; i++) {
+        linear[i] = g_random_int();
+    }
+
+    if (check_reference) {
+        ref_swizzle_box(linear, width, height, depth, scratch, row_pitch,
+                        slice_pitch, bytes_per_pixel);
+        swizzle_box(linear, width, height, depth, swizzled, row_pitch,
+                    slice_pitch, bytes_per_pixel);
+        if (memcmp(scratch, swizzled, size)) {
+            fprintf(stderr, "swizzle mismatch: %ux%ux%u, %u bytes/pixel\n",
+                    width, height, depth, bytes_per_pixel);
+            ok = false;
+        }
+        unswizzle_box(swizzled, width, height, depth, scratch, row_pitch,
+                      slice_pitch, bytes_per_pixel);
+        if (memcmp(scratch, linear, size)) {
+            fprintf(stderr, "unswizzle mismatch: %ux%ux%u, %u bytes/pixel\n",
+                    width, height, depth, bytes_per_pixel);
+            ok = false;
+        }
+    }
+
+    double swz = measure(swizzle_box, linear, width, height, depth, swizzled,
+                         bytes_per_pixel);
+    double unswz = measure(unswizzle_box, swizzled, width, height, depth,
+                           scratch, bytes_per_pixel);
+    double ref = measure(ref_swizzle_box, linear, width, height, depth,
+                         scratch, bytes_per_pixel);
+
+    printf("%4ux%-4ux%-3u %2u Bpp  swizzle %9.1f MiB/s  "
+           "unswizzle %9.1f MiB/s  reference %8.1f MiB/s\n",
+           width, height, depth, bytes_per_pixel, swz, unswz, ref);
+
+    g_free(linear);
+    g_free(swizzled);
+    g_free(scratch);
+
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    static const unsigned int sizes[][3] = {
+        /* 2D textures and surfaces */
+        { 64, 64, 1 },
+        { 128, 128, 1 },
+        { 256, 256, 1 },
+        { 512, 512, 1 },
+        { 1024, 1024, 1 },
+        { 512, 256, 1 },
+        { 256, 512, 1 },
+        /* Volume textures */
+        { 16, 16, 16 },
+        { 32, 32, 32 },
+        { 64, 64, 64 },
+        { 128, 128, 8 },
+    };
+    static const unsigned int bpps[] = { 1, 2, 4, 8 };
+    bool ok = true;
+    int c;
+
+    while ((c = getopt(argc, argv, "hd:n")) != -1) {
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            return 0;
+        case 'd':
+            duration_ms = atoi(optarg);
+            break;
+        case 'n':
+            check_reference = false;
+            break;
+        default:
+            usage_complete(argv);
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < ARRAY_SIZE(sizes); i++) {
+        for (int j = 0; j < ARRAY_SIZE(bpps); j++) {
+            ok &= run(sizes[i][0], sizes[i][1], sizes[i][2], bpps[j]);
+        }
+    }
+
+    return ok ? 0 : 1;
+}
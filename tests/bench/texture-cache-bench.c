@@ -0,0 +1,271 @@
+/*
+ * Benchmark for nv2a texture cache dirty tracking
+ *
+ * Compares marking textures that overlap a written VRAM range by walking
+ * every LRU bin against querying the interval tree of cached ranges, for
+ * a range of cache occupancies.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/interval-tree.h"
+#include "hw/xbox/nv2a/lru.h"
+
+#define VRAM_SIZE (64 * MiB)
+#define VRAM_PAGE_SIZE 4096
+
+static unsigned int duration_ms = 200;
+static bool check_reference = true;
+
+static const char commands_string[] =
+    " -d = duration of each measurement in milliseconds\n"
+    " -n = skip verification of the interval tree against the LRU walk";
+
+typedef struct BenchKey {
+    uint64_t offset;
+    uint64_t length;
+} BenchKey;
+
+typedef struct BenchNode {
+    LruNode node;
+    BenchKey key;
+    bool possibly_dirty;
+    IntervalTreeNode range;
+} BenchNode;
+
+typedef struct BenchCache {
+    Lru lru;
+    IntervalTreeRoot ranges;
+    BenchNode *entries;
+} BenchCache;
+
+struct mark_range {
+    uint64_t start, last;
+};
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+static uint64_t key_hash(const BenchKey *key)
+{
+    return (key->offset * 0x9e3779b97f4a7c15ULL) ^ key->length;
+}
+
+static void entry_init(Lru *lru, LruNode *node, void *key)
+{
+    BenchCache *cache = container_of(lru, BenchCache, lru);
+    BenchNode *bnode = container_of(node, BenchNode, node);
+
+    memcpy(&bnode->key, key, sizeof(BenchKey));
+    bnode->possibly_dirty = false;
+    interval_tree_insert(&cache->ranges, &bnode->range, bnode->key.offset,
+                         bnode->key.offset + bnode->key.length - 1);
+}
+
+static void entry_post_evict(Lru *lru, LruNode *node)
+{
+    BenchCache *cache = container_of(lru, BenchCache, lru);
+    BenchNode *bnode = container_of(node, BenchNode, node);
+
+    interval_tree_remove(&cache->ranges, &bnode->range);
+}
+
+static bool entry_compare(Lru *lru, LruNode *node, void *key)
+{
+    BenchNode *bnode = container_of(node, BenchNode, node);
+    return memcmp(&bnode->key, key, sizeof(BenchKey));
+}
+
+/* The scan the texture cache used before it had a range index */
+static void mark_visitor(Lru *lru, LruNode *node, void *opaque)
+{
+    struct mark_range *range = opaque;
+    BenchNode *bnode = container_of(node, BenchNode, node);
+
+    if (bnode->possibly_dirty) {
+        return;
+    }
+
+    uint64_t start = bnode->key.offset;
+    uint64_t last = start + bnode->key.length - 1;
+    bnode->possibly_dirty = !(range->start > last || start > range->last);
+}
+
+static bool mark_range_visitor(IntervalTreeNode *node, void *opaque)
+{
+    BenchNode *bnode = container_of(node, BenchNode, range);
+    bnode->possibly_dirty = true;
+    return false;
+}
+
+static void mark_lru(BenchCache *cache, uint64_t start, uint64_t last)
+{
+    struct mark_range range = { .start = start, .last = last };
+    lru_visit_active(&cache->lru, mark_visitor, &range);
+}
+
+static void mark_tree(BenchCache *cache, uint64_t start, uint64_t last)
+{
+    interval_tree_visit(&cache->ranges, start, last, mark_range_visitor,
+                        NULL);
+}
+
+static void random_texture(BenchKey *key)
+{
+    /* 32x32 to 512x512, 2 or 4 bytes per texel, plus mipmaps */
+    unsigned int dim = 32 << g_random_int_range(0, 5);
+    uint64_t length = dim * dim * (g_random_boolean() ? 4 : 2) * 4 / 3;
+
+    key->length = ROUND_UP(length, 128);
+    key->offset = ROUND_DOWN(g_random_int_range(0, VRAM_SIZE - key->length),
+                             128);
+}
+
+static void random_write(uint64_t *start, uint64_t *last)
+{
+    /* Page-aligned CPU or surface writes of 4 KiB to 1 MiB */
+    uint64_t size = VRAM_PAGE_SIZE << g_random_int_range(0, 9);
+    *start = ROUND_DOWN(g_random_int_range(0, VRAM_SIZE - size),
+                        VRAM_PAGE_SIZE);
+    *last = *start + size - 1;
+}
+
+static void clear_dirty(BenchCache *cache, unsigned int occupancy)
+{
+    for (unsigned int i = 0; i < occupancy; i++) {
+        cache->entries[i].possibly_dirty = false;
+    }
+}
+
+static double measure(void (*fn)(BenchCache *, uint64_t, uint64_t),
+                      BenchCache *cache, unsigned int occupancy)
+{
+    int64_t start = g_get_monotonic_time();
+    int64_t end = start + duration_ms * 1000;
+    int64_t now;
+    unsigned long iterations = 0;
+
+    do {
+        uint64_t write_start, write_last;
+        random_write(&write_start, &write_last);
+        fn(cache, write_start, write_last);
+        if ((iterations & 63) == 0) {
+            clear_dirty(cache, occupancy);
+        }
+        iterations++;
+        now = g_get_monotonic_time();
+    } while (now < end);
+
+    /* ns per dirty-marking call */
+    return (double)(now - start) * 1000 / iterations;
+}
+
+static bool verify(BenchCache *cache, unsigned int occupancy)
+{
+    bool *expected = g_new(bool, occupancy);
+    bool ok = true;
+
+    for (int i = 0; i < 1000 && ok; i++) {
+        uint64_t start, last;
+        random_write(&start, &last);
+
+        clear_dirty(cache, occupancy);
+        mark_lru(cache, start, last);
+        for (unsigned int j = 0; j < occupancy; j++) {
+            expected[j] = cache->entries[j].possibly_dirty;
+        }
+
+        clear_dirty(cache, occupancy);
+        mark_tree(cache, start, last);
+        for (unsigned int j = 0; j < occupancy; j++) {
+            if (expected[j] != cache->entries[j].possibly_dirty) {
+                fprintf(stderr, "mismatch: occupancy %u, write "
+                        "[0x%" PRIx64 ", 0x%" PRIx64 "], entry %u\n",
+                        occupancy, start, last, j);
+                ok = false;
+                break;
+            }
+        }
+    }
+
+    g_free(expected);
+    return ok;
+}
+
+static bool run(unsigned int occupancy)
+{
+    BenchCache *cache = g_new0(BenchCache, 1);
+    bool ok = true;
+
+    lru_init(&cache->lru);
+    interval_tree_init(&cache->ranges);
+    cache->entries = g_new0(BenchNode, occupancy);
+    for (unsigned int i = 0; i < occupancy; i++) {
+        lru_add_free(&cache->lru, &cache->entries[i].node);
+    }
+    cache->lru.init_node = entry_init;
+    cache->lru.compare_nodes = entry_compare;
+    cache->lru.post_node_evict = entry_post_evict;
+
+    /* Fill the cache, with some churn so the tree sees removals too */
+    for (unsigned int i = 0; i < occupancy * 2; i++) {
+        BenchKey key;
+        random_texture(&key);
+        lru_lookup(&cache->lru, key_hash(&key), &key);
+    }
+
+    if (check_reference) {
+        ok = verify(cache, occupancy);
+    }
+
+    double lru_ns = measure(mark_lru, cache, occupancy);
+    double tree_ns = measure(mark_tree, cache, occupancy);
+
+    printf("%5u textures  LRU walk %9.1f ns  interval tree %7.1f ns\n",
+           occupancy, lru_ns, tree_ns);
+
+    lru_flush(&cache->lru);
+    g_assert(interval_tree_is_empty(&cache->ranges));
+    g_free(cache->entries);
+    g_free(cache);
+
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    static const unsigned int occupancies[] = {
+        16, 64, 128, 256, 512, 1024, 4096,
+    };
+    bool ok = true;
+    int c;
+
+    while ((c = getopt(argc, argv, "hd:n")) != -1) {
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            return 0;
+        case 'd':
+            duration_ms = atoi(optarg);
+            break;
+        case 'n':
+            check_reference = false;
+            break;
+        default:
+            usage_complete(argv);
+            return 1;
+        }
+    }
+
+    for (int i = 0; i < ARRAY_SIZE(occupancies); i++) {
+        ok &= run(occupancies[i]);
+    }
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,253 @@
+/*
+ * Benchmark for the nv2a texture decode pool
+ *
+ * Decodes a texture set shaped like the misses of a typical title (large
+ * atlases, cube maps, volume textures and the conversions that need the
+ * CPU) with an increasing number of worker threads, the way texture misses
+ * are decoded before their pixel buffer upload.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "hw/xbox/nv2a/texture_decode.h"
+
+static unsigned int duration_ms = 200;
+static bool check_reference = true;
+
+static const char commands_string[] =
+    " -d = duration of each measurement in milliseconds\n"
+    " -n = skip verification against single threaded decoding";
+
+typedef struct BenchTexture {
+    TextureDecodeConversion conversion;
+    bool swizzled;
+    unsigned int width, height, depth;
+    unsigned int bytes_per_pixel;
+    unsigned int levels;
+    unsigned int faces;
+} BenchTexture;
+
+static const BenchTexture texture_set[] = {
+    /* A8R8G8B8 and R5G6B5 atlases */
+    { TEXTURE_DECODE_COPY, true, 1024, 1024, 1, 4, 11, 1 },
+    { TEXTURE_DECODE_COPY, true, 1024, 512, 1, 2, 11, 1 },
+    /* I8 and A8R8G8B8 cube maps */
+    { TEXTURE_DECODE_PALETTE, true, 256, 256, 1, 1, 9, 6 },
+    { TEXTURE_DECODE_COPY, true, 256, 256, 1, 4, 9, 6 },
+    /* R6G5B5 bump map */
+    { TEXTURE_DECODE_R6G5B5, true, 512, 512, 1, 2, 10, 1 },
+    /* YUY2 movie frame */
+    { TEXTURE_DECODE_YUY2, false, 640, 480, 1, 2, 1, 1 },
+    /* DXT1, DXT5 and A8R8G8B8 volumes */
+    { TEXTURE_DECODE_DXT1, true, 64, 64, 64, 0, 1, 1 },
+    { TEXTURE_DECODE_DXT5, true, 128, 128, 16, 0, 1, 1 },
+    { TEXTURE_DECODE_COPY, true, 64, 64, 64, 4, 1, 1 },
+};
+
+typedef struct BenchSet {
+    GArray *images;
+    uint8_t **sources;
+    uint8_t *palette;
+    size_t size;
+} BenchSet;
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+static size_t source_size(const BenchTexture *t, unsigned int width,
+                          unsigned int height, unsigned int depth)
+{
+    switch (t->conversion) {
+    case TEXTURE_DECODE_DXT1:
+        return (size_t)width / 4 * height / 4 * depth * 8;
+    case TEXTURE_DECODE_DXT3:
+    case TEXTURE_DECODE_DXT5:
+        return (size_t)width / 4 * height / 4 * depth * 16;
+    default:
+        return (size_t)width * height * depth * t->bytes_per_pixel;
+    }
+}
+
+static uint8_t *random_data(size_t size)
+{
+    uint8_t *data = g_malloc(size);
+    for (size_t i = 0; i < size; i++) {
+        data[i] = g_random_int();
+    }
+    return data;
+}
+
+/* Queues every level and face of the set like upload_gl_texture() does */
+static void build_set(BenchSet *set)
+{
+    unsigned int num_sources = 0;
+
+    set->images = g_array_new(false, false, sizeof(TextureDecodeImage));
+    set->sources = g_new0(uint8_t *, ARRAY_SIZE(texture_set));
+    set->palette = random_data(256 * 4);
+    set->size = 0;
+
+    for (int i = 0; i < ARRAY_SIZE(texture_set); i++) {
+        const BenchTexture *t = &texture_set[i];
+        size_t length = 0;
+        unsigned int w = t->width, h = t->height, d = t->depth;
+
+        for (int level = 0; level < t->levels; level++) {
+            length += source_size(t, MAX(w, 1), MAX(h, 1), MAX(d, 1));
+            w /= 2;
+            h /= 2;
+            d /= 2;
+        }
+        uint8_t *data = random_data(length * t->faces);
+        set->sources[num_sources++] = data;
+
+        for (int face = 0; face < t->faces; face++) {
+            w = t->width;
+            h = t->height;
+            d = t->depth;
+            for (int level = 0; level < t->levels; level++) {
+                TextureDecodeImage image = {
+                    .src = data,
+                    .swizzled = t->swizzled,
+                    .width = MAX(w, 1),
+                    .height = MAX(h, 1),
+                    .depth = MAX(d, 1),
+                    .src_pitch = t->swizzled ? 0 : w * t->bytes_per_pixel,
+                    .bytes_per_pixel = t->bytes_per_pixel,
+                    .conversion = t->conversion,
+                    .palette = set->palette,
+                    .dst_offset = set->size,
+                };
+                texture_decode_add(set->images, &image);
+                set->size += ROUND_UP(texture_decode_size(&image),
+                                      TEXTURE_DECODE_ALIGN);
+                data += source_size(t, image.width, image.height,
+                                    image.depth);
+                w /= 2;
+                h /= 2;
+                d /= 2;
+            }
+        }
+    }
+}
+
+static void free_set(BenchSet *set)
+{
+    for (int i = 0; i < ARRAY_SIZE(texture_set); i++) {
+        g_free(set->sources[i]);
+    }
+    g_free(set->sources);
+    g_free(set->palette);
+    g_array_free(set->images, true);
+}
+
+static void decode_set(TextureDecodePool *pool, BenchSet *set,
+                       uint8_t *staging)
+{
+    texture_decode_pool_run(pool, (TextureDecodeImage *)set->images->data,
+                            set->images->len, staging);
+}
+
+static double measure(TextureDecodePool *pool, BenchSet *set,
+                      uint8_t *staging)
+{
+    int64_t start = g_get_monotonic_time();
+    int64_t end = start + duration_ms * 1000;
+    int64_t now;
+    unsigned long iterations = 0;
+
+    do {
+        decode_set(pool, set, staging);
+        iterations++;
+        now = g_get_monotonic_time();
+    } while (now < end);
+
+    /* ms per texture set */
+    return (double)(now - start) / 1000 / iterations;
+}
+
+int main(int argc, char *argv[])
+{
+    BenchSet set;
+    uint8_t *reference = NULL;
+    bool ok = true;
+    int c;
+
+    while ((c = getopt(argc, argv, "hd:n")) != -1) {
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            return 0;
+        case 'd':
+            duration_ms = atoi(optarg);
+            break;
+        case 'n':
+            check_reference = false;
+            break;
+        default:
+            usage_complete(argv);
+            return 1;
+        }
+    }
+
+    build_set(&set);
+    uint8_t *staging = g_malloc(set.size);
+
+    printf("%u textures, %u decode jobs, %.1f MiB decoded\n",
+           (unsigned int)ARRAY_SIZE(texture_set), set.images->len,
+           (double)set.size / (1 << 20));
+
+    if (check_reference) {
+        reference = g_malloc(set.size);
+        for (int i = 0; i < set.images->len; i++) {
+            texture_decode_image(&g_array_index(set.images,
+                                                TextureDecodeImage, i),
+                                 reference);
+        }
+    }
+
+    double single_ms = 0;
+    for (unsigned int threads = 0; threads <= TEXTURE_DECODE_MAX_THREADS;
+         threads++) {
+        TextureDecodePool pool;
+        texture_decode_pool_init(&pool, threads);
+
+        if (check_reference) {
+            memset(staging, 0, set.size);
+            decode_set(&pool, &set, staging);
+            for (int i = 0; i < set.images->len; i++) {
+                TextureDecodeImage *image =
+                    &g_array_index(set.images, TextureDecodeImage, i);
+                if (memcmp(staging + image->dst_offset,
+                           reference + image->dst_offset,
+                           texture_decode_size(image))) {
+                    fprintf(stderr, "mismatch: %u workers, job %d\n",
+                            threads, i);
+                    ok = false;
+                    break;
+                }
+            }
+        }
+
+        double ms = measure(&pool, &set, staging);
+        if (threads == 0) {
+            single_ms = ms;
+        }
+        printf("%u workers  %8.2f ms/set  %9.1f MiB/s  speedup %.2fx\n",
+               threads, ms, set.size / (ms / 1000) / (1 << 20),
+               single_ms / ms);
+
+        texture_decode_pool_finalize(&pool);
+    }
+
+    g_free(reference);
+    g_free(staging);
+    free_set(&set);
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,147 @@
+/*
+ * Interval tree unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/interval-tree.h"
+
+#define N_NODES 512
+#define N_ROUNDS 20000
+#define ADDR_SPACE (1 << 20)
+
+static IntervalTreeNode nodes[N_NODES];
+
+struct visit_state {
+    uint64_t start, last;
+    uint64_t prev_start;
+    unsigned long count;
+    bool seen[N_NODES];
+};
+
+static bool record_visit(IntervalTreeNode *node, void *opaque)
+{
+    struct visit_state *state = opaque;
+    int i = node - nodes;
+
+    g_assert_cmpint(i, >=, 0);
+    g_assert_cmpint(i, <, N_NODES);
+    g_assert(node->start <= state->last && node->last >= state->start);
+    g_assert_cmpuint(node->start, >=, state->prev_start);
+    g_assert_false(state->seen[i]);
+
+    state->prev_start = node->start;
+    state->seen[i] = true;
+    state->count++;
+    return false;
+}
+
+static bool stop_at_second(IntervalTreeNode *node, void *opaque)
+{
+    unsigned long *count = opaque;
+    return ++*count == 2;
+}
+
+static void check_query(IntervalTreeRoot *root, uint64_t start, uint64_t last)
+{
+    struct visit_state state = { .start = start, .last = last };
+    IntervalTreeNode *first = NULL;
+    unsigned long expected = 0;
+
+    g_assert_null(interval_tree_visit(root, start, last, record_visit,
+                                      &state));
+
+    for (int i = 0; i < N_NODES; i++) {
+        IntervalTreeNode *node = &nodes[i];
+        bool overlaps = interval_tree_node_in_tree(node)
+                        && node->start <= last && node->last >= start;
+        g_assert_cmpint(overlaps, ==, state.seen[i]);
+        if (overlaps) {
+            expected++;
+            if (!first || node->start < first->start) {
+                first = node;
+            }
+        }
+    }
+    g_assert_cmpuint(state.count, ==, expected);
+
+    IntervalTreeNode *found = interval_tree_find(root, start, last);
+    if (first) {
+        g_assert_nonnull(found);
+        g_assert_cmpuint(found->start, ==, first->start);
+    } else {
+        g_assert_null(found);
+    }
+
+    unsigned long count = 0;
+    found = interval_tree_visit(root, start, last, stop_at_second, &count);
+    g_assert_cmpuint(count, ==, MIN(expected, 2));
+    g_assert(expected >= 2 ? found != NULL : found == NULL);
+}
+
+static void test_random(void)
+{
+    IntervalTreeRoot root;
+
+    memset(nodes, 0, sizeof(nodes));
+    interval_tree_init(&root);
+    g_assert_true(interval_tree_is_empty(&root));
+
+    for (int round = 0; round < N_ROUNDS; round++) {
+        IntervalTreeNode *node = &nodes[g_test_rand_int_range(0, N_NODES)];
+
+        if (interval_tree_node_in_tree(node)) {
+            interval_tree_remove(&root, node);
+            g_assert_false(interval_tree_node_in_tree(node));
+        } else {
+            uint64_t start = g_test_rand_int_range(0, ADDR_SPACE);
+            uint64_t len = g_test_rand_int_range(1, ADDR_SPACE / 16);
+            interval_tree_insert(&root, node, start, start + len - 1);
+        }
+
+        uint64_t start = g_test_rand_int_range(0, ADDR_SPACE);
+        uint64_t len = g_test_rand_int_range(1, ADDR_SPACE / 8);
+        check_query(&root, start, start + len - 1);
+    }
+
+    for (int i = 0; i < N_NODES; i++) {
+        if (interval_tree_node_in_tree(&nodes[i])) {
+            interval_tree_remove(&root, &nodes[i]);
+        }
+    }
+    g_assert_true(interval_tree_is_empty(&root));
+}
+
+static void test_duplicates(void)
+{
+    IntervalTreeRoot root;
+
+    memset(nodes, 0, sizeof(nodes));
+    interval_tree_init(&root);
+
+    /* Identical ranges must be kept apart and removable individually */
+    for (int i = 0; i < 64; i++) {
+        interval_tree_insert(&root, &nodes[i], 0x1000, 0x1fff);
+    }
+    check_query(&root, 0x1800, 0x1800);
+    for (int i = 0; i < 64; i += 2) {
+        interval_tree_remove(&root, &nodes[i]);
+    }
+    check_query(&root, 0, UINT64_MAX);
+    g_assert_null(interval_tree_find(&root, 0, 0xfff));
+    g_assert_null(interval_tree_find(&root, 0x2000, UINT64_MAX));
+    for (int i = 1; i < 64; i += 2) {
+        interval_tree_remove(&root, &nodes[i]);
+    }
+    g_assert_true(interval_tree_is_empty(&root));
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/interval-tree/random", test_random);
+    g_test_add_func("/interval-tree/duplicates", test_duplicates);
+    return g_test_run();
+}
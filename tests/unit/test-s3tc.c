@@ -0,0 +1,241 @@
+/*
+ * S3TC texture decompression unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "hw/xbox/nv2a/s3tc.h"
+
+static const GLint formats[] = {
+    GL_COMPRESSED_RGBA_S3TC_DXT1_EXT,
+    GL_COMPRESSED_RGBA_S3TC_DXT3_EXT,
+    GL_COMPRESSED_RGBA_S3TC_DXT5_EXT,
+};
+
+static const S3TCDecoder decoders[] = {
+    S3TC_DECODER_SCALAR,
+    S3TC_DECODER_SSE2,
+    S3TC_DECODER_AVX2,
+    S3TC_DECODER_NEON,
+};
+
+static unsigned int block_size(GLint format)
+{
+    return format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT ? 8 : 16;
+}
+
+/* Decodes one block the way the original per-block decoder did */
+static void ref_decode_block(GLint format, const uint8_t *block,
+                             uint32_t texels[16])
+{
+    const uint8_t *color_block =
+        format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT ? block : block + 8;
+    uint16_t c[2] = {
+        color_block[0] | color_block[1] << 8,
+        color_block[2] | color_block[3] << 8,
+    };
+    uint32_t indices = color_block[4] | color_block[5] << 8
+                       | color_block[6] << 16 | (uint32_t)color_block[7] << 24;
+    bool transparent = format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT
+                       && c[0] <= c[1];
+    int r[4], g[4], b[4], a[4];
+
+    for (int k = 0; k < 2; k++) {
+        r[k] = (c[k] >> 11) * 255 / 31;
+        g[k] = ((c[k] >> 5) & 0x3F) * 255 / 63;
+        b[k] = (c[k] & 0x1F) * 255 / 31;
+        a[k] = 255;
+    }
+    if (transparent) {
+        r[2] = (r[0] + r[1]) / 2;
+        g[2] = (g[0] + g[1]) / 2;
+        b[2] = (b[0] + b[1]) / 2;
+        r[3] = g[3] = b[3] = a[3] = 0;
+    } else {
+        r[2] = (2 * r[0] + r[1]) / 3;
+        g[2] = (2 * g[0] + g[1]) / 3;
+        b[2] = (2 * b[0] + b[1]) / 3;
+        r[3] = (r[0] + 2 * r[1]) / 3;
+        g[3] = (g[0] + 2 * g[1]) / 3;
+        b[3] = (b[0] + 2 * b[1]) / 3;
+        a[3] = 255;
+    }
+    a[2] = 255;
+
+    uint64_t alpha_bits = 0;
+    for (int k = 0; k < 8; k++) {
+        alpha_bits |= (uint64_t)block[k] << (8 * k);
+    }
+    int alphas[8] = { block[0], block[1] };
+    for (int k = 2; k < 8; k++) {
+        if (block[0] > block[1]) {
+            alphas[k] = ((8 - k) * block[0] + (k - 1) * block[1]) / 7;
+        } else if (k < 6) {
+            alphas[k] = ((6 - k) * block[0] + (k - 1) * block[1]) / 5;
+        } else {
+            alphas[k] = k == 6 ? 0 : 255;
+        }
+    }
+
+    for (int t = 0; t < 16; t++) {
+        int index = (indices >> (2 * t)) & 3;
+        int alpha;
+        if (format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT) {
+            alpha = a[index];
+        } else if (format == GL_COMPRESSED_RGBA_S3TC_DXT3_EXT) {
+            alpha = ((alpha_bits >> (4 * t)) & 0xF) * 17;
+        } else {
+            alpha = alphas[(alpha_bits >> (16 + 3 * t)) & 7];
+        }
+        texels[t] = (uint32_t)r[index] << 24 | g[index] << 16 | b[index] << 8
+                    | alpha;
+    }
+}
+
+static uint32_t *ref_decode(GLint format, const uint8_t *data,
+                            unsigned int width, unsigned int height,
+                            unsigned int depth)
+{
+    uint32_t *out = g_new(uint32_t, width * height * depth);
+    unsigned int block_depth = MIN(depth, 4);
+    const uint8_t *block = data;
+
+    for (unsigned int k = 0; k < depth / block_depth; k++) {
+        for (unsigned int j = 0; j < height / 4; j++) {
+            for (unsigned int i = 0; i < width / 4; i++) {
+                for (unsigned int s = 0; s < block_depth; s++) {
+                    uint32_t texels[16];
+                    unsigned int z = k * block_depth + s;
+                    ref_decode_block(format, block, texels);
+                    for (int t = 0; t < 16; t++) {
+                        unsigned int x = i * 4 + t % 4, y = j * 4 + t / 4;
+                        out[(z * height + y) * width + x] = texels[t];
+                    }
+                    block += block_size(format);
+                }
+            }
+        }
+    }
+
+    return out;
+}
+
+static void random_blocks(GLint format, uint8_t *data, unsigned int count)
+{
+    for (unsigned int i = 0; i < count * block_size(format); i++) {
+        data[i] = g_test_rand_int_range(0, 256);
+    }
+
+    /* Make sure both DXT1 and DXT5 modes, and equal endpoints, are common */
+    for (unsigned int n = 0; n < count; n++) {
+        uint8_t *block = data + n * block_size(format);
+        uint8_t *color = format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT
+                         ? block : block + 8;
+        switch (g_test_rand_int_range(0, 4)) {
+        case 0:
+            color[2] = color[0];
+            color[3] = color[1];
+            break;
+        case 1:
+            if (format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT) {
+                block[1] = block[0];
+            }
+            break;
+        }
+    }
+}
+
+static void check_volume(GLint format, unsigned int width,
+                         unsigned int height, unsigned int depth)
+{
+    unsigned int num_blocks = width / 4 * height / 4 * depth;
+    size_t size = (size_t)width * height * depth * 4;
+    uint8_t *data = g_malloc(num_blocks * block_size(format));
+    uint8_t *out = g_malloc(size);
+
+    random_blocks(format, data, num_blocks);
+    uint32_t *expected = ref_decode(format, data, width, height, depth);
+
+    for (int i = 0; i < ARRAY_SIZE(decoders); i++) {
+        if (!s3tc_set_decoder(decoders[i])) {
+            continue;
+        }
+        memset(out, 0xAA, size);
+        decompress_3d_texture_data(format, data, width, height, depth, out);
+        if (memcmp(out, expected, size)) {
+            g_test_message("decoder %d, format 0x%x, %ux%ux%u", decoders[i],
+                           format, width, height, depth);
+            g_assert_not_reached();
+        }
+    }
+    g_assert_true(s3tc_set_decoder(S3TC_DECODER_SCALAR));
+
+    g_free(expected);
+    g_free(out);
+    g_free(data);
+}
+
+static void test_decoders(void)
+{
+    static const unsigned int sizes[][3] = {
+        { 4, 4, 1 }, { 8, 4, 1 }, { 4, 8, 2 }, { 12, 4, 1 }, { 16, 16, 4 },
+        { 36, 8, 4 }, { 64, 32, 8 }, { 128, 128, 1 }, { 32, 32, 32 },
+    };
+
+    for (int round = 0; round < 8; round++) {
+        for (int f = 0; f < ARRAY_SIZE(formats); f++) {
+            for (int s = 0; s < ARRAY_SIZE(sizes); s++) {
+                check_volume(formats[f], sizes[s][0], sizes[s][1],
+                             sizes[s][2]);
+            }
+        }
+    }
+}
+
+static void test_split(void)
+{
+    static const unsigned int depths[] = { 1, 2, 4, 8, 16 };
+    unsigned int width = 16, height = 8;
+
+    for (int f = 0; f < ARRAY_SIZE(formats); f++) {
+        for (int d = 0; d < ARRAY_SIZE(depths); d++) {
+            GLint format = formats[f];
+            unsigned int depth = depths[d];
+            size_t slice_blocks = width / 4 * height / 4;
+            size_t slice_size = slice_blocks * block_size(format);
+            size_t texels = (size_t)width * height;
+            uint8_t *data = g_malloc(slice_size * depth);
+            uint8_t *slices = g_malloc(slice_size * depth);
+            uint32_t *volume = g_new(uint32_t, texels * depth);
+            uint32_t *slice = g_new(uint32_t, texels);
+
+            random_blocks(format, data, slice_blocks * depth);
+            decompress_3d_texture_data(format, data, width, height, depth,
+                                       (uint8_t *)volume);
+            split_3d_texture_data(format, data, width, height, depth, slices);
+
+            for (unsigned int z = 0; z < depth; z++) {
+                decompress_3d_texture_data(format, slices + z * slice_size,
+                                           width, height, 1,
+                                           (uint8_t *)slice);
+                g_assert_cmpmem(slice, texels * 4, volume + z * texels,
+                                texels * 4);
+            }
+
+            g_free(slice);
+            g_free(volume);
+            g_free(slices);
+            g_free(data);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/s3tc/decoders", test_decoders);
+    g_test_add_func("/s3tc/split", test_split);
+    return g_test_run();
+}
@@ -1631,10 +1631,12 @@ class DebugApuWindow
 {
 public:
     bool is_open;
+    bool profiling;
 
     DebugApuWindow()
     {
         is_open = false;
+        profiling = false;
     }
 
     ~DebugApuWindow()
@@ -1643,6 +1645,10 @@ public:
 
     void Draw()
     {
+        if (profiling != is_open) {
+            profiling = is_open;
+            mcpx_apu_debug_set_resampler_profiling(profiling);
+        }
         if (!is_open) return;
 
         ImGui::SetNextWindowContentSize(ImVec2(600.0f*g_ui_scale, 0.0f));
@@ -1785,6 +1791,11 @@ public:
         ImGui::Text("Frames:      %04d", dbg->frames_processed);
         ImGui::Text("GP Cycles:   %04d", dbg->gp.cycles);
         ImGui::Text("EP Cycles:   %04d", dbg->ep.cycles);
+        ImGui::Text("ADPCM Hits:  %04u", dbg->vp.adpcm_blocks_cached);
+        ImGui::Text("ADPCM Miss:  %04u", dbg->vp.adpcm_blocks_decoded);
+        ImGui::Text("Linear:      %.0f ns", dbg->vp.resampler_ns[AUDIO_RESAMPLER_LINEAR]);
+        ImGui::Text("Hermite:     %.0f ns", dbg->vp.resampler_ns[AUDIO_RESAMPLER_HERMITE]);
+        ImGui::Text("Sinc:        %.0f ns", dbg->vp.resampler_ns[AUDIO_RESAMPLER_SINC]);
         bool color = (dbg->utilization > 0.9);
         if (color) ImGui::PushStyleColor(ImGuiCol_Text, ImVec4(1,0,0,1));
         ImGui::Text("Utilization: %.2f%%", (dbg->utilization*100));
@@ -1799,6 +1810,12 @@ public:
             mcpx_apu_debug_set_monitor(mon);
         }
 
+        int resampler = mcpx_apu_get_resampler();
+        if (ImGui::Combo("Resampler", &resampler, "Linear\0Hermite\0Sinc\0")) {
+            mcpx_apu_set_resampler(resampler);
+        }
+        ImGui::SameLine(); HelpMarker("Interpolation used to pitch voices. The times above are the cost of resampling one voice for one frame in each mode.");
+
         static bool gp_realtime;
         gp_realtime = dbg->gp_realtime;
         if (ImGui::Checkbox("GP Realtime\n", &gp_realtime)) {
@@ -1915,6 +1932,22 @@ public:
             }
             ImPlot::PopStyleColor();
 
+            ImGui::Text("Shader disk cache: %u hits, %u misses",
+                        g_nv2a_stats.shader_disk_cache.hits,
+                        g_nv2a_stats.shader_disk_cache.misses);
+
+            bool gpu_swizzle = nv2a_get_gpu_swizzle();
+            if (ImGui::Checkbox("GPU swizzling", &gpu_swizzle)) {
+                nv2a_set_gpu_swizzle(gpu_swizzle);
+            }
+            ImGui::SameLine(); HelpMarker("Swizzle surface downloads and unswizzle texture and surface uploads on the GPU instead of the CPU");
+
+            bool strict_reports = nv2a_get_strict_reports();
+            if (ImGui::Checkbox("Synchronous occlusion reports", &strict_reports)) {
+                nv2a_set_strict_reports(strict_reports);
+            }
+            ImGui::SameLine(); HelpMarker("Wait for occlusion query results as soon as a report is requested instead of writing it once the GPU has finished. Slower, but may help titles that misbehave while a report is outstanding");
+
             if (ImGui::TreeNode("Advanced")) {
                 ImPlot::SetNextPlotLimitsX(x_start, x_end, ImGuiCond_Always);
                 ImPlot::SetNextPlotLimitsY(0, 1500, ImGuiCond_Always);
@@ -2326,6 +2359,12 @@ static void ShowMainMenu()
                 nv2a_set_surface_scale_factor(rendering_scale+1);
             }
 
+            int shader_compile_mode = nv2a_get_shader_compile_mode();
+            if (ImGui::Combo("Shader Compilation", &shader_compile_mode, "Synchronous\0Asynchronous (Fallback)\0Asynchronous (Skip Draws)\0")) {
+                nv2a_set_shader_compile_mode(shader_compile_mode);
+            }
+            ImGui::SameLine(); HelpMarker("Asynchronous modes compile new shaders in the background to avoid stutter, temporarily drawing with the last shader or skipping draws until compilation completes");
+
             if (ImGui::Combo(
                     "Scaling Mode", &scaling_mode, "Center\0Scale\0Scale (Widescreen 16:9)\0Scale (4:3)\0Stretch\0")) {
                 xemu_settings_set_enum(XEMU_SETTINGS_DISPLAY_SCALE, scaling_mode);
@@ -51,11 +51,15 @@ struct xemu_settings {
 
 	// [audio]
 	int use_dsp; // Boolean
+	int resampler;
 
 	// [display]
 	int scale;
 	float ui_scale;
 	int render_scale;
+	int shader_compile;
+	int gpu_swizzle; // Boolean
+	int strict_reports; // Boolean
 
 	// [input]
 	char *controller_1_guid;
@@ -97,6 +101,20 @@ static const struct enum_str_map display_scale_map[DISPLAY_SCALE__COUNT+1] = {
 	{ 0,                     NULL      },
 };
 
+static const struct enum_str_map shader_compile_map[SHADER_COMPILE__COUNT+1] = {
+	{ SHADER_COMPILE_SYNC,           "sync"           },
+	{ SHADER_COMPILE_ASYNC_FALLBACK, "async_fallback" },
+	{ SHADER_COMPILE_ASYNC_SKIP,     "async_skip"     },
+	{ 0,                             NULL             },
+};
+
+static const struct enum_str_map resampler_map[AUDIO_RESAMPLER__COUNT+1] = {
+	{ AUDIO_RESAMPLER_LINEAR,  "linear"  },
+	{ AUDIO_RESAMPLER_HERMITE, "hermite" },
+	{ AUDIO_RESAMPLER_SINC,    "sinc"    },
+	{ 0,                       NULL      },
+};
+
 static const struct enum_str_map net_backend_map[XEMU_NET_BACKEND__COUNT+1] = {
 	{ XEMU_NET_BACKEND_USER,       "user" },
 	{ XEMU_NET_BACKEND_SOCKET_UDP, "udp"  },
@@ -147,10 +165,14 @@ struct config_offset_table {
 	[XEMU_SETTINGS_SYSTEM_HARD_FPU]         = X_BOOL  (system , hard_fpu         , 1),
 
 	[XEMU_SETTINGS_AUDIO_USE_DSP]           = X_BOOL  (audio  , use_dsp          , 0),
+	[XEMU_SETTINGS_AUDIO_RESAMPLER]         = X_ENUM  (audio  , resampler        , AUDIO_RESAMPLER_SINC, resampler_map),
 
 	[XEMU_SETTINGS_DISPLAY_SCALE]           = X_ENUM  (display, scale            , DISPLAY_SCALE_SCALE, display_scale_map),
 	[XEMU_SETTINGS_DISPLAY_UI_SCALE]        = X_FLOAT (display, ui_scale         , 1.0f, 1.0f, 4.0f),
 	[XEMU_SETTINGS_DISPLAY_RENDER_SCALE]    = X_INT   (display, render_scale     , 1   , 1   , 10),
+	[XEMU_SETTINGS_DISPLAY_SHADER_COMPILE]  = X_ENUM  (display, shader_compile   , SHADER_COMPILE_SYNC, shader_compile_map),
+	[XEMU_SETTINGS_DISPLAY_GPU_SWIZZLE]     = X_BOOL  (display, gpu_swizzle      , 1),
+	[XEMU_SETTINGS_DISPLAY_STRICT_REPORTS]  = X_BOOL  (display, strict_reports   , 0),
 
 	[XEMU_SETTINGS_INPUT_CONTROLLER_1_GUID] = X_STRING(input  , controller_1_guid, ""),
 	[XEMU_SETTINGS_INPUT_CONTROLLER_2_GUID] = X_STRING(input  , controller_2_guid, ""),
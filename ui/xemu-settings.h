@@ -42,9 +42,13 @@ enum xemu_settings_keys {
 	XEMU_SETTINGS_SYSTEM_SHORT_ANIMATION,
 	XEMU_SETTINGS_SYSTEM_HARD_FPU,
 	XEMU_SETTINGS_AUDIO_USE_DSP,
+	XEMU_SETTINGS_AUDIO_RESAMPLER,
 	XEMU_SETTINGS_DISPLAY_SCALE,
 	XEMU_SETTINGS_DISPLAY_UI_SCALE,
 	XEMU_SETTINGS_DISPLAY_RENDER_SCALE,
+	XEMU_SETTINGS_DISPLAY_SHADER_COMPILE,
+	XEMU_SETTINGS_DISPLAY_GPU_SWIZZLE,
+	XEMU_SETTINGS_DISPLAY_STRICT_REPORTS,
 	XEMU_SETTINGS_INPUT_CONTROLLER_1_GUID,
 	XEMU_SETTINGS_INPUT_CONTROLLER_2_GUID,
 	XEMU_SETTINGS_INPUT_CONTROLLER_3_GUID,
@@ -79,6 +83,24 @@ enum DISPLAY_SCALE
     DISPLAY_SCALE_INVALID = -1
 };
 
+enum SHADER_COMPILE
+{
+    SHADER_COMPILE_SYNC,
+    SHADER_COMPILE_ASYNC_FALLBACK,
+    SHADER_COMPILE_ASYNC_SKIP,
+    SHADER_COMPILE__COUNT,
+    SHADER_COMPILE_INVALID = -1
+};
+
+enum AUDIO_RESAMPLER
+{
+    AUDIO_RESAMPLER_LINEAR,
+    AUDIO_RESAMPLER_HERMITE,
+    AUDIO_RESAMPLER_SINC,
+    AUDIO_RESAMPLER__COUNT,
+    AUDIO_RESAMPLER_INVALID = -1
+};
+
 enum xemu_net_backend {
 	XEMU_NET_BACKEND_USER,
 	XEMU_NET_BACKEND_SOCKET_UDP,
@@ -0,0 +1,202 @@
+/*
+ * Augmented interval tree over 64-bit address ranges
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/interval-tree.h"
+
+/*
+ * AVL tree without parent pointers. The recursion depth of every operation
+ * is bounded by the tree height, i.e. about 1.44 * log2(n).
+ */
+
+static inline int node_height(const IntervalTreeNode *node)
+{
+    return node ? node->height : 0;
+}
+
+static void node_update(IntervalTreeNode *node)
+{
+    uint64_t subtree_last = node->last;
+
+    if (node->left && node->left->subtree_last > subtree_last) {
+        subtree_last = node->left->subtree_last;
+    }
+    if (node->right && node->right->subtree_last > subtree_last) {
+        subtree_last = node->right->subtree_last;
+    }
+    node->subtree_last = subtree_last;
+    node->height = 1 + MAX(node_height(node->left), node_height(node->right));
+}
+
+/* Total order: start, then last, then node address */
+static int node_compare(const IntervalTreeNode *a, const IntervalTreeNode *b)
+{
+    if (a->start != b->start) {
+        return a->start < b->start ? -1 : 1;
+    }
+    if (a->last != b->last) {
+        return a->last < b->last ? -1 : 1;
+    }
+    if (a != b) {
+        return (uintptr_t)a < (uintptr_t)b ? -1 : 1;
+    }
+    return 0;
+}
+
+static IntervalTreeNode *rotate_left(IntervalTreeNode *node)
+{
+    IntervalTreeNode *right = node->right;
+
+    node->right = right->left;
+    right->left = node;
+    node_update(node);
+    node_update(right);
+    return right;
+}
+
+static IntervalTreeNode *rotate_right(IntervalTreeNode *node)
+{
+    IntervalTreeNode *left = node->left;
+
+    node->left = left->right;
+    left->right = node;
+    node_update(node);
+    node_update(left);
+    return left;
+}
+
+static IntervalTreeNode *rebalance(IntervalTreeNode *node)
+{
+    int balance;
+
+    node_update(node);
+    balance = node_height(node->left) - node_height(node->right);
+
+    if (balance > 1) {
+        if (node_height(node->left->left) < node_height(node->left->right)) {
+            node->left = rotate_left(node->left);
+        }
+        return rotate_right(node);
+    }
+    if (balance < -1) {
+        if (node_height(node->right->right) < node_height(node->right->left)) {
+            node->right = rotate_right(node->right);
+        }
+        return rotate_left(node);
+    }
+    return node;
+}
+
+static IntervalTreeNode *insert_node(IntervalTreeNode *subtree,
+                                     IntervalTreeNode *node)
+{
+    if (!subtree) {
+        node_update(node);
+        return node;
+    }
+
+    if (node_compare(node, subtree) < 0) {
+        subtree->left = insert_node(subtree->left, node);
+    } else {
+        subtree->right = insert_node(subtree->right, node);
+    }
+    return rebalance(subtree);
+}
+
+static IntervalTreeNode *remove_min(IntervalTreeNode *subtree,
+                                    IntervalTreeNode **min)
+{
+    if (!subtree->left) {
+        *min = subtree;
+        return subtree->right;
+    }
+    subtree->left = remove_min(subtree->left, min);
+    return rebalance(subtree);
+}
+
+static IntervalTreeNode *remove_node(IntervalTreeNode *subtree,
+                                     IntervalTreeNode *node)
+{
+    IntervalTreeNode *left, *right, *min;
+    int cmp;
+
+    assert(subtree != NULL); /* Node not in this tree */
+
+    cmp = node_compare(node, subtree);
+    if (cmp < 0) {
+        subtree->left = remove_node(subtree->left, node);
+    } else if (cmp > 0) {
+        subtree->right = remove_node(subtree->right, node);
+    } else {
+        left = subtree->left;
+        right = subtree->right;
+        if (!right) {
+            return left;
+        }
+        right = remove_min(right, &min);
+        min->left = left;
+        min->right = right;
+        return rebalance(min);
+    }
+    return rebalance(subtree);
+}
+
+void interval_tree_insert(IntervalTreeRoot *root, IntervalTreeNode *node,
+                          uint64_t start, uint64_t last)
+{
+    assert(start <= last);
+    assert(!interval_tree_node_in_tree(node));
+
+    node->left = NULL;
+    node->right = NULL;
+    node->start = start;
+    node->last = last;
+    root->node = insert_node(root->node, node);
+}
+
+void interval_tree_remove(IntervalTreeRoot *root, IntervalTreeNode *node)
+{
+    assert(interval_tree_node_in_tree(node));
+
+    root->node = remove_node(root->node, node);
+    node->left = NULL;
+    node->right = NULL;
+    node->height = 0;
+}
+
+static IntervalTreeNode *visit_node(IntervalTreeNode *node,
+                                    uint64_t start, uint64_t last,
+                                    IntervalTreeVisitFunc func, void *opaque)
+{
+    IntervalTreeNode *found;
+
+    while (node && node->subtree_last >= start) {
+        found = visit_node(node->left, start, last, func, opaque);
+        if (found) {
+            return found;
+        }
+        if (node->start > last) {
+            /* This node and everything to its right start too late */
+            return NULL;
+        }
+        if (node->last >= start && (!func || func(node, opaque))) {
+            return node;
+        }
+        node = node->right;
+    }
+
+    return NULL;
+}
+
+IntervalTreeNode *interval_tree_visit(IntervalTreeRoot *root,
+                                      uint64_t start, uint64_t last,
+                                      IntervalTreeVisitFunc func,
+                                      void *opaque)
+{
+    assert(start <= last);
+    return visit_node(root->node, start, last, func, opaque);
+}